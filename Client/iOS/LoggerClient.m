@@ -40,6 +40,8 @@
 
 #import "LoggerClient.h"
 #import "LoggerCommon.h"
+#import "LoggerCompression.h"
+#import "LoggerMessageRing.h"
 
 #import <sys/types.h>
 #import <sys/sysctl.h>
@@ -47,6 +49,9 @@
 #import <dlfcn.h>
 #import <fcntl.h>
 #import <stdatomic.h>
+#import <mach/mach_time.h>
+#import <mach-o/getsect.h>
+#import <mach-o/dyld.h>
 
 #if TARGET_OS_IPHONE
 #import <UIKit/UIDevice.h>
@@ -121,6 +126,69 @@
 #error LoggerClient.m must be compiled without Objective-C Automatic Reference Counting (CLANG_ENABLE_OBJC_ARC=NO)
 #endif
 
+// String literals (__FILE__, __FUNCTION__, constant tags) are registered once in a process-wide table.
+// Queued messages only carry a PART_TYPE_LITERAL_REF part with their ID, which is expanded (or interned
+// for the connection when using the v2 protocol) when the message leaves the queue.
+#define PART_TYPE_LITERAL_REF			0x80		// client internal part type, never sent: uint32_t size (4), then uint32_t literal ID
+#define LOGGER_LITERALS_CHUNK_SIZE		1024
+#define LOGGER_LITERALS_MAX_CHUNKS		64
+#define LOGGER_LITERAL_CACHE_SIZE		64			// per-thread pointer cache, must be a power of two
+
+typedef struct
+{
+	const char *bytes;
+	uint32_t length;
+} LoggerLiteral;
+
+typedef struct
+{
+	const char *pointer;                            // a string literal (other pointers are not cached)
+	uint32_t literalID;
+} LoggerLiteralCacheEntry;
+
+// Messages are encoded in a per-thread arena that is reused from one logging call to the next
+typedef struct
+{
+	uint8_t *bytes;                                 // arena storage, starts with the message size and part count
+	uint32_t capacity;
+	uint32_t used;                                  // number of bytes used in the arena, including the 6 bytes header
+	uint16_t partCount;
+	BOOL inUse;                                     // set while a message is being encoded in this arena
+	BOOL temporary;                                 // set for arenas used by nested logging calls, freed once the message is finalized
+	uint8_t *threadIDPart;                          // cached, fully encoded thread ID part for the arena's thread
+	uint32_t threadIDPartSize;
+	char threadIDPthreadName[64];                   // pthread name at the time threadIDPart was computed
+	LoggerLiteralCacheEntry literalCache[LOGGER_LITERAL_CACHE_SIZE];
+} LoggerMessageEncoder;
+
+// State of the v2 wire protocol encoder for the current connection (see LoggerCommon.h).
+// Strings of the parts below are interned: they are sent once, then referred to by ID.
+#define LOGGER_WIRE_HASH_BUCKETS			4096		// must be a power of two
+#define LOGGER_WIRE_MAX_INTERNED_LENGTH		1024		// longer strings are always sent inline
+#define LOGGER_WIRE_IS_INTERNED_KEY(key)	((key) == PART_KEY_FILENAME || (key) == PART_KEY_FUNCTIONNAME || \
+											 (key) == PART_KEY_TAG || (key) == PART_KEY_THREAD_ID)
+
+typedef struct
+{
+	uint32_t hash;
+	uint32_t length;
+	uint32_t offset;                                // offset of the string bytes in the pool
+	int32_t next;                                   // next string in the same hash bucket, -1 at end of chain
+} LoggerWireString;
+
+typedef struct
+{
+	int64_t deltaBase[LOGGER_WIRE_DELTA_KEYS];      // last value sent for each of the delta-encoded part keys
+	uint32_t stringsCount;
+	LoggerWireString strings[LOGGER_WIRE_MAX_STRINGS];
+	int32_t buckets[LOGGER_WIRE_HASH_BUCKETS];
+	uint8_t *pool;                                  // storage for the bytes of interned strings
+	uint32_t poolSize;
+	uint32_t poolUsed;
+	uint32_t *literalStringIDs;                     // string ID + 1 of the string literals already sent, indexed by literal ID
+	uint32_t literalStringIDsCount;
+} LoggerWireEncoder;
+
 struct Logger
 {
 	CFStringRef bufferFile;                         // If non-NULL, all buffering is done to the specified file instead of in-memory
@@ -130,10 +198,12 @@ struct Logger
 	CFMutableArrayRef bonjourServiceBrowsers;       // Active service browsers
 	CFMutableArrayRef bonjourServices;              // Services being tried
 	NSNetServiceBrowser *bonjourDomainBrowser;      // Domain browser
-	CFMutableArrayRef logQueue;                     // Message queue
+	CFMutableArrayRef logQueue;                     // Message queue (seq-ordered, only touched with logQueueMutex held)
 	pthread_mutex_t logQueueMutex;					// A mutex we use to protect access to the log queue and some critical variables
 	pthread_cond_t logQueueEmpty;
-	
+
+	LoggerMessageRing messageRing;                  // Lock-free MPSC ring where logging threads drop their encoded messages (drained with logQueueMutex held)
+
 	dispatch_once_t workerThreadInit;               // Use this to ensure creation of the worker thread is ever done only once for a given logger
 	pthread_t workerThread;                         // The worker thread responsible for Bonjour resolution, connection and logs transmission
 	CFRunLoopSourceRef messagePushedSource;         // A message source that fires on the worker thread when messages are available for send
@@ -152,6 +222,18 @@ struct Logger
 	NSUInteger sendBufferSize;
 	NSUInteger sendBufferUsed;                      // number of bytes of the send buffer currently in use
 	NSUInteger sendBufferOffset;                    // offset in sendBuffer to start sending at
+	CFMutableArrayRef sendBufferItems;              // queue messages currently encoded in sendBuffer (only touched by the worker thread)
+	uint32_t *sendBufferItemEnds;                   // offset of the end of each of these messages in sendBuffer
+
+	uint32_t viewerProtocolVersion;                 // wire protocol version of the viewer we're connected (or connecting) to
+	LoggerWireEncoder *wireEncoder;                 // v2 encoding state, allocated the first time we connect to a v2 viewer
+
+	BOOL compressData;                              // set when sending compressed blocks to the viewer (see kLoggerOption_CompressTransmittedData)
+	uint8_t *blockBuffer;                           // compressed block being sent, including its header
+	NSUInteger blockBufferUsed;                     // size of the block, 0 when no block is being sent
+	NSUInteger blockBufferOffset;                   // number of bytes of the block sent so far
+	NSUInteger blockSourceLength;                   // number of uncompressed bytes the block contains
+	uint32_t *compressionHashTable;                 // compressor scratch table, allocated with blockBuffer
 	
 	_Atomic(int32_t) messageSeq;                    // sequential message number (added to each message sent)
 	
@@ -172,12 +254,16 @@ static void LoggerFlushAllOnExit(void);
 static void* LoggerWorkerThread(Logger *logger);
 static void LoggerWriteMoreData(Logger *logger);
 static void LoggerPushMessageToQueue(Logger *logger, CFDataRef message);
+static void LoggerDrainMessageRing(Logger *logger);
+static CFMutableArrayRef LoggerTakeSendBatch(Logger *logger);
+static CFIndex LoggerPendingMessagesCount(Logger *logger);
 
 // Bonjour management
 static void LoggerStartBonjourBrowsing(Logger *logger);
 static void LoggerStopBonjourBrowsing(Logger *logger);
 static void LoggerBrowseBonjourForServices(Logger *logger, CFStringRef domainName);
 static void LoggerConnectToService(Logger *logger, NSNetService *service);
+static uint32_t LoggerViewerProtocolVersion(NSNetService *service, BOOL *acceptsCompression);
 static void LoggerDisconnectFromService(Logger *logger, NSNetService *service);
 
 @interface FPLLoggerBonjourDelegate : NSObject <NSNetServiceBrowserDelegate>
@@ -207,19 +293,35 @@ static void LoggerCreateBufferReadStream(Logger *logger);
 static void LoggerEmptyBufferFile(Logger *logger);
 static void LoggerFileBufferingOptionsChanged(Logger *logger);
 static void LoggerFlushQueueToBufferStream(Logger *logger, BOOL firstEntryIsClientInfo);
+static void LoggerRequeueSendBufferItems(Logger *logger);
+
+// Compressed framing
+static BOOL LoggerPrepareCompression(Logger *logger);
+static void LoggerResetCompression(Logger *logger);
+static int LoggerWriteCompressedBlock(Logger *logger, const uint8_t *source, NSUInteger sourceLength);
 
 // Encoding functions
 static void	LoggerPushClientInfoToFrontOfQueue(Logger *logger);
-static void LoggerMessageAddTimestampAndThreadID(CFMutableDataRef encoder);
-
-static CFMutableDataRef LoggerMessageCreate(int32_t seq);
-static void LoggerMessageAddInt32(CFMutableDataRef encoder, int32_t anInt, int key);
-#if __LP64__
-static void LoggerMessageAddInt64(CFMutableDataRef data, int64_t anInt, int key);
-#endif
-static void LoggerMessageAddString(CFMutableDataRef encoder, CFStringRef aString, int key);
-static void LoggerMessageAddData(CFMutableDataRef encoder, CFDataRef theData, int key, int partType);
+static void LoggerMessageAddTimestampAndThreadID(Logger *logger, LoggerMessageEncoder *encoder);
+
+static LoggerMessageEncoder *LoggerMessageCreate(Logger *logger, int32_t seq);
+static CFDataRef LoggerMessageFinalize(LoggerMessageEncoder *encoder);
+static void LoggerMessageAbandon(LoggerMessageEncoder *encoder);
+static void LoggerMessageFinalizeAndPushToQueue(Logger *logger, LoggerMessageEncoder *encoder);
+static void LoggerMessageAddInt32(LoggerMessageEncoder *encoder, int32_t anInt, int key);
+static void LoggerMessageAddInt64(LoggerMessageEncoder *encoder, int64_t anInt, int key);
+static void LoggerMessageAddString(LoggerMessageEncoder *encoder, CFStringRef aString, int key);
+static void LoggerMessageAddData(LoggerMessageEncoder *encoder, CFDataRef theData, int key, int partType);
 static uint32_t LoggerMessageGetSeq(CFDataRef message);
+static const LoggerLiteral *LoggerGetLiteral(uint32_t literalID);
+static CFIndex LoggerMessageCopyV1(CFDataRef message, uint8_t *dst, NSUInteger available);
+static CFDataRef LoggerMessageCreateV1(CFDataRef message);
+static LoggerWireEncoder *LoggerWireEncoderCreate(void);
+static void LoggerWireEncoderDispose(LoggerWireEncoder *wire);
+static void LoggerWireEncoderReset(LoggerWireEncoder *wire);
+static CFIndex LoggerWireEncodeMessage(LoggerWireEncoder *wire, CFDataRef message, uint8_t *dst, NSUInteger available);
+static uint64_t LoggerMonotonicNanoseconds(void);
+static int64_t LoggerMonotonicClockAnchor(void);
 
 /* Static objects */
 static CFMutableArrayRef sLoggersList;
@@ -228,6 +330,19 @@ static Boolean sAtexitFunctionSet = FALSE;
 static pthread_mutex_t sLoggersListMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t sDefaultLoggerMutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Allocation counters, used to verify that encoding a message costs a single allocation
+// once a thread's arena is warmed up (see Tools/EncoderBenchmark)
+#ifndef LOGGER_ENCODER_STATISTICS
+	#define LOGGER_ENCODER_STATISTICS LOGGER_DEBUG
+#endif
+#if LOGGER_ENCODER_STATISTICS
+static _Atomic(uint32_t) sEncodedMessagesCount;
+static _Atomic(uint32_t) sEncoderAllocationsCount;
+	#define LOGGER_COUNT_ENCODER_ALLOCATION() atomic_fetch_add(&sEncoderAllocationsCount, 1)
+#else
+	#define LOGGER_COUNT_ENCODER_ALLOCATION() do{}while(0)
+#endif
+
 // Console logging
 static void LoggerStartGrabbingConsole(Logger *logger);
 static void LoggerStopGrabbingConsole(Logger *logger);
@@ -285,6 +400,8 @@ Logger *LoggerInit(void)
 	pthread_mutex_init(&logger->logQueueMutex, NULL);
 	pthread_cond_init(&logger->logQueueEmpty, NULL);
 
+	LoggerMessageRingInit(&logger->messageRing);
+
 	logger->bonjourServiceBrowsers = CFArrayCreateMutable(NULL, 4, &kCFTypeArrayCallBacks);
 	logger->bonjourServices = CFArrayCreateMutable(NULL, 4, &kCFTypeArrayCallBacks);
 
@@ -292,6 +409,11 @@ Logger *LoggerInit(void)
 	// (bigger messages will be sent separately)
 	logger->sendBuffer = (uint8_t *)malloc(4096);
 	logger->sendBufferSize = 4096;
+
+	// any encoded message takes at least 5 bytes, this is enough to track all messages packed in the send buffer
+	logger->sendBufferItems = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	logger->sendBufferItemEnds = (uint32_t *)malloc(sizeof(uint32_t) * (logger->sendBufferSize / 4));
+	logger->viewerProtocolVersion = 1;
 	
 	logger->options = LOGGER_DEFAULT_OPTIONS;
 #if LOGGER_DEBUG
@@ -526,6 +648,9 @@ Logger *LoggerStart(Logger *logger)
 void LoggerStop(Logger *logger)
 {
 	LOGGERDBG(CFSTR("LoggerStop"));
+#if LOGGER_DEBUG
+	LOGGERDBG(CFSTR("-> encoded %u messages with %u allocations"), atomic_load(&sEncodedMessagesCount), atomic_load(&sEncoderAllocationsCount));
+#endif
 
 	pthread_mutex_lock(&sLoggersListMutex);
 	if (logger == NULL || logger == sDefaultLogger)
@@ -551,9 +676,21 @@ void LoggerStop(Logger *logger)
 			logger->workerThread = NULL;
 		}
 
+		// release messages that were never drained from the ring
+		pthread_mutex_lock(&logger->logQueueMutex);
+		LoggerDrainMessageRing(logger);
+		pthread_mutex_unlock(&logger->logQueueMutex);
+		LoggerMessageRingFree(&logger->messageRing);
+		CFRelease(logger->logQueue);
+
 		CFRelease(logger->bonjourServiceBrowsers);
 		CFRelease(logger->bonjourServices);
 		free(logger->sendBuffer);
+		CFRelease(logger->sendBufferItems);
+		free(logger->sendBufferItemEnds);
+		LoggerWireEncoderDispose(logger->wireEncoder);
+		free(logger->blockBuffer);
+		free(logger->compressionHashTable);
 		if (logger->host != NULL)
 			CFRelease(logger->host);
 		if (logger->bufferFile != NULL)
@@ -596,7 +733,7 @@ void LoggerFlush(Logger *logger, BOOL waitForConnection)
 		(logger->connected || logger->bufferFile != NULL || waitForConnection))		// TODO: change this test
 	{
 		pthread_mutex_lock(&logger->logQueueMutex);
-		if (CFArrayGetCount(logger->logQueue) > 0)
+		if (LoggerPendingMessagesCount(logger) > 0)
 			pthread_cond_wait(&logger->logQueueEmpty, &logger->logQueueMutex);
 		pthread_mutex_unlock(&logger->logQueueMutex);
 	}
@@ -726,6 +863,8 @@ static void *LoggerWorkerThread(Logger *logger)
 		CFWriteStreamClose(logger->logStream);
 		CFRelease(logger->logStream);
 		logger->logStream = NULL;
+		logger->viewerProtocolVersion = 1;
+		LoggerResetCompression(logger);
 	}
 
 	if (logger->bufferWriteStream == NULL && logger->bufferFile != NULL)
@@ -734,7 +873,7 @@ static void *LoggerWorkerThread(Logger *logger)
 		// a buffer file was set just before LoggerStop() was called, flush
 		// the log queue to the buffer file
 		pthread_mutex_lock(&logger->logQueueMutex);
-		CFIndex outstandingMessages = CFArrayGetCount(logger->logQueue);
+		CFIndex outstandingMessages = LoggerPendingMessagesCount(logger);
 		pthread_mutex_unlock(&logger->logQueueMutex);
 		if (outstandingMessages)
 			LoggerCreateBufferWriteStream(logger);
@@ -903,6 +1042,13 @@ static void LoggerLogToConsole(CFDataRef data)
 			case PART_KEY_TIMESTAMP_US:			// microsecond part of the timestamp (optional)
 				timestamp.tv_usec = (partType == PART_TYPE_INT64) ? (__darwin_suseconds_t)value64 : (__darwin_suseconds_t)value32;
 				break;
+			case PART_KEY_TIMESTAMP_NS:			// monotonic timestamp, relative to this process' clock anchor
+			{
+				int64_t ns = LoggerMonotonicClockAnchor() + (int64_t)value64;
+				timestamp.tv_sec = (__darwin_time_t)(ns / 1000000000LL);
+				timestamp.tv_usec = (__darwin_suseconds_t)((ns % 1000000000LL) / 1000);
+				break;
+			}
 			case PART_KEY_THREAD_ID:
 				if (thread == NULL)				// useless test, we know what we're doing but clang analyzer doesn't...
 				{
@@ -988,6 +1134,7 @@ static void LoggerWriteMoreData(Logger *logger)
 		if (logToConsole)
 		{
 			pthread_mutex_lock(&logger->logQueueMutex);
+			LoggerDrainMessageRing(logger);
 			while (CFArrayGetCount(logger->logQueue))
 			{
 				LoggerLogToConsole((CFDataRef)CFArrayGetValueAtIndex(logger->logQueue, 0));
@@ -1009,10 +1156,8 @@ static void LoggerWriteMoreData(Logger *logger)
              * So let's just sack the whole queue
              */
 			pthread_mutex_lock(&logger->logQueueMutex);
-			while (CFArrayGetCount(logger->logQueue))
-			{
-				CFArrayRemoveValueAtIndex(logger->logQueue, 0);
-			}
+			LoggerDrainMessageRing(logger);
+			CFArrayRemoveAllValues(logger->logQueue);
 			pthread_mutex_unlock(&logger->logQueueMutex);
 			pthread_cond_broadcast(&logger->logQueueEmpty);
         }
@@ -1022,7 +1167,8 @@ static void LoggerWriteMoreData(Logger *logger)
 	if (CFWriteStreamCanAcceptBytes(logger->logStream))
 	{
 		// prepare archived data with log queue contents, unblock the queue as soon as possible
-		CFMutableDataRef sendFirstItem = NULL;
+		CFDataRef sendFirstItem = NULL;
+		CFMutableArrayRef batch = NULL;
 		if (logger->sendBufferUsed == 0)
 		{
 			// pull more data from the log queue
@@ -1041,25 +1187,57 @@ static void LoggerWriteMoreData(Logger *logger)
 					logger->sendBufferUsed = (NSUInteger)CFReadStreamRead(logger->bufferReadStream, logger->sendBuffer, (CFIndex)logger->sendBufferSize);
 				}
 			}
-			else
+			else if (!logger->incompleteSendOfFirstItem)
 			{
-				while (CFArrayGetCount(logger->logQueue))
+				// take the messages that may fit in the send buffer off the queue, and encode them
+				// with the queue unlocked so that logging threads don't wait for us
+				LoggerDrainMessageRing(logger);
+				batch = LoggerTakeSendBatch(logger);
+			}
+			pthread_mutex_unlock(&logger->logQueueMutex);
+
+			if (batch != NULL)
+			{
+				LoggerWireEncoder *wire = (logger->viewerProtocolVersion >= 2) ? logger->wireEncoder : NULL;
+				CFIndex batchCount = CFArrayGetCount(batch), encoded = 0;
+				for (; encoded < batchCount; encoded++)
 				{
-					CFDataRef d = (CFDataRef)CFArrayGetValueAtIndex(logger->logQueue, 0);
-					CFIndex dsize = CFDataGetLength(d);
-					if ((logger->sendBufferUsed + (NSUInteger)dsize) > logger->sendBufferSize)
-						break;
-					memcpy(logger->sendBuffer + logger->sendBufferUsed, CFDataGetBytePtr(d), (size_t)dsize);
+					CFDataRef d = (CFDataRef)CFArrayGetValueAtIndex(batch, encoded);
+					CFIndex dsize = 0;
+					if (wire != NULL)
+					{
+						// the viewer understands the compact v2 format, use it whenever possible
+						dsize = LoggerWireEncodeMessage(wire, d, logger->sendBuffer + logger->sendBufferUsed, logger->sendBufferSize - logger->sendBufferUsed);
+						if (dsize < 0)
+							break;
+					}
+					if (dsize == 0)
+					{
+						dsize = LoggerMessageCopyV1(d, logger->sendBuffer + logger->sendBufferUsed, logger->sendBufferSize - logger->sendBufferUsed);
+						if (dsize < 0)
+							break;
+					}
 					logger->sendBufferUsed += (NSUInteger)dsize;
+					logger->sendBufferItemEnds[CFArrayGetCount(logger->sendBufferItems)] = (uint32_t)logger->sendBufferUsed;
+					CFArrayAppendValue(logger->sendBufferItems, d);
 					if (logToConsole)
 						LoggerLogToConsole(d);
-					CFArrayRemoveValueAtIndex(logger->logQueue, 0);
-					logger->incompleteSendOfFirstItem = NO;
 				}
+				if (encoded < batchCount)
+				{
+					// the messages that didn't fit go back at the head of the queue
+					pthread_mutex_lock(&logger->logQueueMutex);
+					for (CFIndex i = encoded; i < batchCount; i++)
+						CFArrayInsertValueAtIndex(logger->logQueue, i - encoded, CFArrayGetValueAtIndex(batch, i));
+					pthread_mutex_unlock(&logger->logQueueMutex);
+				}
+				CFRelease(batch);
 			}
-			if (logger->sendBufferUsed == 0) 
+
+			if (logger->sendBufferUsed == 0)
 			{
 				// are we done yet?
+				pthread_mutex_lock(&logger->logQueueMutex);
 				if (CFArrayGetCount(logger->logQueue) == 0)
 				{
 					pthread_cond_broadcast(&logger->logQueueEmpty);
@@ -1067,18 +1245,44 @@ static void LoggerWriteMoreData(Logger *logger)
 					return;
 				}
 
-				// first item is too big to fit in a single packet, send it separately
-				sendFirstItem = (CFMutableDataRef)CFArrayGetValueAtIndex(logger->logQueue, 0);
-				logger->incompleteSendOfFirstItem = YES;
-				logger->sendBufferOffset = 0;
+				// first item is too big to fit in a single packet, send it separately.
+				// sendBufferOffset tracks how much of it has been sent already.
+				sendFirstItem = (CFDataRef)CFArrayGetValueAtIndex(logger->logQueue, 0);
+				if (!logger->incompleteSendOfFirstItem)
+				{
+					// big messages are sent as-is, string literals need to be expanded first
+					CFDataRef v1Message = LoggerMessageCreateV1(sendFirstItem);
+					if (v1Message != NULL)
+					{
+						if (v1Message != sendFirstItem)
+							CFArraySetValueAtIndex(logger->logQueue, 0, v1Message);
+						CFRelease(v1Message);
+						sendFirstItem = (CFDataRef)CFArrayGetValueAtIndex(logger->logQueue, 0);
+					}
+					logger->incompleteSendOfFirstItem = YES;
+					logger->sendBufferOffset = 0;
+				}
+				pthread_mutex_unlock(&logger->logQueueMutex);
 			}
-			pthread_mutex_unlock(&logger->logQueueMutex);
 		}
 
 		// send data over the socket. We try hard to be failsafe and if we have to send
 		// data in fragments, we make sure that in case a disconnect occurs we restart
 		// sending the whole message(s)
-		if (logger->sendBufferUsed != 0)
+		if (logger->sendBufferUsed != 0 && logger->compressData)
+		{
+			// the send buffer goes out as a single block. sendBufferOffset stays at 0 until the block
+			// is completely sent, so that a disconnect requeues all the messages it contains
+			int result = LoggerWriteCompressedBlock(logger, logger->sendBuffer, logger->sendBufferUsed);
+			if (result < 0)
+				return;
+			if (result > 0)
+			{
+				logger->sendBufferUsed = 0;
+				CFArrayRemoveAllValues(logger->sendBufferItems);
+			}
+		}
+		else if (logger->sendBufferUsed != 0)
 		{
 			CFIndex written = CFWriteStreamWrite(logger->logStream,
 												 logger->sendBuffer + logger->sendBufferOffset,
@@ -1099,29 +1303,43 @@ static void LoggerWriteMoreData(Logger *logger)
 			{
 				logger->sendBufferUsed = 0;
 				logger->sendBufferOffset = 0;
+				CFArrayRemoveAllValues(logger->sendBufferItems);
 			}
 		}
 		else if (sendFirstItem)
 		{
 			CFIndex length = CFDataGetLength(sendFirstItem) - (CFIndex)logger->sendBufferOffset;
-			CFIndex written = CFWriteStreamWrite(logger->logStream,
-												 CFDataGetBytePtr(sendFirstItem) + logger->sendBufferOffset,
-												 length);
-			if (written < 0)
+			if (logger->compressData)
 			{
-				// We'll get an event if the stream closes on error
-				return;
+				// big messages are cut in several blocks, sendBufferOffset tracks the uncompressed
+				// bytes of the message that were completely sent
+				int result = LoggerWriteCompressedBlock(logger, CFDataGetBytePtr(sendFirstItem) + logger->sendBufferOffset, (NSUInteger)length);
+				if (result <= 0)
+					return;
+				logger->sendBufferOffset += logger->blockSourceLength;
+				if ((CFIndex)logger->blockSourceLength < length)
+					return;
 			}
-			if (written < length)
+			else
 			{
-				// The output pipe is full, and the first item has not been sent completely
-				// We need to reduce the remaining data on the first item so it can be taken
-				// care of at the next iteration. We take advantage of the fact that each item
-				// in the queue is actually a mutable data block
-				// TODO: IF WE GET DISCONNECTED WHILE DOING THIS, THINGS WILL GO WRONG - NEED TO UPDATE THIS LOGIC
-				LOGGERDBG(CFSTR("Output pipe is full"));
-				CFDataReplaceBytes((CFMutableDataRef)sendFirstItem, CFRangeMake(0, written), NULL, 0);
-				return;
+				CFIndex written = CFWriteStreamWrite(logger->logStream,
+													 CFDataGetBytePtr(sendFirstItem) + logger->sendBufferOffset,
+													 length);
+				if (written < 0)
+				{
+					// We'll get an event if the stream closes on error
+					return;
+				}
+				if (written < length)
+				{
+					// The output pipe is full, and the first item has not been sent completely.
+					// Remember where we are so the rest of it is sent at the next iteration.
+					// If we get disconnected in the meantime, LoggerWriteStreamTerminated() resets
+					// the offset so that the whole message is sent again on the next connection
+					LOGGERDBG(CFSTR("Output pipe is full"));
+					logger->sendBufferOffset += (NSUInteger)written;
+					return;
+				}
 			}
 			
 			// we are done sending the first item in the queue, remove it now
@@ -1133,7 +1351,7 @@ static void LoggerWriteMoreData(Logger *logger)
 		}
 		
 		pthread_mutex_lock(&logger->logQueueMutex);
-		CFIndex remainingMsgs = CFArrayGetCount(logger->logQueue);
+		CFIndex remainingMsgs = LoggerPendingMessagesCount(logger);
 		if (remainingMsgs == 0)
 			pthread_cond_broadcast(&logger->logQueueEmpty);
 		pthread_mutex_unlock(&logger->logQueueMutex);
@@ -1513,6 +1731,7 @@ static void LoggerFlushQueueToBufferStream(Logger *logger, BOOL firstEntryIsClie
 {
 	LOGGERDBG(CFSTR("LoggerFlushQueueToBufferStream"));
 	pthread_mutex_lock(&logger->logQueueMutex);
+	LoggerRequeueSendBufferItems(logger);
 	if (logger->incompleteSendOfFirstItem)
 	{
 		// drop anything being sent
@@ -1526,12 +1745,17 @@ static void LoggerFlushQueueToBufferStream(Logger *logger, BOOL firstEntryIsClie
 	if (!firstEntryIsClientInfo && logger->sendBufferUsed)
 		CFWriteStreamWrite(logger->bufferWriteStream, logger->sendBuffer + logger->sendBufferOffset, (CFIndex)(logger->sendBufferUsed - logger->sendBufferOffset));
 	
+	LoggerDrainMessageRing(logger);
 	int n = 0;
 	while (CFArrayGetCount(logger->logQueue))
 	{
-		CFDataRef data = CFArrayGetValueAtIndex(logger->logQueue, 0);
+		// string literals are only known to this process, expand them in the buffer file
+		CFDataRef data = LoggerMessageCreateV1(CFArrayGetValueAtIndex(logger->logQueue, 0));
+		if (data == NULL)
+			break;
 		CFIndex dataLength = CFDataGetLength(data);
 		CFIndex written = CFWriteStreamWrite(logger->bufferWriteStream, CFDataGetBytePtr(data), dataLength);
+		CFRelease(data);
 		if (written != dataLength)
 		{
 			// couldn't write all data to file, maybe storage run out of space?
@@ -1553,6 +1777,26 @@ static void LoggerFlushQueueToBufferStream(Logger *logger, BOOL firstEntryIsClie
 	pthread_cond_broadcast(&logger->logQueueEmpty);
 }
 
+static void LoggerRequeueSendBufferItems(Logger *logger)
+{
+	// Put the messages packed in the send buffer that were not completely sent back at the
+	// head of the queue, and empty the send buffer. Called with the log queue mutex held when
+	// the connection goes away, as the send buffer may contain data encoded for this connection only.
+	// Data read from the buffer file is not tracked, and is left untouched.
+	CFIndex count = CFArrayGetCount(logger->sendBufferItems);
+	if (count == 0)
+		return;
+	CFIndex insertIndex = 0;
+	for (CFIndex i = 0; i < count; i++)
+	{
+		if (logger->sendBufferItemEnds[i] > logger->sendBufferOffset)
+			CFArrayInsertValueAtIndex(logger->logQueue, insertIndex++, CFArrayGetValueAtIndex(logger->sendBufferItems, i));
+	}
+	CFArrayRemoveAllValues(logger->sendBufferItems);
+	logger->sendBufferUsed = 0;
+	logger->sendBufferOffset = 0;
+}
+
 // -----------------------------------------------------------------------------
 #pragma mark -
 #pragma mark Bonjour browsing
@@ -1683,6 +1927,42 @@ static void LoggerConnectToService(Logger *logger, NSNetService *service)
 	LoggerTryConnect(logger);
 }
 
+static uint32_t LoggerViewerProtocolVersion(NSNetService *service, BOOL *acceptsCompression)
+{
+	// Viewers that understand a newer version of the wire protocol advertise it in their TXT record,
+	// along with the compression they accept
+	uint32_t version = 1;
+	*acceptsCompression = NO;
+	CFDataRef txtData = (__bridge CFDataRef)service.TXTRecordData;
+	if (txtData != NULL)
+	{
+		CFDictionaryRef txtDict = CFNetServiceCreateDictionaryWithTXTData(NULL, txtData);
+		if (txtDict != NULL)
+		{
+			CFTypeRef value = CFDictionaryGetValue(txtDict, LOGGER_TXT_KEY_PROTOCOL);
+			if (value != NULL && CFGetTypeID(value) == CFDataGetTypeID())
+			{
+				const UInt8 *p = CFDataGetBytePtr((CFDataRef)value);
+				CFIndex length = CFDataGetLength((CFDataRef)value);
+				uint32_t advertised = 0;
+				for (CFIndex i = 0; i < length && p[i] >= '0' && p[i] <= '9' && advertised < 1000; i++)
+					advertised = advertised * 10 + (uint32_t)(p[i] - '0');
+				if (advertised > 1)
+					version = MIN(advertised, LOGGER_PROTOCOL_VERSION);
+			}
+			value = CFDictionaryGetValue(txtDict, LOGGER_TXT_KEY_COMPRESSION);
+			if (value != NULL && CFGetTypeID(value) == CFDataGetTypeID())
+			{
+				CFIndex length = CFDataGetLength((CFDataRef)value);
+				*acceptsCompression = (length == (CFIndex)strlen(LOGGER_COMPRESSION_LZ4) &&
+									   memcmp(CFDataGetBytePtr((CFDataRef)value), LOGGER_COMPRESSION_LZ4, (size_t)length) == 0);
+			}
+			CFRelease(txtDict);
+		}
+	}
+	return version;
+}
+
 static void LoggerDisconnectFromService(Logger *logger, NSNetService *service)
 {
 	CFIndex idx = CFArrayGetFirstIndexOfValue(logger->bonjourServices, CFRangeMake(0, CFArrayGetCount(logger->bonjourServices)), service);
@@ -2020,6 +2300,21 @@ static void LoggerTryConnect(Logger *logger)
 	{
 		NSNetService *service = CFArrayGetValueAtIndex(logger->bonjourServices, 0);
 		LOGGERDBG(CFSTR("-> Trying to open write stream to service %@"), service);
+		BOOL acceptsCompression;
+		logger->viewerProtocolVersion = LoggerViewerProtocolVersion(service, &acceptsCompression);
+		if (logger->viewerProtocolVersion >= 2)
+		{
+			// strings interned on a previous connection are unknown to this one
+			if (logger->wireEncoder == NULL)
+				logger->wireEncoder = LoggerWireEncoderCreate();
+			else
+				LoggerWireEncoderReset(logger->wireEncoder);
+			if (logger->wireEncoder == NULL)
+				logger->viewerProtocolVersion = 1;
+		}
+		logger->compressData = (acceptsCompression &&
+								(logger->options & kLoggerOption_CompressTransmittedData) &&
+								LoggerPrepareCompression(logger));
 		NSOutputStream *outputStream;
 		[service getInputStream:NULL outputStream:&outputStream];
 		logger->logStream = (CFWriteStreamRef)outputStream;
@@ -2042,6 +2337,10 @@ static void LoggerTryConnect(Logger *logger)
 	if (logger->host != NULL)
 	{
 		LOGGERDBG(CFSTR("-> Trying to open direct connection to host %@ port %u"), logger->host, logger->port);
+
+		// we don't know what the viewer understands when connecting directly, stick to v1
+		logger->viewerProtocolVersion = 1;
+		logger->compressData = NO;
 		CFStreamCreatePairWithSocketToHost(NULL, logger->host, logger->port, NULL, &logger->logStream);
 		if (logger->logStream == NULL)
 		{
@@ -2093,6 +2392,14 @@ static void LoggerWriteStreamTerminated(Logger *logger)
 		logger->logStream = NULL;
 	}
 
+	// messages that were not completely sent go back to the queue, they will be encoded
+	// again for the next connection or written to the buffer file
+	pthread_mutex_lock(&logger->logQueueMutex);
+	LoggerRequeueSendBufferItems(logger);
+	pthread_mutex_unlock(&logger->logQueueMutex);
+	logger->viewerProtocolVersion = 1;
+	LoggerResetCompression(logger);
+
 	if (logger->bufferReadStream != NULL)
 	{
 		// In the case the connection drops before we have flushed the
@@ -2109,6 +2416,16 @@ static void LoggerWriteStreamTerminated(Logger *logger)
 	if (logger->bufferFile != NULL && logger->bufferWriteStream == NULL)
 		LoggerCreateBufferWriteStream(logger);
 
+	// if we were in the middle of sending a large message, start over with it
+	// when reconnecting (the client info will be sent before it)
+	pthread_mutex_lock(&logger->logQueueMutex);
+	if (logger->incompleteSendOfFirstItem)
+	{
+		logger->incompleteSendOfFirstItem = NO;
+		logger->sendBufferOffset = 0;
+	}
+	pthread_mutex_unlock(&logger->logQueueMutex);
+
 	// ensure that any current block on LoggerFlush() gets unblocked
 	pthread_cond_broadcast(&logger->logQueueEmpty);
 
@@ -2184,9 +2501,8 @@ static void LoggerWriteStreamCallback(CFWriteStreamRef ws, CFStreamEventType eve
 	*q32 = (uint8_t)i32; \
 }
 
-#if __LP64__
 #define WRITE_MISALIGNED_INT64(p,n) { \
-	uint32_t i = (uint32_t)(n); \
+	uint64_t i = (uint64_t)(n); \
 	uint8_t *q = (uint8_t *)(p) + 7; \
 	*q-- = (uint8_t)i; i >>= 8; \
 	*q-- = (uint8_t)i; i >>= 8; \
@@ -2197,31 +2513,135 @@ static void LoggerWriteStreamCallback(CFWriteStreamRef ws, CFStreamEventType eve
 	*q-- = (uint8_t)i; i >>= 8; \
 	*q = (uint8_t)i; \
 }
-#endif
 
-static uint8_t *LoggerMessagePrepareForPart(CFMutableDataRef encoder, uint32_t requiredExtraBytes)
+static dispatch_once_t sMonotonicClockInit;
+static mach_timebase_info_data_t sMonotonicTimebase;
+static uint64_t (*sMonotonicClock)(void);
+static BOOL sMonotonicClockCountsSleep;
+static int64_t sMonotonicClockAnchor;
+
+#define LOGGER_ENCODER_INITIAL_CAPACITY			1024
+#define LOGGER_ENCODER_MAX_RETAINED_CAPACITY	65536	// arenas that grew larger than this (i.e. for images) are released after use
+
+static pthread_key_t sEncoderKey;
+static pthread_once_t sEncoderKeyOnce = PTHREAD_ONCE_INIT;
+
+static LoggerLiteral *sLiterals[LOGGER_LITERALS_MAX_CHUNKS];
+static uint32_t sLiteralsCount;
+static CFMutableDictionaryRef sLiteralIDs;			// string literal address -> literal ID + 1
+static pthread_mutex_t sLiteralsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct
+{
+	uintptr_t start;
+	uintptr_t end;
+} LoggerAddressRange;
+
+static LoggerAddressRange *sTextSegments;			// __TEXT segments of the loaded images, by address
+static uint32_t sTextSegmentsCount;
+static uint32_t sTextSegmentsCapacity;
+static pthread_rwlock_t sTextSegmentsLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t sTextSegmentsOnce = PTHREAD_ONCE_INIT;
+
+static void LoggerMessageEncoderDispose(void *context)
+{
+	LoggerMessageEncoder *encoder = (LoggerMessageEncoder *)context;
+	if (encoder != NULL)
+	{
+		free(encoder->bytes);
+		free(encoder->threadIDPart);
+		free(encoder);
+	}
+}
+
+static void LoggerMessageEncoderCreateKey(void)
+{
+	pthread_key_create(&sEncoderKey, &LoggerMessageEncoderDispose);
+}
+
+static BOOL LoggerMessageReserve(LoggerMessageEncoder *encoder, uint32_t requiredExtraBytes)
+{
+	// Ensure the arena can hold the required extra bytes. Arenas grow by doubling
+	// their size so that, once warmed up, encoding a message never reallocates
+	uint32_t required = encoder->used + requiredExtraBytes;
+	if (required <= encoder->capacity)
+		return YES;
+	uint32_t newCapacity = encoder->capacity ? encoder->capacity : LOGGER_ENCODER_INITIAL_CAPACITY;
+	while (newCapacity < required && newCapacity < 0x80000000U)
+		newCapacity <<= 1;
+	if (newCapacity < required)
+		newCapacity = required;
+	uint8_t *newBytes = (uint8_t *)realloc(encoder->bytes, newCapacity);
+	if (newBytes == NULL)
+		return NO;
+	LOGGER_COUNT_ENCODER_ALLOCATION();
+	encoder->bytes = newBytes;
+	encoder->capacity = newCapacity;
+	return YES;
+}
+
+static uint8_t *LoggerMessagePrepareForPart(LoggerMessageEncoder *encoder, uint32_t requiredExtraBytes)
 {
-	// Ensure a data block has the required storage capacity, update the total size and part count
+	// Ensure the arena has the required storage capacity, update the used size and part count
 	// then return a pointer for fast storage of the data
-	uint8_t *p = CFDataGetMutableBytePtr(encoder);
-	CFIndex size = CFDataGetLength(encoder);
-	uint32_t oldSize = ntohl(*(uint32_t *)p);
-	uint32_t newSize = oldSize + requiredExtraBytes;
-	if ((newSize + 4) > (uint32_t)size)
+	if (!LoggerMessageReserve(encoder, requiredExtraBytes))
+		return NULL;
+	uint8_t *p = encoder->bytes + encoder->used;
+	encoder->used += requiredExtraBytes;
+	encoder->partCount++;
+	return p;
+}
+
+static int64_t LoggerComputeMonotonicClockAnchor(void)
+{
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	uint64_t now = sMonotonicClock() * sMonotonicTimebase.numer / sMonotonicTimebase.denom;
+	return (int64_t)t.tv_sec * 1000000000LL + (int64_t)t.tv_usec * 1000LL - (int64_t)now;
+}
+
+static void LoggerInitMonotonicClock(void)
+{
+	// The timebase lets us convert mach time units to nanoseconds. The anchor is the wall clock
+	// time at which the monotonic clock was zero: it is computed once per process, so that wall clock
+	// changes (i.e. NTP adjustments) can't reorder messages, and so that messages queued before a
+	// reconnection keep their time. It is transmitted to the viewer with the client info.
+	// mach_continuous_time() keeps counting while the device sleeps. On systems that don't have it,
+	// mach_absolute_time() stops during sleep and would fall behind the anchor: messages get wall
+	// clock timestamps there (see LoggerMessageAddTimestampAndThreadID)
+	mach_timebase_info(&sMonotonicTimebase);
+	sMonotonicClock = &mach_absolute_time;
+	if (@available(macOS 10.12, iOS 10.0, tvOS 10.0, *))
 	{
-		// grow by 64 bytes chunks
-		CFDataSetLength(encoder, (newSize + 4 + 64) & ~63);
-		p = CFDataGetMutableBytePtr(encoder);
+		sMonotonicClock = &mach_continuous_time;
+		sMonotonicClockCountsSleep = YES;
 	}
-	*((uint32_t *)p) = htonl(newSize);
-	p += 4;
-	*((uint16_t *)p) = htons(ntohs(*(uint16_t *)p) + 1);
+	sMonotonicClockAnchor = LoggerComputeMonotonicClockAnchor();
+}
 
-	// return a pointer to where new data must be put
-	return p + oldSize;
+static uint64_t LoggerMonotonicNanoseconds(void)
+{
+	// Monotonic clock that doesn't require a system call
+	dispatch_once(&sMonotonicClockInit, ^{ LoggerInitMonotonicClock(); });
+	uint64_t t = sMonotonicClock();
+	if (sMonotonicTimebase.numer != sMonotonicTimebase.denom)
+		t = t * sMonotonicTimebase.numer / sMonotonicTimebase.denom;
+	return t;
 }
 
-static void LoggerMessageAddTimestamp(CFMutableDataRef encoder)
+static int64_t LoggerMonotonicClockAnchor(void)
+{
+	dispatch_once(&sMonotonicClockInit, ^{ LoggerInitMonotonicClock(); });
+	return sMonotonicClockAnchor;
+}
+
+static BOOL LoggerMonotonicClockCountsSleep(void)
+{
+	dispatch_once(&sMonotonicClockInit, ^{ LoggerInitMonotonicClock(); });
+	return sMonotonicClockCountsSleep;
+}
+
+static void LoggerMessageAddTimestamp(LoggerMessageEncoder *encoder)
 {
 	struct timeval t;
 	if (gettimeofday(&t, NULL) == 0)
@@ -2245,130 +2665,214 @@ static void LoggerMessageAddTimestamp(CFMutableDataRef encoder)
 	}
 }
 
-static void LoggerMessageAddTimestampAndThreadID(CFMutableDataRef encoder)
+static void LoggerMessageBuildThreadIDPart(LoggerMessageEncoder *cache, const char *pthreadName)
 {
-	LoggerMessageAddTimestamp(encoder);
+	// Compute the thread ID part for the current thread and store it, fully encoded,
+	// in the thread's cache. We use a scratch encoder so that the part is encoded
+	// exactly like any other part.
+	LoggerMessageEncoder part;
+	bzero(&part, sizeof(part));
 
 	BOOL hasThreadName = NO;
 	// Getting the thread number is tedious, to say the least. Since there is
 	// no direct way to get it, we have to do it sideways. Note that it can be dangerous
 	// to use any Cocoa call when in a multithreaded application that only uses non-Cocoa threads
 	// and for which Cocoa's multithreading has not been activated. We test for this case.
-	BOOL inMainThread = [NSThread isMainThread];
-	if (inMainThread)
+	if (pthread_main_np())
 	{
 		hasThreadName = YES;
-		LoggerMessageAddString(encoder, CFSTR("Main thread"), PART_KEY_THREAD_ID);
+		LoggerMessageAddString(&part, CFSTR("Main thread"), PART_KEY_THREAD_ID);
 	}
 	else if ([NSThread isMultiThreaded])
 	{
-		NSThread *thread = [NSThread currentThread];
-		NSString *name = [thread name];
-		if (![name length])
+		@autoreleasepool
 		{
-			// use the thread dictionary to store and retrieve the computed thread name
-			NSMutableDictionary *threadDict = [thread threadDictionary];
-			name = [threadDict objectForKey:@"__$NSLoggerThreadName$__"];
-			if (name == nil)
+			NSThread *thread = [NSThread currentThread];
+			NSString *name = [thread name];
+			if (![name length])
 			{
-				@autoreleasepool {
-					// optimize CPU use by computing the thread name once and storing it back
-					// in the thread dictionary
-					name = [thread description];
-                    NSArray *threadNumberPrefixes = @[@"num = ", @"number = "];
-                    NSRange range = NSMakeRange(NSNotFound, 0);
-                    
-                    for (NSString *threadNumberPrefix in threadNumberPrefixes)
-                    {
-                        range = [name rangeOfString:threadNumberPrefix];
-                        
-                        if (range.location != NSNotFound)
-                            break;
-                    }
-					
+				name = [thread description];
+				NSArray *threadNumberPrefixes = @[@"num = ", @"number = "];
+				NSRange range = NSMakeRange(NSNotFound, 0);
+
+				for (NSString *threadNumberPrefix in threadNumberPrefixes)
+				{
+					range = [name rangeOfString:threadNumberPrefix];
+
 					if (range.location != NSNotFound)
+						break;
+				}
+
+				if (range.location != NSNotFound)
+				{
+					// iOS and OS X now add a "name = (null)" when thread name unknown. Suppress it.
+					NSRange noNameRange = [name rangeOfString:@", name = (null)" options:(NSLiteralSearch | NSBackwardsSearch)];
+					if (noNameRange.location != NSNotFound)
 					{
-						// iOS and OS X now add a "name = (null)" when thread name unknown. Suppress it.
-						NSRange noNameRange = [name rangeOfString:@", name = (null)" options:(NSLiteralSearch | NSBackwardsSearch)];
-						if (noNameRange.location != NSNotFound)
-						{
-							name = [NSString stringWithFormat:@"Thread %@",
-									[name substringWithRange:NSMakeRange(range.location + range.length,
-																		 noNameRange.location - range.location - range.length)]];
-						}
-						else
-						{
-							name = [NSString stringWithFormat:@"Thread %@",
-									[name substringWithRange:NSMakeRange(range.location + range.length,
-																		 [name length] - range.location - range.length - 1)]];
-						}
-						[threadDict setObject:name forKey:@"__$NSLoggerThreadName$__"];
+						name = [NSString stringWithFormat:@"Thread %@",
+								[name substringWithRange:NSMakeRange(range.location + range.length,
+																	 noNameRange.location - range.location - range.length)]];
+					}
+					else
+					{
+						name = [NSString stringWithFormat:@"Thread %@",
+								[name substringWithRange:NSMakeRange(range.location + range.length,
+																	 [name length] - range.location - range.length - 1)]];
 					}
-                    else
-                    {
-                        name = nil;
-                    }
+				}
+				else
+				{
+					name = nil;
 				}
 			}
-		}
-		if (name != nil)
-		{
-			LoggerMessageAddString(encoder, (CFStringRef)name, PART_KEY_THREAD_ID);
-			hasThreadName = YES;
+			if (name != nil)
+			{
+				LoggerMessageAddString(&part, (CFStringRef)name, PART_KEY_THREAD_ID);
+				hasThreadName = YES;
+			}
 		}
 	}
 	if (!hasThreadName)
 	{
 #if __LP64__
-		LoggerMessageAddInt64(encoder, (int64_t)pthread_self(), PART_KEY_THREAD_ID);
+		LoggerMessageAddInt64(&part, (int64_t)pthread_self(), PART_KEY_THREAD_ID);
 #else
-		LoggerMessageAddInt32(encoder, (int32_t)pthread_self(), PART_KEY_THREAD_ID);
+		LoggerMessageAddInt32(&part, (int32_t)pthread_self(), PART_KEY_THREAD_ID);
 #endif
 	}
+
+	if (part.bytes != NULL && part.used < part.capacity)
+	{
+		uint8_t *trimmed = (uint8_t *)realloc(part.bytes, part.used);
+		if (trimmed != NULL)
+			part.bytes = trimmed;
+	}
+	free(cache->threadIDPart);
+	cache->threadIDPart = part.bytes;
+	cache->threadIDPartSize = part.used;
+	strlcpy(cache->threadIDPthreadName, pthreadName, sizeof(cache->threadIDPthreadName));
 }
 
-static CFMutableDataRef LoggerMessageCreate(int32_t seq)
+static void LoggerMessageAddTimestampAndThreadID(Logger *logger, LoggerMessageEncoder *encoder)
 {
-	CFMutableDataRef encoder = CFDataCreateMutable(NULL, 0);
-	if (encoder != NULL)
+	if ((logger->options & kLoggerOption_UseMonotonicTimestamps) && LoggerMonotonicClockCountsSleep())
+		LoggerMessageAddInt64(encoder, (int64_t)LoggerMonotonicNanoseconds(), PART_KEY_TIMESTAMP_NS);
+	else
+		LoggerMessageAddTimestamp(encoder);
+
+	// The thread ID part is computed once per thread and cached with the thread's arena.
+	// We use the pthread name to detect thread renames: -[NSThread setName:] also sets
+	// the pthread name when called on the current thread, which is cheap to read.
+	LoggerMessageEncoder *cache = encoder->temporary ? (LoggerMessageEncoder *)pthread_getspecific(sEncoderKey) : encoder;
+	if (cache == NULL)
+		cache = encoder;
+	char pthreadName[sizeof(cache->threadIDPthreadName)];
+	pthreadName[0] = 0;
+	pthread_getname_np(pthread_self(), pthreadName, sizeof(pthreadName));
+	if (cache->threadIDPart == NULL || strcmp(pthreadName, cache->threadIDPthreadName) != 0)
+		LoggerMessageBuildThreadIDPart(cache, pthreadName);
+
+	if (cache->threadIDPart != NULL)
 	{
-		CFDataIncreaseLength(encoder, 64);
-		uint8_t *p = CFDataGetMutableBytePtr(encoder);
+		uint8_t *p = LoggerMessagePrepareForPart(encoder, cache->threadIDPartSize);
 		if (p != NULL)
-		{
-			// directly write the sequence number as first part of the message
-			// so we find it quickly when inserting new messages in the queue
-			if (seq)
-			{
-				p[3] = 8;		// size 0x00000008 in big endian
-				p[5] = 1;		// part count 0x0001
-				p[6] = (uint8_t)PART_KEY_MESSAGE_SEQ;
-				p[7] = (uint8_t)PART_TYPE_INT32;
-				*(uint32_t *)(p + 8) = htonl(seq);
-			}
-			else
-			{
-				// empty message with a 0 part count
-				p[3] = 2;
-			}
-		}
-		LoggerMessageAddTimestampAndThreadID(encoder);
+			memcpy(p, cache->threadIDPart, cache->threadIDPartSize);
+	}
+}
+
+static LoggerMessageEncoder *LoggerMessageCreate(Logger *logger, int32_t seq)
+{
+	// Get this thread's encoding arena. If it is already in use, we are being called
+	// by a nested logging call (for example from a -description method invoked while
+	// formatting the message) and use a temporary arena instead.
+	pthread_once(&sEncoderKeyOnce, &LoggerMessageEncoderCreateKey);
+	LoggerMessageEncoder *encoder = (LoggerMessageEncoder *)pthread_getspecific(sEncoderKey);
+	if (encoder == NULL || encoder->inUse)
+	{
+		LoggerMessageEncoder *newEncoder = (LoggerMessageEncoder *)calloc(1, sizeof(LoggerMessageEncoder));
+		if (newEncoder == NULL)
+			return NULL;
+		if (encoder == NULL)
+			pthread_setspecific(sEncoderKey, newEncoder);
+		else
+			newEncoder->temporary = YES;
+		encoder = newEncoder;
+	}
+
+	// reserve the message header (size and part count are written by LoggerMessageFinalize)
+	encoder->used = 0;
+	if (!LoggerMessageReserve(encoder, 6))
+	{
+		if (encoder->temporary)
+			LoggerMessageEncoderDispose(encoder);
+		return NULL;
 	}
+	encoder->used = 6;
+	encoder->partCount = 0;
+	encoder->inUse = YES;
+
+	// directly write the sequence number as first part of the message
+	// so we find it quickly when inserting new messages in the queue
+	if (seq)
+		LoggerMessageAddInt32(encoder, seq, PART_KEY_MESSAGE_SEQ);
+
+	LoggerMessageAddTimestampAndThreadID(logger, encoder);
 	return encoder;
 }
 
-static void LoggerMessageFinalize(CFMutableDataRef encoder)
+static CFDataRef LoggerMessageFinalize(LoggerMessageEncoder *encoder)
 {
-	// Finalize a message by reducing the CFData size to the actual used size
+	// Finalize a message: write its header and copy it to a CFData in a single allocation,
+	// then give the arena back to the thread
+	CFDataRef message = NULL;
 	if (encoder != NULL)
 	{
-		uint32_t *p = (uint32_t *)CFDataGetBytePtr(encoder);
-		if (p != NULL)
-			CFDataSetLength(encoder, ntohl(*p) + 4);
+		uint8_t *p = encoder->bytes;
+		WRITE_MISALIGNED_INT32(p, encoder->used - 4)
+		p[4] = (uint8_t)(encoder->partCount >> 8);
+		p[5] = (uint8_t)encoder->partCount;
+		message = CFDataCreate(NULL, encoder->bytes, (CFIndex)encoder->used);
+		LOGGER_COUNT_ENCODER_ALLOCATION();
+#if LOGGER_ENCODER_STATISTICS
+		atomic_fetch_add(&sEncodedMessagesCount, 1);
+#endif
+		LoggerMessageAbandon(encoder);
+	}
+	return message;
+}
+
+static void LoggerMessageAbandon(LoggerMessageEncoder *encoder)
+{
+	// Give the arena back to the thread, without producing a message. Also used by
+	// LoggerMessageFinalize(), and when formatting a message throws an exception.
+	if (encoder != NULL)
+	{
+		encoder->inUse = NO;
+		if (encoder->temporary)
+		{
+			LoggerMessageEncoderDispose(encoder);
+		}
+		else if (encoder->capacity > LOGGER_ENCODER_MAX_RETAINED_CAPACITY)
+		{
+			// don't keep a big arena around after logging a large block of data or an image
+			free(encoder->bytes);
+			encoder->bytes = NULL;
+			encoder->capacity = 0;
+		}
 	}
 }
 
-static void LoggerMessageAddInteger(CFMutableDataRef encoder, NSInteger anInt, int key) {
+static void LoggerMessageFinalizeAndPushToQueue(Logger *logger, LoggerMessageEncoder *encoder)
+{
+	CFDataRef message = LoggerMessageFinalize(encoder);
+	if (message != NULL)
+	{
+		LoggerPushMessageToQueue(logger, message);
+		CFRelease(message);
+	}
+}
+
+static void LoggerMessageAddInteger(LoggerMessageEncoder *encoder, NSInteger anInt, int key) {
 #if __LP64__
     LoggerMessageAddInt64(encoder, anInt, key);
 #else
@@ -2376,7 +2880,7 @@ static void LoggerMessageAddInteger(CFMutableDataRef encoder, NSInteger anInt, i
 #endif
 }
 
-static void LoggerMessageAddInt32(CFMutableDataRef encoder, int32_t anInt, int key)
+static void LoggerMessageAddInt32(LoggerMessageEncoder *encoder, int32_t anInt, int key)
 {
 	uint8_t *p = LoggerMessagePrepareForPart(encoder, 6);
 	if (p != NULL)
@@ -2387,8 +2891,7 @@ static void LoggerMessageAddInt32(CFMutableDataRef encoder, int32_t anInt, int k
 	}
 }
 
-#if __LP64__
-static void LoggerMessageAddInt64(CFMutableDataRef encoder, int64_t anInt, int key)
+static void LoggerMessageAddInt64(LoggerMessageEncoder *encoder, int64_t anInt, int key)
 {
 	uint8_t *p = LoggerMessagePrepareForPart(encoder, 10);
 	if (p != NULL)
@@ -2398,17 +2901,157 @@ static void LoggerMessageAddInt64(CFMutableDataRef encoder, int64_t anInt, int k
 		WRITE_MISALIGNED_INT64(p, anInt)
 	}
 }
+
+static void LoggerImageAdded(const struct mach_header *header, intptr_t slide)
+{
+	// Called by dyld for each image already loaded when the callback is registered, then for each
+	// image loaded later. Keep the __TEXT segments sorted by address
+	(void)slide;
+	unsigned long size = 0;
+#if __LP64__
+	const uint8_t *text = getsegmentdata((const struct mach_header_64 *)header, "__TEXT", &size);
+#else
+	const uint8_t *text = getsegmentdata(header, "__TEXT", &size);
 #endif
+	if (text == NULL || size == 0)
+		return;
+	pthread_rwlock_wrlock(&sTextSegmentsLock);
+	if (sTextSegmentsCount == sTextSegmentsCapacity)
+	{
+		uint32_t capacity = sTextSegmentsCapacity ? sTextSegmentsCapacity * 2 : 512;
+		LoggerAddressRange *segments = (LoggerAddressRange *)realloc(sTextSegments, capacity * sizeof(LoggerAddressRange));
+		if (segments == NULL)
+		{
+			pthread_rwlock_unlock(&sTextSegmentsLock);
+			return;
+		}
+		sTextSegments = segments;
+		sTextSegmentsCapacity = capacity;
+	}
+	uint32_t i = sTextSegmentsCount;
+	while (i > 0 && sTextSegments[i - 1].start > (uintptr_t)text)
+	{
+		sTextSegments[i] = sTextSegments[i - 1];
+		i--;
+	}
+	sTextSegments[i].start = (uintptr_t)text;
+	sTextSegments[i].end = (uintptr_t)text + size;
+	sTextSegmentsCount++;
+	pthread_rwlock_unlock(&sTextSegmentsLock);
+}
+
+static void LoggerRegisterImageCallback(void)
+{
+	_dyld_register_func_for_add_image(&LoggerImageAdded);
+}
 
-static void LoggerMessageAddCString(CFMutableDataRef data, const char *aString, int key)
+static BOOL LoggerIsStringLiteral(const char *aString)
+{
+	// String literals (including the bytes of constant CFStrings) live in the read-only
+	// __TEXT segment of the image that uses them, so their address identifies their contents.
+	// The segments are recorded as images load, this doesn't call into dyld (dladdr takes its lock)
+	pthread_once(&sTextSegmentsOnce, &LoggerRegisterImageCallback);
+	uintptr_t address = (uintptr_t)aString;
+	BOOL found = NO;
+	pthread_rwlock_rdlock(&sTextSegmentsLock);
+	uint32_t lo = 0, hi = sTextSegmentsCount;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (sTextSegments[mid].start <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && address < sTextSegments[lo - 1].end)
+		found = YES;
+	pthread_rwlock_unlock(&sTextSegmentsLock);
+	return found;
+}
+
+static const LoggerLiteral *LoggerGetLiteral(uint32_t literalID)
+{
+	// Literals are never removed, and chunks never move once allocated: no lock is needed
+	// to read a literal once its ID has been obtained
+	return &sLiterals[literalID / LOGGER_LITERALS_CHUNK_SIZE][literalID % LOGGER_LITERALS_CHUNK_SIZE];
+}
+
+static uint32_t LoggerRegisterLiteral(const char *aString)
+{
+	// Returns the ID of a string literal, registering it the first time it's seen by any thread.
+	// Returns UINT32_MAX if aString is not a string literal, or the table is full
+	if (!LoggerIsStringLiteral(aString))
+		return UINT32_MAX;
+
+	uint32_t literalID = UINT32_MAX;
+	pthread_mutex_lock(&sLiteralsMutex);
+	if (sLiteralIDs == NULL)
+		sLiteralIDs = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+	uintptr_t value = (uintptr_t)CFDictionaryGetValue(sLiteralIDs, aString);
+	if (value != 0)
+	{
+		literalID = (uint32_t)(value - 1);
+	}
+	else
+	{
+		uint32_t chunk = sLiteralsCount / LOGGER_LITERALS_CHUNK_SIZE;
+		if (chunk < LOGGER_LITERALS_MAX_CHUNKS)
+		{
+			if (sLiterals[chunk] == NULL)
+				sLiterals[chunk] = (LoggerLiteral *)calloc(LOGGER_LITERALS_CHUNK_SIZE, sizeof(LoggerLiteral));
+			if (sLiterals[chunk] != NULL)
+			{
+				LoggerLiteral *literal = &sLiterals[chunk][sLiteralsCount % LOGGER_LITERALS_CHUNK_SIZE];
+				literal->bytes = aString;
+				literal->length = (uint32_t)strlen(aString);
+				literalID = sLiteralsCount++;
+				CFDictionarySetValue(sLiteralIDs, aString, (const void *)(uintptr_t)(literalID + 1));
+			}
+		}
+	}
+	pthread_mutex_unlock(&sLiteralsMutex);
+	return literalID;
+}
+
+static BOOL LoggerMessageAddLiteral(LoggerMessageEncoder *encoder, const char *aString, int key)
+{
+	// If aString is a string literal (typically __FILE__ and __FUNCTION__), add a reference to it
+	// instead of its contents. The thread's pointer cache saves looking up the global table on each
+	// call. Other pointers are not cached: they may be buffers that change on each call (i.e. strings
+	// bridged from Swift), which would evict the literals. Returns NO if aString is not a literal.
+	LoggerLiteralCacheEntry *entry = &encoder->literalCache[((uintptr_t)aString ^ ((uintptr_t)aString >> 9)) & (LOGGER_LITERAL_CACHE_SIZE - 1)];
+	if (entry->pointer != aString)
+	{
+		uint32_t literalID = LoggerRegisterLiteral(aString);
+		if (literalID == UINT32_MAX)
+			return NO;
+		entry->pointer = aString;
+		entry->literalID = literalID;
+	}
+
+	uint8_t *p = LoggerMessagePrepareForPart(encoder, 10);
+	if (p != NULL)
+	{
+		*p++ = (uint8_t)key;
+		*p++ = (uint8_t)PART_TYPE_LITERAL_REF;
+		WRITE_MISALIGNED_INT32(p, 4)
+		WRITE_MISALIGNED_INT32(p + 4, entry->literalID)
+	}
+	return YES;
+}
+
+static void LoggerMessageAddCString(LoggerMessageEncoder *encoder, const char *aString, int key)
 {
 	if (aString == NULL || *aString == 0)
 		return;
-	
+
+	if (LoggerMessageAddLiteral(encoder, aString, key))
+		return;
+
 	int n = (int)strlen(aString);
 	if (n)
 	{
-		uint8_t *p = LoggerMessagePrepareForPart(data, (uint32_t)n+6);
+		uint8_t *p = LoggerMessagePrepareForPart(encoder, (uint32_t)n+6);
 		if (p != NULL)
 		{
 			*p++ = (uint8_t)key;
@@ -2419,42 +3062,37 @@ static void LoggerMessageAddCString(CFMutableDataRef data, const char *aString,
 	}
 }
 
-static void LoggerMessageAddString(CFMutableDataRef encoder, CFStringRef aString, int key)
+static void LoggerMessageAddString(LoggerMessageEncoder *encoder, CFStringRef aString, int key)
 {
 	if (aString == NULL)
 		aString = CFSTR("");
 
-	// All strings are UTF-8 encoded
-	uint32_t partSize = 0;
-	uint8_t *bytes = NULL;
-	
-	CFIndex stringLength = CFStringGetLength(aString);
-	CFIndex bytesLength = stringLength * 4;
-	if (stringLength)
+	// Constant tags, file and function names are sent as string literals
+	if (key == PART_KEY_TAG || key == PART_KEY_FILENAME || key == PART_KEY_FUNCTIONNAME)
 	{
-		bytes = (uint8_t *)malloc((size_t)bytesLength + 4);
-		if (bytes != NULL)
-		{
-			CFStringGetBytes(aString, CFRangeMake(0, stringLength), kCFStringEncodingUTF8, '?', false, bytes, bytesLength, &bytesLength);
-			partSize = (uint32_t)bytesLength;
-		}
+		const char *literal = CFStringGetCStringPtr(aString, kCFStringEncodingUTF8);
+		if (literal != NULL && *literal != 0 && LoggerMessageAddLiteral(encoder, literal, key))
+			return;
 	}
 
-	uint8_t *p = LoggerMessagePrepareForPart(encoder, 6 + partSize);
+	// All strings are UTF-8 encoded. We reserve room for the worst case and convert
+	// the string right into the arena, then give back what we didn't use
+	CFIndex stringLength = CFStringGetLength(aString);
+	CFIndex maxBytesLength = stringLength ? CFStringGetMaximumSizeForEncoding(stringLength, kCFStringEncodingUTF8) : 0;
+	uint8_t *p = LoggerMessagePrepareForPart(encoder, 6 + (uint32_t)maxBytesLength);
 	if (p != NULL)
 	{
+		CFIndex bytesLength = 0;
+		if (stringLength)
+			CFStringGetBytes(aString, CFRangeMake(0, stringLength), kCFStringEncodingUTF8, '?', false, p + 6, maxBytesLength, &bytesLength);
 		*p++ = (uint8_t)key;
 		*p++ = (uint8_t)PART_TYPE_STRING;
-		WRITE_MISALIGNED_INT32(p, partSize)
-		if (partSize && bytes != NULL)
-			memcpy(p + 4, bytes, (size_t)partSize);
+		WRITE_MISALIGNED_INT32(p, bytesLength)
+		encoder->used -= (uint32_t)(maxBytesLength - bytesLength);
 	}
-
-	if (bytes != NULL)
-		free(bytes);
 }
 
-static void LoggerMessageAddData(CFMutableDataRef encoder, CFDataRef theData, int key, int partType)
+static void LoggerMessageAddData(LoggerMessageEncoder *encoder, CFDataRef theData, int key, int partType)
 {
 	if (theData != NULL)
 	{
@@ -2487,6 +3125,467 @@ static uint32_t LoggerMessageGetSeq(CFDataRef message)
 	return 0;
 }
 
+static CFIndex LoggerMessageGetV1Size(CFDataRef message, BOOL *hasLiterals)
+{
+	// Compute the size of a queued message once its string literal references are expanded
+	const uint8_t *p = CFDataGetBytePtr(message);
+	CFIndex size = CFDataGetLength(message);
+	uint32_t partCount = ((uint32_t)p[4] << 8) | p[5];
+	p += 6;
+	*hasLiterals = NO;
+	while (partCount--)
+	{
+		uint8_t type = p[1];
+		p += 2;
+		if (type == PART_TYPE_INT16)
+			p += 2;
+		else if (type == PART_TYPE_INT32)
+			p += 4;
+		else if (type == PART_TYPE_INT64)
+			p += 8;
+		else
+		{
+			uint32_t partSize = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+			if (type == PART_TYPE_LITERAL_REF)
+			{
+				uint32_t literalID = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+				size += (CFIndex)LoggerGetLiteral(literalID)->length - 4;
+				*hasLiterals = YES;
+			}
+			p += 4 + partSize;
+		}
+	}
+	return size;
+}
+
+static CFIndex LoggerMessageCopyV1(CFDataRef message, uint8_t *dst, NSUInteger available)
+{
+	// Copy a queued message to dst in the v1 format, expanding string literal references.
+	// Returns the number of bytes written, or -1 if the message doesn't fit
+	BOOL hasLiterals;
+	CFIndex size = LoggerMessageGetV1Size(message, &hasLiterals);
+	if ((NSUInteger)size > available)
+		return -1;
+	const uint8_t *p = CFDataGetBytePtr(message);
+	if (!hasLiterals)
+	{
+		memcpy(dst, p, (size_t)size);
+		return size;
+	}
+
+	uint32_t partCount = ((uint32_t)p[4] << 8) | p[5];
+	WRITE_MISALIGNED_INT32(dst, size - 4)
+	dst[4] = p[4];
+	dst[5] = p[5];
+	uint8_t *q = dst + 6;
+	p += 6;
+	while (partCount--)
+	{
+		uint8_t type = p[1];
+		uint32_t partSize;
+		if (type == PART_TYPE_INT16)
+			partSize = 2 + 2;
+		else if (type == PART_TYPE_INT32)
+			partSize = 2 + 4;
+		else if (type == PART_TYPE_INT64)
+			partSize = 2 + 8;
+		else
+			partSize = 2 + 4 + (((uint32_t)p[2] << 24) | ((uint32_t)p[3] << 16) | ((uint32_t)p[4] << 8) | p[5]);
+		if (type == PART_TYPE_LITERAL_REF)
+		{
+			const LoggerLiteral *literal = LoggerGetLiteral(((uint32_t)p[6] << 24) | ((uint32_t)p[7] << 16) | ((uint32_t)p[8] << 8) | p[9]);
+			*q++ = p[0];
+			*q++ = (uint8_t)PART_TYPE_STRING;
+			WRITE_MISALIGNED_INT32(q, literal->length)
+			memcpy(q + 4, literal->bytes, literal->length);
+			q += 4 + literal->length;
+		}
+		else
+		{
+			memcpy(q, p, partSize);
+			q += partSize;
+		}
+		p += partSize;
+	}
+	return size;
+}
+
+static CFDataRef LoggerMessageCreateV1(CFDataRef message)
+{
+	// Return a queued message in the v1 format (the message itself if it doesn't reference string literals)
+	BOOL hasLiterals;
+	CFIndex size = LoggerMessageGetV1Size(message, &hasLiterals);
+	if (!hasLiterals)
+		return (CFDataRef)CFRetain(message);
+	uint8_t *bytes = (uint8_t *)malloc((size_t)size);
+	if (bytes == NULL)
+		return NULL;
+	LoggerMessageCopyV1(message, bytes, (NSUInteger)size);
+	CFDataRef v1Message = CFDataCreateWithBytesNoCopy(NULL, bytes, size, kCFAllocatorMalloc);
+	if (v1Message == NULL)
+		free(bytes);
+	return v1Message;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Wire protocol v2 encoding
+// -----------------------------------------------------------------------------
+static LoggerWireEncoder *LoggerWireEncoderCreate(void)
+{
+	LoggerWireEncoder *wire = (LoggerWireEncoder *)calloc(1, sizeof(LoggerWireEncoder));
+	if (wire != NULL)
+		LoggerWireEncoderReset(wire);
+	return wire;
+}
+
+static void LoggerWireEncoderDispose(LoggerWireEncoder *wire)
+{
+	if (wire != NULL)
+	{
+		free(wire->pool);
+		free(wire->literalStringIDs);
+		free(wire);
+	}
+}
+
+static void LoggerWireEncoderReset(LoggerWireEncoder *wire)
+{
+	// Forget the strings and values sent so far. The viewer does the same when it receives
+	// a client info message
+	bzero(wire->deltaBase, sizeof(wire->deltaBase));
+	memset(wire->buckets, 0xFF, sizeof(wire->buckets));
+	wire->stringsCount = 0;
+	wire->poolUsed = 0;
+	if (wire->literalStringIDs != NULL)
+		bzero(wire->literalStringIDs, sizeof(uint32_t) * wire->literalStringIDsCount);
+}
+
+static uint32_t LoggerWireInternString(LoggerWireEncoder *wire, const uint8_t *bytes, uint32_t length, BOOL *isNew)
+{
+	// Look up a string in the table of strings already sent on this connection, and add it
+	// if it's not there yet. Returns UINT32_MAX if the string can't be interned.
+	if (length > LOGGER_WIRE_MAX_INTERNED_LENGTH)
+		return UINT32_MAX;
+
+	uint32_t hash = 2166136261U;					// FNV-1a
+	for (uint32_t i = 0; i < length; i++)
+		hash = (hash ^ bytes[i]) * 16777619U;
+
+	int32_t *bucket = &wire->buckets[hash & (LOGGER_WIRE_HASH_BUCKETS - 1)];
+	for (int32_t idx = *bucket; idx >= 0; idx = wire->strings[idx].next)
+	{
+		LoggerWireString *str = &wire->strings[idx];
+		if (str->hash == hash && str->length == length && memcmp(wire->pool + str->offset, bytes, length) == 0)
+		{
+			*isNew = NO;
+			return (uint32_t)idx;
+		}
+	}
+
+	if (wire->stringsCount == LOGGER_WIRE_MAX_STRINGS)
+		return UINT32_MAX;
+	if (wire->poolUsed + length > wire->poolSize)
+	{
+		uint32_t newSize = wire->poolSize ? wire->poolSize : 16384;
+		while (newSize < wire->poolUsed + length)
+			newSize <<= 1;
+		uint8_t *newPool = (uint8_t *)realloc(wire->pool, newSize);
+		if (newPool == NULL)
+			return UINT32_MAX;
+		wire->pool = newPool;
+		wire->poolSize = newSize;
+	}
+
+	uint32_t idx = wire->stringsCount++;
+	LoggerWireString *str = &wire->strings[idx];
+	str->hash = hash;
+	str->length = length;
+	str->offset = wire->poolUsed;
+	str->next = *bucket;
+	*bucket = (int32_t)idx;
+	memcpy(wire->pool + wire->poolUsed, bytes, length);
+	wire->poolUsed += length;
+	*isNew = YES;
+	return idx;
+}
+
+static uint32_t LoggerWireInternLiteral(LoggerWireEncoder *wire, uint32_t literalID, BOOL *isNew)
+{
+	// Get the string ID of a string literal on this connection. Literals are known by their ID,
+	// they don't need to be hashed or kept in the strings pool.
+	if (literalID >= wire->literalStringIDsCount)
+	{
+		uint32_t newCount = wire->literalStringIDsCount ? wire->literalStringIDsCount : 256;
+		while (newCount <= literalID)
+			newCount <<= 1;
+		uint32_t *newIDs = (uint32_t *)realloc(wire->literalStringIDs, sizeof(uint32_t) * newCount);
+		if (newIDs == NULL)
+			return UINT32_MAX;
+		bzero(newIDs + wire->literalStringIDsCount, sizeof(uint32_t) * (newCount - wire->literalStringIDsCount));
+		wire->literalStringIDs = newIDs;
+		wire->literalStringIDsCount = newCount;
+	}
+	if (wire->literalStringIDs[literalID] != 0)
+	{
+		*isNew = NO;
+		return wire->literalStringIDs[literalID] - 1;
+	}
+	if (wire->stringsCount == LOGGER_WIRE_MAX_STRINGS)
+		return UINT32_MAX;
+	uint32_t idx = wire->stringsCount++;
+	bzero(&wire->strings[idx], sizeof(LoggerWireString));
+	wire->strings[idx].next = -1;
+	wire->literalStringIDs[literalID] = idx + 1;
+	*isNew = YES;
+	return idx;
+}
+
+static uint8_t *LoggerWireWriteVarint(uint8_t *p, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		*p++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static int64_t LoggerWireReadInt(const uint8_t *p, uint8_t partType)
+{
+	// Read the (big endian) value of an integer part of a v1 message
+	if (partType == PART_TYPE_INT16)
+		return (int16_t)(((uint16_t)p[0] << 8) | p[1]);
+	if (partType == PART_TYPE_INT32)
+		return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return (int64_t)v;
+}
+
+static CFIndex LoggerWireEncodeMessage(LoggerWireEncoder *wire, CFDataRef message, uint8_t *dst, NSUInteger available)
+{
+	// Encode a queued message in the v2 format. Returns the size of the frame written at dst,
+	// 0 if the message must be sent in its original form (client info messages, which reset the
+	// encoder state, and messages we can't parse), or -1 if the frame may not fit in the available space
+	const uint8_t *msg = CFDataGetBytePtr(message);
+	CFIndex msgLength = CFDataGetLength(message);
+	if (msgLength < 6)
+		return 0;
+	const uint8_t *end = msg + msgLength;
+	uint32_t partCount = ((uint32_t)msg[4] << 8) | msg[5];
+
+	// First pass: validate the message and compute the worst case size of its frame
+	// (the encoder state is only modified once we know the frame fits)
+	NSUInteger maxFrameSize = 4 + 3;
+	const uint8_t *p = msg + 6;
+	for (uint32_t i = 0; i < partCount; i++)
+	{
+		if (end - p < 2)
+			return 0;
+		uint8_t key = p[0], type = p[1];
+		p += 2;
+		uint32_t size;
+		switch (type)
+		{
+			case PART_TYPE_INT16:
+				size = 2;
+				break;
+			case PART_TYPE_INT32:
+				size = 4;
+				break;
+			case PART_TYPE_INT64:
+				size = 8;
+				break;
+			case PART_TYPE_STRING:
+			case PART_TYPE_BINARY:
+			case PART_TYPE_IMAGE:
+			case PART_TYPE_LITERAL_REF:
+				if (end - p < 4)
+					return 0;
+				size = (uint32_t)LoggerWireReadInt(p, PART_TYPE_INT32);
+				p += 4;
+				break;
+			default:
+				return 0;
+		}
+		if ((NSUInteger)(end - p) < size)
+			return 0;
+		if (type == PART_TYPE_LITERAL_REF)
+			maxFrameSize += LoggerGetLiteral((uint32_t)LoggerWireReadInt(p, PART_TYPE_INT32))->length;
+		if (key == PART_KEY_MESSAGE_TYPE && type != PART_TYPE_STRING && type != PART_TYPE_BINARY && type != PART_TYPE_IMAGE &&
+			LoggerWireReadInt(p, type) == LOGMSG_TYPE_CLIENTINFO)
+		{
+			LoggerWireEncoderReset(wire);
+			return 0;
+		}
+		maxFrameSize += 2 + 10 + 10 + size;			// key, type, string ID and size or value varints, data
+		p += size;
+	}
+	if (maxFrameSize > available)
+		return -1;
+
+	// Second pass: encode the parts
+	uint8_t *q = LoggerWireWriteVarint(dst + 4, partCount);
+	p = msg + 6;
+	for (uint32_t i = 0; i < partCount; i++)
+	{
+		uint8_t key = *p++, type = *p++;
+		*q++ = key;
+		if (type == PART_TYPE_INT16 || type == PART_TYPE_INT32 || type == PART_TYPE_INT64)
+		{
+			int64_t value = LoggerWireReadInt(p, type);
+			p += (type == PART_TYPE_INT16) ? 2 : (type == PART_TYPE_INT32) ? 4 : 8;
+			if (LOGGER_WIRE_IS_DELTA_KEY(key))
+			{
+				int64_t base = wire->deltaBase[key];
+				wire->deltaBase[key] = value;
+				value = (int64_t)((uint64_t)value - (uint64_t)base);
+			}
+			*q++ = type;
+			q = LoggerWireWriteVarint(q, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+		}
+		else
+		{
+			uint32_t size = (uint32_t)LoggerWireReadInt(p, PART_TYPE_INT32);
+			p += 4;
+			const uint8_t *bytes = p;
+			p += size;
+			uint32_t stringID = UINT32_MAX;
+			BOOL isNew = NO;
+			if (type == PART_TYPE_LITERAL_REF)
+			{
+				uint32_t literalID = (uint32_t)LoggerWireReadInt(bytes, PART_TYPE_INT32);
+				const LoggerLiteral *literal = LoggerGetLiteral(literalID);
+				bytes = (const uint8_t *)literal->bytes;
+				size = literal->length;
+				type = PART_TYPE_STRING;
+				stringID = LoggerWireInternLiteral(wire, literalID, &isNew);
+			}
+			else if (type == PART_TYPE_STRING && LOGGER_WIRE_IS_INTERNED_KEY(key))
+			{
+				stringID = LoggerWireInternString(wire, bytes, size, &isNew);
+			}
+			if (stringID != UINT32_MAX && !isNew)
+			{
+				*q++ = PART_TYPE_STRING_REF;
+				q = LoggerWireWriteVarint(q, stringID);
+			}
+			else
+			{
+				if (stringID != UINT32_MAX)
+				{
+					*q++ = PART_TYPE_STRING_DEF;
+					q = LoggerWireWriteVarint(q, stringID);
+				}
+				else
+				{
+					*q++ = type;
+				}
+				q = LoggerWireWriteVarint(q, size);
+				memcpy(q, bytes, size);
+				q += size;
+			}
+		}
+	}
+
+	uint32_t frameSize = (uint32_t)(q - dst - 4);
+	WRITE_MISALIGNED_INT32(dst, frameSize | LOGGER_FRAME_V2_FLAG)
+	return (CFIndex)(q - dst);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Compressed framing
+// -----------------------------------------------------------------------------
+#define LOGGER_COMPRESSED_SEND_BUFFER_SIZE	32768	// send buffer size when compressing, larger blocks compress better
+
+static BOOL LoggerPrepareCompression(Logger *logger)
+{
+	// Allocate the compression buffers the first time we connect to a viewer that accepts
+	// compressed data, and grow the send buffer so that each block carries more messages.
+	// Called from the worker thread while disconnected.
+	if (logger->blockBuffer == NULL)
+	{
+		logger->blockBuffer = (uint8_t *)malloc(8 + LOGGER_COMPRESSED_BLOCK_MAX_SIZE);
+		logger->compressionHashTable = (uint32_t *)malloc(sizeof(uint32_t) * LOGGER_LZ4_HASH_SIZE);
+		if (logger->blockBuffer == NULL || logger->compressionHashTable == NULL)
+		{
+			free(logger->blockBuffer);
+			free(logger->compressionHashTable);
+			logger->blockBuffer = NULL;
+			logger->compressionHashTable = NULL;
+			return NO;
+		}
+	}
+	if (logger->sendBufferSize < LOGGER_COMPRESSED_SEND_BUFFER_SIZE && logger->sendBufferUsed == 0)
+	{
+		uint8_t *newBuffer = (uint8_t *)realloc(logger->sendBuffer, LOGGER_COMPRESSED_SEND_BUFFER_SIZE);
+		if (newBuffer != NULL)
+		{
+			logger->sendBuffer = newBuffer;
+			uint32_t *newEnds = (uint32_t *)realloc(logger->sendBufferItemEnds, sizeof(uint32_t) * (LOGGER_COMPRESSED_SEND_BUFFER_SIZE / 4));
+			if (newEnds != NULL)
+			{
+				logger->sendBufferItemEnds = newEnds;
+				logger->sendBufferSize = LOGGER_COMPRESSED_SEND_BUFFER_SIZE;
+			}
+		}
+	}
+	LoggerResetCompression(logger);
+	return YES;
+}
+
+static void LoggerResetCompression(Logger *logger)
+{
+	// Forget the block being sent, if any: the data it contains will be sent again (see LoggerRequeueSendBufferItems)
+	logger->compressData = NO;
+	logger->blockBufferUsed = 0;
+	logger->blockBufferOffset = 0;
+	logger->blockSourceLength = 0;
+}
+
+static int LoggerWriteCompressedBlock(Logger *logger, const uint8_t *source, NSUInteger sourceLength)
+{
+	// Send the beginning of the source bytes as a compressed block. Returns -1 if the write failed, 0 if
+	// the block was only partially sent (call again with the same source to continue) or 1 once the block
+	// has been completely sent. blockSourceLength then tells how many source bytes the block contained.
+	if (logger->blockBufferUsed == 0)
+	{
+		uint32_t length = (uint32_t)MIN(sourceLength, (NSUInteger)LOGGER_COMPRESSED_BLOCK_MAX_SIZE);
+		uint8_t *p = logger->blockBuffer;
+		uint32_t payloadLength = LoggerLZ4Compress(source, length, p + 8, length - 1, logger->compressionHashTable);
+		if (payloadLength == 0)
+		{
+			// data that doesn't compress (i.e. PNG images) is sent as-is
+			memcpy(p + 8, source, length);
+			payloadLength = length;
+		}
+		WRITE_MISALIGNED_INT32(p, (payloadLength + 4) | LOGGER_FRAME_COMPRESSED_FLAG)
+		WRITE_MISALIGNED_INT32(p + 4, length)
+		logger->blockBufferUsed = 8 + payloadLength;
+		logger->blockBufferOffset = 0;
+		logger->blockSourceLength = length;
+	}
+
+	CFIndex written = CFWriteStreamWrite(logger->logStream,
+										 logger->blockBuffer + logger->blockBufferOffset,
+										 (CFIndex)(logger->blockBufferUsed - logger->blockBufferOffset));
+	if (written < 0)
+	{
+		LOGGERDBG(CFSTR("CFWriteStreamWrite got %d result"), written);
+		return -1;
+	}
+	logger->blockBufferOffset += (NSUInteger)written;
+	if (logger->blockBufferOffset < logger->blockBufferUsed)
+		return 0;
+	logger->blockBufferUsed = 0;
+	logger->blockBufferOffset = 0;
+	return 1;
+}
+
 // -----------------------------------------------------------------------------
 #pragma mark -
 #pragma mark Private logging functions
@@ -2501,10 +3600,13 @@ static void	LoggerPushClientInfoToFrontOfQueue(Logger *logger)
 	CFBundleRef bundle = CFBundleGetMainBundle();
 	if (bundle == NULL)
 		return;
-	CFMutableDataRef encoder = LoggerMessageCreate(0);
+	LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, 0);
 	if (encoder != NULL)
 	{
 		LoggerMessageAddInt32(encoder, LOGMSG_TYPE_CLIENTINFO, PART_KEY_MESSAGE_TYPE);
+		LoggerMessageAddInt64(encoder, LoggerMonotonicClockAnchor(), PART_KEY_TIMESTAMP_ANCHOR_NS);
+		if (logger->viewerProtocolVersion >= 2)
+			LoggerMessageAddInt32(encoder, (int32_t)logger->viewerProtocolVersion, PART_KEY_PROTOCOL_VERSION);
 
 		CFStringRef version = (CFStringRef)CFBundleGetValueForInfoDictionaryKey(bundle, kCFBundleVersionKey);
 		if (version != NULL && CFGetTypeID(version) == CFStringGetTypeID())
@@ -2579,38 +3681,96 @@ static void	LoggerPushClientInfoToFrontOfQueue(Logger *logger)
 		LoggerMessageAddString(encoder, s, PART_KEY_CLIENT_MODEL);
 		CFRelease(s);
 #endif
-		LoggerMessageFinalize(encoder);
-
-		pthread_mutex_lock(&logger->logQueueMutex);
-		CFArrayInsertValueAtIndex(logger->logQueue, logger->incompleteSendOfFirstItem ? 1 : 0, encoder);
-		pthread_mutex_unlock(&logger->logQueueMutex);
-
-		CFRelease(encoder);
+		CFDataRef message = LoggerMessageFinalize(encoder);
+		if (message != NULL)
+		{
+			pthread_mutex_lock(&logger->logQueueMutex);
+			CFArrayInsertValueAtIndex(logger->logQueue, logger->incompleteSendOfFirstItem ? 1 : 0, message);
+			pthread_mutex_unlock(&logger->logQueueMutex);
+			CFRelease(message);
+		}
 	}
 }
 
-static void LoggerPushMessageToQueue(Logger *logger, CFDataRef message)
+static void LoggerInsertMessageInQueue(Logger *logger, CFDataRef message)
 {
-	// Add the message to the log queue and signal the runLoop source that will trigger
-	// a send on the worker thread.
-	pthread_mutex_lock(&logger->logQueueMutex);
+	// Insert a message in the log queue. Must be called with the log queue mutex held.
 	CFIndex idx = CFArrayGetCount(logger->logQueue);
 	if (idx)
 	{
 		// to prevent out-of-order messages (as much as possible), we try to transmit messages in the
 		// order their sequence number was generated. Since the seq is generated first-thing,
 		// we can provide fine-grained ordering that gives a reasonable idea of the order
-		// the logging calls were made (useful for precise information about multithreading code)
+		// the logging calls were made (useful for precise information about multithreading code).
+		// Messages that have not been sent yet act as the reorder window.
 		uint32_t lastSeq, seq = LoggerMessageGetSeq(message);
 		do {
 			lastSeq = LoggerMessageGetSeq(CFArrayGetValueAtIndex(logger->logQueue, idx-1));
 		} while (lastSeq > seq && --idx > 0);
+		if (logger->incompleteSendOfFirstItem && idx == 0)
+			idx = 1;		// never insert before an item being partially sent
 	}
-	if (idx >= 0)
-		CFArrayInsertValueAtIndex(logger->logQueue, idx, message);
-	else
-		CFArrayAppendValue(logger->logQueue, message);
-	
+	CFArrayInsertValueAtIndex(logger->logQueue, idx, message);
+}
+
+static void LoggerDrainMessageRing(Logger *logger)
+{
+	// Move all the messages published in the ring to the log queue. The log queue mutex
+	// must be held: it is what makes us the single consumer of the ring. We stop at
+	// the first slot whose producer hasn't published its message yet; it will be picked
+	// up at the next drain (the producer signals the worker thread after publishing).
+	CFDataRef message;
+	while ((message = (CFDataRef)LoggerMessageRingPop(&logger->messageRing)) != NULL)
+	{
+		LoggerInsertMessageInQueue(logger, message);
+		CFRelease(message);
+	}
+}
+
+static CFMutableArrayRef LoggerTakeSendBatch(Logger *logger)
+{
+	// Remove the messages at the head of the log queue that may fit in the send buffer, at least one.
+	// Encoded messages are usually smaller than the messages in the queue, those that don't fit after
+	// all are put back. Must be called with the log queue mutex held, returns NULL if the queue is empty
+	CFIndex queueCount = CFArrayGetCount(logger->logQueue), count = 0;
+	if (queueCount == 0)
+		return NULL;
+	NSUInteger available = logger->sendBufferSize - logger->sendBufferUsed, size = 0;
+	do {
+		size += (NSUInteger)CFDataGetLength((CFDataRef)CFArrayGetValueAtIndex(logger->logQueue, count++));
+	} while (count < queueCount && size < available);
+	CFMutableArrayRef batch = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
+	if (batch == NULL)
+		return NULL;
+	CFArrayAppendArray(batch, logger->logQueue, CFRangeMake(0, count));
+	CFArrayReplaceValues(logger->logQueue, CFRangeMake(0, count), NULL, 0);
+	return batch;
+}
+
+static CFIndex LoggerPendingMessagesCount(Logger *logger)
+{
+	// Number of messages waiting to be sent, including those still sitting in the ring.
+	// Must be called with the log queue mutex held.
+	return CFArrayGetCount(logger->logQueue) + (CFIndex)LoggerMessageRingCount(&logger->messageRing);
+}
+
+static void LoggerPushMessageToQueue(Logger *logger, CFDataRef message)
+{
+	// Add the message to the ring and signal the runLoop source that will trigger
+	// a send on the worker thread. In the common case this doesn't take any lock, so
+	// logging threads don't contend with each other or with the worker thread.
+	CFRetain(message);
+	if (!LoggerMessageRingPush(&logger->messageRing, message))
+	{
+		// The ring is full: the worker thread can't keep up. Drain the ring ourselves
+		// to the log queue and append the message there directly.
+		CFRelease(message);
+		pthread_mutex_lock(&logger->logQueueMutex);
+		LoggerDrainMessageRing(logger);
+		LoggerInsertMessageInQueue(logger, message);
+		pthread_mutex_unlock(&logger->logQueueMutex);
+	}
+
 	if (logger->messagePushedSource != NULL)
 	{
 		// One case where the pushed source may be NULL is if the client code
@@ -2623,14 +3783,16 @@ static void LoggerPushMessageToQueue(Logger *logger, CFDataRef message)
 	{
 		// In this case, a failure creating the message runLoop source forces us
 		// to always log to console
+		pthread_mutex_lock(&logger->logQueueMutex);
+		LoggerDrainMessageRing(logger);
 		while (CFArrayGetCount(logger->logQueue))
 		{
 			LoggerLogToConsole(CFArrayGetValueAtIndex(logger->logQueue, 0));
 			CFArrayRemoveValueAtIndex(logger->logQueue, 0);
 		}
 		pthread_cond_broadcast(&logger->logQueueEmpty);		// in case other threads are waiting for a flush
+		pthread_mutex_unlock(&logger->logQueueMutex);
 	}
-	pthread_mutex_unlock(&logger->logQueueMutex);
 }
 
 static void LogMessageRawTo_internal(Logger *logger,
@@ -2648,7 +3810,7 @@ static void LogMessageRawTo_internal(Logger *logger,
         int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
         LOGGERDBG2(CFSTR("%ld LogMessage"), seq);
 
-        CFMutableDataRef encoder = LoggerMessageCreate(seq);
+        LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
         if (encoder != NULL)
         {
             LoggerMessageAddInt32(encoder, LOGMSG_TYPE_LOG, PART_KEY_MESSAGE_TYPE);
@@ -2667,9 +3829,7 @@ static void LogMessageRawTo_internal(Logger *logger,
 			else
 				LoggerMessageAddString(encoder, CFSTR(""), PART_KEY_MESSAGE);
 
-			LoggerMessageFinalize(encoder);
-            LoggerPushMessageToQueue(logger, encoder);
-            CFRelease(encoder);
+			LoggerMessageFinalizeAndPushToQueue(logger, encoder);
         }
         else
         {
@@ -2693,7 +3853,7 @@ static void LogMessageTo_internal(Logger *logger,
         int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
         LOGGERDBG2(CFSTR("%ld LogMessage"), seq);
 
-        CFMutableDataRef encoder = LoggerMessageCreate(seq);
+        LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
         if (encoder != NULL)
         {
             LoggerMessageAddInt32(encoder, LOGMSG_TYPE_LOG, PART_KEY_MESSAGE_TYPE);
@@ -2708,16 +3868,24 @@ static void LogMessageTo_internal(Logger *logger,
             if (functionName != NULL)
                 LoggerMessageAddCString(encoder, functionName, PART_KEY_FUNCTIONNAME);
 
-            NSString *msgString = [[NSString alloc] initWithFormat:format arguments:args];
+            // formatting calls -description on the arguments, which may throw
+            NSString *msgString = nil;
+            @try
+            {
+                msgString = [[NSString alloc] initWithFormat:format arguments:args];
+            }
+            @catch (id exception)
+            {
+                LoggerMessageAbandon(encoder);
+                @throw;
+            }
             if (msgString != nil)
             {
                 LoggerMessageAddString(encoder, (CFStringRef)msgString, PART_KEY_MESSAGE);
                 [msgString release];
             }
 
-			LoggerMessageFinalize(encoder);
-            LoggerPushMessageToQueue(logger, encoder);
-            CFRelease(encoder);
+			LoggerMessageFinalizeAndPushToQueue(logger, encoder);
         }
         else
         {
@@ -2739,7 +3907,7 @@ void LogMessage_noFormat(NSString *filename,
         int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
         LOGGERDBG2(CFSTR("%ld LogMessage"), seq);
         
-        CFMutableDataRef encoder = LoggerMessageCreate(seq);
+        LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
         if (encoder != NULL)
         {
             LoggerMessageAddInt32(encoder, LOGMSG_TYPE_LOG, PART_KEY_MESSAGE_TYPE);
@@ -2756,9 +3924,7 @@ void LogMessage_noFormat(NSString *filename,
             
             LoggerMessageAddString(encoder, (CFStringRef)message, PART_KEY_MESSAGE);
             
-            LoggerMessageFinalize(encoder);
-            LoggerPushMessageToQueue(logger, encoder);
-            CFRelease(encoder);
+            LoggerMessageFinalizeAndPushToQueue(logger, encoder);
         }
         else
         {
@@ -2783,7 +3949,7 @@ static void LogImageTo_internal(Logger *logger,
 		int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
 		LOGGERDBG2(CFSTR("%ld LogImage"), seq);
 
-		CFMutableDataRef encoder = LoggerMessageCreate(seq);
+		LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
 		if (encoder != NULL)
 		{
 			LoggerMessageAddInt32(encoder, LOGMSG_TYPE_LOG, PART_KEY_MESSAGE_TYPE);
@@ -2804,9 +3970,7 @@ static void LogImageTo_internal(Logger *logger,
 				LoggerMessageAddCString(encoder, functionName, PART_KEY_FUNCTIONNAME);
 			LoggerMessageAddData(encoder, (CFDataRef)data, PART_KEY_MESSAGE, PART_TYPE_IMAGE);
 
-			LoggerMessageFinalize(encoder);
-			LoggerPushMessageToQueue(logger, encoder);
-			CFRelease(encoder);
+			LoggerMessageFinalizeAndPushToQueue(logger, encoder);
 		}
 		else
 		{
@@ -2830,7 +3994,7 @@ void LogImage_noFormat(NSString *filename,
         int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
         LOGGERDBG2(CFSTR("%ld LogImage"), seq);
         
-        CFMutableDataRef encoder = LoggerMessageCreate(seq);
+        LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
         if (encoder != NULL)
         {
             LoggerMessageAddInt32(encoder, LOGMSG_TYPE_LOG, PART_KEY_MESSAGE_TYPE);
@@ -2851,9 +4015,7 @@ void LogImage_noFormat(NSString *filename,
                 LoggerMessageAddString(encoder, (CFStringRef)functionName, PART_KEY_FUNCTIONNAME);
             LoggerMessageAddData(encoder, (CFDataRef)data, PART_KEY_MESSAGE, PART_TYPE_IMAGE);
             
-            LoggerMessageFinalize(encoder);
-            LoggerPushMessageToQueue(logger, encoder);
-            CFRelease(encoder);
+            LoggerMessageFinalizeAndPushToQueue(logger, encoder);
         }
         else
         {
@@ -2875,7 +4037,7 @@ static void LogDataTo_internal(Logger *logger,
         int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
         LOGGERDBG2(CFSTR("%ld LogData"), seq);
 
-        CFMutableDataRef encoder = LoggerMessageCreate(seq);
+        LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
         if (encoder != NULL)
         {
             LoggerMessageAddInt32(encoder, LOGMSG_TYPE_LOG, PART_KEY_MESSAGE_TYPE);
@@ -2891,9 +4053,7 @@ static void LogDataTo_internal(Logger *logger,
                 LoggerMessageAddCString(encoder, functionName, PART_KEY_FUNCTIONNAME);
             LoggerMessageAddData(encoder, (CFDataRef)data, PART_KEY_MESSAGE, PART_TYPE_BINARY);
 
-			LoggerMessageFinalize(encoder);
-            LoggerPushMessageToQueue(logger, encoder);
-            CFRelease(encoder);
+			LoggerMessageFinalizeAndPushToQueue(logger, encoder);
         }
         else
         {
@@ -2915,7 +4075,7 @@ void LogData_noFormat(NSString *filename,
         int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
         LOGGERDBG2(CFSTR("%ld LogData"), seq);
         
-        CFMutableDataRef encoder = LoggerMessageCreate(seq);
+        LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
         if (encoder != NULL)
         {
             LoggerMessageAddInt32(encoder, LOGMSG_TYPE_LOG, PART_KEY_MESSAGE_TYPE);
@@ -2931,9 +4091,7 @@ void LogData_noFormat(NSString *filename,
                 LoggerMessageAddString(encoder, (CFStringRef)functionName, PART_KEY_FUNCTIONNAME);
             LoggerMessageAddData(encoder, (CFDataRef)data, PART_KEY_MESSAGE, PART_TYPE_BINARY);
             
-            LoggerMessageFinalize(encoder);
-            LoggerPushMessageToQueue(logger, encoder);
-            CFRelease(encoder);
+            LoggerMessageFinalizeAndPushToQueue(logger, encoder);
         }
         else
         {
@@ -2950,13 +4108,23 @@ static void LogStartBlockTo_internal(Logger *logger, NSString *format, va_list a
 		int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
 		LOGGERDBG2(CFSTR("%ld LogStartBlock"), seq);
 
-		CFMutableDataRef encoder = LoggerMessageCreate(seq);
+		LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
 		if (encoder != NULL)
 		{
 			LoggerMessageAddInt32(encoder, LOGMSG_TYPE_BLOCKSTART, PART_KEY_MESSAGE_TYPE);
 			if (format != nil)
 			{
-				CFStringRef msgString = CFStringCreateWithFormatAndArguments(NULL, NULL, (CFStringRef)format, args);
+				// formatting calls -description on the arguments, which may throw
+				CFStringRef msgString = NULL;
+				@try
+				{
+					msgString = CFStringCreateWithFormatAndArguments(NULL, NULL, (CFStringRef)format, args);
+				}
+				@catch (id exception)
+				{
+					LoggerMessageAbandon(encoder);
+					@throw;
+				}
 				if (msgString != NULL)
 				{
 					LoggerMessageAddString(encoder, msgString, PART_KEY_MESSAGE);
@@ -2964,9 +4132,7 @@ static void LogStartBlockTo_internal(Logger *logger, NSString *format, va_list a
 				}
 			}
 		
-			LoggerMessageFinalize(encoder);
-			LoggerPushMessageToQueue(logger, encoder);
-			CFRelease(encoder);
+			LoggerMessageFinalizeAndPushToQueue(logger, encoder);
 		}
 	}
 }
@@ -3117,13 +4283,11 @@ void LogEndBlockTo(Logger *logger)
         int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
         LOGGERDBG2(CFSTR("%ld LogEndBlock"), seq);
 
-        CFMutableDataRef encoder = LoggerMessageCreate(seq);
+        LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
         if (encoder != NULL)
         {
             LoggerMessageAddInt32(encoder, LOGMSG_TYPE_BLOCKEND, PART_KEY_MESSAGE_TYPE);
-			LoggerMessageFinalize(encoder);
-            LoggerPushMessageToQueue(logger, encoder);
-            CFRelease(encoder);
+			LoggerMessageFinalizeAndPushToQueue(logger, encoder);
         }
         else
         {
@@ -3145,7 +4309,7 @@ void LogMarkerTo(Logger *logger, NSString *text)
 		int32_t seq = atomic_fetch_add(&logger->messageSeq, 1);
 		LOGGERDBG2(CFSTR("%ld LogMarker"), seq);
 
-		CFMutableDataRef encoder = LoggerMessageCreate(seq);
+		LoggerMessageEncoder *encoder = LoggerMessageCreate(logger, seq);
 		if (encoder != NULL)
 		{
 			LoggerMessageAddInt32(encoder, LOGMSG_TYPE_MARK, PART_KEY_MESSAGE_TYPE);
@@ -3164,9 +4328,7 @@ void LogMarkerTo(Logger *logger, NSString *text)
 			{
 				LoggerMessageAddString(encoder, (CFStringRef)text, PART_KEY_MESSAGE);
 			}
-			LoggerMessageFinalize(encoder);
-			LoggerPushMessageToQueue(logger, encoder);
-			CFRelease(encoder);
+			LoggerMessageFinalizeAndPushToQueue(logger, encoder);
 		}
 		else
 		{
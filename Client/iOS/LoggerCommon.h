@@ -54,6 +54,8 @@
  *  - a PART_KEY_TIMESTAMP_S (mandatory) which is the timestamp returned by gettimeofday() (seconds from 01.01.1970 00:00)
  *	- a PART_KEY_TIMESTAMP_MS (optional) complement of the timestamp seconds, in milliseconds
  *	- a PART_KEY_TIMESTAMP_US (optional) complement of the timestamp seconds and milliseconds, in microseconds
+ *	  (alternatively, a PART_KEY_TIMESTAMP_NS replaces the parts above: it is a monotonic clock value in nanoseconds,
+ *	  to be added to the PART_KEY_TIMESTAMP_ANCHOR_NS transmitted by the client in its LOGMSG_TYPE_CLIENTINFO message)
  *	- a PART_KEY_THREAD_ID (mandatory) the ID of the user thread that produced the log entry
  *	- a PART_KEY_TAG (optional) a tag that helps categorizing and filtering logs from your application, and shows up in viewer logs
  *	- a PART_KEY_LEVEL (optional) a log level that helps filtering logs from your application (see as few or as much detail as you need)
@@ -63,6 +65,41 @@
  *	- a PART_KEY_LINENUMBER (optional) the linenumber in the filename at which the log was generated
  *	- a PART_KEY_FUNCTIONNAME (optional) the function / method / selector from which the log was generated
  *  - if logging an image, PART_KEY_IMAGE_WIDTH and PART_KEY_IMAGE_HEIGHT let the desktop know the image size without having to actually decode it
+ *
+ * Wire protocol v2:
+ * Viewers that understand a more compact encoding advertise the highest protocol version they support
+ * with the LOGGER_TXT_KEY_PROTOCOL key of their Bonjour TXT record. A client connecting to such a viewer
+ * sends its LOGMSG_TYPE_CLIENTINFO message in the format above, with a PART_KEY_PROTOCOL_VERSION part,
+ * then may send messages in the v2 format. v1 and v2 messages can be interleaved on a connection.
+ *
+ *	uint32_t	totalSize | LOGGER_FRAME_V2_FLAG
+ *	varint		partCount
+ *  [repeat partCount times]:
+ *		uint8_t		partKey
+ *		uint8_t		partType
+ *		- int16, int32 and int64 types: zigzag varint value. For the keys matched by LOGGER_WIRE_IS_DELTA_KEY(),
+ *		  this is the difference with the value of the same key in the previous v2 message
+ *		- string, binary and image types: varint partSize, then `partSize' data bytes
+ *		- PART_TYPE_STRING_DEF: varint string ID, varint partSize, then `partSize' bytes of an UTF-8 string
+ *		  that later parts can refer to
+ *		- PART_TYPE_STRING_REF: varint ID of a string previously defined with PART_TYPE_STRING_DEF
+ *
+ * Varints are LEB128 encoded: 7 bits per byte, least significant bits first, the high bit is set on all
+ * bytes but the last one. String IDs and delta bases are reset by every LOGMSG_TYPE_CLIENTINFO message.
+ *
+ * Compressed framing:
+ * Viewers that accept compressed data advertise it with the LOGGER_TXT_KEY_COMPRESSION key of their Bonjour TXT
+ * record (value LOGGER_COMPRESSION_LZ4). When the client decides to use compression, everything it sends on the
+ * connection, starting with its first byte, is cut in blocks:
+ *
+ *	uint32_t	payloadSize | LOGGER_FRAME_COMPRESSED_FLAG
+ *	uint32_t	originalSize	(number of bytes of the stream contained in this block, at most LOGGER_COMPRESSED_BLOCK_MAX_SIZE)
+ *	.. `payloadSize - 4' bytes: an LZ4 compressed block (see LoggerCompression.h), or the original bytes
+ *	   themselves if `payloadSize - 4' equals `originalSize'
+ *
+ * Once decompressed, blocks concatenate to the regular (v1 and v2) message stream. Block boundaries
+ * don't need to match message boundaries. The viewer determines which framing is used from the first
+ * 32-bit word it receives on a connection.
  */
 
 // Constants for the "part key" field
@@ -80,6 +117,7 @@
 #define PART_KEY_FILENAME		11			// when logging, message can contain a file name
 #define PART_KEY_LINENUMBER		12			// as well as a line number
 #define PART_KEY_FUNCTIONNAME	13			// and a function or method name
+#define PART_KEY_TIMESTAMP_NS	14			// monotonic timestamp in nanoseconds (int64), replaces PART_KEY_TIMESTAMP_S and PART_KEY_TIMESTAMP_US/MS
 
 // Constants for parts in LOGMSG_TYPE_CLIENTINFO
 #define PART_KEY_CLIENT_NAME	20
@@ -88,6 +126,8 @@
 #define PART_KEY_OS_VERSION		23
 #define PART_KEY_CLIENT_MODEL	24			// For iPhone, device model (i.e 'iPhone', 'iPad', etc)
 #define PART_KEY_UNIQUEID		25			// for remote device identification, part of LOGMSG_TYPE_CLIENTINFO
+#define PART_KEY_TIMESTAMP_ANCHOR_NS 26		// wall clock time (nanoseconds since 01.01.1970) at which the client's monotonic clock was zero
+#define PART_KEY_PROTOCOL_VERSION 27		// highest wire protocol version the client may use on this connection (absent for v1)
 
 // Area starting at which you may define your own constants
 #define PART_KEY_USER_DEFINED	100
@@ -99,6 +139,8 @@
 #define PART_TYPE_INT32			3
 #define	PART_TYPE_INT64			4
 #define PART_TYPE_IMAGE			5			// An image, stored in PNG format
+#define PART_TYPE_STRING_DEF	6			// (v2 only) A string, also defining a string ID for later reference
+#define PART_TYPE_STRING_REF	7			// (v2 only) A reference to a previously defined string
 
 // Data values for the PART_KEY_MESSAGE_TYPE parts
 #define LOGMSG_TYPE_LOG			0			// A standard log message
@@ -111,3 +153,22 @@
 // Default Bonjour service identifiers
 #define LOGGER_SERVICE_TYPE_SSL	CFSTR("_nslogger-ssl._tcp")
 #define LOGGER_SERVICE_TYPE		CFSTR("_nslogger._tcp")
+
+// Wire protocol versions and negotiation
+#define LOGGER_PROTOCOL_VERSION	2
+#define LOGGER_TXT_KEY_PROTOCOL	CFSTR("protocol")	// Bonjour TXT record key the viewer uses to advertise its protocol version
+
+// v2 framing
+#define LOGGER_FRAME_V2_FLAG		0x80000000U		// set in the size of v2 frames
+#define LOGGER_FRAME_SIZE_MASK		0x3FFFFFFFU		// frame size bits, the remaining bits are reserved for framing flags
+#define LOGGER_WIRE_MAX_STRINGS		4096			// maximum number of string IDs defined on a connection
+#define LOGGER_WIRE_DELTA_KEYS		(PART_KEY_TIMESTAMP_NS + 1)
+#define LOGGER_WIRE_IS_DELTA_KEY(key) ((key) == PART_KEY_MESSAGE_SEQ || (key) == PART_KEY_TIMESTAMP_S || \
+									   (key) == PART_KEY_TIMESTAMP_MS || (key) == PART_KEY_TIMESTAMP_US || \
+									   (key) == PART_KEY_TIMESTAMP_NS)
+
+// Compressed framing
+#define LOGGER_TXT_KEY_COMPRESSION	CFSTR("compression")	// Bonjour TXT record key the viewer uses to advertise the compression it accepts
+#define LOGGER_COMPRESSION_LZ4		"lz4"
+#define LOGGER_FRAME_COMPRESSED_FLAG	0x40000000U		// set in the size of compressed blocks
+#define LOGGER_COMPRESSED_BLOCK_MAX_SIZE	65536		// maximum number of uncompressed bytes in a block
@@ -0,0 +1,245 @@
+/*
+ * LoggerCompression.h
+ *
+ * version 1.9.5 26-DEC-2018
+ *
+ * LZ4 block compression used by NSLogger Viewer and NSLoggerClient
+ * for the compressed stream framing (see LoggerCommon.h)
+ * https://github.com/fpillet/NSLogger
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2019 Florent Pillet All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+
+/* Compressed blocks use the LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+ * so that the viewer side can be implemented with any LZ4 library. The encoder below is a straightforward
+ * greedy implementation: log data is mostly made of short repeated strings (file and function names,
+ * message prefixes), which it handles well while staying cheap on the client device.
+ */
+
+#ifndef LOGGER_COMPRESSION_H
+#define LOGGER_COMPRESSION_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOGGER_LZ4_HASH_BITS		12
+#define LOGGER_LZ4_HASH_SIZE		(1 << LOGGER_LZ4_HASH_BITS)		// number of entries of the hash table passed to LoggerLZ4Compress()
+#define LOGGER_LZ4_MIN_MATCH		4
+#define LOGGER_LZ4_LAST_LITERALS	5			// the last bytes of a block are always literals
+#define LOGGER_LZ4_MFLIMIT			12			// the last match must start at least this many bytes before the end of the block
+#define LOGGER_LZ4_MAX_OFFSET		65535
+
+static inline uint32_t LoggerLZ4Read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t LoggerLZ4Hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LOGGER_LZ4_HASH_BITS);
+}
+
+static inline uint8_t *LoggerLZ4WriteLength(uint8_t *op, uint32_t length)
+{
+	while (length >= 255)
+	{
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+static inline uint32_t LoggerLZ4Compress(const uint8_t *src, uint32_t srcSize, uint8_t *dst, uint32_t dstCapacity, uint32_t *hashTable)
+{
+	// Compress srcSize bytes to dst. Returns the compressed size, or 0 if it would exceed dstCapacity.
+	// hashTable is a scratch table of LOGGER_LZ4_HASH_SIZE entries.
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *end = src + srcSize;
+	uint8_t *op = dst;
+	uint8_t *opEnd = dst + dstCapacity;
+
+	if (srcSize > LOGGER_LZ4_MFLIMIT)
+	{
+		const uint8_t *matchLimit = end - LOGGER_LZ4_LAST_LITERALS;
+		const uint8_t *ipLimit = end - LOGGER_LZ4_MFLIMIT;
+		memset(hashTable, 0, sizeof(uint32_t) * LOGGER_LZ4_HASH_SIZE);
+		ip++;
+		while (ip < ipLimit)
+		{
+			uint32_t sequence = LoggerLZ4Read32(ip);
+			uint32_t h = LoggerLZ4Hash(sequence);
+			const uint8_t *ref = src + hashTable[h];
+			hashTable[h] = (uint32_t)(ip - src);
+			if (ref >= ip || (ip - ref) > LOGGER_LZ4_MAX_OFFSET || LoggerLZ4Read32(ref) != sequence)
+			{
+				// skip faster over data that doesn't compress
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			// extend the match backwards then forwards
+			while (ip > anchor && ref > src && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			const uint8_t *matchEnd = ip + LOGGER_LZ4_MIN_MATCH;
+			const uint8_t *refEnd = ref + LOGGER_LZ4_MIN_MATCH;
+			while (matchEnd < matchLimit && *matchEnd == *refEnd)
+			{
+				matchEnd++;
+				refEnd++;
+			}
+
+			uint32_t literalLength = (uint32_t)(ip - anchor);
+			uint32_t matchLength = (uint32_t)(matchEnd - ip) - LOGGER_LZ4_MIN_MATCH;
+			if ((size_t)(opEnd - op) < 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1)
+				return 0;
+
+			uint8_t *token = op++;
+			if (literalLength >= 15)
+			{
+				*token = 15 << 4;
+				op = LoggerLZ4WriteLength(op, literalLength - 15);
+			}
+			else
+			{
+				*token = (uint8_t)(literalLength << 4);
+			}
+			memcpy(op, anchor, literalLength);
+			op += literalLength;
+
+			uint32_t offset = (uint32_t)(ip - ref);
+			*op++ = (uint8_t)offset;
+			*op++ = (uint8_t)(offset >> 8);
+
+			if (matchLength >= 15)
+			{
+				*token |= 15;
+				op = LoggerLZ4WriteLength(op, matchLength - 15);
+			}
+			else
+			{
+				*token |= (uint8_t)matchLength;
+			}
+
+			ip = matchEnd;
+			anchor = ip;
+			if (ip < ipLimit)
+				hashTable[LoggerLZ4Hash(LoggerLZ4Read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+		}
+	}
+
+	// the block always ends with literals
+	uint32_t literalLength = (uint32_t)(end - anchor);
+	if ((size_t)(opEnd - op) < 1 + literalLength / 255 + 1 + literalLength)
+		return 0;
+	if (literalLength >= 15)
+	{
+		*op++ = 15 << 4;
+		op = LoggerLZ4WriteLength(op, literalLength - 15);
+	}
+	else
+	{
+		*op++ = (uint8_t)(literalLength << 4);
+	}
+	memcpy(op, anchor, literalLength);
+	op += literalLength;
+	return (uint32_t)(op - dst);
+}
+
+static inline int32_t LoggerLZ4Decompress(const uint8_t *src, uint32_t srcSize, uint8_t *dst, uint32_t dstCapacity)
+{
+	// Decompress an LZ4 block. Returns the decompressed size, or -1 if the block is invalid
+	// or doesn't fit in dstCapacity
+	const uint8_t *ip = src;
+	const uint8_t *end = src + srcSize;
+	uint8_t *op = dst;
+	uint8_t *opEnd = dst + dstCapacity;
+
+	while (ip < end)
+	{
+		uint8_t token = *ip++;
+		uint32_t literalLength = token >> 4;
+		if (literalLength == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= end)
+					return -1;
+				b = *ip++;
+				literalLength += b;
+			} while (b == 255);
+		}
+		if ((size_t)(end - ip) < literalLength || (size_t)(opEnd - op) < literalLength)
+			return -1;
+		memcpy(op, ip, literalLength);
+		op += literalLength;
+		ip += literalLength;
+		if (ip == end)
+			break;						// the last sequence only has literals
+
+		if (end - ip < 2)
+			return -1;
+		uint32_t offset = (uint32_t)ip[0] | ((uint32_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (uint32_t)(op - dst))
+			return -1;
+		uint32_t matchLength = token & 15;
+		if (matchLength == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= end)
+					return -1;
+				b = *ip++;
+				matchLength += b;
+			} while (b == 255);
+		}
+		matchLength += LOGGER_LZ4_MIN_MATCH;
+		if ((size_t)(opEnd - op) < matchLength)
+			return -1;
+		const uint8_t *match = op - offset;
+		if (offset >= matchLength)
+		{
+			memcpy(op, match, matchLength);
+			op += matchLength;
+		}
+		else while (matchLength--)
+			*op++ = *match++;			// matches may overlap the bytes being written
+	}
+	return (int32_t)(op - dst);
+}
+
+#endif
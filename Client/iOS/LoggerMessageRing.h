@@ -0,0 +1,138 @@
+/*
+ * LoggerMessageRing.h
+ *
+ * version 1.9.5 26-DEC-2018
+ *
+ * Lock-free ring buffer logging threads push their encoded messages to in NSLoggerClient
+ * https://github.com/fpillet/NSLogger
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2019 Florent Pillet All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+
+/* Bounded MPMC queue algorithm from Dmitry Vyukov, used here with multiple producers (the logging
+ * threads) and a single consumer (whoever holds the log queue mutex). Each slot's turn is equal to the
+ * position it can be written at when free, and to that position + 1 once the message is published.
+ * LoggerClient.m and Tools/QueueBenchmark both use these functions, so the benchmark measures the
+ * code that ships.
+ */
+
+#ifndef LOGGER_MESSAGE_RING_H
+#define LOGGER_MESSAGE_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// Number of slots in the ring. Must be a power of two. When the ring is full (the worker thread
+// is lagging behind), producers fall back to draining it themselves under the log queue mutex.
+#define LOGGER_MESSAGE_RING_CAPACITY	1024
+
+typedef struct
+{
+	_Atomic(uintptr_t) turn;                        // ring position this slot is ready for (see LoggerMessageRingPush)
+	const void *message;
+} LoggerRingSlot;
+
+typedef struct
+{
+	LoggerRingSlot *slots;
+	_Atomic(uintptr_t) enqueuePos;                  // next ring position producers will claim
+	uintptr_t dequeuePos;                           // next ring position to drain (only touched by the consumer)
+} LoggerMessageRing;
+
+static inline int LoggerMessageRingInit(LoggerMessageRing *ring)
+{
+	ring->slots = (LoggerRingSlot *)calloc(LOGGER_MESSAGE_RING_CAPACITY, sizeof(LoggerRingSlot));
+	if (ring->slots == NULL)
+		return 0;
+	for (uintptr_t i = 0; i < LOGGER_MESSAGE_RING_CAPACITY; i++)
+		atomic_init(&ring->slots[i].turn, i);
+	atomic_init(&ring->enqueuePos, 0);
+	ring->dequeuePos = 0;
+	return 1;
+}
+
+static inline void LoggerMessageRingFree(LoggerMessageRing *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+static inline int LoggerMessageRingPush(LoggerMessageRing *ring, const void *message)
+{
+	// Lock-free push of a message. Returns 0 if the ring is full.
+	uintptr_t pos = atomic_load_explicit(&ring->enqueuePos, memory_order_relaxed);
+	LoggerRingSlot *slot;
+	for (;;)
+	{
+		slot = &ring->slots[pos & (LOGGER_MESSAGE_RING_CAPACITY - 1)];
+		uintptr_t turn = atomic_load_explicit(&slot->turn, memory_order_acquire);
+		intptr_t diff = (intptr_t)turn - (intptr_t)pos;
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&ring->enqueuePos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// ring is full
+			return 0;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&ring->enqueuePos, memory_order_relaxed);
+		}
+	}
+	slot->message = message;
+	atomic_store_explicit(&slot->turn, pos + 1, memory_order_release);
+	return 1;
+}
+
+static inline const void *LoggerMessageRingPop(LoggerMessageRing *ring)
+{
+	// Take the next published message, or return NULL if the producer of the next slot hasn't
+	// published its message yet (it will be picked up at the next drain). Only one thread at a
+	// time may pop.
+	uintptr_t pos = ring->dequeuePos;
+	LoggerRingSlot *slot = &ring->slots[pos & (LOGGER_MESSAGE_RING_CAPACITY - 1)];
+	if (atomic_load_explicit(&slot->turn, memory_order_acquire) != pos + 1)
+		return NULL;
+	const void *message = slot->message;
+	slot->message = NULL;
+	atomic_store_explicit(&slot->turn, pos + LOGGER_MESSAGE_RING_CAPACITY, memory_order_release);
+	ring->dequeuePos = pos + 1;
+	return message;
+}
+
+static inline uintptr_t LoggerMessageRingCount(LoggerMessageRing *ring)
+{
+	// Number of positions claimed by producers and not popped yet (only meaningful for the consumer)
+	return atomic_load_explicit(&ring->enqueuePos, memory_order_acquire) - ring->dequeuePos;
+}
+
+#endif
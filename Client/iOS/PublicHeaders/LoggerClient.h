@@ -59,7 +59,9 @@ enum {
 	kLoggerOption_BrowseOnlyLocalDomain				= 0x08,
 	kLoggerOption_UseSSL							= 0x10,
 	kLoggerOption_CaptureSystemConsole				= 0x20,
-	kLoggerOption_BrowsePeerToPeer					= 0x40
+	kLoggerOption_BrowsePeerToPeer					= 0x40,
+	kLoggerOption_UseMonotonicTimestamps			= 0x80,		// timestamp messages with a monotonic nanoseconds clock (requires a viewer that supports it, ignored before macOS 10.12 / iOS 10)
+	kLoggerOption_CompressTransmittedData			= 0x100		// compress the data sent to viewers that advertise support for it over Bonjour
 };
 
 #define LOGGER_DEFAULT_OPTIONS	(kLoggerOption_BufferLogsUntilConnection |	\
@@ -58,6 +58,13 @@
 
 extern NSString * const kPrefKeepMultipleRuns;
 extern NSString * const kPrefCloseWithoutSaving;
+extern NSString * const kPrefMessagesKeptInMemory;
+extern NSString * const kPrefMessagesMemoryLimit;
+extern NSString * const kPrefMessagesMaxAge;
+extern NSString * const kPrefSpillEvictedMessages;
+extern NSString * const kPrefJournalLiveSessions;
+extern NSString * const kPrefDocumentMessagesLimit;
+extern NSString * const kPrefDocumentMemoryLimit;
 
 extern NSString * const kPrefPublishesBonjourService;
 extern NSString * const kPrefHasDirectTCPIPResponder;
@@ -75,6 +82,9 @@ extern NSString * const kPref_ApplicationFilterSet;
 #define TOOLS_MENU_DELETE_MARK_TAG				4
 #define TOOLS_MENU_JUMP_TO_MARK_TAG				5
 #define TOOLS_MENU_HIDE_SHOW_TOOLBAR		    7
+#define TOOLS_MENU_GO_TO_TIME_TAG				8
+#define TOOLS_MENU_SHOW_TIME_RANGE_TAG			9
+#define TOOLS_MENU_SHOW_ALL_TIMES_TAG			10
 
 #define VIEW_MENU_ITEM_TAG                      2
 #define VIEW_MENU_SWITCH_TO_RUN_TAG				6
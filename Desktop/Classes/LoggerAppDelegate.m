@@ -37,9 +37,17 @@
 #import "LoggerStatusWindowController.h"
 #import "LoggerPrefsWindowController.h"
 #import "LoggerMessageCell.h"
+#import "LoggerJournal.h"
 
 NSString * const kPrefKeepMultipleRuns = @"keepMultipleRuns";
 NSString * const kPrefCloseWithoutSaving = @"closeWithoutSaving";
+NSString * const kPrefMessagesKeptInMemory = @"messagesKeptInMemory";
+NSString * const kPrefMessagesMemoryLimit = @"messagesMemoryLimit";				// MB
+NSString * const kPrefMessagesMaxAge = @"messagesMaxAge";						// seconds
+NSString * const kPrefSpillEvictedMessages = @"spillEvictedMessages";
+NSString * const kPrefJournalLiveSessions = @"journalLiveSessions";
+NSString * const kPrefDocumentMessagesLimit = @"documentMessagesLimit";
+NSString * const kPrefDocumentMemoryLimit = @"documentMemoryLimit";				// MB
 
 NSString * const kPrefPublishesBonjourService = @"publishesBonjourService";
 NSString * const kPrefHasDirectTCPIPResponder = @"hasDirectTCPIPResponder";
@@ -63,7 +71,14 @@ NSString * const kPref_ApplicationFilterSet = @"appFilterSet";
 						  kPrefHasDirectTCPIPResponder: @NO,
 						  kPrefDirectTCPIPResponderPort: @50000,
 						  kPrefBonjourServiceName: @"",
-						  kPrefKeepMultipleRuns: @YES
+						  kPrefKeepMultipleRuns: @YES,
+						  kPrefMessagesKeptInMemory: @1000000,
+						  kPrefMessagesMemoryLimit: @0,
+						  kPrefMessagesMaxAge: @0,
+						  kPrefSpillEvictedMessages: @YES,
+						  kPrefJournalLiveSessions: @YES,
+						  kPrefDocumentMessagesLimit: @0,
+						  kPrefDocumentMemoryLimit: @0
 						  };
 	}
 	return sDefaultPrefs;
@@ -261,6 +276,55 @@ NSString * const kPref_ApplicationFilterSet = @"appFilterSet";
 
 	// start transports
 	[self performSelector:@selector(startStopTransports) withObject:nil afterDelay:0];
+
+	[self recoverJournals];
+}
+
+- (void)recoverJournals
+{
+	// Journals of live sessions are deleted when their window closes or when the viewer quits. Those
+	// left behind were written by a viewer that was killed or crashed: move them out of the way and
+	// open them, the user can then save them or close them
+	NSFileManager *fm = [NSFileManager defaultManager];
+	NSURL *journalsURL = [LoggerConnection journalsDirectoryURL];
+	NSURL *recoveredURL = [[journalsURL URLByDeletingLastPathComponent] URLByAppendingPathComponent:@"Recovered" isDirectory:YES];
+	NSArray *urls = [fm contentsOfDirectoryAtURL:journalsURL
+					  includingPropertiesForKeys:@[NSURLFileSizeKey]
+										 options:NSDirectoryEnumerationSkipsHiddenFiles
+										   error:NULL];
+	for (NSURL *url in urls)
+	{
+		// skip the journals of sessions another instance of the viewer is receiving
+		if (![[url pathExtension] isEqualToString:@"rawnsloggerdata"] || LoggerJournalIsInUse([url fileSystemRepresentation]))
+			continue;
+		NSNumber *size = nil;
+		[url getResourceValue:&size forKey:NSURLFileSizeKey error:NULL];
+		if ([size unsignedLongLongValue] == 0)
+		{
+			[fm removeItemAtURL:url error:NULL];
+			continue;
+		}
+		NSURL *destinationURL = [recoveredURL URLByAppendingPathComponent:[url lastPathComponent]];
+		if (![fm createDirectoryAtURL:recoveredURL withIntermediateDirectories:YES attributes:nil error:NULL] ||
+			![fm moveItemAtURL:url toURL:destinationURL error:NULL])
+			continue;
+		[[NSDocumentController sharedDocumentController] openDocumentWithContentsOfURL:destinationURL
+																			   display:YES
+																	 completionHandler:^(NSDocument *document, BOOL documentWasAlreadyOpen, NSError *error) {
+		}];
+	}
+}
+
+- (void)applicationWillTerminate:(NSNotification *)aNotification
+{
+	// sessions that were open when quitting don't need to be recovered
+	for (LoggerTransport *t in transports)
+		[t.connections makeObjectsPerformSelector:@selector(discardJournal)];
+	for (LoggerDocument *doc in [[NSDocumentController sharedDocumentController] documents])
+	{
+		if ([doc isKindOfClass:[LoggerDocument class]])
+			[doc.attachedLogs makeObjectsPerformSelector:@selector(discardJournal)];
+	}
 }
 
 - (BOOL)applicationShouldOpenUntitledFile:(NSApplication *)sender
@@ -0,0 +1,54 @@
+/*
+ * LoggerColorRules.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#import <Cocoa/Cocoa.h>
+
+// -----------------------------------------------------------------------------
+// LoggerColorRules: the rules of the advanced colors preferences, regular
+// expressions matched against the description of messages. The first rule
+// that matches, in the order of their patterns, gives the message its color.
+//
+// Rules are compiled once: the literal text every match of a pattern must
+// contain is extracted from it, and the literals of all rules are searched in
+// one pass with an Aho-Corasick automaton. Regular expressions are only run for
+// the rules whose literal was found, and not at all for plain text patterns.
+// -----------------------------------------------------------------------------
+@interface LoggerColorRules : NSObject
+
+@property (nonatomic, readonly) NSUInteger count;
+
+- (id)initWithColors:(NSDictionary *)colorsByRegularExpression;
+
+// Index of the first rule matching the string, NSNotFound if there is none
+- (NSUInteger)indexOfRuleMatchingString:(NSString *)string;
+
+- (NSColor *)colorOfRuleAtIndex:(NSUInteger)index;
+
+@end
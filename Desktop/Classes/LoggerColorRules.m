@@ -0,0 +1,391 @@
+/*
+ * LoggerColorRules.m
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#import "LoggerColorRules.h"
+
+// Multi-pattern search of the rules' literals, ASCII letters compared case-insensitively (the
+// regular expressions are). Transitions form a complete DFA: one row of `classesCount' states
+// per node, indexed by the class of the next character
+typedef struct
+{
+	uint32_t nodesCount;
+	uint32_t classesCount;
+	uint8_t classes[256];						// character -> class, 0 for characters no literal has
+	int32_t *transitions;
+	int32_t *firstRule;							// first rule whose literal ends at the node, -1 if none
+	int32_t *outputLink;						// nearest node on the failure chain where literals end, -1 if none
+	int32_t *nextRule;							// next rule with the same literal, -1 if none
+} ColorRulesAutomaton;
+
+@implementation LoggerColorRules
+{
+	NSArray *_regularExpressions;
+	NSArray *_colors;
+	NSMutableArray *_literals;					// NSNull for rules without a literal
+	BOOL *_isPlainText;							// the pattern is its literal
+	ColorRulesAutomaton _automaton;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Literals
+// -----------------------------------------------------------------------------
+static size_t SkipClass(const char *p, size_t i, size_t n)
+{
+	// Skip a [...] set (ICU sets can be nested), i is the index of the opening bracket
+	int depth = 0;
+	while (i < n)
+	{
+		if (p[i] == '\\')
+			i++;
+		else if (p[i] == '[')
+		{
+			depth++;
+			if (p[i + 1] == '^')
+				i++;
+			if (p[i + 1] == ']')
+				i++;
+		}
+		else if (p[i] == ']' && --depth == 0)
+			return i + 1;
+		i++;
+	}
+	return n;
+}
+
+static void EndRun(const char *run, size_t *runLength, char *best, size_t *bestLength)
+{
+	if (*runLength > *bestLength)
+	{
+		memcpy(best, run, *runLength);
+		*bestLength = *runLength;
+	}
+	*runLength = 0;
+}
+
+static NSString *RequiredLiteral(NSString *pattern, BOOL *outPlainText)
+{
+	// The longest run of literal characters every match of the pattern contains, lowercased.
+	// Returns nil if the pattern has none or is too complicated to tell (alternatives, inline
+	// options, escapes that aren't simple character classes). Sets *outPlainText if the whole
+	// pattern is literal text
+	*outPlainText = NO;
+	const char *p = [pattern UTF8String];
+	size_t n = (p != NULL) ? strlen(p) : 0;
+	if (n == 0 || strstr(p, "(?") != NULL)
+		return nil;
+	char *run = (char *)malloc(n + 1), *best = (char *)malloc(n + 1);
+	size_t runLength = 0, bestLength = 0;
+	BOOL plainText = YES, complicated = NO;
+	for (size_t i = 0; i < n && !complicated; )
+	{
+		uint8_t c = (uint8_t)p[i];
+		if (c >= 0x80)
+		{
+			// non-ASCII characters may fold to ASCII ones when ignoring case
+			plainText = NO;
+			EndRun(run, &runLength, best, &bestLength);
+			i++;
+		}
+		else if (c == '\\')
+		{
+			plainText = NO;
+			uint8_t e = (i + 1 < n) ? (uint8_t)p[i + 1] : 0;
+			if (e != 0 && e < 0x80 && !isalnum(e))
+				run[runLength++] = (char)e;
+			else if (e != 0 && strchr("dDwWsSbBAzZGhHvVRX", e) != NULL)
+				EndRun(run, &runLength, best, &bestLength);
+			else
+				complicated = YES;
+			i += 2;
+		}
+		else if (c == '*' || c == '?' || c == '{')
+		{
+			// the character before a quantifier that allows zero occurrences may be absent
+			plainText = NO;
+			if (runLength)
+				runLength--;
+			EndRun(run, &runLength, best, &bestLength);
+			while (c == '{' && i < n && p[i] != '}')
+				i++;
+			i++;
+			if (i < n && (p[i] == '?' || p[i] == '+'))
+				i++;
+		}
+		else if (c == '+')
+		{
+			// the character is there, but what follows may not be next to it
+			plainText = NO;
+			EndRun(run, &runLength, best, &bestLength);
+			i++;
+			if (i < n && (p[i] == '?' || p[i] == '+'))
+				i++;
+		}
+		else if (c == '|')
+			complicated = YES;
+		else if (c == '(')
+		{
+			plainText = NO;
+			EndRun(run, &runLength, best, &bestLength);
+			for (int depth = 0; i < n; )
+			{
+				if (p[i] == '\\')
+					i += 2;
+				else if (p[i] == '[')
+					i = SkipClass(p, i, n);
+				else if (p[i++] == '(')
+					depth++;
+				else if (p[i - 1] == ')' && --depth == 0)
+					break;
+			}
+		}
+		else if (c == '[')
+		{
+			plainText = NO;
+			EndRun(run, &runLength, best, &bestLength);
+			i = SkipClass(p, i, n);
+		}
+		else if (strchr(".^$)]}", c) != NULL)
+		{
+			plainText = NO;
+			EndRun(run, &runLength, best, &bestLength);
+			i++;
+		}
+		else
+		{
+			run[runLength++] = (char)tolower(c);
+			i++;
+		}
+	}
+	EndRun(run, &runLength, best, &bestLength);
+	NSString *result = nil;
+	if (!complicated && bestLength)
+	{
+		result = [[NSString alloc] initWithBytes:best length:bestLength encoding:NSASCIIStringEncoding];
+		*outPlainText = plainText;
+	}
+	free(run);
+	free(best);
+	return result;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Automaton
+// -----------------------------------------------------------------------------
+static BOOL BuildAutomaton(ColorRulesAutomaton *a, NSArray *literals)
+{
+	// Character classes: one per character found in the literals, letters in both cases
+	memset(a->classes, 0, sizeof(a->classes));
+	a->classesCount = 1;
+	uint32_t maxNodes = 1, rulesCount = (uint32_t)[literals count];
+	for (id literal in literals)
+	{
+		if (literal == [NSNull null])
+			continue;
+		const uint8_t *p = (const uint8_t *)[literal UTF8String];
+		for (; *p; p++, maxNodes++)
+		{
+			if (a->classes[*p] == 0)
+			{
+				a->classes[*p] = (uint8_t)a->classesCount;
+				if (*p >= 'a' && *p <= 'z')
+					a->classes[*p - 0x20] = (uint8_t)a->classesCount;
+				a->classesCount++;
+			}
+		}
+	}
+
+	uint32_t C = a->classesCount;
+	a->transitions = (int32_t *)malloc(maxNodes * C * sizeof(int32_t));
+	a->firstRule = (int32_t *)malloc(maxNodes * sizeof(int32_t));
+	a->outputLink = (int32_t *)malloc(maxNodes * sizeof(int32_t));
+	a->nextRule = (int32_t *)malloc((rulesCount + 1) * sizeof(int32_t));
+	int32_t *failure = (int32_t *)malloc(maxNodes * sizeof(int32_t));
+	int32_t *queue = (int32_t *)malloc(maxNodes * sizeof(int32_t));
+	if (a->transitions == NULL || a->firstRule == NULL || a->outputLink == NULL || a->nextRule == NULL || failure == NULL || queue == NULL)
+	{
+		free(failure);
+		free(queue);
+		return NO;
+	}
+	memset(a->transitions, 0xFF, maxNodes * C * sizeof(int32_t));
+	memset(a->firstRule, 0xFF, maxNodes * sizeof(int32_t));
+	memset(a->outputLink, 0xFF, maxNodes * sizeof(int32_t));
+
+	// Trie of the literals. Rules are added last to first so that each node's list is in rule order
+	a->nodesCount = 1;
+	for (int32_t rule = (int32_t)rulesCount - 1; rule >= 0; rule--)
+	{
+		a->nextRule[rule] = -1;
+		id literal = literals[(NSUInteger)rule];
+		if (literal == [NSNull null])
+			continue;
+		int32_t node = 0;
+		for (const uint8_t *p = (const uint8_t *)[literal UTF8String]; *p; p++)
+		{
+			int32_t *next = &a->transitions[(uint32_t)node * C + a->classes[*p]];
+			if (*next < 0)
+				*next = (int32_t)a->nodesCount++;
+			node = *next;
+		}
+		a->nextRule[rule] = a->firstRule[node];
+		a->firstRule[node] = rule;
+	}
+
+	// Failure links, breadth first, turning missing transitions into the ones of the failure node
+	uint32_t head = 0, tail = 0;
+	for (uint32_t c = 0; c < C; c++)
+	{
+		int32_t child = a->transitions[c];
+		if (child < 0)
+			a->transitions[c] = 0;
+		else
+		{
+			failure[child] = 0;
+			queue[tail++] = child;
+		}
+	}
+	while (head < tail)
+	{
+		int32_t node = queue[head++];
+		int32_t *row = &a->transitions[(uint32_t)node * C];
+		for (uint32_t c = 0; c < C; c++)
+		{
+			int32_t fallback = a->transitions[(uint32_t)failure[node] * C + c];
+			if (row[c] < 0)
+				row[c] = fallback;
+			else
+			{
+				int32_t child = row[c];
+				failure[child] = fallback;
+				a->outputLink[child] = (a->firstRule[fallback] >= 0) ? fallback : a->outputLink[fallback];
+				queue[tail++] = child;
+			}
+		}
+	}
+	free(failure);
+	free(queue);
+	return YES;
+}
+
+static BOOL FindLiterals(const ColorRulesAutomaton *a, const uint8_t *s, BOOL *found)
+{
+	// Mark the rules whose literal the string contains. Returns NO if the string has non-ASCII
+	// characters: they may match ASCII characters of the patterns when ignoring case
+	uint32_t C = a->classesCount;
+	int32_t node = 0;
+	for (; *s; s++)
+	{
+		if (*s >= 0x80)
+			return NO;
+		node = a->transitions[(uint32_t)node * C + a->classes[*s]];
+		for (int32_t out = (a->firstRule[node] >= 0) ? node : a->outputLink[node]; out >= 0; out = a->outputLink[out])
+		{
+			for (int32_t rule = a->firstRule[out]; rule >= 0; rule = a->nextRule[rule])
+				found[rule] = YES;
+		}
+	}
+	return YES;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Rules
+// -----------------------------------------------------------------------------
+- (id)initWithColors:(NSDictionary *)colorsByRegularExpression
+{
+	if ((self = [super init]) != nil)
+	{
+		_regularExpressions = [[colorsByRegularExpression allKeys] sortedArrayUsingComparator:
+			^NSComparisonResult(NSRegularExpression *regexp1, NSRegularExpression *regexp2) {
+				return [regexp1.pattern compare:regexp2.pattern];
+			}];
+		_count = [_regularExpressions count];
+		_colors = [colorsByRegularExpression objectsForKeys:_regularExpressions notFoundMarker:[NSNull null]];
+		_literals = [[NSMutableArray alloc] initWithCapacity:_count];
+		_isPlainText = (BOOL *)calloc(_count + 1, sizeof(BOOL));
+		for (NSUInteger i = 0; i < _count; i++)
+		{
+			NSRegularExpression *regexp = _regularExpressions[i];
+			BOOL plainText = NO;
+			NSString *literal = nil;
+			if ((regexp.options & ~(NSRegularExpressionCaseInsensitive)) == 0)
+				literal = RequiredLiteral(regexp.pattern, &plainText);
+			// literals are compared ignoring case, the plain text shortcut only works if the pattern does too
+			_isPlainText[i] = plainText && (regexp.options & NSRegularExpressionCaseInsensitive);
+			[_literals addObject:literal ?: (id)[NSNull null]];
+		}
+		if (!BuildAutomaton(&_automaton, _literals))
+			_automaton.nodesCount = 0;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	free(_isPlainText);
+	free(_automaton.transitions);
+	free(_automaton.firstRule);
+	free(_automaton.outputLink);
+	free(_automaton.nextRule);
+}
+
+- (NSUInteger)indexOfRuleMatchingString:(NSString *)string
+{
+	if (_count == 0 || string == nil)
+		return NSNotFound;
+	BOOL found[_count];
+	memset(found, 0, sizeof(found));
+	const uint8_t *utf8 = (const uint8_t *)[string UTF8String];
+	BOOL useLiterals = (_automaton.nodesCount != 0 && utf8 != NULL && FindLiterals(&_automaton, utf8, found));
+	NSRange range = NSMakeRange(0, [string length]);
+	for (NSUInteger i = 0; i < _count; i++)
+	{
+		if (useLiterals && _literals[i] != [NSNull null])
+		{
+			if (!found[i])
+				continue;
+			if (_isPlainText[i])
+				return i;
+		}
+		if ([_regularExpressions[i] rangeOfFirstMatchInString:string options:0 range:range].location != NSNotFound)
+			return i;
+	}
+	return NSNotFound;
+}
+
+- (NSColor *)colorOfRuleAtIndex:(NSUInteger)index
+{
+	id color = (index < _count) ? _colors[index] : nil;
+	return (color == [NSNull null]) ? nil : color;
+}
+
+@end
@@ -29,6 +29,7 @@
  * 
  */
 #import <Cocoa/Cocoa.h>
+#import "LoggerMessageStore.h"
 
 @class LoggerConnection, LoggerMessage;
 
@@ -43,6 +44,11 @@
 @interface NSObject (LoggerConnectionDelegateOptional)
 // method always called on main thread
 - (void)remoteDisconnected:(LoggerConnection *)theConnection;
+
+// method that may not be called on main thread. The messages were the oldest of the connection's messages
+// (the client info message excepted), in order. They are gone from the connection's messages list. When
+// evicted messages are dropped, the mark telling how many were dropped took their place (otherwise nil)
+- (void)connection:(LoggerConnection *)theConnection didEvictMessages:(NSArray *)theMessages mark:(LoggerMessage *)mark;
 @end
 
 // -----------------------------------------------------------------------------
@@ -62,6 +68,7 @@
 @property (nonatomic, readonly) NSData *clientAddress;			// depends on the underlying protocol
 @property (nonatomic, readonly) NSMutableSet *filenames;		// pool of unique file names
 @property (nonatomic, readonly) NSMutableSet *functionNames;	// pool of unique function names
+@property (nonatomic, assign) int64_t clientClockAnchor;		// wall clock time (ns since 1970) at which the client's monotonic clock was zero
 
 @property (nonatomic, readonly) NSMutableArray *messages;
 @property (nonatomic, assign) int reconnectionCount;			// when a reconnection is detected (same client, disconnects then reconnects), the # reconnection for this connection
@@ -73,9 +80,91 @@
 @property (nonatomic, readonly) dispatch_queue_t messageProcessingQueue;
 
 - (id)initWithAddress:(NSData *)anAddress;
+
+// Connection of a run restored from a saved document (see LoggerDocumentFile.h). Its messages refer
+// to the document's string table, these strings are returned by -wireStringWithID:
+- (id)initWithSavedStrings:(NSArray *)strings;
 - (void)shutdown;
 
 - (void)messagesReceived:(NSArray *)msgs;
+
+// Insert messages of a saved document decoded out of order before a message of the list (at the end if
+// it is not in the list). The delegate is not told: the window refreshes once they are inserted
+- (void)insertMessages:(NSArray *)msgs beforeMessage:(LoggerMessage *)message;
+
+// Connection that decodes messages for this one into a store of its own, so that ranges of a file can be
+// decoded on several threads. It resolves the same wire strings and starts with this connection's clock
+// anchor. Before its messages are added to the list, -keepStoreOfDecoder: makes this connection hold the
+// decoder's store (and count it in -messagesMemoryUsage)
+- (LoggerConnection *)decoderConnection;
+- (void)keepStoreOfDecoder:(LoggerConnection *)decoder;
+
+// Unless kPrefJournalLiveSessions is off, live connections write the messages they receive to a journal (see
+// LoggerJournal.h), so that they survive the viewer being killed: journals left behind are reopened at launch.
+// The journal is deleted with the connection.
+// Messages are kept in segments of consecutive messages that each have their own store. When the messages in
+// memory exceed the retention policy (kPrefMessagesKeptInMemory, kPrefMessagesMemoryLimit, kPrefMessagesMaxAge),
+// the oldest segments are evicted from the messages list. Depending on kPrefSpillEvictedMessages, they are read
+// back from the journal when the user scrolls to them (see -restoreEvictedMessages:) or dropped
++ (NSURL *)journalsDirectoryURL;
+@property (nonatomic, readonly) NSURL *journalURL;
+
+// Called by the transport for each message it decoded, with the v1 wire format message data. Messages
+// transcoded from the v2 format have string references, which are resolved with -wireStringWithID:
+- (void)journalMessage:(LoggerMessage *)message data:(NSData *)data hasStringRefs:(BOOL)hasStringRefs;
+
+// Called by the transport once it decoded the messages it received, writes them to the journal file
+- (void)flushJournal;
+
+// Stop writing to the journal and delete it (i.e. when the viewer quits)
+- (void)discardJournal;
+
+// The oldest message on screen (client info message excepted), nil if none: the segments that hold
+// it or the messages after it are not evicted while the user looks at them. Evictions that drop
+// messages don't wait for the user to scroll away. Set and read with the messages list locked, so
+// that an eviction under way sees the message the window set last
+@property (nonatomic, retain) LoggerMessage *oldestVisibleMessage;
+
+// Number of segments evicted from the messages list, and messages of an evicted segment read back from
+// the journal. These messages have their own store and are not added to the messages list (to save them)
+- (NSUInteger)evictedSegmentsCount;
+- (NSArray *)messagesReadFromJournalSegment:(NSUInteger)segmentIndex;
+
+// Read the most recent evicted segment back from the journal and insert its messages in the messages
+// list. The completion block is called on the main thread with the number of messages restored
+- (void)restoreEvictedMessages:(void (^)(NSUInteger count))completion;
+
+// Strings the client defined for later reference when using the v2 wire protocol (see LoggerCommon.h).
+// Returns nil if the connection doesn't know about this string ID
+- (NSString *)wireStringWithID:(uint32_t)stringID;
+
+// Columnar storage of the messages received on this connection (see LoggerMessageStore.h).
+// The store is replaced when messages are cleared and when a journaled connection starts a new
+// segment, callers get it retained and must release it
+- (LoggerMessageStore *)retainedMessageStore;
+
+// Memory used by the messages in memory: their stores (with their text index) and the objects of the
+// messages list. Retention limits (kPrefMessagesMemoryLimit) apply to it
+- (size_t)messagesMemoryUsage;
+
+// Lookups in the messages list by timestamp and sequence number (see LoggerOrderIndex.h). Messages from
+// the client mostly arrive in order, these don't scan the list. Messages inserted in the list by the
+// viewer (i.e. marks) must be followed by a call to -invalidateMessageIndexes. A nil date means no bound,
+// the range returned may include a few messages outside of the requested dates (check their timestamps)
+- (void)invalidateMessageIndexes;
+- (NSRange)rangeOfMessagesFromDate:(NSDate *)startDate toDate:(NSDate *)endDate;
+- (NSUInteger)indexOfFirstMessageAtOrAfterDate:(NSDate *)date;
+- (NSUInteger)indexOfMessage:(LoggerMessage *)message;
+
+// Memory used by the index of the message texts (see LoggerTextIndex.h)
+- (size_t)textIndexMemoryUsage;
+
+// Tags of the messages on this connection (see LoggerTagIDForTag), counted as messages are received and
+// cleared. tagsVersion changes each time a tag appears or disappears. Can be called from any thread
+- (NSArray *)tags;
+- (NSUInteger)tagsVersion;
+- (NSUInteger)countOfMessagesWithTagID:(uint32_t)tagID;
+
 - (void)clientInfoReceived:(LoggerMessage *)message;
 - (void)clearMessages;
 
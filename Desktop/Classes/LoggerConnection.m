@@ -32,13 +32,121 @@
 #import <objc/runtime.h>
 #import "LoggerConnection.h"
 #import "LoggerMessage.h"
+#import "LoggerNativeMessage.h"
 #import "LoggerCommon.h"
 #import "LoggerAppDelegate.h"
 #import "LoggerStatusWindowController.h"
+#import "LoggerTextIndex.h"
+#import "LoggerJournal.h"
+#import "LoggerOrderIndex.h"
 
 char sConnectionAssociatedObjectKey = 1;
 
+// Consecutive messages of a live connection, appended to the same store (see LoggerJournal.h), or
+// messages of a file decoded into the store of another connection (see -keepStoreOfDecoder:)
+typedef struct
+{
+	LoggerMessageStore *store;				// NULL while the segment is evicted
+	uint64_t journalOffset;					// range of the journal the messages were written to
+	uint64_t journalLength;
+	uint64_t messagesBytes;					// size of the messages as received
+	size_t memoryUsage;						// memory used by the store, once the segment is full
+	int64_t firstTimestamp;					// time of the first and last messages, microseconds since 1970
+	int64_t lastTimestamp;
+	int64_t clockAnchor;					// client clock anchor when the segment started
+	uint32_t messagesCount;
+	BOOL journaled;							// all the messages were written to the journal
+} JournalSegment;
+
 @implementation LoggerConnection
+{
+	LoggerMessageStore *_messageStore;
+	size_t _reportedTextIndexMemoryUsage;	// last value shown in the status window
+	uint32_t *_tagCounts;					// number of messages by tag ID (messages without a tag are not counted)
+	uint32_t _tagCountsSize;
+	NSUInteger _tagsVersion;
+	NSArray *_savedStrings;					// string table of the document the connection was restored from
+	LoggerJournal *_journal;				// NULL until the first message is journaled
+	BOOL _journalStopped;					// the journal can't be written to (or was discarded)
+	JournalSegment *_segments;				// segments of the journal, oldest first
+	NSUInteger _segmentsCount;
+	NSUInteger _segmentsCapacity;
+	NSUInteger _firstSegmentInMemory;		// segments before this one are evicted
+	size_t _fullSegmentsMemoryUsage;		// memory used by the stores of the full segments in memory
+	BOOL _retentionConfigured;				// retention policy read from the prefs when the first message arrives
+	NSUInteger _messagesKeptInMemory;		// retention limits, 0 for no limit
+	size_t _memoryKeptForMessages;
+	int64_t _maxMessageAge;					// microseconds
+	BOOL _spillsEvictedMessages;			// evicted messages can be read back from the journal, or are dropped
+	uint32_t _segmentSize;					// a new segment starts after this number of messages,
+	uint64_t _segmentBytes;					// this size of messages,
+	int64_t _segmentDuration;				// or once the messages span this time
+	NSUInteger _droppedMessagesCount;
+	LoggerMessage *_droppedMessagesMark;	// the mark telling how many messages were dropped, accessed with the messages list locked
+	NSMapTable *_spilledMarkPositions;		// user marks of spilled segments -> @[segment index, sequence of the message before it]
+	LoggerOrderIndex *_timeIndex;			// positions of the messages list by timestamp and by sequence number,
+	LoggerOrderIndex *_sequenceIndex;		// used with the messages list locked
+	BOOL _orderIndexesValid;				// the indexes follow the messages list (rebuilt when needed otherwise)
+	LoggerMessage *_oldestVisibleMessage;	// accessed with the messages list locked
+}
+
+static LoggerMessageStore *CreateMessageStore(void)
+{
+	// Each store comes with an index of the message texts, updated in -messagesReceived:
+	LoggerMessageStore *store = LoggerMessageStoreCreate(&CFRelease);
+	if (store != NULL)
+		LoggerMessageStoreSetTextIndex(store, LoggerTextIndexCreate());
+	return store;
+}
+
+static void IndexMessageOrder(LoggerOrderIndex *timeIndex, LoggerOrderIndex *sequenceIndex, LoggerMessage *message)
+{
+	// marks, client info and disconnect messages are placed where they are in the list, with a
+	// time of their own that doesn't come from the client
+	short type = message.type;
+	if (type == LOGMSG_TYPE_LOG || type == LOGMSG_TYPE_BLOCKSTART || type == LOGMSG_TYPE_BLOCKEND)
+	{
+		struct timeval tv = message.timestamp;
+		LoggerOrderIndexAppend(timeIndex, (int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+		LoggerOrderIndexAppend(sequenceIndex, (int64_t)message.sequence);
+	}
+	else
+	{
+		LoggerOrderIndexAppendWithoutKey(timeIndex);
+		LoggerOrderIndexAppendWithoutKey(sequenceIndex);
+	}
+}
+
+static size_t MessagesMemoryUsage(size_t storesMemoryUsage, NSUInteger messagesCount)
+{
+	// The stores hold the message values, the messages list also has one object per message.
+	// Objects are allocated in 16 bytes quanta, the list holds a pointer to each
+	static size_t sMessageObjectSize;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		sMessageObjectSize = (class_getInstanceSize([LoggerNativeMessage class]) + 15) / 16 * 16 + sizeof(id);
+	});
+	return storesMemoryUsage + messagesCount * sMessageObjectSize;
+}
+
+static LoggerMessageStore *RetainedStoreOfMessage(LoggerMessage *message)
+{
+	if (![message isKindOfClass:[LoggerNativeMessage class]])
+		return NULL;
+	uint32_t row;
+	uint8_t storedFields;
+	return [(LoggerNativeMessage *)message retainStore:&row storedFields:&storedFields unlessHeld:NULL];
+}
+
+static BOOL IsMessageInStore(LoggerMessage *message, LoggerMessageStore *store, BOOL *outHasStore)
+{
+	// `store' must be kept alive by the caller, so that no other store can have its address
+	LoggerMessageStore *messageStore = RetainedStoreOfMessage(message);
+	LoggerMessageStoreRelease(messageStore);
+	if (outHasStore != NULL)
+		*outHasStore = (messageStore != NULL);
+	return (messageStore != NULL && messageStore == store);
+}
 
 - (id)init
 {
@@ -49,6 +157,7 @@ char sConnectionAssociatedObjectKey = 1;
 		_parentIndexesStack = [[NSMutableArray alloc] init];
 		_filenames = [[NSMutableSet alloc] init];
 		_functionNames = [[NSMutableSet alloc] init];
+		_messageStore = CreateMessageStore();
 	}
 	return self;
 }
@@ -63,10 +172,33 @@ char sConnectionAssociatedObjectKey = 1;
 		_clientAddress = [anAddress copy];
 		_filenames = [[NSMutableSet alloc] init];
 		_functionNames = [[NSMutableSet alloc] init];
+		_messageStore = CreateMessageStore();
+	}
+	return self;
+}
+
+- (id)initWithSavedStrings:(NSArray *)strings
+{
+	if ((self = [self init]) != nil)
+	{
+		_savedStrings = strings;
+		_restoredFromSave = YES;
 	}
 	return self;
 }
 
+- (void)dealloc
+{
+	LoggerMessageStoreRelease(_messageStore);
+	for (NSUInteger i = _firstSegmentInMemory; i < _segmentsCount; i++)
+		LoggerMessageStoreRelease(_segments[i].store);
+	free(_segments);
+	LoggerJournalDispose(_journal, true);
+	LoggerOrderIndexDispose(_timeIndex);
+	LoggerOrderIndexDispose(_sequenceIndex);
+	free(_tagCounts);
+}
+
 - (BOOL)isNewRunOfClient:(LoggerConnection *)aConnection
 {
 	// Try to detect if a connection is a new run of an older, disconnected session
@@ -190,13 +322,150 @@ char sConnectionAssociatedObjectKey = 1;
 		{
 			range = NSMakeRange([self.messages count], [msgs count]);
 			[self.messages addObjectsFromArray:msgs];
+			if (self->_orderIndexesValid && LoggerOrderIndexCount(self->_timeIndex) == range.location)
+			{
+				for (LoggerMessage *message in msgs)
+					IndexMessageOrder(self->_timeIndex, self->_sequenceIndex, message);
+			}
+			else
+			{
+				self->_orderIndexesValid = NO;
+			}
 		}
+		[self countTagsOfMessages:msgs added:YES];
 		
 		if (self.attachedToWindow)
 			[self.delegate connection:self didReceiveMessages:msgs range:range];
+
+		// Index the text of the new messages for the quick filter. Messages that are not
+		// indexed yet are still found, only more slowly. When the messages start a new
+		// segment, the end of the previous one is indexed too
+		LoggerMessageStore *store = [self retainedMessageStore];
+		LoggerMessageStore *previousStore = RetainedStoreOfMessage([msgs firstObject]);
+		if (previousStore != NULL && previousStore != store && LoggerMessageStoreGetTextIndex(previousStore) != NULL)
+			LoggerTextIndexUpdate(LoggerMessageStoreGetTextIndex(previousStore), previousStore);
+		LoggerMessageStoreRelease(previousStore);
+		LoggerTextIndex *textIndex = LoggerMessageStoreGetTextIndex(store);
+		if (textIndex != NULL)
+		{
+			LoggerTextIndexUpdate(textIndex, store);
+			size_t memoryUsage = LoggerTextIndexMemoryUsage(textIndex);
+			if (memoryUsage < _reportedTextIndexMemoryUsage || memoryUsage - _reportedTextIndexMemoryUsage >= 1024 * 1024)
+			{
+				_reportedTextIndexMemoryUsage = memoryUsage;
+				[[NSNotificationCenter defaultCenter] postNotificationName:kShowStatusInStatusWindowNotification
+																	object:self];
+			}
+		}
+		LoggerMessageStoreRelease(store);
+
+		[self evictMessagesIfNeeded];
+	});
+}
+
+- (void)insertMessages:(NSArray *)msgs beforeMessage:(LoggerMessage *)message
+{
+	dispatch_async(_messageProcessingQueue, ^{
+		@synchronized (self.messages)
+		{
+			NSUInteger index = [self indexOfMessage:message];
+			if (index == NSNotFound)
+				index = [self.messages count];
+			[self.messages insertObjects:msgs atIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(index, [msgs count])]];
+			self->_orderIndexesValid = NO;
+		}
+		[self countTagsOfMessages:msgs added:YES];
+
+		LoggerMessageStore *store = [self retainedMessageStore];
+		LoggerTextIndex *textIndex = LoggerMessageStoreGetTextIndex(store);
+		if (textIndex != NULL)
+			LoggerTextIndexUpdate(textIndex, store);
+		LoggerMessageStoreRelease(store);
 	});
 }
 
+- (void)countTagsOfMessages:(NSArray *)msgs added:(BOOL)added
+{
+	@synchronized (self)
+	{
+		for (LoggerMessage *message in msgs)
+		{
+			uint32_t tagID = message.tagID;
+			if (tagID == 0)
+				continue;
+			if (!added)
+			{
+				if (tagID < _tagCountsSize && _tagCounts[tagID] && --_tagCounts[tagID] == 0)
+					_tagsVersion++;
+				continue;
+			}
+			if (tagID >= _tagCountsSize)
+			{
+				uint32_t newSize = MAX(tagID + 1, MAX(_tagCountsSize * 2, 64U));
+				uint32_t *newCounts = (uint32_t *)realloc(_tagCounts, newSize * sizeof(uint32_t));
+				if (newCounts == NULL)
+					continue;
+				memset(newCounts + _tagCountsSize, 0, (newSize - _tagCountsSize) * sizeof(uint32_t));
+				_tagCounts = newCounts;
+				_tagCountsSize = newSize;
+			}
+			if (_tagCounts[tagID]++ == 0)
+				_tagsVersion++;
+		}
+	}
+}
+
+- (NSArray *)tags
+{
+	NSMutableArray *tags = [[NSMutableArray alloc] init];
+	@synchronized (self)
+	{
+		for (uint32_t tagID = 1; tagID < _tagCountsSize; tagID++)
+		{
+			if (_tagCounts[tagID])
+				[tags addObject:LoggerTagForID(tagID)];
+		}
+	}
+	return tags;
+}
+
+- (NSUInteger)tagsVersion
+{
+	@synchronized (self)
+	{
+		return _tagsVersion;
+	}
+}
+
+- (NSUInteger)countOfMessagesWithTagID:(uint32_t)tagID
+{
+	@synchronized (self)
+	{
+		return (tagID < _tagCountsSize) ? _tagCounts[tagID] : 0;
+	}
+}
+
+- (size_t)textIndexMemoryUsage
+{
+	// each segment of a live connection has its own store and index
+	size_t memoryUsage = 0;
+	@synchronized (self)
+	{
+		for (NSUInteger i = _firstSegmentInMemory; i < _segmentsCount; i++)
+		{
+			LoggerTextIndex *textIndex = LoggerMessageStoreGetTextIndex(_segments[i].store);
+			if (_segments[i].store != _messageStore && textIndex != NULL)
+				memoryUsage += LoggerTextIndexMemoryUsage(textIndex);
+		}
+	}
+	LoggerMessageStore *store = [self retainedMessageStore];
+	LoggerTextIndex *textIndex = LoggerMessageStoreGetTextIndex(store);
+	if (textIndex != NULL)
+		memoryUsage += LoggerTextIndexMemoryUsage(textIndex);
+	LoggerMessageStoreRelease(store);
+	return memoryUsage;
+}
+
 - (void)clearMessages
 {
 	// Clear the backlog of _messages, only keeping the top (client info) message
@@ -205,10 +474,42 @@ char sConnectionAssociatedObjectKey = 1;
 		return;
 
 	// Locate the clientInfo message
-	if (((LoggerMessage *) _messages[0]).type == LOGMSG_TYPE_CLIENTINFO)
-		[_messages removeObjectsInRange:NSMakeRange(1, [_messages count]-1)];
-	else
-		[_messages removeAllObjects];
+	LoggerMessage *clientInfo = _messages[0];
+	@synchronized (_messages)
+	{
+		if (clientInfo.type == LOGMSG_TYPE_CLIENTINFO)
+			[_messages removeObjectsInRange:NSMakeRange(1, [_messages count]-1)];
+		else
+			[_messages removeAllObjects];
+		_orderIndexesValid = NO;
+		_droppedMessagesMark = nil;
+		[_spilledMarkPositions removeAllObjects];
+	}
+
+	// Start a new store so that the memory used by cleared messages is released
+	// once they are gone (the client info message we keep doesn't reference a store)
+	LoggerMessageStore *newStore = CreateMessageStore();
+	LoggerMessageStore *oldStore;
+	@synchronized (self)
+	{
+		oldStore = _messageStore;
+		_messageStore = newStore;
+		if (_tagCountsSize)
+		{
+			memset(_tagCounts, 0, _tagCountsSize * sizeof(uint32_t));
+			_tagsVersion++;
+		}
+
+		// the journal keeps the cleared messages, but they can't be restored anymore
+		for (NSUInteger i = _firstSegmentInMemory; i < _segmentsCount; i++)
+			LoggerMessageStoreRelease(_segments[i].store);
+		_segmentsCount = 0;
+		_firstSegmentInMemory = 0;
+		_fullSegmentsMemoryUsage = 0;
+		_droppedMessagesCount = 0;
+	}
+	LoggerMessageStoreRelease(oldStore);
+	[self countTagsOfMessages:_messages added:YES];
 }
 
 - (void)clientInfoReceived:(LoggerMessage *)message
@@ -221,7 +522,11 @@ char sConnectionAssociatedObjectKey = 1;
 		@synchronized (self.messages)
 		{
 			if ([self.messages count] == 0 || ((LoggerMessage *) self.messages[0]).type != LOGMSG_TYPE_CLIENTINFO)
+			{
 				[self.messages insertObject:message atIndex:0];
+				self->_orderIndexesValid = NO;
+				[self countTagsOfMessages:@[message] added:YES];
+			}
 		}
 	});
 
@@ -327,6 +632,652 @@ char sConnectionAssociatedObjectKey = 1;
 	self.connected = NO;
 }
 
+- (NSString *)wireStringWithID:(uint32_t)stringID
+{
+	// only connections that understand the v2 wire protocol and connections restored
+	// from a saved document have string references
+	return (stringID < [_savedStrings count]) ? _savedStrings[stringID] : nil;
+}
+
+- (LoggerMessageStore *)retainedMessageStore
+{
+	@synchronized (self)
+	{
+		return LoggerMessageStoreRetain(_messageStore);
+	}
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Time and sequence indexes
+// -----------------------------------------------------------------------------
+static int64_t MicrosecondsSince1970(NSDate *date)
+{
+	return (int64_t)llround([date timeIntervalSince1970] * 1000000.0);
+}
+
+- (void)validateOrderIndexes
+{
+	// must be called with the messages list locked. Messages arriving are added to the indexes,
+	// other changes to the list have them rebuilt when they are next used
+	if (_orderIndexesValid && LoggerOrderIndexCount(_timeIndex) == [_messages count])
+		return;
+	if (_timeIndex == NULL)
+	{
+		_timeIndex = LoggerOrderIndexCreate();
+		_sequenceIndex = LoggerOrderIndexCreate();
+		if (_timeIndex == NULL || _sequenceIndex == NULL)
+			[NSException raise:NSMallocException format:@"can't allocate message indexes"];
+	}
+	LoggerOrderIndexRemoveAll(_timeIndex);
+	LoggerOrderIndexRemoveAll(_sequenceIndex);
+	for (LoggerMessage *message in _messages)
+		IndexMessageOrder(_timeIndex, _sequenceIndex, message);
+	_orderIndexesValid = YES;
+}
+
+- (void)invalidateMessageIndexes
+{
+	@synchronized (_messages)
+	{
+		_orderIndexesValid = NO;
+	}
+}
+
+- (NSRange)rangeOfMessagesFromDate:(NSDate *)startDate toDate:(NSDate *)endDate
+{
+	@synchronized (_messages)
+	{
+		[self validateOrderIndexes];
+		uint32_t start, end;
+		LoggerOrderIndexRange(_timeIndex,
+							  (startDate != nil) ? MicrosecondsSince1970(startDate) : INT64_MIN,
+							  (endDate != nil) ? MicrosecondsSince1970(endDate) : INT64_MAX,
+							  &start, &end);
+		return NSMakeRange(start, end - start);
+	}
+}
+
+- (NSUInteger)indexOfFirstMessageAtOrAfterDate:(NSDate *)date
+{
+	@synchronized (_messages)
+	{
+		[self validateOrderIndexes];
+		uint32_t position = LoggerOrderIndexLowerBound(_timeIndex, MicrosecondsSince1970(date));
+		return (position < [_messages count]) ? position : NSNotFound;
+	}
+}
+
+- (NSUInteger)indexOfMessage:(LoggerMessage *)message
+{
+	if (message == nil)
+		return NSNotFound;
+	@synchronized (_messages)
+	{
+		short type = message.type;
+		if (type == LOGMSG_TYPE_LOG || type == LOGMSG_TYPE_BLOCKSTART || type == LOGMSG_TYPE_BLOCKEND)
+		{
+			[self validateOrderIndexes];
+			uint32_t start, end;
+			int64_t sequence = (int64_t)message.sequence;
+			LoggerOrderIndexRange(_sequenceIndex, sequence, sequence, &start, &end);
+			for (NSUInteger i = start; i < end && i < [_messages count]; i++)
+			{
+				if (_messages[i] == message)
+					return i;
+			}
+		}
+		// messages without a sequence number of their own, or sequence numbers that went back
+		// (i.e. the client was restarted in the same connection)
+		return [_messages indexOfObjectIdenticalTo:message];
+	}
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Journal
+// -----------------------------------------------------------------------------
+static const uint8_t *ResolveWireString(void *info, uint32_t stringID, uint32_t *outLength)
+{
+	// string references of v2 messages are written to the journal as the strings themselves
+	const char *utf8 = [[(__bridge LoggerConnection *)info wireStringWithID:stringID] UTF8String];
+	if (utf8 == NULL)
+		return NULL;
+	*outLength = (uint32_t)strlen(utf8);
+	return (const uint8_t *)utf8;
+}
+
++ (NSURL *)journalsDirectoryURL
+{
+	NSURL *url = [[NSFileManager defaultManager] URLForDirectory:NSApplicationSupportDirectory
+														inDomain:NSUserDomainMask
+											   appropriateForURL:nil
+														  create:YES
+														   error:NULL];
+	return [url URLByAppendingPathComponent:@"NSLogger/Journals" isDirectory:YES];
+}
+
+- (void)createJournal
+{
+	// must be called with self locked. The file name tells when the session started,
+	// it becomes the title of the window if the journal has to be recovered
+	NSURL *directory = [LoggerConnection journalsDirectoryURL];
+	NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+	formatter.locale = [NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"];
+	formatter.dateFormat = @"yyyy-MM-dd HH.mm.ss";
+	NSString *name = [NSString stringWithFormat:@"Session %@ %@.rawnsloggerdata",
+					  [formatter stringFromDate:[NSDate date]], [[[NSUUID UUID] UUIDString] substringToIndex:8]];
+	NSURL *url = [directory URLByAppendingPathComponent:name];
+	if (directory != nil && [[NSFileManager defaultManager] createDirectoryAtURL:directory withIntermediateDirectories:YES attributes:nil error:NULL])
+		_journal = LoggerJournalCreate([url fileSystemRepresentation]);
+	if (_journal == NULL)
+	{
+		_journalStopped = YES;
+		return;
+	}
+	_journalURL = url;
+}
+
+- (void)configureRetention
+{
+	// must be called with self locked. Segments hold a quarter of what each limit allows: once
+	// it is reached, what stays in memory is between 3/4 and 5/4 of the limit. Without a journal,
+	// evicted messages can only be dropped
+	NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+	if (![defaults boolForKey:kPrefJournalLiveSessions])
+		_journalStopped = YES;
+	_messagesKeptInMemory = (NSUInteger)MAX([defaults integerForKey:kPrefMessagesKeptInMemory], 0);
+	_memoryKeptForMessages = (size_t)MAX([defaults integerForKey:kPrefMessagesMemoryLimit], 0) * 1024 * 1024;
+	_maxMessageAge = (int64_t)MAX([defaults integerForKey:kPrefMessagesMaxAge], 0) * 1000000;
+	_spillsEvictedMessages = !_journalStopped && [defaults boolForKey:kPrefSpillEvictedMessages];
+	_segmentSize = _messagesKeptInMemory ? (uint32_t)MIN(MAX(_messagesKeptInMemory / 4, LOGGER_STORE_PAGE_ROWS), UINT32_MAX) : UINT32_MAX;
+	_segmentBytes = _memoryKeptForMessages / 4;
+	_segmentDuration = _maxMessageAge / 4;
+	_retentionConfigured = YES;
+}
+
+- (JournalSegment *)addSegmentWithStore:(LoggerMessageStore *)store offset:(uint64_t)offset
+{
+	// must be called with self locked
+	if (_segmentsCount == _segmentsCapacity)
+	{
+		NSUInteger newCapacity = MAX(_segmentsCapacity * 2, 64U);
+		JournalSegment *newSegments = (JournalSegment *)realloc(_segments, newCapacity * sizeof(JournalSegment));
+		if (newSegments == NULL)
+			return NULL;
+		_segments = newSegments;
+		_segmentsCapacity = newCapacity;
+	}
+	JournalSegment *segment = &_segments[_segmentsCount++];
+	segment->store = LoggerMessageStoreRetain(store);
+	segment->journalOffset = offset;
+	segment->journalLength = 0;
+	segment->messagesBytes = 0;
+	segment->memoryUsage = 0;
+	segment->firstTimestamp = 0;
+	segment->lastTimestamp = 0;
+	segment->clockAnchor = _clientClockAnchor;
+	segment->messagesCount = 0;
+	segment->journaled = YES;
+	return segment;
+}
+
+- (LoggerConnection *)decoderConnection
+{
+	LoggerConnection *decoder = [[LoggerConnection alloc] init];
+	decoder->_savedStrings = _savedStrings;
+	decoder.clientClockAnchor = self.clientClockAnchor;
+	return decoder;
+}
+
+- (void)keepStoreOfDecoder:(LoggerConnection *)decoder
+{
+	// The store is kept as a full segment that is not journaled. Connections that decode files
+	// have no retention policy: their segments are not evicted
+	LoggerMessageStore *store = [decoder retainedMessageStore];
+	if (store == NULL)
+		return;
+	@synchronized (self)
+	{
+		JournalSegment *segment = [self addSegmentWithStore:store offset:0];
+		if (segment != NULL)
+		{
+			segment->clockAnchor = decoder.clientClockAnchor;
+			segment->messagesCount = LoggerMessageStoreCount(store);
+			segment->memoryUsage = LoggerMessageStoreMemoryUsage(store);
+			segment->journaled = NO;
+			_fullSegmentsMemoryUsage += segment->memoryUsage;
+		}
+	}
+	LoggerMessageStoreRelease(store);
+}
+
+- (void)journalMessage:(LoggerMessage *)message data:(NSData *)data hasStringRefs:(BOOL)hasStringRefs
+{
+	// Called on the transport thread once the message was appended to the store. Segments are
+	// kept even without a journal, their messages can then be dropped but not spilled. The client
+	// info message keeps its values itself, it was appended to the current store
+	LoggerMessageStore *store = (message.type == LOGMSG_TYPE_CLIENTINFO) ? [self retainedMessageStore] : RetainedStoreOfMessage(message);
+	if (store == NULL)
+		return;
+	[self journalMessage:message data:data hasStringRefs:hasStringRefs store:store];
+	LoggerMessageStoreRelease(store);
+}
+
+- (void)journalMessage:(LoggerMessage *)message data:(NSData *)data hasStringRefs:(BOOL)hasStringRefs store:(LoggerMessageStore *)store
+{
+	LoggerJournal *journal = NULL;
+	@synchronized (self)
+	{
+		if (!_retentionConfigured)
+			[self configureRetention];
+		if (_journal == NULL && !_journalStopped)
+			[self createJournal];
+		if (!_journalStopped)
+			journal = _journal;
+	}
+
+	// only the transport thread appends to the journal
+	uint64_t offset = 0, end = 0;
+	BOOL written = NO;
+	if (journal != NULL)
+	{
+		offset = LoggerJournalLength(journal);
+		written = LoggerJournalAppendMessage(journal, (const uint8_t *)[data bytes], (uint32_t)[data length],
+											 hasStringRefs ? &ResolveWireString : NULL, (__bridge void *)self);
+		end = LoggerJournalLength(journal);
+	}
+
+	struct timeval tv = message.timestamp;
+	int64_t timestamp = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	@synchronized (self)
+	{
+		if (journal != NULL && !written)
+			_journalStopped = YES;
+
+		JournalSegment *segment = (_segmentsCount > _firstSegmentInMemory) ? &_segments[_segmentsCount - 1] : NULL;
+		if (segment == NULL || segment->store != store)
+		{
+			segment = [self addSegmentWithStore:store offset:offset];
+			if (segment == NULL)
+				return;
+			segment->firstTimestamp = timestamp;
+		}
+		if (written)
+			segment->journalLength = end - segment->journalOffset;
+		else
+			segment->journaled = NO;		// the messages that follow can't be read back: they stay in memory
+		segment->messagesBytes += [data length];
+		segment->lastTimestamp = MAX(segment->lastTimestamp, timestamp);
+		segment->messagesCount++;
+
+		// once the segment is full, the messages that follow go to a new store so that
+		// this one can be released when the segment is evicted
+		BOOL full = (segment->messagesCount >= _segmentSize ||
+					 (segment->messagesCount >= LOGGER_STORE_PAGE_ROWS &&
+					  ((_segmentBytes && segment->messagesBytes >= _segmentBytes) ||
+					   (_segmentDuration && segment->lastTimestamp - segment->firstTimestamp >= _segmentDuration))));
+		if (full && store == _messageStore)
+		{
+			LoggerMessageStore *newStore = CreateMessageStore();
+			if (newStore != NULL)
+			{
+				segment->memoryUsage = LoggerMessageStoreMemoryUsage(store);
+				_fullSegmentsMemoryUsage += segment->memoryUsage;
+				LoggerMessageStoreRelease(_messageStore);
+				_messageStore = newStore;
+			}
+		}
+	}
+}
+
+- (void)flushJournal
+{
+	LoggerJournal *journal;
+	@synchronized (self)
+	{
+		journal = _journalStopped ? NULL : _journal;
+	}
+	if (journal != NULL && !LoggerJournalFlush(journal))
+	{
+		@synchronized (self)
+		{
+			_journalStopped = YES;
+		}
+	}
+}
+
+- (void)discardJournal
+{
+	// the file stays open until the connection goes away, evicted messages can still be read
+	NSURL *url;
+	@synchronized (self)
+	{
+		_journalStopped = YES;
+		url = _journalURL;
+	}
+	if (url != nil)
+		[[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+}
+
+- (BOOL)segmentCanBeEvicted:(NSUInteger)segmentIndex messagesCount:(NSUInteger)messagesCount
+{
+	// must be called with self locked. The segment messages are being appended to stays, the oldest
+	// segment goes if the messages in memory exceed one of the limits of the retention policy
+	if (segmentIndex + 1 >= _segmentsCount)
+		return NO;
+	JournalSegment *segment = &_segments[segmentIndex];
+	if (_spillsEvictedMessages &&
+		(!segment->journaled || segment->journalOffset + segment->journalLength > LoggerJournalWrittenLength(_journal)))
+		return NO;
+	return ((_messagesKeptInMemory && messagesCount > _messagesKeptInMemory) ||
+			(_memoryKeptForMessages && MessagesMemoryUsage(_fullSegmentsMemoryUsage + LoggerMessageStoreMemoryUsage(_messageStore), messagesCount) > _memoryKeptForMessages) ||
+			(_maxMessageAge && _segments[_segmentsCount - 1].lastTimestamp - segment->lastTimestamp > _maxMessageAge));
+}
+
+- (LoggerMessage *)oldestVisibleMessage
+{
+	@synchronized (_messages)
+	{
+		return _oldestVisibleMessage;
+	}
+}
+
+- (void)setOldestVisibleMessage:(LoggerMessage *)message
+{
+	// Evictions check the message on screen and remove the messages of a segment with the messages
+	// list locked: once the window has set it, the segment that holds it can't go away
+	@synchronized (_messages)
+	{
+		_oldestVisibleMessage = message;
+	}
+}
+
+- (void)evictMessagesIfNeeded
+{
+	// Called on the message processing queue. Each segment is evicted once, in one go: the cost of
+	// evictions is spread over the messages of the segment. Evicted messages are either spilled (they
+	// can be read back from the journal) or dropped, in which case a mark tells how many went away
+	for (;;)
+	{
+		LoggerMessageStore *store = NULL;
+		NSUInteger segmentIndex;
+		@synchronized (self)
+		{
+			segmentIndex = _firstSegmentInMemory;
+			if ([self segmentCanBeEvicted:segmentIndex messagesCount:[_messages count]])
+				store = _segments[segmentIndex].store;
+		}
+		if (store == NULL)
+			break;
+
+		// The segment's messages come first, after the client info message. Marks the user inserted
+		// between them are not journaled and couldn't be read back: they stay at the top of the list,
+		// and go back to their place if the segment is restored. The mark of the messages dropped
+		// before goes, a new one replaces it
+		NSMutableArray *evicted = nil;
+		NSUInteger first = 0, evictedFromStore = 0;
+		@synchronized (_messages)
+		{
+			LoggerMessage *oldestVisible = _spillsEvictedMessages ? _oldestVisibleMessage : nil;
+			NSUInteger count = [_messages count];
+			first = (count && ((LoggerMessage *)_messages[0]).type == LOGMSG_TYPE_CLIENTINFO) ? 1 : 0;
+			NSUInteger end = first;
+			while (end < count)
+			{
+				BOOL hasStore;
+				BOOL inStore = IsMessageInStore(_messages[end], store, &hasStore);
+				if (hasStore && !inStore)
+					break;
+				if (hasStore)
+					evictedFromStore++;
+				end++;
+			}
+			if (end < count &&
+				(oldestVisible == nil || [_messages indexOfObjectIdenticalTo:oldestVisible inRange:NSMakeRange(first, end - first)] == NSNotFound))
+			{
+				evicted = [[NSMutableArray alloc] initWithCapacity:evictedFromStore + 1];
+				NSMutableArray *kept = nil;
+				NSNumber *previousSequence = @(NSNotFound);
+				for (NSUInteger i = first; i < end; i++)
+				{
+					LoggerMessage *msg = _messages[i];
+					BOOL hasStore;
+					IsMessageInStore(msg, store, &hasStore);
+					if (hasStore || msg == _droppedMessagesMark)
+					{
+						[evicted addObject:msg];
+						if (hasStore)
+							previousSequence = @(msg.sequence);
+					}
+					else
+					{
+						if (kept == nil)
+							kept = [[NSMutableArray alloc] init];
+						[kept addObject:msg];
+						if (_spillsEvictedMessages && [_spilledMarkPositions objectForKey:msg] == nil)
+						{
+							if (_spilledMarkPositions == nil)
+								_spilledMarkPositions = [NSMapTable strongToStrongObjectsMapTable];
+							[_spilledMarkPositions setObject:@[@(segmentIndex), previousSequence] forKey:msg];
+						}
+					}
+				}
+				[_messages removeObjectsInRange:NSMakeRange(first, end - first)];
+				if (_orderIndexesValid)
+				{
+					LoggerOrderIndexRemove(_timeIndex, (uint32_t)first, (uint32_t)(end - first));
+					LoggerOrderIndexRemove(_sequenceIndex, (uint32_t)first, (uint32_t)(end - first));
+				}
+				if (kept != nil)
+				{
+					[_messages insertObjects:kept atIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(first, [kept count])]];
+					for (NSUInteger i = 0; i < [kept count] && _orderIndexesValid; i++)
+					{
+						if (!(LoggerOrderIndexInsertWithoutKey(_timeIndex, (uint32_t)(first + i)) &&
+							  LoggerOrderIndexInsertWithoutKey(_sequenceIndex, (uint32_t)(first + i))))
+							_orderIndexesValid = NO;
+					}
+				}
+			}
+		}
+		if (evicted == nil)
+			break;		// the end of the segment is still being delivered, or the segment is on screen
+
+		[self countTagsOfMessages:evicted added:NO];
+		BOOL spilled;
+		@synchronized (self)
+		{
+			JournalSegment *segment = &_segments[_firstSegmentInMemory++];
+			_fullSegmentsMemoryUsage -= segment->memoryUsage;
+			segment->store = NULL;
+			spilled = _spillsEvictedMessages;
+			if (!spilled)
+				_droppedMessagesCount += evictedFromStore;
+		}
+		LoggerMessageStoreRelease(store);
+
+		LoggerMessage *mark = nil;
+		if (!spilled)
+		{
+			mark = [[LoggerMessage alloc] init];
+			mark.type = LOGMSG_TYPE_MARK;
+			mark.timestamp = ((LoggerMessage *)[evicted lastObject]).timestamp;
+			mark.message = [NSString stringWithFormat:NSLocalizedString(@"%lu older messages dropped", @""), (unsigned long)_droppedMessagesCount];
+			mark.threadID = @"";
+			mark.contentsType = kMessageString;
+			@synchronized (_messages)
+			{
+				[_messages insertObject:mark atIndex:first];
+				_droppedMessagesMark = mark;
+				if (_orderIndexesValid &&
+					!(LoggerOrderIndexInsertWithoutKey(_timeIndex, (uint32_t)first) &&
+					  LoggerOrderIndexInsertWithoutKey(_sequenceIndex, (uint32_t)first)))
+					_orderIndexesValid = NO;
+			}
+		}
+
+		if (self.attachedToWindow && [(id)_delegate respondsToSelector:@selector(connection:didEvictMessages:mark:)])
+			[(id)_delegate connection:self didEvictMessages:evicted mark:mark];
+	}
+}
+
+- (NSArray *)readJournalSegment:(NSUInteger)segmentIndex store:(LoggerMessageStore **)outStore
+{
+	JournalSegment segment;
+	LoggerJournal *journal;
+	@synchronized (self)
+	{
+		if (segmentIndex >= _segmentsCount || _journal == NULL)
+			return nil;
+		segment = _segments[segmentIndex];
+		journal = _journal;
+	}
+	uint8_t *bytes = LoggerJournalCopyRange(journal, segment.journalOffset, (size_t)segment.journalLength);
+	if (bytes == NULL)
+		return nil;
+
+	// Decode the messages with a connection of their own, so that they get their own store. The client
+	// info message stays at the top of the messages list, it is not read again
+	LoggerConnection *decoder = [[LoggerConnection alloc] init];
+	decoder.clientClockAnchor = segment.clockAnchor;
+	NSMutableArray *msgs = [[NSMutableArray alloc] initWithCapacity:segment.messagesCount];
+	const uint8_t *p = bytes;
+	size_t length = (size_t)segment.journalLength;
+	while (length > 4)
+	{
+		uint32_t size;
+		memcpy(&size, p, 4);
+		size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+		if (length - 4 < size)
+			break;
+		@autoreleasepool
+		{
+			NSData *subset = [NSData dataWithBytesNoCopy:(void *)(p + 4) length:size freeWhenDone:NO];
+			LoggerMessage *message = [[LoggerNativeMessage alloc] initWithData:subset connection:decoder];
+			if (message != nil && message.type != LOGMSG_TYPE_CLIENTINFO)
+				[msgs addObject:message];
+		}
+		length -= (size_t)size + 4;
+		p += (size_t)size + 4;
+	}
+	free(bytes);
+
+	LoggerMessageStore *store = [decoder retainedMessageStore];
+	LoggerTextIndex *textIndex = LoggerMessageStoreGetTextIndex(store);
+	if (textIndex != NULL)
+		LoggerTextIndexUpdate(textIndex, store);
+	if (outStore != NULL)
+		*outStore = store;
+	else
+		LoggerMessageStoreRelease(store);
+	return msgs;
+}
+
+- (NSUInteger)evictedSegmentsCount
+{
+	@synchronized (self)
+	{
+		return _spillsEvictedMessages ? _firstSegmentInMemory : 0;
+	}
+}
+
+- (size_t)messagesMemoryUsage
+{
+	NSUInteger messagesCount;
+	@synchronized (_messages)
+	{
+		messagesCount = [_messages count];
+	}
+	@synchronized (self)
+	{
+		return MessagesMemoryUsage(_fullSegmentsMemoryUsage + LoggerMessageStoreMemoryUsage(_messageStore), messagesCount);
+	}
+}
+
+- (NSArray *)messagesReadFromJournalSegment:(NSUInteger)segmentIndex
+{
+	return [self readJournalSegment:segmentIndex store:NULL];
+}
+
+- (void)restoreEvictedMessages:(void (^)(NSUInteger count))completion
+{
+	dispatch_async(_messageProcessingQueue, ^{
+		NSUInteger segmentIndex = NSNotFound;
+		@synchronized (self)
+		{
+			if (self->_spillsEvictedMessages && self->_firstSegmentInMemory > 0)
+				segmentIndex = self->_firstSegmentInMemory - 1;
+		}
+		LoggerMessageStore *store = NULL;
+		NSArray *restored = (segmentIndex != NSNotFound) ? [self readJournalSegment:segmentIndex store:&store] : nil;
+		if (restored != nil)
+		{
+			@synchronized (self)
+			{
+				self->_segments[segmentIndex].store = store;
+				self->_segments[segmentIndex].memoryUsage = LoggerMessageStoreMemoryUsage(store);
+				self->_fullSegmentsMemoryUsage += self->_segments[segmentIndex].memoryUsage;
+				self->_firstSegmentInMemory = segmentIndex;
+			}
+			@synchronized (self.messages)
+			{
+				// the user marks of the segment were kept at the top of the list, they go back after
+				// the message they followed
+				NSMutableArray *msgs = self.messages;
+				NSUInteger first = ([msgs count] && ((LoggerMessage *)msgs[0]).type == LOGMSG_TYPE_CLIENTINFO) ? 1 : 0;
+				NSMutableArray *inserted = [restored mutableCopy];
+				for (NSUInteger i = first; i < [msgs count]; )
+				{
+					LoggerMessage *mark = msgs[i];
+					BOOL hasStore;
+					IsMessageInStore(mark, NULL, &hasStore);
+					if (hasStore)
+						break;
+					NSArray *position = [self->_spilledMarkPositions objectForKey:mark];
+					if (position == nil || [position[0] unsignedIntegerValue] != segmentIndex)
+					{
+						i++;
+						continue;
+					}
+					NSUInteger previousSequence = [position[1] unsignedIntegerValue];
+					NSUInteger index = 0;
+					if (previousSequence != NSNotFound)
+					{
+						index = [inserted indexOfObjectPassingTest:^BOOL(LoggerMessage *msg, NSUInteger idx, BOOL *stop) {
+							BOOL fromStore;
+							IsMessageInStore(msg, NULL, &fromStore);
+							return (fromStore && msg.sequence == previousSequence);
+						}];
+						index = (index == NSNotFound) ? [inserted count] : index + 1;
+					}
+					for (; index < [inserted count]; index++)
+					{
+						// after the marks that followed the same message
+						BOOL fromStore;
+						IsMessageInStore(inserted[index], NULL, &fromStore);
+						if (fromStore)
+							break;
+					}
+					[inserted insertObject:mark atIndex:index];
+					[msgs removeObjectAtIndex:i];
+					[self->_spilledMarkPositions removeObjectForKey:mark];
+				}
+				[msgs insertObjects:inserted atIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(first, [inserted count])]];
+				self->_orderIndexesValid = NO;
+			}
+			[self countTagsOfMessages:restored added:YES];
+		}
+		if (completion != nil)
+		{
+			NSUInteger count = [restored count];
+			dispatch_async(dispatch_get_main_queue(), ^{
+				completion(count);
+			});
+		}
+	});
+}
+
 // -----------------------------------------------------------------------------
 #pragma mark -
 #pragma mark NSCoding
@@ -367,10 +1318,12 @@ char sConnectionAssociatedObjectKey = 1;
 			_messages = [aDecoder decodeObjectForKey:@"messages"];
 		_reconnectionCount = [aDecoder decodeIntForKey:@"reconnectionCount"];
 		_restoredFromSave = YES;
+		[self countTagsOfMessages:_messages added:YES];
 		
 		// we need a _messageProcessingQueue just for the ability to add/insert marks
 		// when user does post-mortem investigation
 		_messageProcessingQueue = dispatch_queue_create("com.florentpillet.nslogger._messageProcessingQueue", NULL);
+		_messageStore = CreateMessageStore();
 	}
 	return self;
 }
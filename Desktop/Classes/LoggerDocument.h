@@ -30,7 +30,7 @@
  */
 #import "LoggerConnection.h"
 
-@class LoggerWindowController;
+@class LoggerWindowController, LoggerMessageFilter;
 
 @interface LoggerDocument : NSDocument <LoggerConnectionDelegate>
 
@@ -44,4 +44,12 @@
 - (void)addConnection:(LoggerConnection *)newConnection;
 - (void)clearLogs:(BOOL)includingPreviousRuns;
 
+// Runs of a saved document have their chunks of messages (see LoggerDocumentFile.h) decoded when the
+// window needs them. The chunks decoded are the ones whose summary may match the filter (all of them with
+// a nil filter) that come before the last chunk decoded, and the first `following' ones after it. Their
+// messages are added to the connection's messages list, the completion block is called on the main thread
+// once they are there with the number of messages decoded
+- (BOOL)hasSavedChunksToDecodeForConnection:(LoggerConnection *)connection filter:(LoggerMessageFilter *)filter following:(NSUInteger)following;
+- (void)decodeSavedChunksOfConnection:(LoggerConnection *)connection filter:(LoggerMessageFilter *)filter following:(NSUInteger)following completion:(void (^)(NSUInteger count))completion;
+
 @end
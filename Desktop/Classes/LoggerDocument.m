@@ -36,8 +36,27 @@
 #import "LoggerNativeMessage.h"
 #import "LoggerAppDelegate.h"
 #import "LoggerTCPConnection.h"
+#import "LoggerDocumentFile.h"
+#import "LoggerMessageFilter.h"
+#import "LoggerTextIndex.h"
 
 @implementation LoggerDocument
+{
+	// Saved documents: the chunks of messages are decoded when the window needs them (see -decodeSavedChunks...)
+	NSData *_savedData;							// bytes of the document, the reader works on them
+	LoggerDocumentReader *_savedReader;
+	NSArray *_savedRuns;						// connection of each run of the document
+	uint8_t *_savedChunksClaimed;				// per chunk, set once it is decoded or being decoded
+	NSMutableArray *_savedChunksFirstMessages;	// per chunk, its first message in the messages list (NSNull if none)
+	NSDictionary *_savedStringIDs;				// string ID of the strings of the string table
+}
+
+// Saved documents use the chunked format of LoggerDocumentFile.h. Documents saved by previous versions
+// are keyed archives of the connections, they still open as "NSLogger Data" and can be exported
+// in that format with this type
+static NSString * const kArchivedDataType = @"NSLogger Archived Data";
+
+#define DECODE_BATCH_SIZE		8192		// messages delivered to the connection at once when loading a file
 
 + (BOOL)canConcurrentlyReadDocumentsOfType:(NSString *)typeName
 {
@@ -118,6 +137,10 @@
 			while ([self.attachedLogs count] > 1)
 				[self.attachedLogs removeObjectAtIndex:0];
 		}
+		else
+		{
+			[self removePreviousRunsOverRetentionLimits];
+		}
 		[self didChangeValueForKey:@"attachedLogsPopupNames"];
 		self.currentConnection = newConnection;
 
@@ -126,6 +149,50 @@
 	});
 }
 
+- (void)removePreviousRunsOverRetentionLimits
+{
+	// The retention policy of the document applies to all its runs: the oldest runs are removed while
+	// the messages of all runs exceed the limits, or if their last message is too old. The last run
+	// (the new connection) always stays. Each run is looked at once, when the next one starts
+	NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+	NSUInteger maxMessages = (NSUInteger)MAX([defaults integerForKey:kPrefDocumentMessagesLimit], 0);
+	size_t maxMemory = (size_t)MAX([defaults integerForKey:kPrefDocumentMemoryLimit], 0) * 1024 * 1024;
+	NSTimeInterval maxAge = (NSTimeInterval)MAX([defaults integerForKey:kPrefMessagesMaxAge], 0);
+	if (!maxMessages && !maxMemory && !maxAge)
+		return;
+
+	NSUInteger messagesCount = 0;
+	size_t memoryUsage = 0;
+	for (LoggerConnection *connection in self.attachedLogs)
+	{
+		@synchronized (connection.messages)
+		{
+			messagesCount += [connection.messages count];
+		}
+		memoryUsage += [connection messagesMemoryUsage];
+	}
+	NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+	while ([self.attachedLogs count] > 1)
+	{
+		LoggerConnection *oldest = self.attachedLogs[0];
+		NSUInteger count;
+		struct timeval lastTime = {0, 0};
+		@synchronized (oldest.messages)
+		{
+			count = [oldest.messages count];
+			if (count)
+				lastTime = ((LoggerMessage *)[oldest.messages lastObject]).timestamp;
+		}
+		BOOL tooOld = (maxAge && count && now - (lastTime.tv_sec + lastTime.tv_usec / 1000000.0) > maxAge);
+		if (!tooOld && (!maxMessages || messagesCount <= maxMessages) && (!maxMemory || memoryUsage <= maxMemory))
+			break;
+		messagesCount -= MIN(count, messagesCount);
+		memoryUsage -= MIN([oldest messagesMemoryUsage], memoryUsage);
+		oldest.delegate = nil;
+		[self.attachedLogs removeObjectAtIndex:0];
+	}
+}
+
 - (void)clearLogs:(BOOL)includingPreviousRuns
 {
 	LoggerConnection *connection = [self.attachedLogs lastObject];
@@ -141,6 +208,7 @@
 	}
 
 	// Remove all entries from current run log
+	[self discardSavedChunksOfConnection:connection];
 	dispatch_async(connection.messageProcessingQueue, ^{
 		[connection clearMessages];
 		dispatch_async(dispatch_get_main_queue(), ^{
@@ -194,11 +262,635 @@
 		for (LoggerTransport *t in ((LoggerAppDelegate *)[NSApp	delegate]).transports)
 			[t removeConnection:connection];
 	}
+	if (_savedReader != NULL)
+		LoggerDocumentReaderDispose(_savedReader);
+	free(_savedChunksClaimed);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Saved documents
+// -----------------------------------------------------------------------------
+static void AppendIntPart(NSMutableData *frame, uint8_t key, uint8_t partType, uint64_t value)
+{
+	uint8_t part[10] = { key, partType };
+	uint32_t size = (partType == PART_TYPE_INT64) ? 8 : 4;
+	for (uint32_t i = 0; i < size; i++)
+		part[2 + i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+	[frame appendBytes:part length:2 + size];
+}
+
+static void AppendPart(NSMutableData *frame, uint8_t key, uint8_t partType, const void *bytes, NSUInteger length)
+{
+	uint8_t part[6] = { key, partType };
+	uint32_t size = htonl((uint32_t)length);
+	memcpy(&part[2], &size, 4);
+	[frame appendBytes:part length:6];
+	[frame appendBytes:bytes length:length];
+}
+
+static uint32_t AppendStringRefPart(NSMutableData *frame, uint8_t key, NSString *string, LoggerDocumentWriter *writer)
+{
+	// names are written once in the string table, see LoggerDocumentFile.h
+	const char *utf8 = [string UTF8String];
+	uint32_t stringID = LoggerDocumentWriterInternString(writer, (const uint8_t *)utf8, (uint32_t)strlen(utf8));
+	if (stringID != LOGGER_DOCUMENT_NO_STRING)
+	{
+		uint32_t ref = htonl(stringID);
+		AppendPart(frame, key, PART_TYPE_STRING_REF, &ref, 4);
+	}
+	return stringID;
+}
+
+static void EncodeMessage(LoggerMessage *message, NSMutableData *frame, LoggerDocumentWriter *writer, LoggerDocumentMessageInfo *info)
+{
+	// Messages are saved in the v1 wire format so that LoggerNativeMessage decodes them when
+	// the document is opened, whatever class they were created with
+	[frame setLength:2];
+	struct timeval ts = message.timestamp;
+	AppendIntPart(frame, PART_KEY_MESSAGE_TYPE, PART_TYPE_INT32, (uint32_t)message.type);
+	AppendIntPart(frame, PART_KEY_MESSAGE_SEQ, PART_TYPE_INT32, (uint32_t)message.sequence);
+	AppendIntPart(frame, PART_KEY_TIMESTAMP_S, PART_TYPE_INT64, (uint64_t)ts.tv_sec);
+	AppendIntPart(frame, PART_KEY_TIMESTAMP_US, PART_TYPE_INT32, (uint32_t)ts.tv_usec);
+	AppendIntPart(frame, PART_KEY_LEVEL, PART_TYPE_INT32, (uint32_t)(int32_t)message.level);
+	uint16_t count = 5;
+
+	info->timestamp = (int64_t)ts.tv_sec * 1000000LL + ts.tv_usec;
+	info->sequence = (uint32_t)message.sequence;
+	info->level = message.level;
+	info->type = message.type;
+	info->tagStringID = LOGGER_DOCUMENT_NO_STRING;
+	NSString *tag = message.tag;
+	if ([tag length])
+	{
+		info->tagStringID = AppendStringRefPart(frame, PART_KEY_TAG, tag, writer);
+		count += (info->tagStringID != LOGGER_DOCUMENT_NO_STRING);
+	}
+	NSString *threadID = message.threadID;
+	if ([threadID length])
+		count += (AppendStringRefPart(frame, PART_KEY_THREAD_ID, threadID, writer) != LOGGER_DOCUMENT_NO_STRING);
+	if ([message.filename length])
+	{
+		count += (AppendStringRefPart(frame, PART_KEY_FILENAME, message.filename, writer) != LOGGER_DOCUMENT_NO_STRING);
+		AppendIntPart(frame, PART_KEY_LINENUMBER, PART_TYPE_INT32, (uint32_t)message.lineNumber);
+		count++;
+	}
+	if ([message.functionName length])
+		count += (AppendStringRefPart(frame, PART_KEY_FUNCTIONNAME, message.functionName, writer) != LOGGER_DOCUMENT_NO_STRING);
+
+	// the contents of native messages are copied from their store, without building an object
+	uint8_t partType = (message.contentsType == kMessageImage) ? PART_TYPE_IMAGE : (message.contentsType == kMessageData) ? PART_TYPE_BINARY : PART_TYPE_STRING;
+	uint32_t row, length;
+	uint8_t storedFields = 0;
+	LoggerMessageStore *store = [message isKindOfClass:[LoggerNativeMessage class]] ? [(LoggerNativeMessage *)message retainStore:&row storedFields:&storedFields unlessHeld:NULL] : NULL;
+	if (store != NULL && (storedFields & kStoredMessage))
+	{
+		const uint8_t *bytes = LoggerMessageStoreGetContents(store, row, &length);
+		if (bytes != NULL && length)
+		{
+			AppendPart(frame, PART_KEY_MESSAGE, partType, bytes, length);
+			count++;
+		}
+	}
+	else
+	{
+		id contents = message.message;
+		if ([contents isKindOfClass:[NSString class]])
+			contents = [(NSString *)contents dataUsingEncoding:NSUTF8StringEncoding];
+		if ([contents isKindOfClass:[NSData class]] && [contents length])
+		{
+			AppendPart(frame, PART_KEY_MESSAGE, partType, [contents bytes], [contents length]);
+			count++;
+		}
+	}
+	LoggerMessageStoreRelease(store);
+	if (message.contentsType == kMessageImage)
+	{
+		NSSize size = message.imageSize;
+		AppendIntPart(frame, PART_KEY_IMAGE_WIDTH, PART_TYPE_INT32, (uint32_t)size.width);
+		AppendIntPart(frame, PART_KEY_IMAGE_HEIGHT, PART_TYPE_INT32, (uint32_t)size.height);
+		count += 2;
+	}
+
+	// non-standard parts (i.e. client info)
+	NSDictionary *parts = message.parts;
+	for (NSNumber *key in parts)
+	{
+		NSUInteger partKey = [key unsignedIntegerValue];
+		id value = parts[key];
+		if (partKey <= PART_KEY_TIMESTAMP_NS || partKey > 255 || partKey == PART_KEY_TIMESTAMP_ANCHOR_NS)
+			continue;
+		if ([value isKindOfClass:[NSString class]])
+			value = [(NSString *)value dataUsingEncoding:NSUTF8StringEncoding];
+		else if ([value isKindOfClass:[NSNumber class]])
+		{
+			AppendIntPart(frame, (uint8_t)partKey, PART_TYPE_INT64, [(NSNumber *)value unsignedLongLongValue]);
+			count++;
+			continue;
+		}
+		if (![value isKindOfClass:[NSData class]] || ![value length])
+			continue;
+		AppendPart(frame, (uint8_t)partKey, [parts[key] isKindOfClass:[NSString class]] ? PART_TYPE_STRING : PART_TYPE_BINARY, [value bytes], [value length]);
+		count++;
+	}
+
+	uint8_t *p = (uint8_t *)[frame mutableBytes];
+	p[0] = (uint8_t)(count >> 8);
+	p[1] = (uint8_t)count;
+}
+
+static NSData *RunInfo(LoggerConnection *connection)
+{
+	NSMutableDictionary *info = [[NSMutableDictionary alloc] init];
+	info[@"reconnectionCount"] = @(connection.reconnectionCount);
+	if (connection.clientName != nil)
+		info[@"clientName"] = connection.clientName;
+	if (connection.clientVersion != nil)
+		info[@"clientVersion"] = connection.clientVersion;
+	if (connection.clientOSName != nil)
+		info[@"clientOSName"] = connection.clientOSName;
+	if (connection.clientOSVersion != nil)
+		info[@"clientOSVersion"] = connection.clientOSVersion;
+	if (connection.clientDevice != nil)
+		info[@"clientDevice"] = connection.clientDevice;
+	if (connection.clientUDID != nil)
+		info[@"clientUDID"] = connection.clientUDID;
+	return [NSPropertyListSerialization dataWithPropertyList:info format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL];
+}
+
+static NSString *RunInfoString(NSDictionary *info, NSString *key)
+{
+	id value = info[key];
+	return [value isKindOfClass:[NSString class]] ? value : nil;
+}
+
+static NSUInteger LocateFrames(const uint8_t *p, NSUInteger length, NSUInteger maxCount)
+{
+	// Length of the first maxCount frames (fewer if the data ends before), stopping before an incomplete frame
+	const uint8_t *start = p;
+	for (NSUInteger count = 0; count < maxCount && length > 4; count++)
+	{
+		uint32_t size;
+		memcpy(&size, p, 4);
+		size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+		if (length - 4 < size)
+			break;
+		length -= size + 4;
+		p += size + 4;
+	}
+	return (NSUInteger)(p - start);
+}
+
+static NSArray *DecodeFrames(const uint8_t *p, NSUInteger length, LoggerConnection *decoder, BOOL indexText, NSMutableArray *clientInfos)
+{
+	// Decode located frames with the decoder, which appends them to its store. The text of a decoder's
+	// own store can be indexed right away, the connection indexes its store when it gets the messages
+	NSMutableArray *msgs = [[NSMutableArray alloc] initWithCapacity:MIN(DECODE_BATCH_SIZE, length / 6 + 1)];
+	while (length > 4)
+	{
+		uint32_t size;
+		memcpy(&size, p, 4);
+		size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+		NSData *subset = [NSData dataWithBytesNoCopy:(void *)(p + 4) length:size freeWhenDone:NO];
+		LoggerMessage *message = [[LoggerNativeMessage alloc] initWithData:subset connection:decoder];
+		if (message.type == LOGMSG_TYPE_CLIENTINFO)
+			[clientInfos addObject:message];
+		else if (message != nil)
+			[msgs addObject:message];
+		length -= size + 4;
+		p += size + 4;
+	}
+	if (indexText)
+	{
+		LoggerMessageStore *store = [decoder retainedMessageStore];
+		LoggerTextIndex *textIndex = LoggerMessageStoreGetTextIndex(store);
+		if (textIndex != NULL)
+			LoggerTextIndexUpdate(textIndex, store);
+		LoggerMessageStoreRelease(store);
+	}
+	return msgs;
+}
+
+static void DeliverMessages(const uint8_t *p, NSUInteger length, LoggerConnection *connection, void (^deliver)(NSArray *msgs))
+{
+	// Decode messages in the v1 wire format, each preceded by its size, and hand them to the connection
+	// a batch at a time (or to the deliver block). The calling thread locates ranges of DECODE_BATCH_SIZE
+	// frames from their size words, while the ranges located before are decoded on all CPUs: each with a
+	// decoder connection that has its own store, so that the message objects and the text index are made
+	// in parallel too. A range is delivered as soon as the ranges before it are, by the thread that decoded
+	// the last of them. Data that holds a single range (i.e. a chunk of a saved document) is decoded with
+	// the connection itself: nothing would run in parallel
+	NSUInteger rangeLength = LocateFrames(p, length, DECODE_BATCH_SIZE);
+	if (LocateFrames(p + rangeLength, length - rangeLength, 1) == 0)
+	{
+		@autoreleasepool
+		{
+			NSMutableArray *clientInfos = [[NSMutableArray alloc] init];
+			NSArray *msgs = DecodeFrames(p, rangeLength, connection, NO, clientInfos);
+			for (LoggerMessage *clientInfo in clientInfos)
+				[connection clientInfoReceived:clientInfo];
+			if ([msgs count] && deliver != nil)
+				deliver(msgs);
+			else if ([msgs count])
+				[connection messagesReceived:msgs];
+		}
+		return;
+	}
+
+	// Ranges are decoded with the clock anchor the connection has when they start. A client info message
+	// that changes it normally comes first, the ranges that follow it and were decoded with the previous
+	// anchor are decoded again when they are delivered. A slot is taken by each range until it is delivered,
+	// so that the ranges waiting for a slow one don't pile up
+	dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	dispatch_group_t group = dispatch_group_create();
+	dispatch_semaphore_t slots = dispatch_semaphore_create(MAX([[NSProcessInfo processInfo] activeProcessorCount], 1) * 2);
+	NSMutableDictionary *decoded = [[NSMutableDictionary alloc] init];		// ranges waiting for the ranges before them
+	__block NSUInteger delivered = 0;
+	for (NSUInteger rangeIndex = 0; rangeLength != 0; rangeIndex++)
+	{
+		dispatch_semaphore_wait(slots, DISPATCH_TIME_FOREVER);
+		const uint8_t *start = p;
+		NSUInteger startLength = rangeLength;
+		int64_t clockAnchor;
+		@synchronized (decoded)
+		{
+			clockAnchor = connection.clientClockAnchor;
+		}
+		dispatch_group_async(group, queue, ^{
+			@autoreleasepool
+			{
+				LoggerConnection *decoder = [connection decoderConnection];
+				decoder.clientClockAnchor = clockAnchor;
+				NSMutableArray *clientInfos = [[NSMutableArray alloc] init];
+				NSArray *msgs = DecodeFrames(start, startLength, decoder, YES, clientInfos);
+				@synchronized (decoded)
+				{
+					NSData *frames = [NSData dataWithBytesNoCopy:(void *)start length:startLength freeWhenDone:NO];
+					decoded[@(rangeIndex)] = @[decoder, msgs, clientInfos, @(clockAnchor), frames];
+					for (NSArray *range; (range = decoded[@(delivered)]) != nil; delivered++)
+					{
+						[decoded removeObjectForKey:@(delivered)];
+						decoder = range[0];
+						msgs = range[1];
+						clientInfos = range[2];
+						if ([range[3] longLongValue] != connection.clientClockAnchor)
+						{
+							decoder = [connection decoderConnection];
+							[clientInfos removeAllObjects];
+							msgs = DecodeFrames((const uint8_t *)[range[4] bytes], [range[4] length], decoder, YES, clientInfos);
+						}
+						[connection keepStoreOfDecoder:decoder];
+						connection.clientClockAnchor = decoder.clientClockAnchor;
+						for (LoggerMessage *clientInfo in clientInfos)
+							[connection clientInfoReceived:clientInfo];
+						if ([msgs count] && deliver != nil)
+							deliver(msgs);
+						else if ([msgs count])
+							[connection messagesReceived:msgs];
+						dispatch_semaphore_signal(slots);
+					}
+				}
+			}
+		});
+		length -= rangeLength;
+		p += rangeLength;
+		rangeLength = LocateFrames(p, length, DECODE_BATCH_SIZE);
+	}
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+}
+
+- (BOOL)writeDocumentToURL:(NSURL *)absoluteURL error:(NSError **)outError
+{
+	FILE *file = fopen([absoluteURL fileSystemRepresentation], "wb");
+	if (file == NULL)
+	{
+		if (outError != NULL)
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+		return NO;
+	}
+	LoggerDocumentWriter *writer = LoggerDocumentWriterCreate(file);
+	BOOL result = (writer != NULL);
+	NSMutableData *frame = [[NSMutableData alloc] initWithCapacity:1024];
+	for (LoggerConnection *connection in self.attachedLogs)
+	{
+		if (!result)
+			break;
+
+		// Make a copy of the array state now so we're not bothered with the array
+		// changing while we're processing it
+		__block NSArray *messages = nil;
+		__block NSUInteger evictedSegments = 0;
+		dispatch_sync(connection.messageProcessingQueue, ^{
+			messages = [[NSArray alloc] initWithArray:connection.messages];
+			evictedSegments = [connection evictedSegmentsCount];
+		});
+		NSData *info = RunInfo(connection);
+		result = LoggerDocumentWriterBeginRun(writer, [info bytes], (uint32_t)[info length]);
+
+		BOOL (^addMessage)(LoggerMessage *) = ^BOOL(LoggerMessage *message) {
+			@autoreleasepool
+			{
+				LoggerDocumentMessageInfo messageInfo;
+				EncodeMessage(message, frame, writer, &messageInfo);
+				return LoggerDocumentWriterAddMessage(writer, [frame bytes], (uint32_t)[frame length], &messageInfo);
+			}
+		};
+
+		// messages the connection evicted are read back from its journal one segment at a time,
+		// they come after the client info message
+		NSUInteger index = 0, count = [messages count];
+		if (count && ((LoggerMessage *)messages[0]).type == LOGMSG_TYPE_CLIENTINFO)
+			result = addMessage(messages[index++]);
+		for (NSUInteger segment = 0; result && segment < evictedSegments; segment++)
+		{
+			@autoreleasepool
+			{
+				for (LoggerMessage *message in [connection messagesReadFromJournalSegment:segment])
+				{
+					if (!(result = addMessage(message)))
+						break;
+				}
+			}
+		}
+		for (; result && index < count; index++)
+			result = addMessage(messages[index]);
+	}
+	if (result)
+		result = LoggerDocumentWriterFinish(writer);
+	LoggerDocumentWriterDispose(writer);
+	if (fclose(file) != 0)
+		result = NO;
+	if (!result && outError != NULL)
+		*outError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:nil];
+	return result;
+}
+
+- (BOOL)readDocumentData:(NSData *)data error:(NSError **)outError
+{
+	LoggerDocumentReader *reader = LoggerDocumentReaderOpen((const uint8_t *)[data bytes], [data length]);
+	if (reader == NULL)
+	{
+		if (outError != NULL)
+			*outError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:nil];
+		return NO;
+	}
+
+	uint32_t chunksCount = LoggerDocumentReaderChunksCount(reader);
+	_savedChunksClaimed = (uint8_t *)calloc(chunksCount + 1, 1);
+	if (_savedChunksClaimed == NULL)
+	{
+		LoggerDocumentReaderDispose(reader);
+		if (outError != NULL)
+			*outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:nil];
+		return NO;
+	}
+
+	uint32_t stringsCount = LoggerDocumentReaderStringsCount(reader);
+	NSMutableArray *strings = [[NSMutableArray alloc] initWithCapacity:stringsCount];
+	for (uint32_t i = 0; i < stringsCount; i++)
+	{
+		uint32_t length;
+		const uint8_t *bytes = LoggerDocumentReaderGetString(reader, i, &length);
+		NSString *string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+		[strings addObject:(string != nil) ? string : @""];
+	}
+
+	NSMutableArray *connections = [[NSMutableArray alloc] init];
+	for (uint32_t run = 0, runsCount = LoggerDocumentReaderRunsCount(reader); run < runsCount; run++)
+	{
+		LoggerConnection *connection = [[LoggerConnection alloc] initWithSavedStrings:strings];
+		uint32_t length;
+		const uint8_t *bytes = LoggerDocumentReaderGetRunInfo(reader, run, &length);
+		NSData *infoData = [NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO];
+		NSDictionary *info = length ? [NSPropertyListSerialization propertyListWithData:infoData options:NSPropertyListImmutable format:NULL error:NULL] : nil;
+		if ([info isKindOfClass:[NSDictionary class]])
+		{
+			connection.clientName = RunInfoString(info, @"clientName");
+			connection.clientVersion = RunInfoString(info, @"clientVersion");
+			connection.clientOSName = RunInfoString(info, @"clientOSName");
+			connection.clientOSVersion = RunInfoString(info, @"clientOSVersion");
+			connection.clientDevice = RunInfoString(info, @"clientDevice");
+			connection.clientUDID = RunInfoString(info, @"clientUDID");
+			connection.reconnectionCount = [info[@"reconnectionCount"] intValue];
+		}
+		connection.delegate = self;
+		[connections addObject:connection];
+	}
+	[self.attachedLogs addObjectsFromArray:connections];
+
+	// Only the index has been read: the first chunk of each run is decoded in the background, the
+	// others when the window needs them (when the user scrolls down, or to filter their messages)
+	NSMutableDictionary *stringIDs = [[NSMutableDictionary alloc] initWithCapacity:stringsCount];
+	for (uint32_t i = stringsCount; i > 0; i--)
+		stringIDs[strings[i - 1]] = @(i - 1);
+	_savedChunksFirstMessages = [[NSMutableArray alloc] initWithCapacity:chunksCount];
+	for (uint32_t i = 0; i < chunksCount; i++)
+		[_savedChunksFirstMessages addObject:[NSNull null]];
+	_savedData = data;
+	_savedReader = reader;
+	_savedRuns = connections;
+	_savedStringIDs = stringIDs;
+	for (LoggerConnection *connection in connections)
+		[self decodeSavedChunksOfConnection:connection filter:nil following:1 completion:nil];
+	return YES;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Decoding saved chunks
+// -----------------------------------------------------------------------------
+static void SummaryOfChunk(const LoggerDocumentChunk *chunk, LoggerMessageSummary *summary)
+{
+	summary->minTimestamp = chunk->minTimestamp;
+	summary->maxTimestamp = chunk->maxTimestamp;
+	summary->levels = chunk->levels;
+	summary->types = chunk->types;
+	summary->tags = chunk->tags;
+}
+
+- (NSIndexSet *)savedChunksOfConnection:(LoggerConnection *)connection filter:(LoggerMessageFilter *)filter following:(NSUInteger)following claim:(BOOL)claim
+{
+	// The chunks not decoded yet whose summary may match the filter (all of them without a filter): the
+	// ones before the last chunk decoded, which the filter skipped before, and the first `following' ones
+	// after it. Must be called with self locked
+	NSUInteger run = [_savedRuns indexOfObjectIdenticalTo:connection];
+	if (_savedReader == NULL || run == NSNotFound)
+		return nil;
+	const LoggerDocumentRun *savedRun = LoggerDocumentReaderGetRun(_savedReader, (uint32_t)run);
+	uint32_t first = savedRun->firstChunk, end = first + savedRun->chunksCount, last = first;
+	for (uint32_t chunk = first; chunk < end; chunk++)
+	{
+		if (_savedChunksClaimed[chunk])
+			last = chunk + 1;
+	}
+	NSDictionary *stringIDs = _savedStringIDs;
+	uint64_t (^tagBits)(NSString *) = ^uint64_t(NSString *tag) {
+		NSNumber *stringID = stringIDs[tag];
+		return (stringID != nil) ? 1ULL << ([stringID unsignedIntValue] & 63) : 0;
+	};
+	NSMutableIndexSet *chunks = [[NSMutableIndexSet alloc] init];
+	for (uint32_t chunk = first; chunk < end && (chunk < last || following > 0); chunk++)
+	{
+		if (_savedChunksClaimed[chunk])
+			continue;
+		LoggerMessageSummary summary;
+		SummaryOfChunk(LoggerDocumentReaderGetChunk(_savedReader, chunk), &summary);
+		if (filter != nil && ![filter mayMatchMessagesWithSummary:&summary tagBits:tagBits])
+			continue;
+		if (chunk >= last)
+			following--;
+		[chunks addIndex:chunk];
+		if (claim)
+			_savedChunksClaimed[chunk] = 1;
+	}
+	return [chunks count] ? chunks : nil;
+}
+
+- (BOOL)hasSavedChunksToDecodeForConnection:(LoggerConnection *)connection filter:(LoggerMessageFilter *)filter following:(NSUInteger)following
+{
+	@synchronized (self)
+	{
+		return [self savedChunksOfConnection:connection filter:filter following:following claim:NO] != nil;
+	}
+}
+
+- (void)decodeSavedChunksOfConnection:(LoggerConnection *)connection filter:(LoggerMessageFilter *)filter following:(NSUInteger)following completion:(void (^)(NSUInteger count))completion
+{
+	NSIndexSet *chunks;
+	@synchronized (self)
+	{
+		chunks = [self savedChunksOfConnection:connection filter:filter following:following claim:YES];
+	}
+	dispatch_async(connection.messageProcessingQueue, ^{
+		NSUInteger count = [self decodeSavedChunks:chunks ofConnection:connection];
+		if (completion != nil)
+		{
+			// the messages are added to the messages list by blocks queued after this one
+			dispatch_async(connection.messageProcessingQueue, ^{
+				dispatch_async(dispatch_get_main_queue(), ^{
+					completion(count);
+				});
+			});
+		}
+	});
+}
+
+- (void)decodeAllSavedChunksOfConnection:(LoggerConnection *)connection
+{
+	// Called before saving or exporting: once this returns, all the messages of the run are in the messages list
+	NSIndexSet *chunks;
+	@synchronized (self)
+	{
+		chunks = [self savedChunksOfConnection:connection filter:nil following:NSUIntegerMax claim:YES];
+	}
+	if (chunks == nil)
+		return;
+	dispatch_sync(connection.messageProcessingQueue, ^{
+		[self decodeSavedChunks:chunks ofConnection:connection];
+	});
+	dispatch_sync(connection.messageProcessingQueue, ^{});
+}
+
+- (void)discardSavedChunksOfConnection:(LoggerConnection *)connection
+{
+	// the messages of a run that is cleared are not decoded anymore
+	@synchronized (self)
+	{
+		[self savedChunksOfConnection:connection filter:nil following:NSUIntegerMax claim:YES];
+		NSUInteger run = [_savedRuns indexOfObjectIdenticalTo:connection];
+		if (run != NSNotFound)
+		{
+			const LoggerDocumentRun *savedRun = LoggerDocumentReaderGetRun(_savedReader, (uint32_t)run);
+			for (uint32_t chunk = savedRun->firstChunk; chunk < savedRun->firstChunk + savedRun->chunksCount; chunk++)
+				_savedChunksFirstMessages[chunk] = [NSNull null];
+		}
+	}
+}
+
+- (NSUInteger)decodeSavedChunks:(NSIndexSet *)chunks ofConnection:(LoggerConnection *)connection
+{
+	// Called on the connection's message processing queue. Chunks are decompressed in parallel a few at a
+	// time, then their messages are decoded in order. The chunks that come after all the ones decoded are
+	// appended to the messages list, the others are inserted before the first message of the next chunk
+	// decoded. Returns the number of messages decoded
+	NSUInteger chunksCount = [chunks count];
+	if (chunksCount == 0)
+		return 0;
+	uint32_t *indexes = (uint32_t *)calloc(chunksCount, sizeof(uint32_t));
+	uint32_t batchSize = (uint32_t)MAX([[NSProcessInfo processInfo] activeProcessorCount], 1) * 2;
+	uint8_t **bytes = (uint8_t **)calloc(batchSize, sizeof(uint8_t *));
+	uint32_t *sizes = (uint32_t *)calloc(batchSize, sizeof(uint32_t));
+	__block NSUInteger decodedCount = 0;
+	__block NSUInteger n = 0;
+	[chunks enumerateIndexesUsingBlock:^(NSUInteger chunk, BOOL *stop) {
+		if (indexes != NULL)
+			indexes[n++] = (uint32_t)chunk;
+	}];
+	LoggerDocumentReader *reader = _savedReader;
+	for (NSUInteger first = 0; indexes != NULL && bytes != NULL && sizes != NULL && first < chunksCount; first += batchSize)
+	{
+		NSUInteger count = MIN(batchSize, chunksCount - first);
+		dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+			bytes[i] = LoggerDocumentReaderCopyChunk(reader, indexes[first + i], &sizes[i]);
+		});
+		for (NSUInteger i = 0; i < count; i++)
+		{
+			if (bytes[i] == NULL)
+				continue;
+			uint32_t chunk = indexes[first + i];
+			id nextMessage = nil;
+			@synchronized (self)
+			{
+				const LoggerDocumentRun *run = LoggerDocumentReaderGetRun(reader, LoggerDocumentReaderGetChunk(reader, chunk)->run);
+				for (uint32_t next = chunk + 1; nextMessage == nil && next < run->firstChunk + run->chunksCount; next++)
+				{
+					if (_savedChunksFirstMessages[next] != [NSNull null])
+						nextMessage = _savedChunksFirstMessages[next];
+				}
+			}
+			@autoreleasepool
+			{
+				__block LoggerMessage *firstMessage = nil;
+				NSMutableArray *inserted = (nextMessage != nil) ? [[NSMutableArray alloc] init] : nil;
+				DeliverMessages(bytes[i], sizes[i], connection, ^(NSArray *msgs) {
+					if (firstMessage == nil)
+						firstMessage = msgs[0];
+					decodedCount += [msgs count];
+					if (inserted != nil)
+						[inserted addObjectsFromArray:msgs];
+					else
+						[connection messagesReceived:msgs];
+				});
+				if ([inserted count])
+					[connection insertMessages:inserted beforeMessage:nextMessage];
+				if (firstMessage != nil)
+				{
+					@synchronized (self)
+					{
+						_savedChunksFirstMessages[chunk] = firstMessage;
+					}
+				}
+			}
+			free(bytes[i]);
+		}
+	}
+	free(indexes);
+	free(bytes);
+	free(sizes);
+	return decodedCount;
 }
 
 - (BOOL)writeToURL:(NSURL *)absoluteURL ofType:(NSString *)typeName error:(NSError **)outError
 {
+	// the runs of a saved document are written with all their messages
+	for (LoggerConnection *connection in self.attachedLogs)
+		[self decodeAllSavedChunksOfConnection:connection];
+
 	if ([typeName isEqualToString:@"NSLogger Data"])
+	{
+		return [self writeDocumentToURL:absoluteURL error:outError];
+	}
+	else if ([typeName isEqualToString:kArchivedDataType])
 	{
 		NSData *data = [NSKeyedArchiver archivedDataWithRootObject:self.attachedLogs];
 		if (data != nil)
@@ -213,8 +905,10 @@
 		assert(connectionIndex != NSNotFound);
 		LoggerConnection *connection = self.attachedLogs[(NSUInteger) connectionIndex];
 		__block NSArray *allMessages = nil;
+		__block NSUInteger evictedSegments = 0;
 		dispatch_sync(connection.messageProcessingQueue , ^{
 			allMessages = [[NSArray alloc] initWithArray:connection.messages];
+			evictedSegments = [connection evictedSegmentsCount];
 		});
 
 		BOOL (^flushData)(NSOutputStream*, NSMutableData*) = ^(NSOutputStream *stream, NSMutableData *data) 
@@ -241,17 +935,29 @@
 			[data appendBytes:bom length:3];
 			result = YES;
 			[stream open];
-			for (LoggerMessage *message in allMessages)
-			{
+			BOOL (^appendMessage)(LoggerMessage *) = ^BOOL(LoggerMessage *message) {
 				[data appendData:[[message textRepresentation] dataUsingEncoding:NSUTF8StringEncoding]];
-				if ([data length] >= bufferCapacity)
+				// periodic flush to reduce memory use while exporting
+				return ([data length] < bufferCapacity || flushData(stream, data));
+			};
+
+			// messages the connection evicted are read back from its journal, after the client info message
+			NSUInteger index = 0, count = [allMessages count];
+			if (count && ((LoggerMessage *)allMessages[0]).type == LOGMSG_TYPE_CLIENTINFO)
+				result = appendMessage(allMessages[index++]);
+			for (NSUInteger segment = 0; result && segment < evictedSegments; segment++)
+			{
+				@autoreleasepool
 				{
-					// periodic flush to reduce memory use while exporting
-					result = flushData(stream, data);
-					if (!result)
-						break;
+					for (LoggerMessage *message in [connection messagesReadFromJournalSegment:segment])
+					{
+						if (!(result = appendMessage(message)))
+							break;
+					}
 				}
 			}
+			for (; result && index < count; index++)
+				result = appendMessage(allMessages[index]);
 			if (result)
 				result = flushData(stream, data);
 			[stream close];
@@ -261,18 +967,36 @@
 	return NO;
 }
 
+- (BOOL)readFromURL:(NSURL *)absoluteURL ofType:(NSString *)typeName error:(NSError **)outError
+{
+	// map the file rather than reading it: saved documents only have their index read
+	// when opening, chunks are paged in as they are decoded
+	NSData *data = [NSData dataWithContentsOfURL:absoluteURL options:NSDataReadingMappedIfSafe error:outError];
+	if (data == nil)
+		return NO;
+	return [self readFromData:data ofType:typeName error:outError];
+}
+
 - (BOOL)readFromData:(NSData *)data ofType:(NSString *)typeName error:(NSError **)outError
 {
 	assert([self.attachedLogs count] == 0);
 	NSUInteger previousLogs = [self.attachedLogs count];
 
-	if ([typeName isEqualToString:@"NSLogger Data"])
+	if (([typeName isEqualToString:@"NSLogger Data"] || [typeName isEqualToString:kArchivedDataType]) &&
+		LoggerDocumentIsDocument((const uint8_t *)[data bytes], [data length]))
+	{
+		if (![self readDocumentData:data error:outError])
+			return NO;
+	}
+	else if ([typeName isEqualToString:@"NSLogger Data"] || [typeName isEqualToString:kArchivedDataType])
 	{
 		id logs=nil;
 		@try
 		{
 			// backward compatibility with NSLogger < 1.5
 			[NSKeyedUnarchiver setClass:[LoggerTCPConnection class] forClassName:@"LoggerNativeConnection"];
+			// messages read from the wire were archived as such, they keep their values once unarchived
+			[NSKeyedUnarchiver setClass:[LoggerMessage class] forClassName:@"LoggerNativeMessage"];
 
 			logs = [NSKeyedUnarchiver unarchiveObjectWithData:data];
 		}
@@ -294,34 +1018,14 @@
 	else if ([typeName isEqualToString:@"NSLogger Raw Data"])
 	{
 		LoggerConnection *connection = [[LoggerConnection alloc] init];
+		connection.delegate = self;
 		[self.attachedLogs addObject:connection];
 
-		NSMutableArray *msgs = [[NSMutableArray alloc] init];
-        long dataLength = data.length;
-        const uint8_t *p = data.bytes;
-        while (dataLength)
-        {
-            // check whether we have a full message
-            uint32_t length;
-            memcpy(&length, p, 4);
-            length = ntohl(length);
-            if (dataLength < (length + 4))
-                break;        // incomplete last message
-
-            // get one message
-            NSData *subset = [NSData dataWithBytesNoCopy:(unsigned char *)p + 4 length:length freeWhenDone:NO];
-            LoggerMessage *message = [[LoggerNativeMessage alloc] initWithData:(NSData *)subset connection:connection];
-            if (message.type == LOGMSG_TYPE_CLIENTINFO) {
-                [connection clientInfoReceived:message];
-            } else {
-                [msgs addObject:message];
-            }
-
-            dataLength -= length + 4;
-            p += length + 4;
-        }
-		if ([msgs count])
-			[connection messagesReceived:msgs];
+		// Buffer files can be several GB: the mapped file is decoded in the background,
+		// and the window shows the messages as they are delivered
+		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+			DeliverMessages((const uint8_t *)[data bytes], [data length], connection, nil);
+		});
 	}
 	self.currentConnection = [self.attachedLogs lastObject];
 	return ([self.attachedLogs count] != previousLogs);
@@ -348,7 +1052,7 @@
 {
 	NSArray *array = [super writableTypesForSaveOperation:saveOperation];
 	if (saveOperation == NSSaveToOperation)
-		array = [array arrayByAddingObject:@"public.plain-text"];
+		array = [array arrayByAddingObjectsFromArray:@[kArchivedDataType, @"public.plain-text"]];
 	return array;
 }
 
@@ -0,0 +1,622 @@
+/*
+ * LoggerDocumentFile.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "LoggerDocumentFile.h"
+#include "LoggerCompression.h"
+
+#define HEADER_SIZE			12
+#define TRAILER_SIZE		24
+#define RUN_RECORD_SIZE		24
+#define CHUNK_RECORD_SIZE	64
+#define MAX_CHUNK_SIZE		0x3FFFFFFFU		// a chunk holds at least one message, which can't be larger than a wire frame
+
+static const uint8_t sMagic[8] = { 'N', 'S', 'L', 'o', 'g', 'g', 'e', 'r' };
+
+typedef struct
+{
+	uint8_t *bytes;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static bool Reserve(Buffer *b, size_t size)
+{
+	if (b->length + size <= b->capacity)
+		return true;
+	size_t capacity = (b->capacity ? b->capacity * 2 : 65536) + size;
+	uint8_t *bytes = (uint8_t *)realloc(b->bytes, capacity);
+	if (bytes == NULL)
+		return false;
+	b->bytes = bytes;
+	b->capacity = capacity;
+	return true;
+}
+
+static bool Append(Buffer *b, const void *bytes, size_t length)
+{
+	if (!Reserve(b, length))
+		return false;
+	memcpy(b->bytes + b->length, bytes, length);
+	b->length += length;
+	return true;
+}
+
+static inline void Put32(uint8_t *p, uint32_t value)
+{
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+	p[2] = (uint8_t)(value >> 16);
+	p[3] = (uint8_t)(value >> 24);
+}
+
+static inline void Put64(uint8_t *p, uint64_t value)
+{
+	Put32(p, (uint32_t)value);
+	Put32(p + 4, (uint32_t)(value >> 32));
+}
+
+static inline uint32_t Get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t Get64(const uint8_t *p)
+{
+	return (uint64_t)Get32(p) | ((uint64_t)Get32(p + 4) << 32);
+}
+
+static bool Append32(Buffer *b, uint32_t value)
+{
+	uint8_t p[4];
+	Put32(p, value);
+	return Append(b, p, 4);
+}
+
+static uint32_t HashString(const uint8_t *bytes, uint32_t length)
+{
+	// FNV-1a
+	uint32_t h = 2166136261U;
+	for (uint32_t i = 0; i < length; i++)
+		h = (h ^ bytes[i]) * 16777619U;
+	return h;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Writer
+// -----------------------------------------------------------------------------
+struct LoggerDocumentWriter
+{
+	FILE *file;
+	uint64_t offset;						// where the next bytes go in the file
+	bool failed;
+
+	Buffer chunk;							// messages of the chunk being filled
+	Buffer compressed;
+	uint32_t *hashTable;					// LZ4 compressor scratch table
+	LoggerDocumentChunk current;			// summary of the chunk being filled
+	LoggerDocumentChunk *chunks;
+	uint32_t chunksCount;
+	uint32_t chunksCapacity;
+	LoggerDocumentRun *runs;
+	uint32_t runsCount;
+	uint32_t runsCapacity;
+
+	// string table: strings are found with an open addressing hash table of their index + 1
+	Buffer stringBytes;
+	uint32_t *stringOffsets;
+	uint32_t *stringLengths;
+	uint32_t stringsCount;
+	uint32_t stringsCapacity;
+	uint32_t *stringSlots;
+	uint32_t stringSlotsCount;				// power of two, kept at least twice the number of strings
+};
+
+static void Write(LoggerDocumentWriter *writer, const void *bytes, size_t length)
+{
+	if (writer->failed || length == 0)
+		return;
+	if (fwrite(bytes, 1, length, writer->file) != length)
+		writer->failed = true;
+	writer->offset += length;
+}
+
+LoggerDocumentWriter *LoggerDocumentWriterCreate(FILE *file)
+{
+	LoggerDocumentWriter *writer = (LoggerDocumentWriter *)calloc(1, sizeof(LoggerDocumentWriter));
+	if (writer == NULL)
+		return NULL;
+	writer->file = file;
+	writer->hashTable = (uint32_t *)malloc(LOGGER_LZ4_HASH_SIZE * sizeof(uint32_t));
+	if (writer->hashTable == NULL)
+	{
+		free(writer);
+		return NULL;
+	}
+	uint8_t header[HEADER_SIZE];
+	memcpy(header, sMagic, 8);
+	Put32(header + 8, LOGGER_DOCUMENT_VERSION);
+	Write(writer, header, HEADER_SIZE);
+	return writer;
+}
+
+void LoggerDocumentWriterDispose(LoggerDocumentWriter *writer)
+{
+	if (writer == NULL)
+		return;
+	free(writer->chunk.bytes);
+	free(writer->compressed.bytes);
+	free(writer->hashTable);
+	free(writer->chunks);
+	free(writer->runs);
+	free(writer->stringBytes.bytes);
+	free(writer->stringOffsets);
+	free(writer->stringLengths);
+	free(writer->stringSlots);
+	free(writer);
+}
+
+static void FlushChunk(LoggerDocumentWriter *writer)
+{
+	LoggerDocumentChunk *chunk = &writer->current;
+	if (chunk->messagesCount == 0)
+		return;
+	if (writer->chunksCount == writer->chunksCapacity)
+	{
+		uint32_t capacity = writer->chunksCapacity ? writer->chunksCapacity * 2 : 256;
+		LoggerDocumentChunk *chunks = (LoggerDocumentChunk *)realloc(writer->chunks, capacity * sizeof(LoggerDocumentChunk));
+		if (chunks == NULL)
+		{
+			writer->failed = true;
+			return;
+		}
+		writer->chunks = chunks;
+		writer->chunksCapacity = capacity;
+	}
+
+	// chunks that LZ4 can't make smaller are stored as is
+	uint32_t size = (uint32_t)writer->chunk.length, compressedSize = 0;
+	writer->compressed.length = 0;
+	if (Reserve(&writer->compressed, size))
+		compressedSize = LoggerLZ4Compress(writer->chunk.bytes, size, writer->compressed.bytes, size, writer->hashTable);
+	chunk->offset = writer->offset;
+	chunk->size = size;
+	if (compressedSize == 0 || compressedSize >= size)
+	{
+		chunk->compressedSize = size;
+		Write(writer, writer->chunk.bytes, size);
+	}
+	else
+	{
+		chunk->compressedSize = compressedSize;
+		Write(writer, writer->compressed.bytes, compressedSize);
+	}
+	chunk->run = writer->runsCount - 1;
+	writer->runs[chunk->run].chunksCount++;
+	writer->chunks[writer->chunksCount++] = *chunk;
+	memset(chunk, 0, sizeof(LoggerDocumentChunk));
+	writer->chunk.length = 0;
+}
+
+bool LoggerDocumentWriterBeginRun(LoggerDocumentWriter *writer, const void *info, uint32_t length)
+{
+	FlushChunk(writer);
+	if (writer->runsCount == writer->runsCapacity)
+	{
+		uint32_t capacity = writer->runsCapacity ? writer->runsCapacity * 2 : 8;
+		LoggerDocumentRun *runs = (LoggerDocumentRun *)realloc(writer->runs, capacity * sizeof(LoggerDocumentRun));
+		if (runs == NULL)
+		{
+			writer->failed = true;
+			return false;
+		}
+		writer->runs = runs;
+		writer->runsCapacity = capacity;
+	}
+	LoggerDocumentRun *run = &writer->runs[writer->runsCount++];
+	run->infoOffset = writer->offset;
+	run->infoLength = length;
+	run->firstChunk = writer->chunksCount;
+	run->chunksCount = 0;
+	run->messagesCount = 0;
+	Write(writer, info, length);
+	return !writer->failed;
+}
+
+static bool GrowStringSlots(LoggerDocumentWriter *writer)
+{
+	uint32_t slotsCount = writer->stringSlotsCount ? writer->stringSlotsCount * 2 : 1024;
+	uint32_t *slots = (uint32_t *)calloc(slotsCount, sizeof(uint32_t));
+	if (slots == NULL)
+		return false;
+	for (uint32_t i = 0; i < writer->stringsCount; i++)
+	{
+		uint32_t h = HashString(writer->stringBytes.bytes + writer->stringOffsets[i], writer->stringLengths[i]);
+		while (slots[h & (slotsCount - 1)] != 0)
+			h++;
+		slots[h & (slotsCount - 1)] = i + 1;
+	}
+	free(writer->stringSlots);
+	writer->stringSlots = slots;
+	writer->stringSlotsCount = slotsCount;
+	return true;
+}
+
+uint32_t LoggerDocumentWriterInternString(LoggerDocumentWriter *writer, const uint8_t *bytes, uint32_t length)
+{
+	if (writer->stringsCount * 2 >= writer->stringSlotsCount && !GrowStringSlots(writer))
+		return LOGGER_DOCUMENT_NO_STRING;
+	uint32_t h = HashString(bytes, length), mask = writer->stringSlotsCount - 1;
+	for (uint32_t slot; (slot = writer->stringSlots[h & mask]) != 0; h++)
+	{
+		uint32_t i = slot - 1;
+		if (writer->stringLengths[i] == length && memcmp(writer->stringBytes.bytes + writer->stringOffsets[i], bytes, length) == 0)
+			return i;
+	}
+	if (writer->stringsCount == writer->stringsCapacity)
+	{
+		uint32_t capacity = writer->stringsCapacity ? writer->stringsCapacity * 2 : 1024;
+		uint32_t *offsets = (uint32_t *)realloc(writer->stringOffsets, capacity * sizeof(uint32_t));
+		if (offsets == NULL)
+			return LOGGER_DOCUMENT_NO_STRING;
+		writer->stringOffsets = offsets;
+		uint32_t *lengths = (uint32_t *)realloc(writer->stringLengths, capacity * sizeof(uint32_t));
+		if (lengths == NULL)
+			return LOGGER_DOCUMENT_NO_STRING;
+		writer->stringLengths = lengths;
+		writer->stringsCapacity = capacity;
+	}
+	if (writer->stringBytes.length + length > UINT32_MAX || !Append(&writer->stringBytes, bytes, length))
+		return LOGGER_DOCUMENT_NO_STRING;
+	uint32_t i = writer->stringsCount++;
+	writer->stringOffsets[i] = (uint32_t)(writer->stringBytes.length - length);
+	writer->stringLengths[i] = length;
+	writer->stringSlots[h & mask] = i + 1;
+	return i;
+}
+
+bool LoggerDocumentWriterAddMessage(LoggerDocumentWriter *writer, const uint8_t *message, uint32_t length, const LoggerDocumentMessageInfo *info)
+{
+	if (writer->runsCount == 0 && !LoggerDocumentWriterBeginRun(writer, NULL, 0))
+		return false;
+	if (length > MAX_CHUNK_SIZE - 4 || !Reserve(&writer->chunk, (size_t)length + 4))
+	{
+		writer->failed = true;
+		return false;
+	}
+
+	// a chunk is written when it reaches LOGGER_DOCUMENT_CHUNK_SIZE, a message never
+	// spans two chunks
+	if (writer->chunk.length + length + 4 > MAX_CHUNK_SIZE)
+		FlushChunk(writer);
+	uint8_t *p = writer->chunk.bytes + writer->chunk.length;
+	p[0] = (uint8_t)(length >> 24);
+	p[1] = (uint8_t)(length >> 16);
+	p[2] = (uint8_t)(length >> 8);
+	p[3] = (uint8_t)length;
+	memcpy(p + 4, message, length);
+	writer->chunk.length += (size_t)length + 4;
+
+	LoggerDocumentChunk *chunk = &writer->current;
+	if (chunk->messagesCount++ == 0)
+	{
+		chunk->minTimestamp = chunk->maxTimestamp = info->timestamp;
+		chunk->minSequence = chunk->maxSequence = info->sequence;
+	}
+	else
+	{
+		if (info->timestamp < chunk->minTimestamp)
+			chunk->minTimestamp = info->timestamp;
+		if (info->timestamp > chunk->maxTimestamp)
+			chunk->maxTimestamp = info->timestamp;
+		if (info->sequence < chunk->minSequence)
+			chunk->minSequence = info->sequence;
+		if (info->sequence > chunk->maxSequence)
+			chunk->maxSequence = info->sequence;
+	}
+	chunk->levels |= 1U << ((info->level < 0) ? 0 : (info->level > 31) ? 31 : info->level);
+	chunk->types |= 1U << ((info->type < 0) ? 0 : (info->type > 31) ? 31 : info->type);
+	if (info->tagStringID != LOGGER_DOCUMENT_NO_STRING)
+		chunk->tags |= 1ULL << (info->tagStringID & 63);
+	writer->runs[writer->runsCount - 1].messagesCount++;
+
+	if (writer->chunk.length >= LOGGER_DOCUMENT_CHUNK_SIZE)
+		FlushChunk(writer);
+	return !writer->failed;
+}
+
+bool LoggerDocumentWriterFinish(LoggerDocumentWriter *writer)
+{
+	FlushChunk(writer);
+	uint64_t indexOffset = writer->offset;
+	Buffer index = { NULL, 0, 0 };
+	bool ok = Append32(&index, writer->stringsCount);
+	for (uint32_t i = 0; ok && i < writer->stringsCount; i++)
+		ok = Append32(&index, writer->stringLengths[i]) && Append(&index, writer->stringBytes.bytes + writer->stringOffsets[i], writer->stringLengths[i]);
+	ok = ok && Append32(&index, writer->runsCount) && Reserve(&index, (size_t)writer->runsCount * RUN_RECORD_SIZE);
+	for (uint32_t i = 0; ok && i < writer->runsCount; i++)
+	{
+		const LoggerDocumentRun *run = &writer->runs[i];
+		uint8_t *p = index.bytes + index.length;
+		Put64(p, run->infoOffset);
+		Put32(p + 8, run->infoLength);
+		Put32(p + 12, run->firstChunk);
+		Put32(p + 16, run->chunksCount);
+		Put32(p + 20, run->messagesCount);
+		index.length += RUN_RECORD_SIZE;
+	}
+	ok = ok && Append32(&index, writer->chunksCount) && Reserve(&index, (size_t)writer->chunksCount * CHUNK_RECORD_SIZE);
+	for (uint32_t i = 0; ok && i < writer->chunksCount; i++)
+	{
+		const LoggerDocumentChunk *chunk = &writer->chunks[i];
+		uint8_t *p = index.bytes + index.length;
+		Put64(p, chunk->offset);
+		Put32(p + 8, chunk->compressedSize);
+		Put32(p + 12, chunk->size);
+		Put32(p + 16, chunk->run);
+		Put32(p + 20, chunk->messagesCount);
+		Put64(p + 24, (uint64_t)chunk->minTimestamp);
+		Put64(p + 32, (uint64_t)chunk->maxTimestamp);
+		Put32(p + 40, chunk->minSequence);
+		Put32(p + 44, chunk->maxSequence);
+		Put32(p + 48, chunk->levels);
+		Put32(p + 52, chunk->types);
+		Put64(p + 56, chunk->tags);
+		index.length += CHUNK_RECORD_SIZE;
+	}
+	if (!ok || index.length > UINT32_MAX)
+		writer->failed = true;
+	else
+	{
+		Write(writer, index.bytes, index.length);
+		uint8_t trailer[TRAILER_SIZE];
+		Put64(trailer, indexOffset);
+		Put32(trailer + 8, (uint32_t)index.length);
+		Put32(trailer + 12, LOGGER_DOCUMENT_VERSION);
+		memcpy(trailer + 16, sMagic, 8);
+		Write(writer, trailer, TRAILER_SIZE);
+	}
+	free(index.bytes);
+	if (fflush(writer->file) != 0)
+		writer->failed = true;
+	return !writer->failed;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Reader
+// -----------------------------------------------------------------------------
+struct LoggerDocumentReader
+{
+	const uint8_t *bytes;
+	size_t length;
+	LoggerDocumentRun *runs;
+	uint32_t runsCount;
+	LoggerDocumentChunk *chunks;
+	uint32_t chunksCount;
+	const uint8_t **strings;
+	uint32_t *stringLengths;
+	uint32_t stringsCount;
+};
+
+bool LoggerDocumentIsDocument(const uint8_t *bytes, size_t length)
+{
+	return length >= HEADER_SIZE && memcmp(bytes, sMagic, 8) == 0;
+}
+
+LoggerDocumentReader *LoggerDocumentReaderOpen(const uint8_t *bytes, size_t length)
+{
+	if (!LoggerDocumentIsDocument(bytes, length) || length < HEADER_SIZE + TRAILER_SIZE)
+		return NULL;
+	const uint8_t *trailer = bytes + length - TRAILER_SIZE;
+	uint64_t indexOffset = Get64(trailer);
+	uint32_t indexLength = Get32(trailer + 8);
+	if (memcmp(trailer + 16, sMagic, 8) != 0 || Get32(bytes + 8) != LOGGER_DOCUMENT_VERSION ||
+		Get32(trailer + 12) != LOGGER_DOCUMENT_VERSION || indexOffset < HEADER_SIZE ||
+		indexOffset + indexLength != length - TRAILER_SIZE)
+		return NULL;
+
+	LoggerDocumentReader *reader = (LoggerDocumentReader *)calloc(1, sizeof(LoggerDocumentReader));
+	if (reader == NULL)
+		return NULL;
+	reader->bytes = bytes;
+	reader->length = length;
+
+	// every count is checked against the bytes left in the index before anything is allocated
+	const uint8_t *p = bytes + indexOffset, *end = p + indexLength;
+	if (end - p < 4)
+		goto invalid;
+	uint32_t count = Get32(p);
+	p += 4;
+	if ((size_t)(end - p) / 4 < count)
+		goto invalid;
+	reader->strings = (const uint8_t **)malloc((count ? count : 1) * sizeof(const uint8_t *));
+	reader->stringLengths = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+	if (reader->strings == NULL || reader->stringLengths == NULL)
+		goto invalid;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (end - p < 4)
+			goto invalid;
+		uint32_t stringLength = Get32(p);
+		p += 4;
+		if ((size_t)(end - p) < stringLength)
+			goto invalid;
+		reader->strings[i] = p;
+		reader->stringLengths[i] = stringLength;
+		p += stringLength;
+	}
+	reader->stringsCount = count;
+
+	if (end - p < 4)
+		goto invalid;
+	count = Get32(p);
+	p += 4;
+	if ((size_t)(end - p) / RUN_RECORD_SIZE < count)
+		goto invalid;
+	reader->runs = (LoggerDocumentRun *)malloc((count ? count : 1) * sizeof(LoggerDocumentRun));
+	if (reader->runs == NULL)
+		goto invalid;
+	for (uint32_t i = 0; i < count; i++, p += RUN_RECORD_SIZE)
+	{
+		LoggerDocumentRun *run = &reader->runs[i];
+		run->infoOffset = Get64(p);
+		run->infoLength = Get32(p + 8);
+		run->firstChunk = Get32(p + 12);
+		run->chunksCount = Get32(p + 16);
+		run->messagesCount = Get32(p + 20);
+		if (run->infoOffset < HEADER_SIZE || run->infoOffset > indexOffset || indexOffset - run->infoOffset < run->infoLength)
+			goto invalid;
+	}
+	reader->runsCount = count;
+
+	if (end - p < 4)
+		goto invalid;
+	count = Get32(p);
+	p += 4;
+	if ((size_t)(end - p) / CHUNK_RECORD_SIZE < count)
+		goto invalid;
+	reader->chunks = (LoggerDocumentChunk *)malloc((count ? count : 1) * sizeof(LoggerDocumentChunk));
+	if (reader->chunks == NULL)
+		goto invalid;
+	for (uint32_t i = 0; i < count; i++, p += CHUNK_RECORD_SIZE)
+	{
+		LoggerDocumentChunk *chunk = &reader->chunks[i];
+		chunk->offset = Get64(p);
+		chunk->compressedSize = Get32(p + 8);
+		chunk->size = Get32(p + 12);
+		chunk->run = Get32(p + 16);
+		chunk->messagesCount = Get32(p + 20);
+		chunk->minTimestamp = (int64_t)Get64(p + 24);
+		chunk->maxTimestamp = (int64_t)Get64(p + 32);
+		chunk->minSequence = Get32(p + 40);
+		chunk->maxSequence = Get32(p + 44);
+		chunk->levels = Get32(p + 48);
+		chunk->types = Get32(p + 52);
+		chunk->tags = Get64(p + 56);
+		if (chunk->offset < HEADER_SIZE || chunk->offset > indexOffset || indexOffset - chunk->offset < chunk->compressedSize ||
+			chunk->compressedSize > chunk->size || chunk->size > MAX_CHUNK_SIZE || chunk->run >= reader->runsCount)
+			goto invalid;
+	}
+	reader->chunksCount = count;
+
+	for (uint32_t i = 0; i < reader->runsCount; i++)
+	{
+		const LoggerDocumentRun *run = &reader->runs[i];
+		if (run->firstChunk > reader->chunksCount || reader->chunksCount - run->firstChunk < run->chunksCount)
+			goto invalid;
+	}
+	return reader;
+
+invalid:
+	LoggerDocumentReaderDispose(reader);
+	return NULL;
+}
+
+void LoggerDocumentReaderDispose(LoggerDocumentReader *reader)
+{
+	if (reader == NULL)
+		return;
+	free(reader->runs);
+	free(reader->chunks);
+	free(reader->strings);
+	free(reader->stringLengths);
+	free(reader);
+}
+
+uint32_t LoggerDocumentReaderRunsCount(const LoggerDocumentReader *reader)
+{
+	return reader->runsCount;
+}
+
+const LoggerDocumentRun *LoggerDocumentReaderGetRun(const LoggerDocumentReader *reader, uint32_t run)
+{
+	return (run < reader->runsCount) ? &reader->runs[run] : NULL;
+}
+
+const uint8_t *LoggerDocumentReaderGetRunInfo(const LoggerDocumentReader *reader, uint32_t run, uint32_t *outLength)
+{
+	if (run >= reader->runsCount)
+	{
+		*outLength = 0;
+		return NULL;
+	}
+	*outLength = reader->runs[run].infoLength;
+	return reader->bytes + reader->runs[run].infoOffset;
+}
+
+uint32_t LoggerDocumentReaderChunksCount(const LoggerDocumentReader *reader)
+{
+	return reader->chunksCount;
+}
+
+const LoggerDocumentChunk *LoggerDocumentReaderGetChunk(const LoggerDocumentReader *reader, uint32_t chunk)
+{
+	return (chunk < reader->chunksCount) ? &reader->chunks[chunk] : NULL;
+}
+
+uint32_t LoggerDocumentReaderStringsCount(const LoggerDocumentReader *reader)
+{
+	return reader->stringsCount;
+}
+
+const uint8_t *LoggerDocumentReaderGetString(const LoggerDocumentReader *reader, uint32_t stringID, uint32_t *outLength)
+{
+	if (stringID >= reader->stringsCount)
+	{
+		*outLength = 0;
+		return NULL;
+	}
+	*outLength = reader->stringLengths[stringID];
+	return reader->strings[stringID];
+}
+
+uint8_t *LoggerDocumentReaderCopyChunk(const LoggerDocumentReader *reader, uint32_t chunk, uint32_t *outSize)
+{
+	*outSize = 0;
+	if (chunk >= reader->chunksCount)
+		return NULL;
+	const LoggerDocumentChunk *c = &reader->chunks[chunk];
+	uint8_t *bytes = (uint8_t *)malloc(c->size ? c->size : 1);
+	if (bytes == NULL)
+		return NULL;
+	const uint8_t *src = reader->bytes + c->offset;
+	if (c->compressedSize == c->size)
+		memcpy(bytes, src, c->size);
+	else if (LoggerLZ4Decompress(src, c->compressedSize, bytes, c->size) != (int32_t)c->size)
+	{
+		free(bytes);
+		return NULL;
+	}
+	*outSize = c->size;
+	return bytes;
+}
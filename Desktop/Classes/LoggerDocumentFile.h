@@ -0,0 +1,149 @@
+/*
+ * LoggerDocumentFile.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_DOCUMENT_FILE_H
+#define LOGGER_DOCUMENT_FILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* File format of saved documents (.nsloggerdata, see LoggerDocument).
+ *
+ * Messages are saved in the NSLogger v1 wire format, each preceded by its size as a 32 bits big endian
+ * value like in .rawnsloggerdata files. File, function, tag and thread names are written once in a
+ * string table, and messages refer to them with PART_TYPE_STRING_REF parts whose 4 bytes payload is the
+ * index of the string in the table. Consecutive messages are grouped in chunks of about
+ * LOGGER_DOCUMENT_CHUNK_SIZE bytes, each compressed as a single LZ4 block (see LoggerCompression.h),
+ * so that a chunk can be read without reading the ones before it.
+ *
+ *	header		"NSLogger" then the format version (uint32)
+ *	chunks		LZ4 blocks, stored as is when they don't compress
+ *	run infos	one opaque block per run, the messages a connection received
+ *	index		the string table, the runs and the chunks (see LoggerDocumentRun and LoggerDocumentChunk)
+ *	trailer		offset of the index (uint64), its size and the format version (uint32), then "NSLogger"
+ *
+ * The trailer is written last: a file that doesn't end with it is incomplete. Numbers in the header,
+ * index and trailer are little endian.
+ *
+ * Version 1 was only written by development builds, with chunk records of different layouts (with
+ * or without the summary, without the types bitmap). These documents are not read.
+ */
+
+#define LOGGER_DOCUMENT_VERSION		2
+#define LOGGER_DOCUMENT_CHUNK_SIZE	(256 * 1024)
+
+typedef struct
+{
+	uint64_t infoOffset;				// opaque block passed to LoggerDocumentWriterBeginRun
+	uint32_t infoLength;
+	uint32_t firstChunk;
+	uint32_t chunksCount;
+	uint32_t messagesCount;
+} LoggerDocumentRun;
+
+typedef struct
+{
+	uint64_t offset;					// location of the LZ4 block in the file
+	uint32_t compressedSize;			// equal to size if the chunk is not compressed
+	uint32_t size;						// size of the chunk's messages, including their size words
+	uint32_t run;
+	uint32_t messagesCount;
+
+	// summary of the messages, to skip the chunks that can't match a time range or filter
+	int64_t minTimestamp;				// microseconds since 01.01.1970
+	int64_t maxTimestamp;
+	uint32_t minSequence;
+	uint32_t maxSequence;
+	uint32_t levels;					// bit n is set if a message has level n (levels above 31 set bit 31)
+	uint32_t types;						// bit n is set if a message has type n (LOGMSG_TYPE_*, above 31 set bit 31)
+	uint64_t tags;						// bit (n % 64) is set if a message has the tag with string ID n
+} LoggerDocumentChunk;
+
+// What the index records about each message
+typedef struct
+{
+	int64_t timestamp;					// microseconds since 01.01.1970
+	uint32_t sequence;
+	int32_t level;
+	int32_t type;
+	uint32_t tagStringID;				// LOGGER_DOCUMENT_NO_STRING if the message has no tag
+} LoggerDocumentMessageInfo;
+
+#define LOGGER_DOCUMENT_NO_STRING	UINT32_MAX
+
+// -----------------------------------------------------------------------------
+// Writer: messages are added run after run, in the order they are displayed
+// -----------------------------------------------------------------------------
+typedef struct LoggerDocumentWriter LoggerDocumentWriter;
+
+LoggerDocumentWriter *LoggerDocumentWriterCreate(FILE *file);
+void LoggerDocumentWriterDispose(LoggerDocumentWriter *writer);
+
+// Start a new run. `info' is saved as is and can be read back with LoggerDocumentReaderGetRunInfo
+bool LoggerDocumentWriterBeginRun(LoggerDocumentWriter *writer, const void *info, uint32_t length);
+
+// Index of the string in the string table, added if needed. Returns LOGGER_DOCUMENT_NO_STRING if out of memory
+uint32_t LoggerDocumentWriterInternString(LoggerDocumentWriter *writer, const uint8_t *bytes, uint32_t length);
+
+// Add a message in the v1 wire format (without its size word)
+bool LoggerDocumentWriterAddMessage(LoggerDocumentWriter *writer, const uint8_t *message, uint32_t length, const LoggerDocumentMessageInfo *info);
+
+// Write the last chunk, the index and the trailer. Returns false if any write failed
+bool LoggerDocumentWriterFinish(LoggerDocumentWriter *writer);
+
+// -----------------------------------------------------------------------------
+// Reader: works on the bytes of the file, usually mapped in memory. Chunks are only
+// decompressed when asked for, LoggerDocumentReaderCopyChunk can be called from any thread
+// -----------------------------------------------------------------------------
+typedef struct LoggerDocumentReader LoggerDocumentReader;
+
+// Whether the bytes start with the header of this format (older documents are keyed archives)
+bool LoggerDocumentIsDocument(const uint8_t *bytes, size_t length);
+
+// Returns NULL if the file is incomplete or invalid. The bytes must stay valid until the reader is disposed
+LoggerDocumentReader *LoggerDocumentReaderOpen(const uint8_t *bytes, size_t length);
+void LoggerDocumentReaderDispose(LoggerDocumentReader *reader);
+
+uint32_t LoggerDocumentReaderRunsCount(const LoggerDocumentReader *reader);
+const LoggerDocumentRun *LoggerDocumentReaderGetRun(const LoggerDocumentReader *reader, uint32_t run);
+const uint8_t *LoggerDocumentReaderGetRunInfo(const LoggerDocumentReader *reader, uint32_t run, uint32_t *outLength);
+
+uint32_t LoggerDocumentReaderChunksCount(const LoggerDocumentReader *reader);
+const LoggerDocumentChunk *LoggerDocumentReaderGetChunk(const LoggerDocumentReader *reader, uint32_t chunk);
+
+uint32_t LoggerDocumentReaderStringsCount(const LoggerDocumentReader *reader);
+const uint8_t *LoggerDocumentReaderGetString(const LoggerDocumentReader *reader, uint32_t stringID, uint32_t *outLength);
+
+// The messages of a chunk, each preceded by its size word, in a buffer to free() or NULL if the chunk is invalid
+uint8_t *LoggerDocumentReaderCopyChunk(const LoggerDocumentReader *reader, uint32_t chunk, uint32_t *outSize);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * LoggerImageCache.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#import <Cocoa/Cocoa.h>
+
+@class LoggerMessage;
+
+// Posted on the main thread when the thumbnail of an image message (the object) was decoded
+extern NSString *const kImageThumbnailReadyNotification;
+
+// -----------------------------------------------------------------------------
+// LoggerImageCache: thumbnails of image messages, at the size the log table
+// displays them, shared by all connections.
+//
+// Thumbnails are decoded with ImageIO on a background queue, the full size
+// image is never kept. Requests are served most recent first, so that the rows
+// currently drawn come before the ones scrolled past, and only the last ones
+// are kept. Decoded thumbnails are kept within a memory budget, the least
+// recently drawn going first.
+// -----------------------------------------------------------------------------
+@interface LoggerImageCache : NSObject
+
++ (LoggerImageCache *)sharedCache;
+
+// The thumbnail of the image fitting in `size' points on a display with `scale'
+// pixels per point. If it was not decoded yet, or only smaller, it is requested:
+// returns the smaller one if any, nil otherwise
+- (NSImage *)thumbnailForMessage:(LoggerMessage *)message fittingSize:(NSSize)size scale:(CGFloat)scale;
+
+@end
@@ -0,0 +1,270 @@
+/*
+ * LoggerImageCache.m
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#import "LoggerImageCache.h"
+#import "LoggerMessage.h"
+
+#define THUMBNAILS_BUDGET		(256 * 1024 * 1024)		// bytes of decoded thumbnails
+#define MAX_PENDING_REQUESTS	64						// older requests are dropped, drawing the row again requests it again
+
+NSString *const kImageThumbnailReadyNotification = @"ImageThumbnailReadyNotification";
+
+@interface LoggerImageCacheEntry : NSObject
+{
+@public
+	NSValue *_key;								// address of the message
+	__weak LoggerMessage *_message;
+	NSImage *_thumbnail;
+	NSUInteger _maxPixelSize;					// largest dimension requested, in pixels
+	NSUInteger _cost;							// bytes of the decoded thumbnail
+	BOOL _fullSize;								// the thumbnail is as large as the image
+	__unsafe_unretained LoggerImageCacheEntry *_previous;	// more recently used entry
+	__unsafe_unretained LoggerImageCacheEntry *_next;		// less recently used entry
+}
+@end
+
+@implementation LoggerImageCacheEntry
+@end
+
+@implementation LoggerImageCache
+{
+	dispatch_queue_t _decodingQueue;
+	NSMutableDictionary *_entries;				// entry of each message, by message address
+	LoggerImageCacheEntry *_mostRecent;
+	LoggerImageCacheEntry *_leastRecent;
+	NSUInteger _cost;
+	NSMutableArray *_requests;					// entries waiting for a thumbnail, most recent last
+	BOOL _decoding;
+}
+
++ (LoggerImageCache *)sharedCache
+{
+	static LoggerImageCache *sCache = nil;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		sCache = [[LoggerImageCache alloc] init];
+	});
+	return sCache;
+}
+
+- (id)init
+{
+	if ((self = [super init]) != nil)
+	{
+		_decodingQueue = dispatch_queue_create("com.florentpillet.nslogger.imageDecoding", NULL);
+		_entries = [[NSMutableDictionary alloc] init];
+		_requests = [[NSMutableArray alloc] init];
+	}
+	return self;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Least recently used list (called with the cache locked)
+// -----------------------------------------------------------------------------
+- (void)unlinkEntry:(LoggerImageCacheEntry *)entry
+{
+	if (entry->_previous != nil)
+		entry->_previous->_next = entry->_next;
+	else if (_mostRecent == entry)
+		_mostRecent = entry->_next;
+	if (entry->_next != nil)
+		entry->_next->_previous = entry->_previous;
+	else if (_leastRecent == entry)
+		_leastRecent = entry->_previous;
+	entry->_previous = entry->_next = nil;
+}
+
+- (void)useEntry:(LoggerImageCacheEntry *)entry
+{
+	if (_mostRecent == entry)
+		return;
+	[self unlinkEntry:entry];
+	entry->_next = _mostRecent;
+	if (_mostRecent != nil)
+		_mostRecent->_previous = entry;
+	_mostRecent = entry;
+	if (_leastRecent == nil)
+		_leastRecent = entry;
+}
+
+- (void)removeEntry:(LoggerImageCacheEntry *)entry
+{
+	[self unlinkEntry:entry];
+	_cost -= entry->_cost;
+	entry->_cost = 0;
+	entry->_thumbnail = nil;
+	[_requests removeObjectIdenticalTo:entry];
+	[_entries removeObjectForKey:entry->_key];
+}
+
+- (void)evictEntries
+{
+	// entries of messages that were deallocated go first, whether they have a thumbnail or not
+	for (LoggerImageCacheEntry *entry = _leastRecent, *previous; entry != nil; entry = previous)
+	{
+		previous = entry->_previous;
+		if (entry->_message == nil)
+			[self removeEntry:entry];
+	}
+
+	// keep the entry just used even if it alone is over the budget
+	while (_cost > THUMBNAILS_BUDGET && _leastRecent != nil && _leastRecent != _mostRecent)
+		[self removeEntry:_leastRecent];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Thumbnails
+// -----------------------------------------------------------------------------
+- (NSImage *)thumbnailForMessage:(LoggerMessage *)message fittingSize:(NSSize)size scale:(CGFloat)scale
+{
+	NSUInteger maxPixelSize = (NSUInteger)ceil(fmax(size.width, size.height) * fmax(scale, 1.0));
+	if (message == nil || maxPixelSize == 0)
+		return nil;
+	BOOL startDecoding = NO;
+	NSImage *thumbnail = nil;
+	@synchronized (self)
+	{
+		NSValue *key = [NSValue valueWithPointer:(__bridge const void *)message];
+		LoggerImageCacheEntry *entry = _entries[key];
+		if (entry != nil && entry->_message != message)
+		{
+			// a message that was deallocated had the same address
+			[self removeEntry:entry];
+			entry = nil;
+		}
+		if (entry == nil)
+		{
+			entry = [[LoggerImageCacheEntry alloc] init];
+			entry->_key = key;
+			entry->_message = message;
+			_entries[key] = entry;
+		}
+		[self useEntry:entry];
+		thumbnail = entry->_thumbnail;
+		if (thumbnail == nil || (!entry->_fullSize && entry->_maxPixelSize < maxPixelSize))
+		{
+			entry->_maxPixelSize = MAX(entry->_maxPixelSize, maxPixelSize);
+			[_requests removeObjectIdenticalTo:entry];
+			[_requests addObject:entry];
+			if ([_requests count] > MAX_PENDING_REQUESTS)
+			{
+				LoggerImageCacheEntry *dropped = _requests[0];
+				[_requests removeObjectAtIndex:0];
+				if (dropped->_thumbnail == nil)
+					[self removeEntry:dropped];
+			}
+			startDecoding = !_decoding;
+			_decoding = YES;
+		}
+	}
+	if (startDecoding)
+		dispatch_async(_decodingQueue, ^{ [self decodeRequests]; });
+	return thumbnail;
+}
+
+static NSImage *DecodeThumbnail(NSData *data, NSUInteger maxPixelSize, BOOL *outFullSize)
+{
+	CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL);
+	if (source == NULL)
+		return nil;
+	NSDictionary *options = @{
+		(__bridge NSString *)kCGImageSourceCreateThumbnailFromImageAlways: @YES,
+		(__bridge NSString *)kCGImageSourceShouldCacheImmediately: @YES,
+		(__bridge NSString *)kCGImageSourceThumbnailMaxPixelSize: @(maxPixelSize)
+	};
+	CGImageRef cgImage = CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+	NSImage *image = nil;
+	if (cgImage != NULL)
+	{
+		// the thumbnail is never larger than the image: if it is smaller than requested, it is the image
+		size_t width = CGImageGetWidth(cgImage), height = CGImageGetHeight(cgImage);
+		*outFullSize = (MAX(width, height) < maxPixelSize);
+		image = [[NSImage alloc] initWithCGImage:cgImage size:NSMakeSize(width, height)];
+		CGImageRelease(cgImage);
+	}
+	CFRelease(source);
+	return image;
+}
+
+- (void)decodeRequests
+{
+	for (;;)
+	{
+		LoggerImageCacheEntry *entry;
+		LoggerMessage *message;
+		NSUInteger maxPixelSize;
+		@synchronized (self)
+		{
+			entry = [_requests lastObject];
+			if (entry == nil)
+			{
+				_decoding = NO;
+				return;
+			}
+			[_requests removeLastObject];
+			message = entry->_message;
+			maxPixelSize = entry->_maxPixelSize;
+
+			// the message was deallocated before its thumbnail was decoded
+			if (message == nil && _entries[entry->_key] == entry)
+				[self removeEntry:entry];
+		}
+		if (message == nil)
+			continue;
+
+		BOOL fullSize = NO;
+		NSImage *thumbnail = nil;
+		@autoreleasepool
+		{
+			thumbnail = DecodeThumbnail(message.message, maxPixelSize, &fullSize);
+		}
+
+		@synchronized (self)
+		{
+			// the entry may have been evicted or requested larger while decoding
+			if (thumbnail == nil || _entries[entry->_key] != entry)
+				continue;
+			NSSize pixels = thumbnail.size;
+			_cost -= entry->_cost;
+			entry->_cost = (NSUInteger)(pixels.width * pixels.height * 4);
+			entry->_thumbnail = thumbnail;
+			entry->_fullSize = fullSize;
+			_cost += entry->_cost;
+			[self evictEntries];
+		}
+		dispatch_async(dispatch_get_main_queue(), ^{
+			[[NSNotificationCenter defaultCenter] postNotificationName:kImageThumbnailReadyNotification object:message];
+		});
+	}
+}
+
+@end
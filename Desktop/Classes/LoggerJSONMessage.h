@@ -32,7 +32,7 @@
 
 @class LoggerConnection;
 
-@interface LoggerJSONMessage : LoggerMessage
+@interface LoggerJSONMessage : LoggerObjectMessage
 {
 }
 
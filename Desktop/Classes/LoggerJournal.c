@@ -0,0 +1,299 @@
+/*
+ * LoggerJournal.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include "LoggerJournal.h"
+#include "LoggerCommon.h"
+
+#define MAX_PENDING_SIZE	(1024 * 1024)		// buffered messages are written when they reach this size
+
+struct LoggerJournal
+{
+	pthread_mutex_t mutex;
+	char *path;
+	int fd;
+	bool failed;
+	uint64_t writtenLength;						// bytes in the file
+	uint8_t *pending;							// messages not written yet
+	size_t pendingLength;
+	size_t pendingCapacity;
+};
+
+static bool Reserve(LoggerJournal *journal, size_t size)
+{
+	if (journal->pendingLength + size <= journal->pendingCapacity)
+		return true;
+	size_t capacity = (journal->pendingCapacity ? journal->pendingCapacity * 2 : 65536) + size;
+	uint8_t *bytes = (uint8_t *)realloc(journal->pending, capacity);
+	if (bytes == NULL)
+		return false;
+	journal->pending = bytes;
+	journal->pendingCapacity = capacity;
+	return true;
+}
+
+static inline void Put32(uint8_t *p, uint32_t value)
+{
+	p[0] = (uint8_t)(value >> 24);
+	p[1] = (uint8_t)(value >> 16);
+	p[2] = (uint8_t)(value >> 8);
+	p[3] = (uint8_t)value;
+}
+
+static inline uint32_t Get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+LoggerJournal *LoggerJournalCreate(const char *path)
+{
+	LoggerJournal *journal = (LoggerJournal *)calloc(1, sizeof(LoggerJournal));
+	if (journal == NULL)
+		return NULL;
+	journal->path = strdup(path);
+	journal->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+	if (journal->path == NULL || journal->fd < 0 || flock(journal->fd, LOCK_EX | LOCK_NB) != 0)
+	{
+		if (journal->fd >= 0)
+		{
+			close(journal->fd);
+			unlink(path);
+		}
+		free(journal->path);
+		free(journal);
+		return NULL;
+	}
+	pthread_mutex_init(&journal->mutex, NULL);
+	return journal;
+}
+
+void LoggerJournalDispose(LoggerJournal *journal, bool removeFile)
+{
+	if (journal == NULL)
+		return;
+	if (removeFile)
+		unlink(journal->path);
+	else
+		LoggerJournalFlush(journal);
+	close(journal->fd);
+	pthread_mutex_destroy(&journal->mutex);
+	free(journal->pending);
+	free(journal->path);
+	free(journal);
+}
+
+bool LoggerJournalIsInUse(const char *path)
+{
+	// the lock is released when the process that holds it exits, even if it is killed
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	bool inUse = (flock(fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK);
+	close(fd);
+	return inUse;
+}
+
+static bool AppendMessage(LoggerJournal *journal, const uint8_t *message, uint32_t length,
+						  LoggerJournalStringResolver resolve, void *info)
+{
+	// must be called with the mutex held. Parts are copied as they are, except string references
+	size_t start = journal->pendingLength;
+	if (!Reserve(journal, (size_t)length + 4))
+		return false;
+	journal->pendingLength += 4;
+	if (resolve == NULL || length < 2)
+	{
+		memcpy(journal->pending + journal->pendingLength, message, length);
+		journal->pendingLength += length;
+	}
+	else
+	{
+		const uint8_t *p = message + 2;
+		const uint8_t *end = message + length;
+		uint16_t partCount = (uint16_t)((message[0] << 8) | message[1]), written = 0;
+		size_t countOffset = journal->pendingLength;
+		journal->pendingLength += 2;
+		while (partCount--)
+		{
+			if (end - p < 2)
+				break;
+			const uint8_t *part = p;
+			uint8_t partType = p[1];
+			p += 2;
+			uint32_t partSize;
+			if (partType == PART_TYPE_INT16)
+				partSize = 2;
+			else if (partType == PART_TYPE_INT32)
+				partSize = 4;
+			else if (partType == PART_TYPE_INT64)
+				partSize = 8;
+			else
+			{
+				if (end - p < 4)
+					break;
+				partSize = Get32(p);
+				p += 4;
+			}
+			if ((size_t)(end - p) < partSize)
+				break;
+			if (partType == PART_TYPE_STRING_REF && partSize == 4)
+			{
+				uint32_t stringLength = 0;
+				const uint8_t *string = resolve(info, Get32(p), &stringLength);
+				if (string == NULL)
+					stringLength = 0;
+				if (!Reserve(journal, (size_t)stringLength + 6))
+				{
+					journal->pendingLength = start;
+					return false;
+				}
+				uint8_t *q = journal->pending + journal->pendingLength;
+				q[0] = part[0];
+				q[1] = PART_TYPE_STRING;
+				Put32(q + 2, stringLength);
+				if (stringLength)
+					memcpy(q + 6, string, stringLength);
+				journal->pendingLength += (size_t)stringLength + 6;
+			}
+			else
+			{
+				size_t partLength = (size_t)(p - part) + partSize;
+				if (!Reserve(journal, partLength))
+				{
+					journal->pendingLength = start;
+					return false;
+				}
+				memcpy(journal->pending + journal->pendingLength, part, partLength);
+				journal->pendingLength += partLength;
+			}
+			p += partSize;
+			written++;
+		}
+		journal->pending[countOffset] = (uint8_t)(written >> 8);
+		journal->pending[countOffset + 1] = (uint8_t)written;
+	}
+	size_t size = journal->pendingLength - start - 4;
+	if (size > LOGGER_FRAME_SIZE_MASK)
+	{
+		journal->pendingLength = start;
+		return false;
+	}
+	Put32(journal->pending + start, (uint32_t)size);
+	return true;
+}
+
+static bool Flush(LoggerJournal *journal)
+{
+	// must be called with the mutex held
+	size_t offset = 0;
+	while (!journal->failed && offset < journal->pendingLength)
+	{
+		ssize_t n = write(journal->fd, journal->pending + offset, journal->pendingLength - offset);
+		if (n > 0)
+		{
+			offset += (size_t)n;
+			journal->writtenLength += (uint64_t)n;
+		}
+		else if (n == 0 || errno != EINTR)
+			journal->failed = true;
+	}
+	journal->pendingLength = 0;
+	return !journal->failed;
+}
+
+bool LoggerJournalAppendMessage(LoggerJournal *journal, const uint8_t *message, uint32_t length,
+								LoggerJournalStringResolver resolve, void *info)
+{
+	pthread_mutex_lock(&journal->mutex);
+	bool result = !journal->failed;
+	if (result && !AppendMessage(journal, message, length, resolve, info))
+	{
+		// out of memory: the messages that follow could not be found from their offset
+		journal->failed = true;
+		journal->pendingLength = 0;
+		result = false;
+	}
+	if (result && journal->pendingLength >= MAX_PENDING_SIZE)
+		result = Flush(journal);
+	pthread_mutex_unlock(&journal->mutex);
+	return result;
+}
+
+bool LoggerJournalFlush(LoggerJournal *journal)
+{
+	pthread_mutex_lock(&journal->mutex);
+	bool result = Flush(journal);
+	pthread_mutex_unlock(&journal->mutex);
+	return result;
+}
+
+uint64_t LoggerJournalLength(LoggerJournal *journal)
+{
+	pthread_mutex_lock(&journal->mutex);
+	uint64_t length = journal->writtenLength + journal->pendingLength;
+	pthread_mutex_unlock(&journal->mutex);
+	return length;
+}
+
+uint64_t LoggerJournalWrittenLength(LoggerJournal *journal)
+{
+	pthread_mutex_lock(&journal->mutex);
+	uint64_t length = journal->writtenLength;
+	pthread_mutex_unlock(&journal->mutex);
+	return length;
+}
+
+uint8_t *LoggerJournalCopyRange(LoggerJournal *journal, uint64_t offset, size_t length)
+{
+	// pread doesn't move the file offset, writes are appended regardless (O_APPEND)
+	pthread_mutex_lock(&journal->mutex);
+	bool written = (offset <= journal->writtenLength && length <= journal->writtenLength - offset);
+	pthread_mutex_unlock(&journal->mutex);
+	uint8_t *bytes = written ? (uint8_t *)malloc(length ? length : 1) : NULL;
+	size_t done = 0;
+	while (bytes != NULL && done < length)
+	{
+		ssize_t n = pread(journal->fd, bytes + done, length - done, (off_t)(offset + done));
+		if (n > 0)
+			done += (size_t)n;
+		else if (n == 0 || errno != EINTR)
+		{
+			free(bytes);
+			bytes = NULL;
+		}
+	}
+	return bytes;
+}
@@ -0,0 +1,84 @@
+/*
+ * LoggerJournal.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_JOURNAL_H
+#define LOGGER_JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Append-only file the messages of a live connection are written to as they are received, so that
+ * they are not lost if the viewer is killed, and so that the connection only needs to keep the most
+ * recent ones in memory (see LoggerConnection).
+ *
+ * The journal is a .rawnsloggerdata file: messages in the NSLogger v1 wire format, each preceded by
+ * its size as a 32 bits big endian value. PART_TYPE_STRING_REF parts are replaced with the strings
+ * they refer to, so that the file can be opened like any raw data file.
+ *
+ * Messages are buffered until LoggerJournalFlush() writes them with a single write(2). Once written,
+ * they survive the viewer being killed (but not the system crashing, the file is not synced). The file
+ * is locked while the journal is open, which tells journals of live sessions from the ones left
+ * behind by a viewer that didn't quit normally.
+ *
+ * The journal can be appended to and read from different threads.
+ */
+
+typedef struct LoggerJournal LoggerJournal;
+
+// Returns the UTF-8 bytes of a string the client defined, or NULL if there is no such string
+typedef const uint8_t *(*LoggerJournalStringResolver)(void *info, uint32_t stringID, uint32_t *outLength);
+
+// Creates the file, which must not exist. Returns NULL if it can't be created
+LoggerJournal *LoggerJournalCreate(const char *path);
+void LoggerJournalDispose(LoggerJournal *journal, bool removeFile);
+
+// Whether the journal at this path is open, in this process or another one
+bool LoggerJournalIsInUse(const char *path);
+
+// Append a message (without its size word). `resolve' may be NULL if the message has no string
+// references. Returns false if the journal failed, the message is then dropped
+bool LoggerJournalAppendMessage(LoggerJournal *journal, const uint8_t *message, uint32_t length,
+								LoggerJournalStringResolver resolve, void *info);
+
+// Write the messages appended since the last flush. Returns false if the journal failed: it then
+// stops writing, and only the messages written before the failure can be read
+bool LoggerJournalFlush(LoggerJournal *journal);
+
+// Size of the journal including the messages not flushed yet, i.e. the offset of the next message
+uint64_t LoggerJournalLength(LoggerJournal *journal);
+
+// Size of the part of the file that was successfully written
+uint64_t LoggerJournalWrittenLength(LoggerJournal *journal);
+
+// Copy of `length' bytes written at `offset'. Returns NULL if they can't be read
+uint8_t *LoggerJournalCopyRange(LoggerJournal *journal, uint64_t offset, size_t length);
+
+#endif
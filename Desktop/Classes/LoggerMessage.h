@@ -33,32 +33,57 @@
 
 @class LoggerConnection;
 
+// Messages either read their values from the message store of their connection (LoggerNativeMessage),
+// or keep them in the object: [LoggerMessage alloc] returns such a message (marks, messages the viewer
+// adds, messages read from archives). LoggerMessage itself only holds the tag and what is cached to
+// display the message
 @interface LoggerMessage : NSObject <NSCoding, NSCopying>
 
 @property (nonatomic, assign) NSUInteger sequence;					// message's number if order of reception
 @property (nonatomic, assign) short contentsType;					// the type of message data (string, data, image)
 @property (nonatomic, retain) NSDictionary *parts;					// for non-standard parts transmitted by the clients, store the data in this dictionary
 @property (nonatomic, assign) struct timeval timestamp;				// full timestamp (seconds & microseconds)
-@property (nonatomic, assign) NSString *tag;						// non-retained (we use a global pool for tags)
+@property (nonatomic, assign) NSString *tag;						// interned in the global table of tags (see LoggerTagIDForTag)
+@property (nonatomic, readonly) uint32_t tagID;						// ID of the tag in the global table of tags
 @property (nonatomic, retain) id message;							// NSString, NSData or image data
 @property (nonatomic, assign) short type;
 @property (nonatomic, assign) short level;
 @property (nonatomic, retain) NSString *threadID;
-@property (nonatomic, assign) NSSize imageSize;						// (unsaved)
+@property (nonatomic, assign) NSSize imageSize;						// (unsaved) sent by the client, or read from the image header
 @property (nonatomic, assign) NSSize cachedCellSize;				// (unsaved) we use this to cache the cell's height when recomputing if the width didn't change
-@property (nonatomic, retain) NSImage *image;						// if the message is an image, the image gets decoded once it's being accessed
+@property (nonatomic, assign) uint16_t colorRulesVersion;			// (unsaved) version of the color rules colorRule was looked up with, 0 if not yet
+@property (nonatomic, assign) int16_t colorRule;					// (unsaved) index of the color rule matching the message, -1 if none (see LoggerMessageCell)
+@property (nonatomic, assign) uint16_t textLayoutVersion;			// (unsaved) version of the text font textLines and textWidth were measured with, 0 if not yet
+@property (nonatomic, assign) uint16_t textLines;					// (unsaved) number of lines of the text when it isn't wrapped
+@property (nonatomic, assign) float textWidth;						// (unsaved) width of the widest line of the text when it isn't wrapped
+@property (nonatomic, readonly) NSImage *image;						// if the message is an image, the full size image, decoded each time (the table draws thumbnails, see LoggerImageCache)
 @property (nonatomic, readonly, assign) NSString *filename;
 @property (nonatomic, readonly, assign) NSString *functionName;
 @property (nonatomic, assign) int lineNumber;						// line number in the file, if filename != nil
 
 - (void)computeTimeDelta:(struct timeval *)td since:(LoggerMessage *)previousMessage;
 - (NSString *)textRepresentation;
+- (NSString *)colorRulesDescription;								// the description without the object address, matched by color rules
+- (NSSize)imageSizeFromHeader;										// read each time, for messages whose client didn't send the image size
 
 - (void)setFilename:(NSString *)aFilename connection:(LoggerConnection *)aConnection;
 - (void)setFunctionName:(NSString *)aFunctionName connection:(LoggerConnection *)aConnection;
 
 @end
 
+// Message keeping its values in the object
+@interface LoggerObjectMessage : LoggerMessage
+@end
+
+// Tags are interned in a table shared by all connections. Messages keep the ID of their tag, a small
+// integer, so that tags can be compared and counted without comparing strings. The empty tag has ID 0.
+// These functions can be called from any thread
+#define LOGGER_NO_TAG_ID	UINT32_MAX
+
+uint32_t LoggerTagIDForTag(NSString *tag);				// interns the tag if needed
+uint32_t LoggerTagFindID(NSString *tag);				// LOGGER_NO_TAG_ID if the tag was never interned
+NSString *LoggerTagForID(uint32_t tagID);
+
 enum {
 	kMessageString = 0,
 	kMessageData,
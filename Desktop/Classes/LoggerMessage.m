@@ -29,86 +29,194 @@
  * 
  */
 #import <objc/runtime.h>
+#import <pthread.h>
 #import "LoggerMessage.h"
 #import "LoggerCommon.h"
 #import "LoggerConnection.h"
 
 static NSString *emptyTag = @"";
-static NSMutableArray *sTags = nil;
 
-@implementation LoggerMessage
+// Tags are looked up in one of several hash tables (shards) picked from the tag's hash, so that the
+// threads decoding messages for different connections rarely wait for each other. Tag names are
+// kept by ID in chunks that never move once allocated, and are read without locking
+#define TAG_SHARDS			16
+#define TAG_CHUNK_SIZE		1024
+#define TAG_MAX_CHUNKS		1024
 
-- (id)init
+typedef struct
 {
-	if ((self = [super init]) != nil)
+	pthread_mutex_t mutex;
+	CFMutableDictionaryRef tagIDs;			// tag -> ID
+} TagShard;
+
+static TagShard sTagShards[TAG_SHARDS];
+static const void **sTagNames[TAG_MAX_CHUNKS];	// retained NSString for each ID
+static uint32_t sTagsCount;
+
+static uint32_t AddTag(CFMutableDictionaryRef tagIDs, NSString *tag)
+{
+	// Called with the shard locked. Past the maximum number of tags, tags are dropped (ID 0) and
+	// the count stays at the maximum
+	uint32_t tagID = __atomic_load_n(&sTagsCount, __ATOMIC_RELAXED);
+	do
 	{
-		_tag = emptyTag;
-		_filename = @"";
-		_functionName = @"";
+		if (tagID >= TAG_CHUNK_SIZE * TAG_MAX_CHUNKS)
+			return 0;
 	}
-	return self;
+	while (!__atomic_compare_exchange_n(&sTagsCount, &tagID, tagID + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	const void ***chunkPtr = &sTagNames[tagID / TAG_CHUNK_SIZE];
+	const void **chunk = __atomic_load_n(chunkPtr, __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+	{
+		// IDs are handed out by all shards: another thread may be allocating the same chunk
+		const void **newChunk = (const void **)calloc(TAG_CHUNK_SIZE, sizeof(void *));
+		if (newChunk == NULL)
+			return 0;
+		if (__atomic_compare_exchange_n(chunkPtr, &chunk, newChunk, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			chunk = newChunk;
+		else
+			free(newChunk);
+	}
+	NSString *name = [tag copy];
+	__atomic_store_n(&chunk[tagID % TAG_CHUNK_SIZE], CFBridgingRetain(name), __ATOMIC_RELEASE);
+	CFDictionarySetValue(tagIDs, (__bridge CFStringRef)name, (const void *)(uintptr_t)tagID);
+	return tagID;
+}
+
+static TagShard *ShardForTag(NSString *tag)
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		for (int i = 0; i < TAG_SHARDS; i++)
+		{
+			pthread_mutex_init(&sTagShards[i].mutex, NULL);
+			sTagShards[i].tagIDs = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+		}
+		AddTag(sTagShards[[emptyTag hash] % TAG_SHARDS].tagIDs, emptyTag);
+	});
+	return &sTagShards[[tag hash] % TAG_SHARDS];
+}
+
+uint32_t LoggerTagIDForTag(NSString *tag)
+{
+	if (![tag length])
+		return 0;
+	TagShard *shard = ShardForTag(tag);
+	const void *value;
+	pthread_mutex_lock(&shard->mutex);
+	uint32_t tagID;
+	if (CFDictionaryGetValueIfPresent(shard->tagIDs, (__bridge CFStringRef)tag, &value))
+		tagID = (uint32_t)(uintptr_t)value;
+	else
+		tagID = AddTag(shard->tagIDs, tag);
+	pthread_mutex_unlock(&shard->mutex);
+	return tagID;
+}
+
+uint32_t LoggerTagFindID(NSString *tag)
+{
+	if (![tag length])
+		return 0;
+	TagShard *shard = ShardForTag(tag);
+	const void *value;
+	pthread_mutex_lock(&shard->mutex);
+	BOOL found = CFDictionaryGetValueIfPresent(shard->tagIDs, (__bridge CFStringRef)tag, &value);
+	pthread_mutex_unlock(&shard->mutex);
+	return found ? (uint32_t)(uintptr_t)value : LOGGER_NO_TAG_ID;
+}
+
+NSString *LoggerTagForID(uint32_t tagID)
+{
+	if (tagID == 0 || tagID >= TAG_CHUNK_SIZE * TAG_MAX_CHUNKS)
+		return emptyTag;
+	const void **chunk = __atomic_load_n(&sTagNames[tagID / TAG_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	const void *name = (chunk != NULL) ? __atomic_load_n(&chunk[tagID % TAG_CHUNK_SIZE], __ATOMIC_ACQUIRE) : NULL;
+	return (name != NULL) ? (__bridge NSString *)name : emptyTag;
+}
+
+@implementation LoggerMessage
+
+@dynamic sequence, contentsType, parts, timestamp, message, type, level, threadID, imageSize, filename, functionName, lineNumber;
+
++ (id)allocWithZone:(NSZone *)zone
+{
+	if (self == [LoggerMessage class])
+		return [LoggerObjectMessage allocWithZone:zone];
+	return [super allocWithZone:zone];
 }
 
 - (NSImage *)image
 {
+	// Not kept: images can be large, and the log table only needs thumbnails
 	if (self.contentsType != kMessageImage)
 		return nil;
-	if (_image == nil)
-		_image = [[NSImage alloc] initWithData:_message];
-	return _image;
+	return [[NSImage alloc] initWithData:self.message];
 }
 
-- (NSSize)imageSize
+- (NSSize)imageSizeFromHeader
 {
-	if (_imageSize.width == 0 || _imageSize.height == 0)
-		_imageSize = self.image.size;
-	return _imageSize;
+	// When the client didn't send the size of the image, it is read from the image header
+	// without decoding the image
+	NSSize size = NSZeroSize;
+	CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)self.message, NULL);
+	if (source != NULL)
+	{
+		NSDictionary *properties = (NSDictionary *)CFBridgingRelease(CGImageSourceCopyPropertiesAtIndex(source, 0, NULL));
+		size = NSMakeSize([properties[(__bridge NSString *)kCGImagePropertyPixelWidth] doubleValue],
+						  [properties[(__bridge NSString *)kCGImagePropertyPixelHeight] doubleValue]);
+		CFRelease(source);
+	}
+	return size;
 }
 
 - (NSString *)textRepresentation
 {
 	// Prepare a text representation of the message, suitable for export of text field display
-	time_t sec = _timestamp.tv_sec;
+	struct timeval timestamp = self.timestamp;
+	time_t sec = timestamp.tv_sec;
 	struct tm *t = localtime(&sec);
+	short contentsType = self.contentsType;
+	NSUInteger sequence = self.sequence;
 
-	if (_contentsType == kMessageString)
+	if (contentsType == kMessageString)
 	{
-		if (_type == LOGMSG_TYPE_MARK)
-			return [NSString stringWithFormat:@"%@\n", _message];
+		if (self.type == LOGMSG_TYPE_MARK)
+			return [NSString stringWithFormat:@"%@\n", self.message];
 
 		/* commmon case */
 		
 		// if message is empty, use the function name (typical case of using a log to record
 		// a "waypoint" in the code flow)
-		NSString *s = _message;
-		if (![s length] && [_functionName length])
-			s = _functionName;
+		NSString *s = self.message;
+		if (![s length] && [self.functionName length])
+			s = self.functionName;
 
 		return [NSString stringWithFormat:@"[%-8lu] %02d:%02d:%02d.%03d | %@ | %@ | %@\n",
-				_sequence,
-				t->tm_hour, t->tm_min, t->tm_sec, _timestamp.tv_usec / 1000,
-				(_tag == NULL) ? @"-" : _tag,
-				_threadID,
+				sequence,
+				t->tm_hour, t->tm_min, t->tm_sec, timestamp.tv_usec / 1000,
+				(self.tag == NULL) ? @"-" : self.tag,
+				self.threadID,
 				s];
 	}
 	
 	NSString *header = [NSString stringWithFormat:@"[%-8lu] %02d:%02d:%02d.%03d | %@ | %@ | ",
-						_sequence, t->tm_hour, t->tm_min, t->tm_sec, _timestamp.tv_usec / 1000,
-						(_tag == NULL) ? @"-" : _tag,
-						_threadID];
+						sequence, t->tm_hour, t->tm_min, t->tm_sec, timestamp.tv_usec / 1000,
+						(self.tag == NULL) ? @"-" : self.tag,
+						self.threadID];
 
-	if (_contentsType == kMessageImage)
+	if (contentsType == kMessageImage)
 		return [NSString stringWithFormat:@"%@IMAGE size=%dx%d px\n", header, (int)self.imageSize.width, (int)self.imageSize.height];
 
-	assert([_message isKindOfClass:[NSData class]]);
+	NSData *data = self.message;
+	assert([data isKindOfClass:[NSData class]]);
 	NSMutableString *s = [[NSMutableString alloc] init];
 	[s appendString:header];
-	NSUInteger offset = 0, dataLen = [(NSData *)_message length];
+	NSUInteger offset = 0, dataLen = [data length];
 	NSString *str;
 	int offsetPad = (int)ceil(ceil(log2f(dataLen)) / 4.f);
 	char buffer[1+offsetPad+2+16*3+1+16+1+1+1];
 	buffer[0] = '\0';
-	const unsigned char *q = [(NSData *)_message bytes];
+	const unsigned char *q = [data bytes];
 	if (dataLen == 1)
 		[s appendString:NSLocalizedString(@"Raw data, 1 byte:\n", @"")];
 	else
@@ -152,17 +260,20 @@ static NSMutableArray *sTags = nil;
 // -----------------------------------------------------------------------------
 - (id)initWithCoder:(NSCoder *)decoder
 {
-	if ((self = [super init]) != nil)
+	// messages are always decoded as messages keeping their values (see +allocWithZone:)
+	if ((self = [self init]) != nil)
 	{
-		_timestamp.tv_sec = (__darwin_time_t)[decoder decodeInt64ForKey:@"s"];
-		_timestamp.tv_usec = (__darwin_suseconds_t)[decoder decodeInt64ForKey:@"us"];
-		_parts = [decoder decodeObjectForKey:@"p"];
-		_message = [decoder decodeObjectForKey:@"m"];
-		_sequence = [decoder decodeIntForKey:@"n"];
-		_threadID = [decoder decodeObjectForKey:@"t"];
-		_level = [decoder decodeIntForKey:@"l"];
-		_type = [decoder decodeIntForKey:@"mt"];
-		_contentsType = [decoder decodeIntForKey:@"ct"];
+		struct timeval timestamp;
+		timestamp.tv_sec = (__darwin_time_t)[decoder decodeInt64ForKey:@"s"];
+		timestamp.tv_usec = (__darwin_suseconds_t)[decoder decodeInt64ForKey:@"us"];
+		self.timestamp = timestamp;
+		self.parts = [decoder decodeObjectForKey:@"p"];
+		self.message = [decoder decodeObjectForKey:@"m"];
+		self.sequence = [decoder decodeIntForKey:@"n"];
+		self.threadID = [decoder decodeObjectForKey:@"t"];
+		self.level = [decoder decodeIntForKey:@"l"];
+		self.type = [decoder decodeIntForKey:@"mt"];
+		self.contentsType = [decoder decodeIntForKey:@"ct"];
 		
 		// reload the filename / function name / line number. Since this is a pool
 		// kept by the LoggerConnection itself, we use the runtime's associated objects
@@ -171,14 +282,10 @@ static NSMutableArray *sTags = nil;
 		NSString *s = [decoder decodeObjectForKey:@"f"];
 		if (s != nil)
 			[self setFilename:s connection:cnx];
-		else
-			_filename = @"";
 		s = [decoder decodeObjectForKey:@"fn"];
 		if (s != nil)
 			[self setFunctionName:s connection:cnx];
-		else
-			_functionName = @"";
-		_lineNumber = [decoder decodeIntForKey:@"ln"];
+		self.lineNumber = [decoder decodeIntForKey:@"ln"];
 
 		self.tag = [decoder decodeObjectForKey:@"tag"];
 	}
@@ -188,29 +295,35 @@ static NSMutableArray *sTags = nil;
 - (void)encodeWithCoder:(NSCoder *)encoder
 {
 	// try to omit info with zero value to save space when saving
-	[encoder encodeInt64:_timestamp.tv_sec forKey:@"s"];
-	[encoder encodeInt64:_timestamp.tv_usec forKey:@"us"];
-	if ([_tag length])
-		[encoder encodeObject:_tag forKey:@"tag"];
-	if (_parts != nil)
-		[encoder encodeObject:_parts forKey:@"p"];
-	if (_message != nil)
-		[encoder encodeObject:_message forKey:@"m"];
-	[encoder encodeInt:(int)_sequence forKey:@"n"];
-	if ([_threadID length])
-		[encoder encodeObject:_threadID forKey:@"t"];
-	if (_level)
-		[encoder encodeInt:_level forKey:@"l"];
-	if (_type)
-		[encoder encodeInt:_type forKey:@"mt"];
-	if (_contentsType)
-		[encoder encodeInt:_contentsType forKey:@"ct"];
-	if (_filename != nil)
-		[encoder encodeObject:_filename forKey:@"f"];
-	if (_functionName != nil)
-		[encoder encodeObject:_functionName forKey:@"fn"];
-	if (_lineNumber != 0)
-		[encoder encodeInt:_lineNumber forKey:@"ln"];
+	struct timeval timestamp = self.timestamp;
+	[encoder encodeInt64:timestamp.tv_sec forKey:@"s"];
+	[encoder encodeInt64:timestamp.tv_usec forKey:@"us"];
+	if ([self.tag length])
+		[encoder encodeObject:self.tag forKey:@"tag"];
+	if (self.parts != nil)
+		[encoder encodeObject:self.parts forKey:@"p"];
+	if (self.message != nil)
+		[encoder encodeObject:self.message forKey:@"m"];
+	[encoder encodeInt:(int)self.sequence forKey:@"n"];
+	if ([self.threadID length])
+		[encoder encodeObject:self.threadID forKey:@"t"];
+	if (self.level)
+		[encoder encodeInt:self.level forKey:@"l"];
+	if (self.type)
+		[encoder encodeInt:self.type forKey:@"mt"];
+	if (self.contentsType)
+		[encoder encodeInt:self.contentsType forKey:@"ct"];
+	if (self.filename != nil)
+		[encoder encodeObject:self.filename forKey:@"f"];
+	if (self.functionName != nil)
+		[encoder encodeObject:self.functionName forKey:@"fn"];
+	if (self.lineNumber != 0)
+		[encoder encodeInt:self.lineNumber forKey:@"ln"];
+}
+
+- (Class)classForCoder
+{
+	return [LoggerMessage class];
 }
 
 // -----------------------------------------------------------------------------
@@ -229,16 +342,17 @@ static NSMutableArray *sTags = nil;
 // -----------------------------------------------------------------------------
 - (NSString *)messageText
 {
-	if (_contentsType == kMessageString)
-		return _message;
+	if (self.contentsType == kMessageString)
+		return self.message;
 	return @"";
 }
 
 - (NSString *)messageType
 {
-	if (_contentsType == kMessageString)
+	short contentsType = self.contentsType;
+	if (contentsType == kMessageString)
 		return @"text";
-	if (_contentsType == kMessageData)
+	if (contentsType == kMessageData)
 		return @"data";
 	return @"img";
 }
@@ -247,53 +361,36 @@ static NSMutableArray *sTags = nil;
 #pragma mark -
 #pragma mark Other
 // -----------------------------------------------------------------------------
+- (NSString *)tag
+{
+	return LoggerTagForID(_tagID);
+}
+
 - (void)setTag:(NSString *)aTag
 {
-	// we're accumulating the various domains in a global list
-	// so as to reduce memory use
+	// tags are interned in a global table so as to reduce memory use, messages only keep their ID
 	if (aTag == nil)
 		return;
-	NSUInteger pos = [sTags indexOfObject:aTag];
-	if (pos == NSNotFound || sTags == nil)
-	{
-		if (sTags == nil)
-			sTags = [[NSMutableArray alloc] init];
-		[sTags addObject:aTag];
-		_tag = aTag;
-	}
-	else
-		_tag = [sTags objectAtIndex:pos];
+	_tagID = LoggerTagIDForTag(aTag);
 }
 
 - (void)setFilename:(NSString *)aFilename connection:(LoggerConnection *)aConnection
 {
-	NSString *s = [aConnection.filenames member:aFilename];
-	if (s == nil)
-	{
-		[aConnection.filenames addObject:aFilename];
-		_filename = aFilename;
-	}
-	else
-		_filename = s;
+	// file and function names of messages read from a store are the store's
+	[self doesNotRecognizeSelector:_cmd];
 }
 
 - (void)setFunctionName:(NSString *)aFunctionName connection:(LoggerConnection *)aConnection
 {
-	NSString *s = [aConnection.functionNames member:aFunctionName];
-	if (s == nil)
-	{
-		[aConnection.functionNames addObject:aFunctionName];
-		_functionName = aFunctionName;
-	}
-	else
-		_functionName = s;
+	[self doesNotRecognizeSelector:_cmd];
 }
 
 - (void)computeTimeDelta:(struct timeval *)td since:(LoggerMessage *)previousMessage
 {
 	assert(previousMessage != NULL);
-	double t1 = (double)_timestamp.tv_sec + ((double)_timestamp.tv_usec) / 1000000.0;
-	double t2 = (double)previousMessage->_timestamp.tv_sec + ((double)previousMessage->_timestamp.tv_usec) / 1000000.0;
+	struct timeval timestamp = self.timestamp, previousTimestamp = previousMessage.timestamp;
+	double t1 = (double)timestamp.tv_sec + ((double)timestamp.tv_usec) / 1000000.0;
+	double t2 = (double)previousTimestamp.tv_sec + ((double)previousTimestamp.tv_usec) / 1000000.0;
 	double t = t1 - t2;
 	td->tv_sec = (__darwin_time_t)t;
 	td->tv_usec = (__darwin_suseconds_t)((t - (double)td->tv_sec) * 1000000.0);
@@ -301,23 +398,99 @@ static NSMutableArray *sTags = nil;
 
 -(NSString *)description
 {
-	NSString *typeString = ((_type == LOGMSG_TYPE_LOG) ? @"Log" :
-							(_type == LOGMSG_TYPE_CLIENTINFO) ? @"ClientInfo" :
-							(_type == LOGMSG_TYPE_DISCONNECT) ? @"Disconnect" :
-							(_type == LOGMSG_TYPE_BLOCKSTART) ? @"BlockStart" :
-							(_type == LOGMSG_TYPE_BLOCKEND) ? @"BlockEnd" :
-							(_type == LOGMSG_TYPE_MARK) ? @"Mark" :
+	return [self descriptionWithAddress:YES];
+}
+
+- (NSString *)colorRulesDescription
+{
+	return [self descriptionWithAddress:NO];
+}
+
+- (NSString *)descriptionWithAddress:(BOOL)withAddress
+{
+	short type = self.type, contentsType = self.contentsType;
+	NSString *typeString = ((type == LOGMSG_TYPE_LOG) ? @"Log" :
+							(type == LOGMSG_TYPE_CLIENTINFO) ? @"ClientInfo" :
+							(type == LOGMSG_TYPE_DISCONNECT) ? @"Disconnect" :
+							(type == LOGMSG_TYPE_BLOCKSTART) ? @"BlockStart" :
+							(type == LOGMSG_TYPE_BLOCKEND) ? @"BlockEnd" :
+							(type == LOGMSG_TYPE_MARK) ? @"Mark" :
 							@"Unknown");
 	NSString *desc;
-	if (_contentsType == kMessageData)
-		desc = [NSString stringWithFormat:@"{data %u bytes}", (unsigned)[_message length]];
-	else if (_contentsType == kMessageImage)
+	if (contentsType == kMessageData)
+		desc = [NSString stringWithFormat:@"{data %u bytes}", (unsigned)[self.message length]];
+	else if (contentsType == kMessageImage)
 		desc = [NSString stringWithFormat:@"{image w=%d h=%d}", (int)[self imageSize].width, (int)[self imageSize].height];
 	else
-		desc = (NSString *)_message;
+		desc = (NSString *)self.message;
 	
+	if (!withAddress)
+		return [NSString stringWithFormat:@"<%@ seq=%d type=%@ thread=%@ tag=%@ level=%d message=%@>",
+				[self class], (int)self.sequence, typeString, self.threadID, self.tag, (int)self.level, desc];
 	return [NSString stringWithFormat:@"<%@ %p seq=%d type=%@ thread=%@ tag=%@ level=%d message=%@>",
-			[self class], self, (int)_sequence, typeString, _threadID, _tag, (int)_level, desc];
+			[self class], self, (int)self.sequence, typeString, self.threadID, self.tag, (int)self.level, desc];
+}
+
+@end
+
+@implementation LoggerObjectMessage
+{
+	NSString *_filename;
+	NSString *_functionName;
+}
+
+@synthesize sequence = _sequence, contentsType = _contentsType, parts = _parts, timestamp = _timestamp, message = _message,
+			type = _type, level = _level, threadID = _threadID, imageSize = _imageSize, lineNumber = _lineNumber;
+
+- (id)init
+{
+	if ((self = [super init]) != nil)
+	{
+		_filename = @"";
+		_functionName = @"";
+	}
+	return self;
+}
+
+- (NSSize)imageSize
+{
+	if ((_imageSize.width == 0 || _imageSize.height == 0) && _contentsType == kMessageImage)
+		_imageSize = [self imageSizeFromHeader];
+	return _imageSize;
+}
+
+- (NSString *)filename
+{
+	return _filename;
+}
+
+- (NSString *)functionName
+{
+	return _functionName;
+}
+
+- (void)setFilename:(NSString *)aFilename connection:(LoggerConnection *)aConnection
+{
+	NSString *s = [aConnection.filenames member:aFilename];
+	if (s == nil)
+	{
+		[aConnection.filenames addObject:aFilename];
+		_filename = aFilename;
+	}
+	else
+		_filename = s;
+}
+
+- (void)setFunctionName:(NSString *)aFunctionName connection:(LoggerConnection *)aConnection
+{
+	NSString *s = [aConnection.functionNames member:aFunctionName];
+	if (s == nil)
+	{
+		[aConnection.functionNames addObject:aFunctionName];
+		_functionName = aFunctionName;
+	}
+	else
+		_functionName = s;
 }
 
 @end
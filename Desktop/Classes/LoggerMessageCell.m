@@ -30,6 +30,9 @@
  */
 #import "LoggerMessageCell.h"
 #import "LoggerMessage.h"
+#import "LoggerColorRules.h"
+#import "LoggerImageCache.h"
+#import "LoggerTextLayout.h"
 #import "LoggerUtils.h"
 #import "LoggerWindowController.h"
 #import "NSColor+NSLogger.h"
@@ -41,10 +44,28 @@
 
 #define TIMESTAMP_COLUMN_WIDTH        85.0f
 
+#define MAX_MEASURED_TEXT_LENGTH    2048             // longer texts are cut for computing the cell height
+
 static NSColor *sDefaultTagAndLevelColor = nil;
 static CGFloat sMinimumHeightForCell = 0;
 static CGFloat sDefaultFileLineFunctionHeight = 0;
 static NSMutableDictionary *advancedColors = nil;
+static LoggerColorRules *sColorRules = nil;
+static uint16_t sColorRulesVersion = 0;			// messages cache the index of their color rule for this version
+static NSMutableDictionary *sTagColors = nil;		// color rule found for each tag, NSNull if none
+static CGFloat sTextFirstLineHeight = 0;			// height of a text of one line
+static CGFloat sTextLineHeight = 0;				// height of each additional line
+static CGFloat sTextCharacterWidth = 0;			// advance of the characters if the text font is monospaced, 0 otherwise
+static uint16_t sTextLayoutVersion = 1;			// messages cache the unwrapped size of their text for this version
+static NSCache *sTextSegments = nil;				// measured words of the texts that wrap (see TextSegmentsHeader)
+
+// Measured texts are kept as this header followed by the LoggerTextSegment of their words
+typedef struct
+{
+	uint32_t version;
+	uint32_t lines;
+	float width;
+} TextSegmentsHeader;
 
 NSString *const kMessageAttributesChangedNotification = @"MessageAttributesChangedNotification";
 NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsChangedNotification";
@@ -220,6 +241,10 @@ NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsC
 	sDefaultAttributes = [[newAttributes copy] mutableCopy];
 	sMinimumHeightForCell = 0;
 	sDefaultFileLineFunctionHeight = 0;
+	sTextFirstLineHeight = 0;
+	if (++sTextLayoutVersion == 0)
+		sTextLayoutVersion = 1;
+	[sTextSegments removeAllObjects];
 	[[NSUserDefaults standardUserDefaults] setObject:[NSKeyedArchiver archivedDataWithRootObject:sDefaultAttributes] forKey:[self messageAttributeKey]];
 	[[NSNotificationCenter defaultCenter] postNotificationName:kMessageAttributesChangedNotification object:nil];
 }
@@ -386,6 +411,12 @@ NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsC
 			advancedColors[regexp] = color;
 		}
 	}
+
+	// rules are only compiled and matched against messages again when the prefs change
+	sColorRules = [[LoggerColorRules alloc] initWithColors:advancedColors];
+	if (++sColorRulesVersion == 0)
+		sColorRulesVersion = 1;
+	sTagColors = [[NSMutableDictionary alloc] init];
 }
 
 + (NSColor *)colorFor:(NSString *)selectorName
@@ -407,28 +438,22 @@ NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsC
 	{
 		[self loadAdvancedColors];
 	}
-	NSRegularExpression *regexp;
-	NSArray *sortedRegexps = [[advancedColors allKeys] sortedArrayUsingComparator:
-		^NSComparisonResult(NSRegularExpression *_Nonnull regexp1,
-							NSRegularExpression *_Nonnull regexp2) {
-			return [regexp1.pattern compare:regexp2.pattern];
-		}];
-
-	for (regexp in sortedRegexps)
-	{
-		NSArray *chunks = [regexp matchesInString:string options:0 range:NSMakeRange(0, [string length])];
-		if ([chunks count] > 0)
-		{
-			return advancedColors[regexp];
-		}
-	}
-	return nil;
+	return [sColorRules colorOfRuleAtIndex:[sColorRules indexOfRuleMatchingString:string]];
 }
 
 + (NSColor *)colorForTag:(NSString *)tag
 {
-	NSColor *color = [self colorForString:[NSString stringWithFormat:@"tag=%@", tag]];
-	if (!color)
+	if (!advancedColors)
+	{
+		[self loadAdvancedColors];
+	}
+	id color = sTagColors[tag];
+	if (color == nil)
+	{
+		color = [self colorForString:[NSString stringWithFormat:@"tag=%@", tag]] ?: [NSNull null];
+		sTagColors[tag] = color;
+	}
+	if (color == [NSNull null])
 	{
 		color = [self defaultTagAndLevelColor];
 	}
@@ -437,7 +462,18 @@ NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsC
 
 + (NSColor *)colorForMessage:(LoggerMessage *)message
 {
-	return [self colorForString:message.description];
+	// the rule matching a message is looked up on first draw, then cached in the message
+	if (!advancedColors)
+	{
+		[self loadAdvancedColors];
+	}
+	if (message.colorRulesVersion != sColorRulesVersion)
+	{
+		NSUInteger rule = [sColorRules indexOfRuleMatchingString:[message colorRulesDescription]];
+		message.colorRule = (rule < INT16_MAX) ? (int16_t)rule : -1;
+		message.colorRulesVersion = sColorRulesVersion;
+	}
+	return (message.colorRule >= 0) ? [sColorRules colorOfRuleAtIndex:(NSUInteger)message.colorRule] : nil;
 }
 
 #pragma mark -
@@ -528,6 +564,103 @@ NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsC
 	return sDefaultFileLineFunctionHeight;
 }
 
++ (void)measureTextMetrics
+{
+	NSDictionary *attrs = self.defaultAttributes[@"text"];
+	NSStringDrawingOptions options = NSStringDrawingUsesLineFragmentOrigin | NSStringDrawingUsesFontLeading;
+	CGFloat oneLine = NSHeight([@"Xg" boundingRectWithSize:NSMakeSize(1024, 1024) options:options attributes:attrs]);
+	CGFloat twoLines = NSHeight([@"Xg\nXg" boundingRectWithSize:NSMakeSize(1024, 1024) options:options attributes:attrs]);
+	NSFont *font = attrs[NSFontAttributeName];
+	sTextCharacterWidth = [font isFixedPitch] ? [@"X" sizeWithAttributes:attrs].width : 0;
+	sTextLineHeight = twoLines - oneLine;
+	sTextFirstLineHeight = oneLine;
+}
+
++ (NSData *)measureTextSegments:(NSString *)s characters:(const unichar *)chars
+{
+	// Lay out each line of the text without wrapping it once, and keep where its words end and
+	// the next ones start: wrapping the text at any width then only takes adding up these offsets
+	NSDictionary *attrs = self.defaultAttributes[@"text"];
+	NSUInteger length = [s length], lineStart = 0;
+	TextSegmentsHeader header = { sTextLayoutVersion, 0, 0 };
+	NSMutableData *data = [NSMutableData dataWithBytes:&header length:sizeof(header)];
+	for (;;)
+	{
+		NSUInteger lineEnd = lineStart, i = lineStart;
+		while (lineEnd < length && chars[lineEnd] != '\n')
+			lineEnd++;
+		NSAttributedString *line = [[NSAttributedString alloc] initWithString:[s substringWithRange:NSMakeRange(lineStart, lineEnd - lineStart)]
+																	attributes:attrs];
+		CTLineRef ctLine = CTLineCreateWithAttributedString((__bridge CFAttributedStringRef)line);
+		LoggerTextSegment segment;
+		do
+		{
+			while (i < lineEnd && chars[i] != ' ')
+				i++;
+			segment.wordEnd = (float)CTLineGetOffsetForStringIndex(ctLine, (CFIndex)(i - lineStart), NULL);
+			while (i < lineEnd && chars[i] == ' ')
+				i++;
+			segment.next = (float)CTLineGetOffsetForStringIndex(ctLine, (CFIndex)(i - lineStart), NULL);
+			segment.endsLine = (i == lineEnd);
+			[data appendBytes:&segment length:sizeof(segment)];
+		} while (i < lineEnd);
+		CFRelease(ctLine);
+		header.lines++;
+		header.width = fmaxf(header.width, segment.wordEnd);
+		if (lineEnd + 1 >= length)
+			break;
+		lineStart = lineEnd + 1;
+	}
+	[data replaceBytesInRange:NSMakeRange(0, sizeof(header)) withBytes:&header];
+	return data;
+}
+
++ (CGFloat)heightForText:(NSString *)s ofMessage:(LoggerMessage *)aMessage width:(CGFloat)width
+{
+	// Texts that are not wider than the column keep the same number of lines. Otherwise, with a
+	// monospaced font, the lines are counted from the characters. With other fonts, the text is
+	// measured once and rewrapped from its measured words each time the width changes
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		sTextSegments = [[NSCache alloc] init];
+		sTextSegments.totalCostLimit = 16 * 1024 * 1024;
+	});
+	if (sTextFirstLineHeight == 0)
+		[self measureTextMetrics];
+
+	uint32_t lines = 0;
+	if (aMessage.textLayoutVersion == sTextLayoutVersion && aMessage.textWidth <= width)
+		lines = aMessage.textLines;
+	else
+	{
+		unichar chars[MAX_MEASURED_TEXT_LENGTH];
+		NSUInteger length = [s length];
+		[s getCharacters:chars range:NSMakeRange(0, length)];
+		if (sTextCharacterWidth > 0)
+			lines = LoggerTextLayoutCountMonospacedLines(chars, (uint32_t)length, (uint32_t)floor((width + 0.01) / sTextCharacterWidth));
+		if (lines == 0)
+		{
+			NSData *segments = [sTextSegments objectForKey:s];
+			if (segments == nil || ((const TextSegmentsHeader *)segments.bytes)->version != sTextLayoutVersion)
+			{
+				segments = [self measureTextSegments:s characters:chars];
+				[sTextSegments setObject:segments forKey:s cost:segments.length];
+			}
+			const TextSegmentsHeader *header = (const TextSegmentsHeader *)segments.bytes;
+			aMessage.textLines = (uint16_t)header->lines;
+			aMessage.textWidth = header->width;
+			aMessage.textLayoutVersion = (uint16_t)header->version;
+			if (header->width <= width)
+				lines = header->lines;
+			else
+				lines = LoggerTextLayoutWrapSegments((const LoggerTextSegment *)(header + 1),
+													 (uint32_t)((segments.length - sizeof(TextSegmentsHeader)) / sizeof(LoggerTextSegment)),
+													 (float)width);
+		}
+	}
+	return sTextFirstLineHeight + (lines - 1) * sTextLineHeight;
+}
+
 + (CGFloat)heightForCellWithMessage:(LoggerMessage *)aMessage threadColumnWidth:(CGFloat)threadColumWidth maxSize:(NSSize)sz showFunctionNames:(BOOL)showFunctionNames
 {
 	// return cached cell height if possible
@@ -550,14 +683,12 @@ NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsC
 		case kMessageString:
 		{
 			// restrict message length for very long contents
-			NSString *s = aMessage.message;
-			if ([s length] > 2048)
-				s = [s substringToIndex:2048];
-
-			NSRect lr = [s boundingRectWithSize:sz
-										options:(NSStringDrawingOneShot | NSStringDrawingUsesLineFragmentOrigin | NSStringDrawingUsesFontLeading)
-									 attributes:self.defaultAttributes[@"text"]];
-			sz.height = fminf((float) NSHeight(lr), (float) sz.height);
+			NSString *s = aMessage.message ?: @"";
+			if ([s length] > MAX_MEASURED_TEXT_LENGTH)
+				s = [s substringToIndex:MAX_MEASURED_TEXT_LENGTH];
+
+			CGFloat textHeight = [self heightForText:s ofMessage:aMessage width:sz.width];
+			sz.height = fminf((float) textHeight, (float) sz.height);
 			break;
 		}
 
@@ -958,13 +1089,23 @@ NSString *const kMessageColumnWidthsChangedNotification = @"MessageColumnWidthsC
 		CGFloat ratio = fmaxf(1.0f, fmaxf((float) (srcSize.width / NSWidth(r)), (float) (srcSize.height / NSHeight(r))));
 		CGSize newSize = CGSizeMake(floorf((float) (srcSize.width / ratio)), floorf((float) (srcSize.height / ratio)));
 		CGContextRef ctx = (CGContextRef) [[NSGraphicsContext currentContext] graphicsPort];
+
+		// Draw the thumbnail decoded for this size, or a placeholder of the same size until it is ready
+		CGFloat scale = CGContextConvertSizeToDeviceSpace(ctx, CGSizeMake(1, 1)).width;
+		NSImage *thumbnail = [[LoggerImageCache sharedCache] thumbnailForMessage:self.message fittingSize:newSize scale:fabs(scale)];
+		if (thumbnail == nil)
+		{
+			[[NSColor colorWithCalibratedWhite:0.5f alpha:0.15f] set];
+			NSRectFillUsingOperation(NSMakeRect(NSMinX(r), NSMaxY(r) - newSize.height, newSize.width, newSize.height), NSCompositeSourceOver);
+			return;
+		}
 		CGContextSaveGState(ctx);
 		CGContextTranslateCTM(ctx, NSMinX(r), NSMinY(r) + NSHeight(r));
 		CGContextScaleCTM(ctx, 1.0f, -1.0f);
-		[self.message.image drawInRect:NSMakeRect(0, 0, newSize.width, newSize.height)
-							  fromRect:NSMakeRect(0, 0, srcSize.width, srcSize.height)
-							 operation:NSCompositeCopy
-							  fraction:1.0f];
+		[thumbnail drawInRect:NSMakeRect(0, 0, newSize.width, newSize.height)
+					 fromRect:NSZeroRect
+					operation:NSCompositeCopy
+					 fraction:1.0f];
 		CGContextRestoreGState(ctx);
 	}
 }
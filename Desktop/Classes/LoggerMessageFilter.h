@@ -0,0 +1,68 @@
+/*
+ * LoggerMessageFilter.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#import <Cocoa/Cocoa.h>
+
+@class LoggerMessage;
+
+// What is known of messages that are not decoded yet, i.e. a chunk of a saved document (see LoggerDocumentFile.h)
+typedef struct
+{
+	int64_t minTimestamp;				// microseconds since 1970
+	int64_t maxTimestamp;
+	uint32_t levels;					// bit n is set if a message has level n (levels below 0 set bit 0, above 31 set bit 31)
+	uint32_t types;						// bit n is set if a message has type n (types above 31 set bit 31)
+	uint64_t tags;						// bits set by the tags of the messages, see -mayMatchMessagesWithSummary:tagBits:
+} LoggerMessageSummary;
+
+// -----------------------------------------------------------------------------
+// LoggerMessageFilter: a filter predicate compiled to a tree of matchers
+// that read the message values directly (from the connection's message store
+// when possible) instead of evaluating the predicate with KVC. Comparisons are
+// reordered so that the cheap ones (type, level, tag) are tested first.
+// Predicates the compiler doesn't understand are evaluated with NSPredicate.
+// -----------------------------------------------------------------------------
+@interface LoggerMessageFilter : NSObject
+
+@property (nonatomic, readonly) NSPredicate *predicate;
+
+- (id)initWithPredicate:(NSPredicate *)aPredicate;
+
+- (BOOL)matchesMessage:(LoggerMessage *)aMessage;
+
+// Returns the messages that match the filter, in their original order. Can be called
+// from any thread
+- (NSArray *)filteredMessages:(NSArray *)messages;
+
+// Returns NO if none of the messages summarized can match the filter. tagBits returns the bits of the
+// summary's tags set by messages that have this tag (0 if no message has it). Can be called from any thread
+- (BOOL)mayMatchMessagesWithSummary:(const LoggerMessageSummary *)summary tagBits:(uint64_t (^)(NSString *tag))tagBits;
+
+@end
@@ -0,0 +1,938 @@
+/*
+ * LoggerMessageFilter.m
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#import <objc/runtime.h>
+#import <pthread.h>
+#import "LoggerMessageFilter.h"
+#import "LoggerMessage.h"
+#import "LoggerNativeMessage.h"
+#import "LoggerTextIndex.h"
+#import "LoggerTextSearch.h"
+#import "LoggerCommon.h"
+
+// The rows (message text comparisons) or string IDs (tag, thread, file and function name
+// comparisons) that may match a string comparison, for one store
+typedef struct FilterCandidates
+{
+	struct FilterCandidates *next;
+	uint64_t storeIdentifier;
+	uint64_t *bitmap;							// NULL if all rows or strings may match
+	uint32_t count;								// rows or string IDs covered by the bitmap, the ones past it may match
+} FilterCandidates;
+
+typedef struct
+{
+	int field;									// FilterField
+	NSPredicateOperatorType op;
+	BOOL caseInsensitive;
+	const uint8_t *needle;
+	uint32_t needleLength;
+	FilterCandidates *candidates;				// one entry per store the filter has seen
+} FilterIndexSlot;
+
+// String comparisons that can be narrowed down using the store's text index and string table.
+// Candidates are computed once per store and shared by all the threads using the filter
+typedef struct
+{
+	pthread_mutex_t mutex;
+	FilterIndexSlot *slots;
+	uint32_t slotsCount;
+} FilterIndex;
+
+// State shared by the evaluations of one -filteredMessages: call: the IDs the filter's
+// constant strings and the candidates of its string comparisons have in the store the
+// messages come from
+typedef struct
+{
+	LoggerMessageStore *store;					// retained, store of the last message evaluated
+	uint32_t *stringIDs;						// UINT32_MAX until looked up in the store
+	uint32_t stringsCount;
+	const FilterCandidates **candidates;		// NULL until looked up in the FilterIndex
+	uint32_t candidatesCount;
+} FilterContext;
+
+// The message being evaluated
+typedef struct
+{
+	__unsafe_unretained LoggerMessage *message;
+	LoggerMessageStore *store;					// NULL if the message values are not read from a store
+	const LoggerMessageStorePage *page;
+	uint32_t row;
+	uint32_t index;								// index of the row in the page
+	uint8_t storedFields;						// kStored* values that come from the store
+	FilterContext *context;
+} FilterRow;
+
+typedef BOOL (^FilterMatcher)(FilterRow *row);
+typedef BOOL (^FilterSummaryMatcher)(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *tag));
+
+typedef enum
+{
+	kFieldUnknown = 0,
+	kFieldType,
+	kFieldLevel,
+	kFieldLineNumber,
+	kFieldTimestamp,							// microseconds since 1970
+	kFieldMessageType,							// 0 for text, 1 for data, 2 for images
+	kFieldMessageText,
+	kFieldTag,
+	kFieldThreadID,
+	kFieldFilename,
+	kFieldFunctionName
+} FilterField;
+
+// Estimated cost of the matchers, cheaper ones are evaluated first in AND / OR clauses
+enum
+{
+	kCostConstant = 0,
+	kCostInteger = 1,
+	kCostStringID = 2,
+	kCostString = 4,
+	kCostMessageText = 8,
+	kCostRegex = 16,
+	kCostPredicate = 32
+};
+
+@implementation LoggerMessageFilter
+{
+	FilterMatcher _matcher;
+	FilterSummaryMatcher _summaryMatcher;
+	NSMutableArray *_constants;					// keeps the bytes the matchers compare to alive
+	uint32_t _stringSlotsCount;					// number of constant strings looked up in message stores
+	FilterIndex *_index;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Reading message values
+// -----------------------------------------------------------------------------
+static inline int64_t IntegerValue(FilterRow *row, FilterField field)
+{
+	if (row->page != NULL)
+	{
+		const LoggerMessageStorePage *page = row->page;
+		uint32_t i = row->index;
+		switch (field)
+		{
+			case kFieldType:
+				return page->types[i];
+			case kFieldLevel:
+				return page->levels[i];
+			case kFieldLineNumber:
+				return page->lineNumbers[i];
+			case kFieldTimestamp:
+				return page->timestamps[i];
+			case kFieldMessageType:
+				return (page->contentsTypes[i] == PART_TYPE_STRING) ? 0 : (page->contentsTypes[i] == PART_TYPE_BINARY) ? 1 : 2;
+			default:
+				return 0;
+		}
+	}
+	LoggerMessage *message = row->message;
+	switch (field)
+	{
+		case kFieldType:
+			return message.type;
+		case kFieldLevel:
+			return message.level;
+		case kFieldLineNumber:
+			return message.lineNumber;
+		case kFieldTimestamp:
+		{
+			struct timeval tv = message.timestamp;
+			return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+		}
+		case kFieldMessageType:
+			return (message.contentsType == kMessageString) ? 0 : (message.contentsType == kMessageData) ? 1 : 2;
+		default:
+			return 0;
+	}
+}
+
+static NSString *StringValue(FilterRow *row, FilterField field)
+{
+	LoggerMessage *message = row->message;
+	switch (field)
+	{
+		case kFieldMessageText:
+			return (message.contentsType == kMessageString) ? message.message : @"";
+		case kFieldTag:
+			return message.tag;
+		case kFieldThreadID:
+			return message.threadID;
+		case kFieldFilename:
+			return message.filename;
+		case kFieldFunctionName:
+			return message.functionName;
+		default:
+			return nil;
+	}
+}
+
+static uint32_t StoredStringID(FilterRow *row, FilterField field, BOOL *outStored)
+{
+	// ID of a string value in the message store. Sets *outStored to NO if
+	// the value must be read from the message instead
+	*outStored = (row->store != NULL);
+	if (row->store == NULL)
+		return LOGGER_STORE_NO_STRING;
+	uint32_t i = row->index;
+	switch (field)
+	{
+		case kFieldTag:
+			*outStored = (row->storedFields & kStoredTag) != 0;
+			return row->page->tagIDs[i];
+		case kFieldThreadID:
+			*outStored = (row->storedFields & kStoredThreadID) != 0;
+			return row->page->threadIDs[i];
+		case kFieldFilename:
+			return row->page->filenameIDs[i];
+		case kFieldFunctionName:
+			return row->page->functionNameIDs[i];
+		default:
+			*outStored = NO;
+			return LOGGER_STORE_NO_STRING;
+	}
+}
+
+static BOOL StoredBytes(FilterRow *row, FilterField field, const uint8_t **outBytes, uint32_t *outLength)
+{
+	// UTF-8 bytes of a string value kept in the store. Absent values are returned as empty strings,
+	// callers only use this with non-empty needles for which nil and empty strings compare the same
+	if (field == kFieldMessageText)
+	{
+		if (row->store == NULL || !(row->storedFields & kStoredMessage))
+			return NO;
+		*outLength = 0;
+		*outBytes = NULL;
+		if (row->page->contentsTypes[row->index] == PART_TYPE_STRING)
+			*outBytes = LoggerMessageStoreGetContents(row->store, row->row, outLength);
+		return YES;
+	}
+	BOOL stored;
+	uint32_t stringID = StoredStringID(row, field, &stored);
+	if (!stored)
+		return NO;
+	*outBytes = LoggerMessageStoreGetString(row->store, stringID, outLength);
+	return YES;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark String comparisons
+// -----------------------------------------------------------------------------
+static inline uint8_t FoldASCII(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (uint8_t)(c | 0x20) : c;
+}
+
+static BOOL EqualASCII(const uint8_t *s, const uint8_t *needle, uint32_t length, BOOL caseInsensitive)
+{
+	if (!caseInsensitive)
+		return memcmp(s, needle, length) == 0;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		if (FoldASCII(s[i]) != needle[i])
+			return NO;
+	}
+	return YES;
+}
+
+static BOOL HasNonASCII(const uint8_t *s, uint32_t length)
+{
+	uint8_t bits = 0;
+	for (uint32_t i = 0; i < length; i++)
+		bits |= s[i];
+	return (bits & 0x80) != 0;
+}
+
+static int MatchASCII(const uint8_t *s, uint32_t length, const uint8_t *needle, uint32_t needleLength,
+					  NSPredicateOperatorType op, BOOL caseInsensitive)
+{
+	// Compare UTF-8 bytes to a non-empty ASCII needle (lowercased for case insensitive comparisons)
+	// without creating an NSString. Returns -1 when non-ASCII characters may change the answer
+	// (Unicode case folding, combining marks), in which case NSString has to decide.
+	int found;
+	switch (op)
+	{
+		case NSEqualToPredicateOperatorType:
+		case NSNotEqualToPredicateOperatorType:
+			found = (length == needleLength && EqualASCII(s, needle, length, caseInsensitive));
+			if (!found && caseInsensitive && HasNonASCII(s, length))
+				return -1;
+			return (op == NSEqualToPredicateOperatorType) ? found : !found;
+
+		case NSBeginsWithPredicateOperatorType:
+			if (length >= needleLength && EqualASCII(s, needle, needleLength, caseInsensitive))
+				return (length == needleLength || s[needleLength] < 0x80) ? 1 : -1;
+			return (caseInsensitive && HasNonASCII(s, length)) ? -1 : 0;
+
+		case NSEndsWithPredicateOperatorType:
+			if (length >= needleLength && EqualASCII(s + length - needleLength, needle, needleLength, caseInsensitive))
+				return 1;
+			return (caseInsensitive && HasNonASCII(s, length)) ? -1 : 0;
+
+		case NSContainsPredicateOperatorType:
+		{
+			const uint8_t *match = LoggerTextSearchFind(s, length, needle, needleLength, caseInsensitive);
+			if (match != NULL)
+				return (match + needleLength == s + length || match[needleLength] < 0x80) ? 1 : -1;
+			return (caseInsensitive && HasNonASCII(s, length)) ? -1 : 0;
+		}
+
+		default:
+			return -1;
+	}
+}
+
+static BOOL MatchString(NSString *s, NSPredicateOperatorType op, NSString *needle, NSStringCompareOptions options, NSRegularExpression *regex)
+{
+	if (s == nil)
+		return (op == NSNotEqualToPredicateOperatorType);
+	switch (op)
+	{
+		case NSEqualToPredicateOperatorType:
+			return [s compare:needle options:options] == NSOrderedSame;
+		case NSNotEqualToPredicateOperatorType:
+			return [s compare:needle options:options] != NSOrderedSame;
+		case NSContainsPredicateOperatorType:
+			return [s rangeOfString:needle options:options].location != NSNotFound;
+		case NSBeginsWithPredicateOperatorType:
+			return [s rangeOfString:needle options:options | NSAnchoredSearch].location != NSNotFound;
+		case NSEndsWithPredicateOperatorType:
+			return [s rangeOfString:needle options:options | NSAnchoredSearch | NSBackwardsSearch].location != NSNotFound;
+		case NSMatchesPredicateOperatorType:
+			return [regex rangeOfFirstMatchInString:s options:NSMatchingAnchored range:NSMakeRange(0, [s length])].location != NSNotFound;
+		default:
+			return NO;
+	}
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Candidates
+// -----------------------------------------------------------------------------
+static uint64_t *StringCandidates(LoggerMessageStore *store, FilterIndexSlot *slot, uint32_t *outCount)
+{
+	// Test the comparison once for each interned string rather than for each message
+	uint32_t count = LoggerMessageStoreStringsCount(store);
+	uint64_t *bitmap = (uint64_t *)calloc(count / 64 + 1, sizeof(uint64_t));
+	if (bitmap == NULL)
+		return NULL;
+	for (uint32_t stringID = 0; stringID < count; stringID++)
+	{
+		uint32_t length;
+		const uint8_t *bytes = LoggerMessageStoreGetString(store, stringID, &length);
+		if (MatchASCII(bytes ?: (const uint8_t *)"", length, slot->needle, slot->needleLength, slot->op, slot->caseInsensitive) != 0)
+			bitmap[stringID >> 6] |= 1ULL << (stringID & 63);
+	}
+	*outCount = count;
+	return bitmap;
+}
+
+static const FilterCandidates *CandidatesForStore(FilterIndex *index, uint32_t slotIndex, LoggerMessageStore *store)
+{
+	uint64_t storeIdentifier = LoggerMessageStoreGetIdentifier(store);
+	pthread_mutex_lock(&index->mutex);
+	FilterIndexSlot *slot = &index->slots[slotIndex];
+	FilterCandidates *candidates = slot->candidates;
+	while (candidates != NULL && candidates->storeIdentifier != storeIdentifier)
+		candidates = candidates->next;
+	if (candidates == NULL && (candidates = (FilterCandidates *)calloc(1, sizeof(FilterCandidates))) != NULL)
+	{
+		candidates->storeIdentifier = storeIdentifier;
+		if (slot->field == kFieldMessageText)
+		{
+			LoggerTextIndex *textIndex = LoggerMessageStoreGetTextIndex(store);
+			if (textIndex != NULL)
+				candidates->bitmap = LoggerTextIndexCopyCandidates(textIndex, slot->needle, slot->needleLength, &candidates->count);
+		}
+		else
+		{
+			candidates->bitmap = StringCandidates(store, slot, &candidates->count);
+		}
+		candidates->next = slot->candidates;
+		slot->candidates = candidates;
+	}
+	pthread_mutex_unlock(&index->mutex);
+	return candidates;
+}
+
+static BOOL IsCandidate(FilterRow *row, FilterIndex *index, uint32_t slotIndex, FilterField field)
+{
+	// Returns NO if the store's text index or string table tell that the row doesn't match
+	uint32_t n;
+	if (field == kFieldMessageText)
+	{
+		if (row->store == NULL || !(row->storedFields & kStoredMessage))
+			return YES;
+		n = row->row;
+	}
+	else
+	{
+		BOOL stored;
+		n = StoredStringID(row, field, &stored);
+		if (!stored)
+			return YES;
+	}
+	const FilterCandidates **candidates = &row->context->candidates[slotIndex];
+	if (*candidates == NULL)
+		*candidates = CandidatesForStore(index, slotIndex, row->store);
+	const FilterCandidates *c = *candidates;
+	return c == NULL || c->bitmap == NULL || n >= c->count || ((c->bitmap[n >> 6] >> (n & 63)) & 1) != 0;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Compilation
+// -----------------------------------------------------------------------------
+- (id)initWithPredicate:(NSPredicate *)aPredicate
+{
+	if ((self = [super init]) != nil)
+	{
+		_predicate = aPredicate;
+		_constants = [[NSMutableArray alloc] init];
+		_index = (FilterIndex *)calloc(1, sizeof(FilterIndex));
+		pthread_mutex_init(&_index->mutex, NULL);
+		NSUInteger cost;
+		_matcher = [self compile:aPredicate cost:&cost];
+		_summaryMatcher = [self compileSummary:aPredicate];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	for (uint32_t i = 0; i < _index->slotsCount; i++)
+	{
+		for (FilterCandidates *candidates = _index->slots[i].candidates, *next; candidates != NULL; candidates = next)
+		{
+			next = candidates->next;
+			free(candidates->bitmap);
+			free(candidates);
+		}
+	}
+	free(_index->slots);
+	pthread_mutex_destroy(&_index->mutex);
+	free(_index);
+}
+
+- (uint32_t)addIndexSlot:(FilterField)field op:(NSPredicateOperatorType)op needle:(const uint8_t *)needle length:(uint32_t)length caseInsensitive:(BOOL)caseInsensitive
+{
+	_index->slots = (FilterIndexSlot *)reallocf(_index->slots, (_index->slotsCount + 1) * sizeof(FilterIndexSlot));
+	if (_index->slots == NULL)
+		[NSException raise:NSMallocException format:@"can't allocate filter index"];
+	FilterIndexSlot *slot = &_index->slots[_index->slotsCount];
+	slot->field = field;
+	slot->op = op;
+	slot->caseInsensitive = caseInsensitive;
+	slot->needle = needle;
+	slot->needleLength = length;
+	slot->candidates = NULL;
+	return _index->slotsCount++;
+}
+
+static FilterField FieldForKeyPath(NSString *keyPath)
+{
+	static NSDictionary *sFields = nil;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		sFields = @{ @"type": @(kFieldType),
+					 @"level": @(kFieldLevel),
+					 @"lineNumber": @(kFieldLineNumber),
+					 @"timestamp": @(kFieldTimestamp),
+					 @"messageType": @(kFieldMessageType),
+					 @"messageText": @(kFieldMessageText),
+					 @"tag": @(kFieldTag),
+					 @"threadID": @(kFieldThreadID),
+					 @"filename": @(kFieldFilename),
+					 @"functionName": @(kFieldFunctionName) };
+	});
+	return (FilterField)[sFields[keyPath] intValue];
+}
+
+- (FilterMatcher)compile:(NSPredicate *)predicate cost:(NSUInteger *)outCost
+{
+	if ([predicate isKindOfClass:[NSCompoundPredicate class]])
+	{
+		NSCompoundPredicate *compound = (NSCompoundPredicate *)predicate;
+		NSArray *subpredicates = compound.subpredicates;
+		NSCompoundPredicateType compoundType = compound.compoundPredicateType;
+		if (compoundType == NSNotPredicateType && [subpredicates count] == 1)
+		{
+			FilterMatcher matcher = [self compile:subpredicates[0] cost:outCost];
+			return ^BOOL(FilterRow *row) { return !matcher(row); };
+		}
+		if (compoundType == NSAndPredicateType || compoundType == NSOrPredicateType)
+			return [self compileSubpredicates:subpredicates and:(compoundType == NSAndPredicateType) cost:outCost];
+	}
+	else if ([predicate isKindOfClass:[NSComparisonPredicate class]])
+	{
+		FilterMatcher matcher = [self compileComparison:(NSComparisonPredicate *)predicate cost:outCost];
+		if (matcher != nil)
+			return matcher;
+	}
+	else if ([predicate isEqual:[NSPredicate predicateWithValue:YES]])
+	{
+		*outCost = kCostConstant;
+		return ^BOOL(FilterRow *row) { return YES; };
+	}
+	else if ([predicate isEqual:[NSPredicate predicateWithValue:NO]])
+	{
+		*outCost = kCostConstant;
+		return ^BOOL(FilterRow *row) { return NO; };
+	}
+
+	// anything else is evaluated the slow way
+	*outCost = kCostPredicate;
+	return ^BOOL(FilterRow *row) { return [predicate evaluateWithObject:row->message]; };
+}
+
+- (FilterMatcher)compileSubpredicates:(NSArray *)subpredicates and:(BOOL)isAnd cost:(NSUInteger *)outCost
+{
+	// Compile the subpredicates and chain them, cheapest first
+	NSMutableArray *compiled = [[NSMutableArray alloc] initWithCapacity:[subpredicates count]];
+	NSUInteger totalCost = 0;
+	for (NSPredicate *subpredicate in subpredicates)
+	{
+		NSUInteger cost;
+		FilterMatcher matcher = [self compile:subpredicate cost:&cost];
+		[compiled addObject:@[@(cost), matcher]];
+		totalCost += cost;
+	}
+	[compiled sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(NSArray *a, NSArray *b) {
+		return [a[0] compare:b[0]];
+	}];
+	*outCost = totalCost;
+
+	// an empty AND is true, an empty OR is false
+	FilterMatcher result = [[compiled lastObject] lastObject];
+	if (result == nil)
+		return isAnd ? ^BOOL(FilterRow *row) { return YES; } : ^BOOL(FilterRow *row) { return NO; };
+	for (NSInteger i = (NSInteger)[compiled count] - 2; i >= 0; i--)
+	{
+		FilterMatcher first = [compiled[(NSUInteger)i] lastObject];
+		FilterMatcher rest = result;
+		if (isAnd)
+			result = ^BOOL(FilterRow *row) { return first(row) && rest(row); };
+		else
+			result = ^BOOL(FilterRow *row) { return first(row) || rest(row); };
+	}
+	return result;
+}
+
+- (FilterMatcher)compileComparison:(NSComparisonPredicate *)comparison cost:(NSUInteger *)outCost
+{
+	// Compile the comparisons the filter editor and the quick filter produce: a message
+	// value on the left, a constant on the right. Returns nil for anything else
+	if (comparison.comparisonPredicateModifier != NSDirectPredicateModifier ||
+		comparison.customSelector != NULL ||
+		comparison.leftExpression.expressionType != NSKeyPathExpressionType ||
+		comparison.rightExpression.expressionType != NSConstantValueExpressionType)
+		return nil;
+	NSUInteger options = comparison.options;
+	if (options & ~(NSUInteger)(NSCaseInsensitivePredicateOption | NSDiacriticInsensitivePredicateOption))
+		return nil;
+
+	FilterField field = FieldForKeyPath(comparison.leftExpression.keyPath);
+	NSPredicateOperatorType op = comparison.predicateOperatorType;
+	id constant = comparison.rightExpression.constantValue;
+	if (field == kFieldUnknown)
+		return nil;
+
+	if (field == kFieldMessageType)
+	{
+		// "text", "data" or "img" (see -[LoggerMessage messageType])
+		if (options != 0 || ![constant isKindOfClass:[NSString class]] ||
+			(op != NSEqualToPredicateOperatorType && op != NSNotEqualToPredicateOperatorType))
+			return nil;
+		NSUInteger kind = [@[@"text", @"data", @"img"] indexOfObject:constant];
+		if (kind == NSNotFound)
+			return nil;
+		constant = @(kind);
+	}
+	else if (field == kFieldTimestamp)
+	{
+		// i.e. the time range of the window: dates, compared to the microseconds timestamps
+		if (![constant isKindOfClass:[NSDate class]])
+			return nil;
+		constant = @(llround([constant timeIntervalSince1970] * 1000000.0));
+	}
+
+	if (field <= kFieldMessageType)
+		return [self compileIntegerComparison:op field:field constant:constant cost:outCost];
+	if ([constant isKindOfClass:[NSString class]])
+		return [self compileStringComparison:op field:field constant:constant options:options cost:outCost];
+	return nil;
+}
+
+- (FilterMatcher)compileIntegerComparison:(NSPredicateOperatorType)op field:(FilterField)field constant:(id)constant cost:(NSUInteger *)outCost
+{
+	*outCost = kCostInteger;
+	if (op == NSInPredicateOperatorType)
+	{
+		// i.e. the always visible entries: a small set of message types
+		if (![constant isKindOfClass:[NSSet class]] && ![constant isKindOfClass:[NSArray class]])
+			return nil;
+		uint64_t mask = 0;
+		for (id value in constant)
+		{
+			if (![value isKindOfClass:[NSNumber class]])
+				return nil;
+			double d = [value doubleValue];
+			if (d < 0 || d >= 64 || d != (double)(int)d)
+				return nil;
+			mask |= 1ULL << (int)d;
+		}
+		return ^BOOL(FilterRow *row) {
+			int64_t value = IntegerValue(row, field);
+			return value >= 0 && value < 64 && (mask & (1ULL << value)) != 0;
+		};
+	}
+
+	if (![constant isKindOfClass:[NSNumber class]])
+		return nil;
+	double c = [constant doubleValue];
+	switch (op)
+	{
+		case NSLessThanPredicateOperatorType:
+			return ^BOOL(FilterRow *row) { return (double)IntegerValue(row, field) < c; };
+		case NSLessThanOrEqualToPredicateOperatorType:
+			return ^BOOL(FilterRow *row) { return (double)IntegerValue(row, field) <= c; };
+		case NSGreaterThanPredicateOperatorType:
+			return ^BOOL(FilterRow *row) { return (double)IntegerValue(row, field) > c; };
+		case NSGreaterThanOrEqualToPredicateOperatorType:
+			return ^BOOL(FilterRow *row) { return (double)IntegerValue(row, field) >= c; };
+		case NSEqualToPredicateOperatorType:
+			return ^BOOL(FilterRow *row) { return (double)IntegerValue(row, field) == c; };
+		case NSNotEqualToPredicateOperatorType:
+			return ^BOOL(FilterRow *row) { return (double)IntegerValue(row, field) != c; };
+		default:
+			return nil;
+	}
+}
+
+- (FilterMatcher)compileStringComparison:(NSPredicateOperatorType)op
+								   field:(FilterField)field
+								constant:(NSString *)needle
+								 options:(NSUInteger)predicateOptions
+									cost:(NSUInteger *)outCost
+{
+	NSStringCompareOptions options = 0;
+	if (predicateOptions & NSCaseInsensitivePredicateOption)
+		options |= NSCaseInsensitiveSearch;
+	if (predicateOptions & NSDiacriticInsensitivePredicateOption)
+		options |= NSDiacriticInsensitiveSearch;
+	BOOL caseInsensitive = (options & NSCaseInsensitiveSearch) != 0;
+
+	NSRegularExpression *regex = nil;
+	switch (op)
+	{
+		case NSEqualToPredicateOperatorType:
+		case NSNotEqualToPredicateOperatorType:
+		case NSContainsPredicateOperatorType:
+		case NSBeginsWithPredicateOperatorType:
+		case NSEndsWithPredicateOperatorType:
+			break;
+		case NSMatchesPredicateOperatorType:
+		{
+			// MATCHES must match the whole string
+			if (options & NSDiacriticInsensitiveSearch)
+				return nil;
+			regex = [NSRegularExpression regularExpressionWithPattern:[NSString stringWithFormat:@"(?:%@)\\z", needle]
+															  options:caseInsensitive ? NSRegularExpressionCaseInsensitive : 0
+																error:NULL];
+			if (regex == nil)
+				return nil;
+			*outCost = kCostRegex;
+			return ^BOOL(FilterRow *row) { return MatchString(StringValue(row, field), op, needle, options, regex); };
+		}
+		default:
+			return nil;
+	}
+
+	// Non-empty ASCII needles can be compared to the UTF-8 bytes kept in the store
+	NSData *needleData = nil;
+	if ([needle length] && !(options & NSDiacriticInsensitiveSearch) && [needle canBeConvertedToEncoding:NSASCIIStringEncoding])
+		needleData = [(caseInsensitive ? [needle lowercaseString] : needle) dataUsingEncoding:NSASCIIStringEncoding];
+	if (needleData == nil)
+	{
+		*outCost = (field == kFieldMessageText) ? kCostMessageText : kCostString;
+		return ^BOOL(FilterRow *row) { return MatchString(StringValue(row, field), op, needle, options, nil); };
+	}
+	[_constants addObject:needleData];
+	const uint8_t *needleBytes = (const uint8_t *)[needleData bytes];
+	uint32_t needleLength = (uint32_t)[needleData length];
+
+	if (field != kFieldMessageText && options == 0 &&
+		(op == NSEqualToPredicateOperatorType || op == NSNotEqualToPredicateOperatorType))
+	{
+		// Exact comparison of a tag, thread, file or function name: compare the string IDs
+		// in the store. The needle is looked up once in the store of the messages being filtered
+		// Messages that are not in a store compare the ID of their tag in the global table of tags
+		uint32_t slot = _stringSlotsCount++;
+		uint32_t needleTagID = (field == kFieldTag) ? LoggerTagFindID(needle) : LOGGER_NO_TAG_ID;
+		*outCost = kCostStringID;
+		return ^BOOL(FilterRow *row) {
+			BOOL stored;
+			uint32_t stringID = StoredStringID(row, field, &stored);
+			if (!stored && field == kFieldTag)
+			{
+				// a tag missing from the table when the filter was built can only be a new one
+				uint32_t tagID = row->message.tagID;
+				BOOL equal = (needleTagID != LOGGER_NO_TAG_ID) ? (tagID == needleTagID) : [LoggerTagForID(tagID) isEqualToString:needle];
+				return (op == NSEqualToPredicateOperatorType) ? equal : !equal;
+			}
+			if (!stored)
+				return MatchString(StringValue(row, field), op, needle, options, nil);
+			uint32_t *needleID = &row->context->stringIDs[slot];
+			if (*needleID == UINT32_MAX)
+				*needleID = LoggerMessageStoreFindString(row->store, needleBytes, needleLength);
+			BOOL equal = (*needleID != LOGGER_STORE_NO_STRING && stringID == *needleID);
+			return (op == NSEqualToPredicateOperatorType) ? equal : !equal;
+		};
+	}
+
+	*outCost = (field == kFieldMessageText) ? kCostMessageText : kCostString;
+	FilterMatcher matcher = ^BOOL(FilterRow *row) {
+		const uint8_t *bytes;
+		uint32_t length;
+		if (!StoredBytes(row, field, &bytes, &length))
+			return MatchString(StringValue(row, field), op, needle, options, nil);
+		int result = MatchASCII(bytes, length, needleBytes, needleLength, op, caseInsensitive);
+		if (result >= 0)
+			return (BOOL)result;
+		NSString *s = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+		return MatchString(s ?: @"", op, needle, options, nil);
+	};
+
+	// Rule out most messages without looking at them: message texts that match contain the needle,
+	// so they must be among the candidates the text index returns for it. Other strings are interned,
+	// the comparison is done once per string in the store
+	if (field == kFieldMessageText && (op == NSNotEqualToPredicateOperatorType || needleLength < LOGGER_TEXT_INDEX_MIN_NEEDLE))
+		return matcher;
+	uint32_t slot = [self addIndexSlot:field op:op needle:needleBytes length:needleLength caseInsensitive:caseInsensitive];
+	FilterIndex *index = _index;
+	return ^BOOL(FilterRow *row) { return IsCandidate(row, index, slot, field) && matcher(row); };
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Summaries
+// -----------------------------------------------------------------------------
+static BOOL RangeMayMatch(int64_t min, int64_t max, NSPredicateOperatorType op, double c, uint64_t mask)
+{
+	// whether the comparison holds for a value in [min, max]. `mask' holds the values of IN comparisons
+	switch (op)
+	{
+		case NSLessThanPredicateOperatorType:
+			return (double)min < c;
+		case NSLessThanOrEqualToPredicateOperatorType:
+			return (double)min <= c;
+		case NSGreaterThanPredicateOperatorType:
+			return (double)max > c;
+		case NSGreaterThanOrEqualToPredicateOperatorType:
+			return (double)max >= c;
+		case NSEqualToPredicateOperatorType:
+			return (double)min <= c && c <= (double)max;
+		case NSNotEqualToPredicateOperatorType:
+			return min != max || (double)min != c;
+		case NSInPredicateOperatorType:
+			for (int64_t value = MAX(min, 0); value <= MIN(max, 63); value++)
+			{
+				if (mask & (1ULL << value))
+					return YES;
+			}
+			return NO;
+		default:
+			return YES;
+	}
+}
+
+static BOOL BitsMayMatch(uint32_t bits, NSPredicateOperatorType op, double c, uint64_t mask)
+{
+	// bit 0 stands for the values up to 0 and bit 31 for the values from 31 on
+	for (int64_t n = 0; n < 32; n++)
+	{
+		if (((bits >> n) & 1) && RangeMayMatch((n == 0) ? INT64_MIN : n, (n == 31) ? INT64_MAX : n, op, c, mask))
+			return YES;
+	}
+	return NO;
+}
+
+- (FilterSummaryMatcher)compileSummary:(NSPredicate *)predicate
+{
+	// Same structure as the message matchers, on what a summary tells of the level, type, timestamp
+	// and tag of the messages. Anything else may match, and so may the negation of anything
+	FilterSummaryMatcher mayMatch = ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return YES; };
+	if ([predicate isKindOfClass:[NSCompoundPredicate class]])
+	{
+		NSCompoundPredicate *compound = (NSCompoundPredicate *)predicate;
+		NSCompoundPredicateType compoundType = compound.compoundPredicateType;
+		if (compoundType != NSAndPredicateType && compoundType != NSOrPredicateType)
+			return mayMatch;
+		BOOL isAnd = (compoundType == NSAndPredicateType);
+		FilterSummaryMatcher result = isAnd ? mayMatch : ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return NO; };
+		for (NSPredicate *subpredicate in compound.subpredicates)
+		{
+			FilterSummaryMatcher first = [self compileSummary:subpredicate];
+			FilterSummaryMatcher rest = result;
+			if (isAnd)
+				result = ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return first(summary, tagBits) && rest(summary, tagBits); };
+			else
+				result = ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return first(summary, tagBits) || rest(summary, tagBits); };
+		}
+		return result;
+	}
+	if ([predicate isEqual:[NSPredicate predicateWithValue:NO]])
+		return ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return NO; };
+	if (![predicate isKindOfClass:[NSComparisonPredicate class]])
+		return mayMatch;
+
+	NSComparisonPredicate *comparison = (NSComparisonPredicate *)predicate;
+	if (comparison.comparisonPredicateModifier != NSDirectPredicateModifier ||
+		comparison.customSelector != NULL ||
+		comparison.leftExpression.expressionType != NSKeyPathExpressionType ||
+		comparison.rightExpression.expressionType != NSConstantValueExpressionType)
+		return mayMatch;
+	FilterField field = FieldForKeyPath(comparison.leftExpression.keyPath);
+	NSPredicateOperatorType op = comparison.predicateOperatorType;
+	id constant = comparison.rightExpression.constantValue;
+
+	if (field == kFieldTag)
+	{
+		// only exact comparisons tell whether a tag may be there
+		if (op != NSEqualToPredicateOperatorType || comparison.options != 0 ||
+			![constant isKindOfClass:[NSString class]] || ![constant length])
+			return mayMatch;
+		NSString *tag = constant;
+		return ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return (summary->tags & tagBits(tag)) != 0; };
+	}
+	if (field != kFieldLevel && field != kFieldType && field != kFieldTimestamp)
+		return mayMatch;
+
+	double c = 0;
+	uint64_t mask = 0;
+	if (op == NSInPredicateOperatorType)
+	{
+		if (![constant isKindOfClass:[NSSet class]] && ![constant isKindOfClass:[NSArray class]])
+			return mayMatch;
+		for (id value in constant)
+		{
+			if (![value isKindOfClass:[NSNumber class]])
+				return mayMatch;
+			double d = [value doubleValue];
+			if (d < 0 || d >= 64 || d != (double)(int)d)
+				return mayMatch;
+			mask |= 1ULL << (int)d;
+		}
+	}
+	else if (field == kFieldTimestamp && [constant isKindOfClass:[NSDate class]])
+		c = (double)llround([constant timeIntervalSince1970] * 1000000.0);
+	else if (field != kFieldTimestamp && [constant isKindOfClass:[NSNumber class]])
+		c = [constant doubleValue];
+	else
+		return mayMatch;
+
+	if (field == kFieldTimestamp)
+		return ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return RangeMayMatch(summary->minTimestamp, summary->maxTimestamp, op, c, mask); };
+	if (field == kFieldLevel)
+		return ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return BitsMayMatch(summary->levels, op, c, mask); };
+	return ^BOOL(const LoggerMessageSummary *summary, uint64_t (^tagBits)(NSString *)) { return BitsMayMatch(summary->types, op, c, mask); };
+}
+
+- (BOOL)mayMatchMessagesWithSummary:(const LoggerMessageSummary *)summary tagBits:(uint64_t (^)(NSString *tag))tagBits
+{
+	return _summaryMatcher(summary, tagBits);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Filtering
+// -----------------------------------------------------------------------------
+static void PrepareRow(FilterRow *row, LoggerMessage *message, FilterContext *context, Class nativeMessageClass)
+{
+	row->message = message;
+	row->context = context;
+	row->store = NULL;
+	row->page = NULL;
+	if (object_getClass(message) == nativeMessageClass)
+	{
+		// the context holds a reference to the store of the last row, which is usually the next row's
+		LoggerMessageStore *store = [(LoggerNativeMessage *)message retainStore:&row->row storedFields:&row->storedFields unlessHeld:context->store];
+		if (store != NULL)
+		{
+			if (store != context->store)
+			{
+				// string IDs and candidates are per store
+				LoggerMessageStoreRelease(context->store);
+				context->store = store;
+				memset(context->stringIDs, 0xFF, context->stringsCount * sizeof(uint32_t));
+				memset(context->candidates, 0, context->candidatesCount * sizeof(FilterCandidates *));
+			}
+			row->store = store;
+			row->page = LoggerMessageStoreGetPage(store, row->row);
+			row->index = row->row & (LOGGER_STORE_PAGE_ROWS - 1);
+		}
+	}
+}
+
+- (BOOL)matchesMessage:(LoggerMessage *)aMessage
+{
+	uint32_t stringIDs[_stringSlotsCount + 1];
+	const FilterCandidates *candidates[_index->slotsCount + 1];
+	FilterContext context = { NULL, stringIDs, _stringSlotsCount, candidates, _index->slotsCount };
+	FilterRow row;
+	PrepareRow(&row, aMessage, &context, [LoggerNativeMessage class]);
+	BOOL matches = _matcher(&row);
+	LoggerMessageStoreRelease(context.store);
+	return matches;
+}
+
+- (NSArray *)filteredMessages:(NSArray *)messages
+{
+	uint32_t stringIDs[_stringSlotsCount + 1];
+	const FilterCandidates *candidates[_index->slotsCount + 1];
+	FilterContext context = { NULL, stringIDs, _stringSlotsCount, candidates, _index->slotsCount };
+	Class nativeMessageClass = [LoggerNativeMessage class];
+	FilterMatcher matcher = _matcher;
+	NSMutableArray *filteredMessages = [[NSMutableArray alloc] initWithCapacity:[messages count]];
+	for (LoggerMessage *message in messages)
+	{
+		FilterRow row;
+		PrepareRow(&row, message, &context, nativeMessageClass);
+		if (matcher(&row))
+			[filteredMessages addObject:message];
+	}
+	LoggerMessageStoreRelease(context.store);
+	return filteredMessages;
+}
+
+@end
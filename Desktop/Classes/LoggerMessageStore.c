@@ -0,0 +1,676 @@
+/*
+ * LoggerMessageStore.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "LoggerMessageStore.h"
+#include "LoggerTextIndex.h"
+#include "LoggerCommon.h"
+
+#define LOGGER_STORE_CHUNK_SIZE			(1024 * 1024)		// arena chunk size
+#define LOGGER_STORE_MAX_CHUNKS			65536
+#define LOGGER_STORE_LARGE_CONTENTS		(LOGGER_STORE_CHUNK_SIZE / 4)	// contents larger than this get their own chunk
+#define LOGGER_STORE_STRING_PAGE_SHIFT	10
+#define LOGGER_STORE_STRING_PAGE_SIZE	(1U << LOGGER_STORE_STRING_PAGE_SHIFT)
+#define LOGGER_STORE_MAX_STRING_PAGES	16384
+#define LOGGER_STORE_BLOCK_SHIFT		8					// directories of pages, chunks and string pages are allocated
+#define LOGGER_STORE_BLOCK_SIZE			(1U << LOGGER_STORE_BLOCK_SHIFT)	// by blocks of this many entries
+
+typedef struct
+{
+	uint64_t ref;						// location of the string bytes in the arena
+	uint32_t length;
+	uint32_t hash;
+} LoggerStoreString;
+
+typedef struct
+{
+	LoggerStoreString strings[LOGGER_STORE_STRING_PAGE_SIZE];
+	const void *objects[LOGGER_STORE_STRING_PAGE_SIZE];
+} LoggerStoreStringPage;
+
+typedef struct
+{
+	uint8_t *bytes;
+	uint32_t size;
+} LoggerStoreChunk;
+
+struct LoggerMessageStore
+{
+	int32_t refCount;
+	uint64_t identifier;
+	pthread_mutex_t mutex;				// serializes writers, readers never lock
+	void (*releaseObject)(const void *object);
+
+	// The directories of pages, chunks and string pages grow by blocks that are never moved, so that
+	// readers can follow them without locking, and a store that holds a few messages stays small
+	uint32_t count;						// number of published rows
+	LoggerMessageStorePage **pageBlocks[LOGGER_STORE_MAX_PAGES / LOGGER_STORE_BLOCK_SIZE];
+	uint32_t pagesCount;
+
+	// arena
+	LoggerStoreChunk *chunkBlocks[LOGGER_STORE_MAX_CHUNKS / LOGGER_STORE_BLOCK_SIZE];
+	uint32_t chunksCount;
+	uint32_t currentChunk;				// chunk small contents are appended to
+	uint32_t currentChunkUsed;
+	size_t arenaSize;
+
+	// interned strings (ID 0 is LOGGER_STORE_NO_STRING)
+	LoggerStoreStringPage **stringPageBlocks[LOGGER_STORE_MAX_STRING_PAGES / LOGGER_STORE_BLOCK_SIZE];
+	uint32_t stringPagesCount;
+	uint32_t stringsCount;
+	uint32_t *stringsHash;				// open addressing table of string IDs, only used by writers
+	uint32_t stringsHashSize;
+
+	LoggerTextIndex *textIndex;
+};
+
+static uint64_t sStoresCount = 0;
+
+static inline LoggerMessageStorePage *LoggerStorePageAt(const LoggerMessageStore *store, uint32_t pageIndex)
+{
+	return store->pageBlocks[pageIndex >> LOGGER_STORE_BLOCK_SHIFT][pageIndex & (LOGGER_STORE_BLOCK_SIZE - 1)];
+}
+
+static inline LoggerStoreChunk *LoggerStoreChunkAt(const LoggerMessageStore *store, uint32_t chunkIndex)
+{
+	return &store->chunkBlocks[chunkIndex >> LOGGER_STORE_BLOCK_SHIFT][chunkIndex & (LOGGER_STORE_BLOCK_SIZE - 1)];
+}
+
+static inline LoggerStoreStringPage *LoggerStoreStringPageAt(const LoggerMessageStore *store, uint32_t pageIndex)
+{
+	return store->stringPageBlocks[pageIndex >> LOGGER_STORE_BLOCK_SHIFT][pageIndex & (LOGGER_STORE_BLOCK_SIZE - 1)];
+}
+
+static bool LoggerStoreReserveBlock(void **blocks, uint32_t index, size_t entrySize)
+{
+	// Allocate the directory block that holds entry `index' if needed. Must be called by the writer,
+	// before the entry is published
+	void **block = &blocks[index >> LOGGER_STORE_BLOCK_SHIFT];
+	if (*block == NULL)
+		*block = calloc(LOGGER_STORE_BLOCK_SIZE, entrySize);
+	return (*block != NULL);
+}
+
+LoggerMessageStore *LoggerMessageStoreCreate(void (*releaseObject)(const void *object))
+{
+	LoggerMessageStore *store = (LoggerMessageStore *)calloc(1, sizeof(LoggerMessageStore));
+	if (store == NULL)
+		return NULL;
+	store->refCount = 1;
+	store->identifier = __atomic_add_fetch(&sStoresCount, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&store->mutex, NULL);
+	store->releaseObject = releaseObject;
+	store->stringsCount = 1;
+	store->currentChunk = UINT32_MAX;
+	return store;
+}
+
+LoggerMessageStore *LoggerMessageStoreRetain(LoggerMessageStore *store)
+{
+	if (store != NULL)
+		__atomic_add_fetch(&store->refCount, 1, __ATOMIC_RELAXED);
+	return store;
+}
+
+uint64_t LoggerMessageStoreGetIdentifier(const LoggerMessageStore *store)
+{
+	return store->identifier;
+}
+
+void LoggerMessageStoreRelease(LoggerMessageStore *store)
+{
+	if (store == NULL || __atomic_sub_fetch(&store->refCount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	for (uint32_t i = 0; i < store->pagesCount; i++)
+		free(LoggerStorePageAt(store, i));
+	for (uint32_t i = 0; i < store->chunksCount; i++)
+		free(LoggerStoreChunkAt(store, i)->bytes);
+	for (uint32_t i = 0; i < store->stringPagesCount; i++)
+	{
+		LoggerStoreStringPage *page = LoggerStoreStringPageAt(store, i);
+		if (store->releaseObject != NULL)
+		{
+			for (uint32_t j = 0; j < LOGGER_STORE_STRING_PAGE_SIZE; j++)
+				if (page->objects[j] != NULL)
+					store->releaseObject(page->objects[j]);
+		}
+		free(page);
+	}
+	for (uint32_t i = 0; i < LOGGER_STORE_MAX_PAGES / LOGGER_STORE_BLOCK_SIZE; i++)
+		free(store->pageBlocks[i]);
+	for (uint32_t i = 0; i < LOGGER_STORE_MAX_CHUNKS / LOGGER_STORE_BLOCK_SIZE; i++)
+		free(store->chunkBlocks[i]);
+	for (uint32_t i = 0; i < LOGGER_STORE_MAX_STRING_PAGES / LOGGER_STORE_BLOCK_SIZE; i++)
+		free(store->stringPageBlocks[i]);
+	free(store->stringsHash);
+	LoggerTextIndexDispose(store->textIndex);
+	pthread_mutex_destroy(&store->mutex);
+	free(store);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Arena
+// -----------------------------------------------------------------------------
+static uint64_t LoggerStoreCopyBytes(LoggerMessageStore *store, const uint8_t *bytes, uint32_t length)
+{
+	// Copy bytes to the arena, returns their location or LOGGER_STORE_NO_CONTENTS if out of memory
+	uint32_t chunkIndex;
+	if (length > LOGGER_STORE_LARGE_CONTENTS ||
+		store->currentChunk == UINT32_MAX ||
+		LoggerStoreChunkAt(store, store->currentChunk)->size - store->currentChunkUsed < length)
+	{
+		if (store->chunksCount == LOGGER_STORE_MAX_CHUNKS ||
+			!LoggerStoreReserveBlock((void **)store->chunkBlocks, store->chunksCount, sizeof(LoggerStoreChunk)))
+			return LOGGER_STORE_NO_CONTENTS;
+		uint32_t size = (length > LOGGER_STORE_LARGE_CONTENTS) ? length : LOGGER_STORE_CHUNK_SIZE;
+		uint8_t *chunkBytes = (uint8_t *)malloc(size ? size : 1);
+		if (chunkBytes == NULL)
+			return LOGGER_STORE_NO_CONTENTS;
+		chunkIndex = store->chunksCount++;
+		LoggerStoreChunkAt(store, chunkIndex)->bytes = chunkBytes;
+		LoggerStoreChunkAt(store, chunkIndex)->size = size;
+		store->arenaSize += size;
+		if (length > LOGGER_STORE_LARGE_CONTENTS)
+		{
+			memcpy(chunkBytes, bytes, length);
+			return (uint64_t)chunkIndex << 32;
+		}
+		store->currentChunk = chunkIndex;
+		store->currentChunkUsed = 0;
+	}
+	chunkIndex = store->currentChunk;
+	uint32_t offset = store->currentChunkUsed;
+	memcpy(LoggerStoreChunkAt(store, chunkIndex)->bytes + offset, bytes, length);
+	store->currentChunkUsed += length;
+	return ((uint64_t)chunkIndex << 32) | offset;
+}
+
+static inline const uint8_t *LoggerStoreBytesAt(const LoggerMessageStore *store, uint64_t ref)
+{
+	return LoggerStoreChunkAt(store, (uint32_t)(ref >> 32))->bytes + (uint32_t)ref;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Strings
+// -----------------------------------------------------------------------------
+static inline LoggerStoreString *LoggerStoreStringAt(const LoggerMessageStore *store, uint32_t stringID)
+{
+	return &LoggerStoreStringPageAt(store, stringID >> LOGGER_STORE_STRING_PAGE_SHIFT)->strings[stringID & (LOGGER_STORE_STRING_PAGE_SIZE - 1)];
+}
+
+static bool LoggerStoreGrowStringsHash(LoggerMessageStore *store)
+{
+	uint32_t newSize = store->stringsHashSize ? store->stringsHashSize * 2 : 4096;
+	uint32_t *newHash = (uint32_t *)calloc(newSize, sizeof(uint32_t));
+	if (newHash == NULL)
+		return false;
+	for (uint32_t stringID = 1; stringID < store->stringsCount; stringID++)
+	{
+		uint32_t slot = LoggerStoreStringAt(store, stringID)->hash & (newSize - 1);
+		while (newHash[slot] != 0)
+			slot = (slot + 1) & (newSize - 1);
+		newHash[slot] = stringID;
+	}
+	free(store->stringsHash);
+	store->stringsHash = newHash;
+	store->stringsHashSize = newSize;
+	return true;
+}
+
+static inline uint32_t LoggerStoreHashString(const uint8_t *bytes, uint32_t length)
+{
+	uint32_t hash = 2166136261U;					// FNV-1a
+	for (uint32_t i = 0; i < length; i++)
+		hash = (hash ^ bytes[i]) * 16777619U;
+	return hash;
+}
+
+static uint32_t LoggerStoreLookupString(LoggerMessageStore *store, const uint8_t *bytes, uint32_t length, uint32_t hash, uint32_t *outSlot)
+{
+	// Look up a string in the hash table, must be called with the mutex held. Returns the
+	// string ID or LOGGER_STORE_NO_STRING, and the slot where the string should be added
+	*outSlot = 0;
+	if (store->stringsHashSize == 0)
+		return LOGGER_STORE_NO_STRING;
+
+	uint32_t slot = hash & (store->stringsHashSize - 1);
+	for (uint32_t stringID; (stringID = store->stringsHash[slot]) != 0; slot = (slot + 1) & (store->stringsHashSize - 1))
+	{
+		LoggerStoreString *str = LoggerStoreStringAt(store, stringID);
+		if (str->hash == hash && str->length == length && memcmp(LoggerStoreBytesAt(store, str->ref), bytes, length) == 0)
+			return stringID;
+	}
+	*outSlot = slot;
+	return LOGGER_STORE_NO_STRING;
+}
+
+static uint32_t LoggerStoreInternString(LoggerMessageStore *store, const uint8_t *bytes, uint32_t length, uint32_t hash)
+{
+	// must be called with the mutex held
+	if (length == 0)
+		return LOGGER_STORE_NO_STRING;
+	if (store->stringsCount * 2 >= store->stringsHashSize && !LoggerStoreGrowStringsHash(store))
+		return LOGGER_STORE_NO_STRING;
+
+	uint32_t slot;
+	uint32_t stringID = LoggerStoreLookupString(store, bytes, length, hash, &slot);
+	if (stringID != LOGGER_STORE_NO_STRING)
+		return stringID;
+
+	stringID = store->stringsCount;
+	uint32_t pageIndex = stringID >> LOGGER_STORE_STRING_PAGE_SHIFT;
+	if (pageIndex == LOGGER_STORE_MAX_STRING_PAGES)
+		return LOGGER_STORE_NO_STRING;
+	if (pageIndex == store->stringPagesCount)
+	{
+		if (!LoggerStoreReserveBlock((void **)store->stringPageBlocks, pageIndex, sizeof(LoggerStoreStringPage *)))
+			return LOGGER_STORE_NO_STRING;
+		LoggerStoreStringPage *page = (LoggerStoreStringPage *)calloc(1, sizeof(LoggerStoreStringPage));
+		if (page == NULL)
+			return LOGGER_STORE_NO_STRING;
+		store->stringPageBlocks[pageIndex >> LOGGER_STORE_BLOCK_SHIFT][pageIndex & (LOGGER_STORE_BLOCK_SIZE - 1)] = page;
+		store->stringPagesCount++;
+	}
+	uint64_t ref = LoggerStoreCopyBytes(store, bytes, length);
+	if (ref == LOGGER_STORE_NO_CONTENTS)
+		return LOGGER_STORE_NO_STRING;
+	LoggerStoreString *str = LoggerStoreStringAt(store, stringID);
+	str->ref = ref;
+	str->length = length;
+	str->hash = hash;
+	store->stringsHash[slot] = stringID;
+	__atomic_store_n(&store->stringsCount, stringID + 1, __ATOMIC_RELEASE);
+	return stringID;
+}
+
+uint32_t LoggerMessageStoreInternString(LoggerMessageStore *store, const uint8_t *bytes, uint32_t length)
+{
+	uint32_t hash = LoggerStoreHashString(bytes, length);
+	pthread_mutex_lock(&store->mutex);
+	uint32_t stringID = LoggerStoreInternString(store, bytes, length, hash);
+	pthread_mutex_unlock(&store->mutex);
+	return stringID;
+}
+
+uint32_t LoggerMessageStoreFindString(LoggerMessageStore *store, const uint8_t *bytes, uint32_t length)
+{
+	// Returns the ID of a string if it was interned, without adding it
+	if (length == 0)
+		return LOGGER_STORE_NO_STRING;
+	uint32_t hash = LoggerStoreHashString(bytes, length), slot;
+	pthread_mutex_lock(&store->mutex);
+	uint32_t stringID = LoggerStoreLookupString(store, bytes, length, hash, &slot);
+	pthread_mutex_unlock(&store->mutex);
+	return stringID;
+}
+
+const uint8_t *LoggerMessageStoreGetString(const LoggerMessageStore *store, uint32_t stringID, uint32_t *outLength)
+{
+	if (stringID == LOGGER_STORE_NO_STRING || stringID >= __atomic_load_n(&store->stringsCount, __ATOMIC_ACQUIRE))
+	{
+		*outLength = 0;
+		return NULL;
+	}
+	const LoggerStoreString *str = LoggerStoreStringAt(store, stringID);
+	*outLength = str->length;
+	return LoggerStoreBytesAt(store, str->ref);
+}
+
+uint32_t LoggerMessageStoreStringsCount(const LoggerMessageStore *store)
+{
+	return __atomic_load_n(&store->stringsCount, __ATOMIC_ACQUIRE);
+}
+
+const void *LoggerMessageStoreGetStringObject(const LoggerMessageStore *store, uint32_t stringID)
+{
+	if (stringID == LOGGER_STORE_NO_STRING || stringID >= __atomic_load_n(&store->stringsCount, __ATOMIC_ACQUIRE))
+		return NULL;
+	LoggerStoreStringPage *page = LoggerStoreStringPageAt(store, stringID >> LOGGER_STORE_STRING_PAGE_SHIFT);
+	return __atomic_load_n(&page->objects[stringID & (LOGGER_STORE_STRING_PAGE_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+const void *LoggerMessageStoreSetStringObject(LoggerMessageStore *store, uint32_t stringID, const void *object)
+{
+	// Attach an object to a string unless another thread did it first. Returns the attached object,
+	// the caller is responsible for releasing `object' if it's not the one returned
+	if (stringID == LOGGER_STORE_NO_STRING || stringID >= __atomic_load_n(&store->stringsCount, __ATOMIC_ACQUIRE))
+		return NULL;
+	LoggerStoreStringPage *page = LoggerStoreStringPageAt(store, stringID >> LOGGER_STORE_STRING_PAGE_SHIFT);
+	const void *expected = NULL;
+	if (__atomic_compare_exchange_n(&page->objects[stringID & (LOGGER_STORE_STRING_PAGE_SIZE - 1)], &expected, object,
+									false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return object;
+	return expected;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Messages
+// -----------------------------------------------------------------------------
+static uint64_t LoggerStoreReadInt(const uint8_t *p, uint8_t partType)
+{
+	if (partType == PART_TYPE_INT16)
+		return (((uint32_t)p[0]) << 8) | (uint32_t)p[1];
+	if (partType == PART_TYPE_INT32)
+		return (((uint32_t)p[0]) << 24) | (((uint32_t)p[1]) << 16) | (((uint32_t)p[2]) << 8) | (uint32_t)p[3];
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+static void LoggerStoreParsePart(LoggerMessageStoreParsedPart *part, const uint8_t *p, uint32_t partSize, uint8_t partType, uint64_t value, bool interned)
+{
+	part->bytes = p;
+	part->length = partSize;
+	part->type = partType;
+	part->present = true;
+	part->value = value;
+	part->hash = (interned && partType == PART_TYPE_STRING) ? LoggerStoreHashString(p, partSize) : 0;
+}
+
+bool LoggerMessageStoreParseMessage(const uint8_t *message, uint32_t length, LoggerMessageStoreParsedMessage *parsed)
+{
+	memset(parsed, 0, sizeof(LoggerMessageStoreParsedMessage));
+	if (length < 2)
+		return false;
+	const uint8_t *p = message + 2;
+	const uint8_t *end = message + length;
+	uint16_t partCount = (uint16_t)((message[0] << 8) | message[1]);
+	while (partCount--)
+	{
+		if (end - p < 2)
+			break;
+		uint8_t partKey = *p++;
+		uint8_t partType = *p++;
+		uint32_t partSize;
+		if (partType == PART_TYPE_INT16)
+			partSize = 2;
+		else if (partType == PART_TYPE_INT32)
+			partSize = 4;
+		else if (partType == PART_TYPE_INT64)
+			partSize = 8;
+		else
+		{
+			if (end - p < 4)
+				break;
+			partSize = (uint32_t)LoggerStoreReadInt(p, PART_TYPE_INT32);
+			p += 4;
+		}
+		if ((size_t)(end - p) < partSize)
+			break;
+		bool isInt = (partType == PART_TYPE_INT16 || partType == PART_TYPE_INT32 || partType == PART_TYPE_INT64);
+		uint64_t value = isInt ? LoggerStoreReadInt(p, partType) : 0;
+		switch (partKey)
+		{
+			case PART_KEY_MESSAGE_TYPE:
+				parsed->type = (uint8_t)value;
+				break;
+			case PART_KEY_MESSAGE_SEQ:
+				parsed->sequence = (uint32_t)value;
+				break;
+			case PART_KEY_TIMESTAMP_S:
+				parsed->seconds = (partType == PART_TYPE_INT64) ? (int64_t)value : (int64_t)(uint32_t)value;
+				break;
+			case PART_KEY_TIMESTAMP_MS:
+				parsed->microseconds = (int64_t)value * 1000;
+				break;
+			case PART_KEY_TIMESTAMP_US:
+				parsed->microseconds = (int64_t)value;
+				break;
+			case PART_KEY_TIMESTAMP_NS:
+				parsed->hasMonotonicTimestamp = true;
+				parsed->monotonicTimestamp = (int64_t)value;
+				break;
+			case PART_KEY_TIMESTAMP_ANCHOR_NS:
+				parsed->hasClockAnchor = true;
+				parsed->clockAnchor = (int64_t)value;
+				break;
+			case PART_KEY_THREAD_ID:
+				LoggerStoreParsePart(&parsed->threadID, p, partSize, partType, value, true);
+				break;
+			case PART_KEY_TAG:
+				LoggerStoreParsePart(&parsed->tag, p, partSize, partType, value, true);
+				break;
+			case PART_KEY_LEVEL:
+				parsed->level = (int16_t)value;
+				break;
+			case PART_KEY_MESSAGE:
+				if (partType == PART_TYPE_STRING || partType == PART_TYPE_BINARY || partType == PART_TYPE_IMAGE || partType == PART_TYPE_STRING_REF)
+					LoggerStoreParsePart(&parsed->contents, p, partSize, partType, value, false);
+				break;
+			case PART_KEY_IMAGE_WIDTH:
+				parsed->imageWidth = (uint32_t)value;
+				break;
+			case PART_KEY_IMAGE_HEIGHT:
+				parsed->imageHeight = (uint32_t)value;
+				break;
+			case PART_KEY_FILENAME:
+				LoggerStoreParsePart(&parsed->filename, p, partSize, partType, value, true);
+				break;
+			case PART_KEY_FUNCTIONNAME:
+				LoggerStoreParsePart(&parsed->functionName, p, partSize, partType, value, true);
+				break;
+			case PART_KEY_LINENUMBER:
+				parsed->lineNumber = (int32_t)value;
+				break;
+			default:
+				parsed->hasExtraParts = true;
+				break;
+		}
+		p += partSize;
+	}
+	return true;
+}
+
+static uint32_t LoggerStoreResolveStringRef(LoggerMessageStore *store, const LoggerMessageStoreParsedPart *part, LoggerMessageStoreDecodeContext *context)
+{
+	// Intern the string a v2 message part refers to. Must be called without the mutex held: the
+	// callback interns the string through LoggerMessageStoreInternString()
+	if (!part->present || part->type != PART_TYPE_STRING_REF || part->length != 4 || context->internStringRef == NULL)
+		return LOGGER_STORE_NO_STRING;
+	return context->internStringRef(context->info, store, (uint32_t)LoggerStoreReadInt(part->bytes, PART_TYPE_INT32));
+}
+
+static uint32_t LoggerStoreInternPart(LoggerMessageStore *store, const LoggerMessageStoreParsedPart *part, uint32_t resolvedStringRef)
+{
+	// must be called with the mutex held, string references were resolved before
+	if (!part->present)
+		return LOGGER_STORE_NO_STRING;
+	if (part->type == PART_TYPE_STRING)
+		return LoggerStoreInternString(store, part->bytes, part->length, part->hash);
+	if (part->type == PART_TYPE_STRING_REF)
+		return resolvedStringRef;
+	return LOGGER_STORE_NO_STRING;
+}
+
+int64_t LoggerMessageStoreAppendParsedMessage(LoggerMessageStore *store, const LoggerMessageStoreParsedMessage *parsed, LoggerMessageStoreDecodeContext *context)
+{
+	// Strings the message refers to are interned first: the row is picked and filled in one go
+	// with the mutex held, so that another writer can't take the same row
+	uint32_t threadRef = LoggerStoreResolveStringRef(store, &parsed->threadID, context);
+	uint32_t tagRef = LoggerStoreResolveStringRef(store, &parsed->tag, context);
+	uint32_t filenameRef = LoggerStoreResolveStringRef(store, &parsed->filename, context);
+	uint32_t functionNameRef = LoggerStoreResolveStringRef(store, &parsed->functionName, context);
+	uint32_t contentsStringID = LoggerStoreResolveStringRef(store, &parsed->contents, context);
+
+	pthread_mutex_lock(&store->mutex);
+	uint32_t row = store->count;
+	uint32_t pageIndex = row >> LOGGER_STORE_PAGE_SHIFT;
+	if (pageIndex == LOGGER_STORE_MAX_PAGES)
+	{
+		pthread_mutex_unlock(&store->mutex);
+		return -1;
+	}
+	if (pageIndex == store->pagesCount)
+	{
+		LoggerMessageStorePage *newPage = NULL;
+		if (LoggerStoreReserveBlock((void **)store->pageBlocks, pageIndex, sizeof(LoggerMessageStorePage *)))
+			newPage = (LoggerMessageStorePage *)malloc(sizeof(LoggerMessageStorePage));
+		if (newPage == NULL)
+		{
+			pthread_mutex_unlock(&store->mutex);
+			return -1;
+		}
+		store->pageBlocks[pageIndex >> LOGGER_STORE_BLOCK_SHIFT][pageIndex & (LOGGER_STORE_BLOCK_SIZE - 1)] = newPage;
+		store->pagesCount++;
+	}
+	LoggerMessageStorePage *page = LoggerStorePageAt(store, pageIndex);
+	uint32_t i = row & (LOGGER_STORE_PAGE_ROWS - 1);
+
+	context->clockAnchorChanged = parsed->hasClockAnchor;
+	if (parsed->hasClockAnchor)
+		context->clockAnchor = parsed->clockAnchor;
+	context->imageWidth = parsed->imageWidth;
+	context->imageHeight = parsed->imageHeight;
+	context->hasExtraParts = parsed->hasExtraParts;
+
+	uint32_t threadID;
+	const LoggerMessageStoreParsedPart *thread = &parsed->threadID;
+	if (thread->present && (thread->type == PART_TYPE_INT32 || thread->type == PART_TYPE_INT64))
+	{
+		char name[32];
+		int n = (thread->type == PART_TYPE_INT32) ? snprintf(name, sizeof(name), "Thread 0x%x", (uint32_t)thread->value)
+												  : snprintf(name, sizeof(name), "Thread 0x%llx", (unsigned long long)thread->value);
+		threadID = LoggerStoreInternString(store, (const uint8_t *)name, (uint32_t)n, LoggerStoreHashString((const uint8_t *)name, (uint32_t)n));
+	}
+	else
+		threadID = LoggerStoreInternPart(store, thread, threadRef);
+	uint32_t tagID = LoggerStoreInternPart(store, &parsed->tag, tagRef);
+	uint32_t filenameID = LoggerStoreInternPart(store, &parsed->filename, filenameRef);
+	uint32_t functionNameID = LoggerStoreInternPart(store, &parsed->functionName, functionNameRef);
+
+	uint64_t contentsLocation = LOGGER_STORE_NO_CONTENTS;
+	uint32_t contentsLength = 0;
+	uint8_t contentsType = PART_TYPE_STRING;
+	const LoggerMessageStoreParsedPart *contents = &parsed->contents;
+	if (contents->present && contents->type == PART_TYPE_STRING_REF)
+	{
+		if (contentsStringID != LOGGER_STORE_NO_STRING)
+		{
+			const LoggerStoreString *str = LoggerStoreStringAt(store, contentsStringID);
+			contentsLocation = str->ref;
+			contentsLength = str->length;
+		}
+	}
+	else if (contents->present)
+	{
+		contentsType = contents->type;
+		if (contents->length)
+		{
+			contentsLocation = LoggerStoreCopyBytes(store, contents->bytes, contents->length);
+			if (contentsLocation != LOGGER_STORE_NO_CONTENTS)
+				contentsLength = contents->length;
+		}
+	}
+
+	int64_t seconds = parsed->seconds, microseconds = parsed->microseconds;
+	if (parsed->hasMonotonicTimestamp)
+	{
+		// monotonic timestamps are relative to the clock anchor the client sent in its client info message
+		int64_t ns = context->clockAnchor + parsed->monotonicTimestamp;
+		seconds = ns / 1000000000LL;
+		microseconds = (ns % 1000000000LL) / 1000;
+	}
+
+	page->timestamps[i] = seconds * 1000000LL + microseconds;
+	page->sequences[i] = parsed->sequence;
+	page->lineNumbers[i] = parsed->lineNumber;
+	page->tagIDs[i] = tagID;
+	page->threadIDs[i] = threadID;
+	page->filenameIDs[i] = filenameID;
+	page->functionNameIDs[i] = functionNameID;
+	page->contentsRefs[i] = contentsLocation;
+	page->contentsLengths[i] = contentsLength;
+	page->levels[i] = parsed->level;
+	page->types[i] = parsed->type;
+	page->contentsTypes[i] = contentsType;
+	__atomic_store_n(&store->count, row + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&store->mutex);
+	return row;
+}
+
+int64_t LoggerMessageStoreAppendMessage(LoggerMessageStore *store, const uint8_t *message, uint32_t length, LoggerMessageStoreDecodeContext *context)
+{
+	LoggerMessageStoreParsedMessage parsed;
+	LoggerMessageStoreParseMessage(message, length, &parsed);
+	return LoggerMessageStoreAppendParsedMessage(store, &parsed, context);
+}
+
+uint32_t LoggerMessageStoreCount(const LoggerMessageStore *store)
+{
+	return __atomic_load_n(&store->count, __ATOMIC_ACQUIRE);
+}
+
+const LoggerMessageStorePage *LoggerMessageStoreGetPage(const LoggerMessageStore *store, uint32_t row)
+{
+	// Returns the page that contains `row'. Rows in the page are at index (row & (LOGGER_STORE_PAGE_ROWS - 1))
+	return LoggerStorePageAt(store, row >> LOGGER_STORE_PAGE_SHIFT);
+}
+
+const uint8_t *LoggerMessageStoreGetContents(const LoggerMessageStore *store, uint32_t row, uint32_t *outLength)
+{
+	const LoggerMessageStorePage *page = LoggerMessageStoreGetPage(store, row);
+	uint32_t i = row & (LOGGER_STORE_PAGE_ROWS - 1);
+	*outLength = page->contentsLengths[i];
+	if (page->contentsRefs[i] == LOGGER_STORE_NO_CONTENTS)
+		return NULL;
+	return LoggerStoreBytesAt(store, page->contentsRefs[i]);
+}
+
+size_t LoggerMessageStoreMemoryUsage(const LoggerMessageStore *store)
+{
+	size_t size = sizeof(LoggerMessageStore) + store->arenaSize + store->stringsHashSize * sizeof(uint32_t);
+	size += store->pagesCount * sizeof(LoggerMessageStorePage);
+	size += store->stringPagesCount * sizeof(LoggerStoreStringPage);
+	size += ((store->pagesCount + LOGGER_STORE_BLOCK_SIZE - 1) / LOGGER_STORE_BLOCK_SIZE) * LOGGER_STORE_BLOCK_SIZE * sizeof(LoggerMessageStorePage *);
+	size += ((store->chunksCount + LOGGER_STORE_BLOCK_SIZE - 1) / LOGGER_STORE_BLOCK_SIZE) * LOGGER_STORE_BLOCK_SIZE * sizeof(LoggerStoreChunk);
+	size += ((store->stringPagesCount + LOGGER_STORE_BLOCK_SIZE - 1) / LOGGER_STORE_BLOCK_SIZE) * LOGGER_STORE_BLOCK_SIZE * sizeof(LoggerStoreStringPage *);
+	if (store->textIndex != NULL)
+		size += LoggerTextIndexMemoryUsage(store->textIndex);
+	return size;
+}
+
+void LoggerMessageStoreSetTextIndex(LoggerMessageStore *store, LoggerTextIndex *index)
+{
+	LoggerTextIndexDispose(store->textIndex);
+	store->textIndex = index;
+}
+
+LoggerTextIndex *LoggerMessageStoreGetTextIndex(const LoggerMessageStore *store)
+{
+	return store->textIndex;
+}
@@ -0,0 +1,165 @@
+/*
+ * LoggerMessageStore.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_MESSAGE_STORE_H
+#define LOGGER_MESSAGE_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Columnar storage for the messages received on a connection.
+ *
+ * Each received message is a row. Its values are stored in parallel arrays (columns), grouped in
+ * pages of LOGGER_STORE_PAGE_ROWS rows. Pages are never moved once allocated, so rows that have been
+ * published (row < LoggerMessageStoreCount()) can be read from any thread without locking while the
+ * connection keeps appending messages.
+ *
+ * Tags, thread names, file and function names are interned: columns contain string IDs. Message
+ * contents (text, binary data or image) are copied to an append-only arena. This is written in plain
+ * C so that it can be benchmarked outside of the viewer (see Tools/StoreBenchmark).
+ */
+
+#define LOGGER_STORE_PAGE_SHIFT		12
+#define LOGGER_STORE_PAGE_ROWS		(1U << LOGGER_STORE_PAGE_SHIFT)
+#define LOGGER_STORE_MAX_PAGES		16384					// up to 64M messages per connection
+#define LOGGER_STORE_NO_STRING		0						// string ID of absent strings
+#define LOGGER_STORE_NO_CONTENTS	UINT64_MAX				// contents reference of messages without contents
+
+typedef struct
+{
+	int64_t timestamps[LOGGER_STORE_PAGE_ROWS];				// microseconds since 01.01.1970
+	uint32_t sequences[LOGGER_STORE_PAGE_ROWS];
+	int32_t lineNumbers[LOGGER_STORE_PAGE_ROWS];
+	uint32_t tagIDs[LOGGER_STORE_PAGE_ROWS];
+	uint32_t threadIDs[LOGGER_STORE_PAGE_ROWS];
+	uint32_t filenameIDs[LOGGER_STORE_PAGE_ROWS];
+	uint32_t functionNameIDs[LOGGER_STORE_PAGE_ROWS];
+	uint64_t contentsRefs[LOGGER_STORE_PAGE_ROWS];			// location of the message contents in the arena
+	uint32_t contentsLengths[LOGGER_STORE_PAGE_ROWS];
+	int16_t levels[LOGGER_STORE_PAGE_ROWS];
+	uint8_t types[LOGGER_STORE_PAGE_ROWS];					// LOGMSG_TYPE_*
+	uint8_t contentsTypes[LOGGER_STORE_PAGE_ROWS];			// PART_TYPE_STRING, PART_TYPE_BINARY or PART_TYPE_IMAGE
+} LoggerMessageStorePage;
+
+typedef struct LoggerMessageStore LoggerMessageStore;
+typedef struct LoggerTextIndex LoggerTextIndex;
+
+typedef struct
+{
+	// in: the connection's client clock anchor, out: updated if the message contains a PART_KEY_TIMESTAMP_ANCHOR_NS part
+	int64_t clockAnchor;
+	bool clockAnchorChanged;
+
+	// called to intern the strings v2 messages refer to (PART_TYPE_STRING_REF), may be NULL. Called before
+	// the store is locked, it can intern strings with LoggerMessageStoreInternString()
+	uint32_t (*internStringRef)(void *info, LoggerMessageStore *store, uint32_t wireStringID);
+	void *info;
+
+	// out: values that don't have their own column
+	uint32_t imageWidth;
+	uint32_t imageHeight;
+	bool hasExtraParts;										// the message has parts with non-standard keys
+} LoggerMessageStoreDecodeContext;
+
+LoggerMessageStore *LoggerMessageStoreCreate(void (*releaseObject)(const void *object));
+LoggerMessageStore *LoggerMessageStoreRetain(LoggerMessageStore *store);
+void LoggerMessageStoreRelease(LoggerMessageStore *store);
+
+// Identifies the store for the lifetime of the process, unlike its address which may be reused
+uint64_t LoggerMessageStoreGetIdentifier(const LoggerMessageStore *store);
+
+// Append a message in the NSLogger v1 wire format (without its size word). Returns the row
+// of the message, or -1 if it can't be stored. Only one thread may append at a time.
+int64_t LoggerMessageStoreAppendMessage(LoggerMessageStore *store, const uint8_t *message, uint32_t length, LoggerMessageStoreDecodeContext *context);
+
+// Decoding can also be done in two steps, so that messages can be parsed on several threads:
+// LoggerMessageStoreParseMessage reads a message without touching any store and can be called
+// from any thread, then LoggerMessageStoreAppendParsedMessage adds it, one thread at a time and
+// in the order messages were received (a message may set the clock anchor of those that follow).
+// The parsed message points into the message bytes, which must stay valid until it is appended
+typedef struct
+{
+	const uint8_t *bytes;
+	uint64_t value;											// thread IDs can be numbers
+	uint32_t length;
+	uint32_t hash;											// of the bytes of PART_TYPE_STRING names (not of the contents)
+	uint8_t type;
+	bool present;
+} LoggerMessageStoreParsedPart;
+
+typedef struct
+{
+	LoggerMessageStoreParsedPart threadID;
+	LoggerMessageStoreParsedPart tag;
+	LoggerMessageStoreParsedPart filename;
+	LoggerMessageStoreParsedPart functionName;
+	LoggerMessageStoreParsedPart contents;
+	int64_t seconds;
+	int64_t microseconds;
+	int64_t monotonicTimestamp;
+	int64_t clockAnchor;
+	uint32_t sequence;
+	uint32_t imageWidth;
+	uint32_t imageHeight;
+	int32_t lineNumber;
+	int16_t level;
+	uint8_t type;
+	bool hasMonotonicTimestamp;
+	bool hasClockAnchor;
+	bool hasExtraParts;
+} LoggerMessageStoreParsedMessage;
+
+bool LoggerMessageStoreParseMessage(const uint8_t *message, uint32_t length, LoggerMessageStoreParsedMessage *parsed);
+int64_t LoggerMessageStoreAppendParsedMessage(LoggerMessageStore *store, const LoggerMessageStoreParsedMessage *parsed, LoggerMessageStoreDecodeContext *context);
+
+// Number of rows that can be read
+uint32_t LoggerMessageStoreCount(const LoggerMessageStore *store);
+const LoggerMessageStorePage *LoggerMessageStoreGetPage(const LoggerMessageStore *store, uint32_t row);
+const uint8_t *LoggerMessageStoreGetContents(const LoggerMessageStore *store, uint32_t row, uint32_t *outLength);
+
+// Interned strings. Each string can also have an object attached (i.e. the NSString built from
+// its bytes), released with the function passed to LoggerMessageStoreCreate()
+uint32_t LoggerMessageStoreInternString(LoggerMessageStore *store, const uint8_t *bytes, uint32_t length);
+uint32_t LoggerMessageStoreFindString(LoggerMessageStore *store, const uint8_t *bytes, uint32_t length);
+const uint8_t *LoggerMessageStoreGetString(const LoggerMessageStore *store, uint32_t stringID, uint32_t *outLength);
+uint32_t LoggerMessageStoreStringsCount(const LoggerMessageStore *store);
+const void *LoggerMessageStoreGetStringObject(const LoggerMessageStore *store, uint32_t stringID);
+const void *LoggerMessageStoreSetStringObject(LoggerMessageStore *store, uint32_t stringID, const void *object);
+
+// Number of bytes allocated by the store, including its text index
+size_t LoggerMessageStoreMemoryUsage(const LoggerMessageStore *store);
+
+// Index of the message texts (see LoggerTextIndex.h). The store takes ownership of the index,
+// which must be set before the store is used by other threads
+void LoggerMessageStoreSetTextIndex(LoggerMessageStore *store, LoggerTextIndex *index);
+LoggerTextIndex *LoggerMessageStoreGetTextIndex(const LoggerMessageStore *store);
+
+#endif
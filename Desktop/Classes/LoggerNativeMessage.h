@@ -29,11 +29,30 @@
  * 
  */
 #import "LoggerMessage.h"
+#import "LoggerMessageStore.h"
 
 @class LoggerConnection;
 
 @interface LoggerNativeMessage : LoggerMessage
 
+// Decode a message (without its 4 bytes size) and append it to the connection's message store.
+// The data is not retained, the message values are read back from the store, which the message keeps
+// alive. Client info messages are returned as messages keeping their values (see LoggerMessage)
 - (id)initWithData:(NSData *)data connection:(LoggerConnection *)aConnection;
 
+// The store and row the message values are read from, used to filter messages on the store columns.
+// `storedFields' tells which kStored* values come from the store. The store is returned retained,
+// unless it is `heldStore': callers going through many messages keep a reference to the store of
+// the previous ones and don't need another one
+- (LoggerMessageStore *)retainStore:(uint32_t *)outRow storedFields:(uint8_t *)outStoredFields unlessHeld:(LoggerMessageStore *)heldStore;
+
 @end
+
+// Values read from the store unless they were set on the message. The message type, level,
+// timestamp, line number, file and function names always come from the store. The tag ID is kept
+// by the message, kStoredTag tells whether the store's tag column still has the message's tag
+enum {
+	kStoredMessage		= 0x01,
+	kStoredTag			= 0x02,
+	kStoredThreadID		= 0x04
+};
@@ -29,166 +29,101 @@
  *
  */
 #import "LoggerNativeMessage.h"
+#import "LoggerConnection.h"
 #import "LoggerCommon.h"
+#import "LoggerMessageStore.h"
 
 @implementation LoggerNativeMessage
+{
+	LoggerMessageStore *_store;		// store the message values live in, retained for the lifetime of the message
+	uint32_t _row;
+	uint8_t _overrides;				// kStored* flags of the values set on the message itself (accessed atomically)
+	NSMutableDictionary *_values;	// values set on the message or not kept by the store (rare), with the message locked
+}
+
+// value of the message's row in a column of the store
+#define ROW_VALUE(column)	([self page]->column[_row & (LOGGER_STORE_PAGE_ROWS - 1)])
+
+static uint64_t ReadIntPart(const uint8_t *p, uint8_t partType)
+{
+	if (partType == PART_TYPE_INT16)
+		return (((uint32_t)p[0]) << 8) | (uint32_t)p[1];
+	if (partType == PART_TYPE_INT32)
+		return (((uint32_t)p[0]) << 24) | (((uint32_t)p[1]) << 16) | (((uint32_t)p[2]) << 8) | (uint32_t)p[3];
+	uint64_t value64;
+	memcpy(&value64, p, 8);
+	return CFSwapInt64BigToHost(value64);
+}
+
+static uint32_t InternWireString(void *info, LoggerMessageStore *store, uint32_t wireStringID)
+{
+	// reference to a string the client already sent on this connection (v2 protocol)
+	NSString *s = [(__bridge LoggerConnection *)info wireStringWithID:wireStringID];
+	if (s == nil)
+		return LOGGER_STORE_NO_STRING;
+	const char *utf8 = [s UTF8String];
+	return LoggerMessageStoreInternString(store, (const uint8_t *)utf8, (uint32_t)strlen(utf8));
+}
+
+static NSString *StoreString(LoggerMessageStore *store, uint32_t stringID)
+{
+	// Strings built from the store's interned strings are shared by all the messages that use them
+	if (stringID == LOGGER_STORE_NO_STRING)
+		return nil;
+	const void *object = LoggerMessageStoreGetStringObject(store, stringID);
+	if (object == NULL)
+	{
+		uint32_t length;
+		const uint8_t *bytes = LoggerMessageStoreGetString(store, stringID, &length);
+		NSString *s = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+		if (s == nil)
+			return nil;
+		const void *newObject = CFBridgingRetain(s);
+		object = LoggerMessageStoreSetStringObject(store, stringID, newObject);
+		if (object != newObject)
+			CFRelease(newObject);
+	}
+	return (__bridge NSString *)object;
+}
 
 - (id)initWithData:(NSData *)data connection:(LoggerConnection *)aConnection
 {
 	if ((self = [super init]) != nil)
 	{
-		// decode message contents
-		uint8_t *p = (uint8_t *)[data bytes];
-		uint16_t partCount;
-		memcpy(&partCount, p, 2);
-		partCount = ntohs(partCount);
-		p += 2;
-		while (partCount--)
+		_store = [aConnection retainedMessageStore];
+		if (_store == NULL)
+			return nil;
+		LoggerMessageStoreDecodeContext context = {
+			.clockAnchor = aConnection.clientClockAnchor,
+			.internStringRef = &InternWireString,
+			.info = (__bridge void *)aConnection
+		};
+		int64_t row = LoggerMessageStoreAppendMessage(_store, (const uint8_t *)[data bytes], (uint32_t)[data length], &context);
+		if (row < 0)
+			return nil;
+		_row = (uint32_t)row;
+		if (context.clockAnchorChanged)
 		{
-			uint8_t partKey = *p++;
-			uint8_t partType = *p++;
-			uint32_t partSize;
-			if (partType == PART_TYPE_INT16)
-				partSize = 2;
-			else if (partType == PART_TYPE_INT32)
-				partSize = 4;
-			else if (partType == PART_TYPE_INT64)
-				partSize = 8;
-			else
-			{
-				memcpy(&partSize, p, 4);
-				p += 4;
-				partSize = ntohl(partSize);
-			}
-			id part = nil;
-			uint32_t value32 = 0;
-			uint64_t value64 = 0;
-			if (partSize > 0)
-			{
-				if (partType == PART_TYPE_STRING)
-				{
-					part = [[NSString alloc] initWithBytes:p length:partSize encoding:NSUTF8StringEncoding];
-				}
-				else if (partType == PART_TYPE_BINARY || partType == PART_TYPE_IMAGE)
-				{
-					part = [[NSData alloc] initWithBytes:p length:partSize];
-				}
-				else if (partType == PART_TYPE_INT16)
-				{
-					value32 = (((uint32_t)p[0]) << 8) | (uint32_t)p[1];
-				}
-				else if (partType == PART_TYPE_INT32)
-				{
-					value32 = (((uint32_t)p[0]) << 24) | (((uint32_t)p[1]) << 16) | (((uint32_t)p[2]) << 8) | (uint32_t)p[3];
-				}
-				else if (partType == PART_TYPE_INT64)
-				{
-					memcpy(&value64, p, 8);
-					value64 = CFSwapInt64BigToHost(value64);
-				}
-				p += partSize;
-			}
-			switch (partKey)
-			{
-				case PART_KEY_MESSAGE_TYPE:
-					self.type = (short)value32;
-					break;
-				case PART_KEY_MESSAGE_SEQ:
-					self.sequence = value32;
-					break;
-				case PART_KEY_TIMESTAMP_S:
-				{
-					// timestamp with seconds-level resolution
-					struct timeval ts = self.timestamp;
-					ts.tv_sec = (partType == PART_TYPE_INT64) ? (__darwin_time_t) value64 : (__darwin_time_t) value32;
-					self.timestamp = ts;
-					break;
-				}
-				case PART_KEY_TIMESTAMP_MS:
-				{
-					// millisecond part of the timestamp (optional)
-					struct timeval ts = self.timestamp;
-					ts.tv_usec = ((partType == PART_TYPE_INT64) ? (__darwin_suseconds_t) value64 : (__darwin_suseconds_t) value32) * 1000;
-					self.timestamp = ts;
-					break;
-				}
-				case PART_KEY_TIMESTAMP_US:
-				{
-					// microsecond part of the timestamp (optional)
-					struct timeval ts = self.timestamp;
-					ts.tv_usec = (partType == PART_TYPE_INT64) ? (__darwin_suseconds_t) value64 : (__darwin_suseconds_t) value32;
-					self.timestamp = ts;
-					break;
-				}
-				case PART_KEY_THREAD_ID:
-					if (partType == PART_TYPE_INT32)
-						self.threadID = [[NSString alloc] initWithFormat:@"Thread 0x%x", value32];
-					else if (partType == PART_TYPE_INT64)
-						self.threadID = [[NSString alloc] initWithFormat:@"Thread 0x%qx", value64];
-					else if (partType == PART_TYPE_STRING)
-						self.threadID = part;
-					else
-						self.threadID = @"";
-					break;
-				case PART_KEY_TAG:
-					self.tag = (NSString *)part;
-					break;
-				case PART_KEY_LEVEL:
-					if (partType == PART_TYPE_INT16 || partType == PART_TYPE_INT32)
-						self.level = (short)value32;
-					else if (partType == PART_TYPE_INT64)
-						self.level = (short)value64;
-					break;
-				case PART_KEY_MESSAGE:
-					self.message = part;
-					if (partType == PART_TYPE_STRING)
-						self.contentsType = kMessageString;
-					else if (partType == PART_TYPE_BINARY)
-						self.contentsType = kMessageData;
-					else if (partType == PART_TYPE_IMAGE)
-						self.contentsType = kMessageImage;
-					break;
-				case PART_KEY_IMAGE_WIDTH:
-					if (partType == PART_TYPE_INT16 || partType == PART_TYPE_INT32)
-						self.imageSize = NSMakeSize(value32, self.imageSize.height);
-					else if (partType == PART_TYPE_INT64)
-						self.imageSize = NSMakeSize(value64, self.imageSize.height);
-					break;
-				case PART_KEY_IMAGE_HEIGHT:
-					if (partType == PART_TYPE_INT16 || partType == PART_TYPE_INT32)
-						self.imageSize = NSMakeSize(self.imageSize.width, value32);
-					else if (partType == PART_TYPE_INT64)
-						self.imageSize = NSMakeSize(self.imageSize.width,value64);
-					break;
-				case PART_KEY_FILENAME:
-					if (part != nil)
-						[self setFilename:part connection:aConnection];
-					break;
-				case PART_KEY_FUNCTIONNAME:
-					if (part!= nil)
-						[self setFunctionName:part connection:aConnection];
-					break;
-				case PART_KEY_LINENUMBER:
-					if (partType == PART_TYPE_INT16 || partType == PART_TYPE_INT32)
-						self.lineNumber = value32;
-					else if (partType == PART_TYPE_INT64)
-						self.lineNumber = (int)value64;
-					break;
-				default: {
-					// all other keys are automatically added to the parts dictionary
-					if (self.parts == nil)
-						self.parts = [[NSMutableDictionary alloc] init];
-					NSNumber *partKeyNumber = [[NSNumber alloc] initWithUnsignedInteger:partKey];
-					if (partType == PART_TYPE_INT32)
-						part = [[NSNumber alloc] initWithInteger:value32];
-					else if (partType == PART_TYPE_INT64)
-						part = [[NSNumber alloc] initWithUnsignedLongLong:value64];
-					if (part != nil)
-						((NSMutableDictionary *) self.parts)[partKeyNumber] = part;
-					break;
-				}
-			}
+			// part of the client info message: remember the client clock anchor
+			// for all messages that follow on this connection
+			aConnection.clientClockAnchor = context.clockAnchor;
 		}
+
+		// the message values are read from the store, the tag is also interned in the global table of tags
+		if (context.imageWidth || context.imageHeight)
+			self.imageSize = NSMakeSize(context.imageWidth, context.imageHeight);
+		NSString *s = StoreString(_store, ROW_VALUE(tagIDs));
+		if (s != nil)
+			[super setTag:s];
+
+		// non-standard parts (i.e. client info) are rare, they go to the parts dictionary
+		if (context.hasExtraParts)
+			[self decodeExtraParts:data connection:aConnection];
+
+		// The client info message stays in the messages list when the messages of its store are
+		// cleared or evicted: it keeps its values itself so that it doesn't hold on to the store
+		if (self.type == LOGMSG_TYPE_CLIENTINFO)
+			return [self objectMessageWithConnection:aConnection];
 	}
 #if 0
 	// Debug tool to log the original image (until we have DnD)
@@ -219,4 +154,242 @@
 	return self;
 }
 
+- (void)dealloc
+{
+	LoggerMessageStoreRelease(_store);
+}
+
+- (void)decodeExtraParts:(NSData *)data connection:(LoggerConnection *)aConnection
+{
+	NSMutableDictionary *dict = [[NSMutableDictionary alloc] init];
+	const uint8_t *p = (const uint8_t *)[data bytes];
+	const uint8_t *end = p + [data length];
+	if (end - p < 2)
+		return;
+	uint16_t partCount = (uint16_t)((p[0] << 8) | p[1]);
+	p += 2;
+	while (partCount--)
+	{
+		if (end - p < 2)
+			break;
+		uint8_t partKey = *p++;
+		uint8_t partType = *p++;
+		uint32_t partSize;
+		if (partType == PART_TYPE_INT16)
+			partSize = 2;
+		else if (partType == PART_TYPE_INT32)
+			partSize = 4;
+		else if (partType == PART_TYPE_INT64)
+			partSize = 8;
+		else
+		{
+			if (end - p < 4)
+				break;
+			partSize = (uint32_t)ReadIntPart(p, PART_TYPE_INT32);
+			p += 4;
+		}
+		if ((NSUInteger)(end - p) < partSize)
+			break;
+		if (partKey > PART_KEY_TIMESTAMP_NS && partKey != PART_KEY_TIMESTAMP_ANCHOR_NS)
+		{
+			id part = nil;
+			if (partType == PART_TYPE_INT32)
+				part = [[NSNumber alloc] initWithInteger:(uint32_t)ReadIntPart(p, partType)];
+			else if (partType == PART_TYPE_INT64)
+				part = [[NSNumber alloc] initWithUnsignedLongLong:ReadIntPart(p, partType)];
+			else if (partType == PART_TYPE_STRING_REF && partSize == 4)
+				part = [aConnection wireStringWithID:(uint32_t)ReadIntPart(p, PART_TYPE_INT32)];
+			else if (partType == PART_TYPE_STRING && partSize > 0)
+				part = [[NSString alloc] initWithBytes:p length:partSize encoding:NSUTF8StringEncoding];
+			else if ((partType == PART_TYPE_BINARY || partType == PART_TYPE_IMAGE) && partSize > 0)
+				part = [[NSData alloc] initWithBytes:p length:partSize];
+			if (part != nil)
+				dict[@((NSUInteger)partKey)] = part;
+		}
+		p += partSize;
+	}
+	if ([dict count])
+		self.parts = dict;
+}
+
+- (LoggerMessage *)objectMessageWithConnection:(LoggerConnection *)aConnection
+{
+	LoggerMessage *message = [[LoggerMessage alloc] init];
+	message.sequence = self.sequence;
+	message.contentsType = self.contentsType;
+	message.parts = self.parts;
+	message.timestamp = self.timestamp;
+	message.tag = self.tag;
+	message.message = self.message;
+	message.type = self.type;
+	message.level = self.level;
+	message.threadID = self.threadID;
+	message.imageSize = self.imageSize;
+	[message setFilename:self.filename connection:aConnection];
+	[message setFunctionName:self.functionName connection:aConnection];
+	message.lineNumber = self.lineNumber;
+	return message;
+}
+
+- (LoggerMessageStore *)retainStore:(uint32_t *)outRow storedFields:(uint8_t *)outStoredFields unlessHeld:(LoggerMessageStore *)heldStore
+{
+	*outRow = _row;
+	*outStoredFields = (uint8_t)(~__atomic_load_n(&_overrides, __ATOMIC_ACQUIRE) & (kStoredMessage | kStoredTag | kStoredThreadID));
+	return (_store == heldStore) ? _store : LoggerMessageStoreRetain(_store);
+}
+
+- (const LoggerMessageStorePage *)page
+{
+	return LoggerMessageStoreGetPage(_store, _row);
+}
+
+- (id)extraValue:(NSString *)key
+{
+	@synchronized (self)
+	{
+		return _values[key];
+	}
+}
+
+- (void)setExtraValue:(id)value forKey:(NSString *)key overriding:(uint8_t)override
+{
+	@synchronized (self)
+	{
+		if (_values == nil)
+			_values = [[NSMutableDictionary alloc] init];
+		if (value != nil)
+			_values[key] = value;
+		else
+			[_values removeObjectForKey:key];
+	}
+	if (override)
+		__atomic_fetch_or(&_overrides, override, __ATOMIC_RELEASE);
+}
+
+- (BOOL)isOverridden:(uint8_t)value
+{
+	return (__atomic_load_n(&_overrides, __ATOMIC_ACQUIRE) & value) != 0;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Properties read from the store
+// -----------------------------------------------------------------------------
+- (NSUInteger)sequence
+{
+	return ROW_VALUE(sequences);
+}
+
+- (struct timeval)timestamp
+{
+	int64_t us = ROW_VALUE(timestamps);
+	struct timeval ts;
+	ts.tv_sec = (__darwin_time_t) (us / 1000000LL);
+	ts.tv_usec = (__darwin_suseconds_t) (us % 1000000LL);
+	return ts;
+}
+
+- (short)type
+{
+	return ROW_VALUE(types);
+}
+
+- (short)level
+{
+	return ROW_VALUE(levels);
+}
+
+- (int)lineNumber
+{
+	return ROW_VALUE(lineNumbers);
+}
+
+- (short)contentsType
+{
+	uint8_t partType = ROW_VALUE(contentsTypes);
+	if (partType == PART_TYPE_BINARY)
+		return kMessageData;
+	if (partType == PART_TYPE_IMAGE)
+		return kMessageImage;
+	return kMessageString;
+}
+
+- (NSString *)filename
+{
+	// file and function names are strings of the store, shared by all its messages
+	NSString *s = StoreString(_store, ROW_VALUE(filenameIDs));
+	return (s != nil) ? s : @"";
+}
+
+- (NSString *)functionName
+{
+	NSString *s = StoreString(_store, ROW_VALUE(functionNameIDs));
+	return (s != nil) ? s : @"";
+}
+
+- (id)message
+{
+	// the contents are not kept by the message, they are copied from the store on each access
+	if ([self isOverridden:kStoredMessage])
+		return [self extraValue:@"message"];
+	uint32_t length;
+	const uint8_t *bytes = LoggerMessageStoreGetContents(_store, _row, &length);
+	if (bytes == NULL)
+		return nil;
+	if (self.contentsType == kMessageString)
+		return [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+	return [[NSData alloc] initWithBytes:bytes length:length];
+}
+
+- (void)setMessage:(id)message
+{
+	[self setExtraValue:message forKey:@"message" overriding:kStoredMessage];
+}
+
+- (void)setTag:(NSString *)tag
+{
+	__atomic_fetch_or(&_overrides, kStoredTag, __ATOMIC_RELEASE);
+	[super setTag:tag];
+}
+
+- (NSString *)threadID
+{
+	if ([self isOverridden:kStoredThreadID])
+		return [self extraValue:@"threadID"];
+	return StoreString(_store, ROW_VALUE(threadIDs));
+}
+
+- (void)setThreadID:(NSString *)threadID
+{
+	[self setExtraValue:threadID forKey:@"threadID" overriding:kStoredThreadID];
+}
+
+- (NSDictionary *)parts
+{
+	return [self extraValue:@"parts"];
+}
+
+- (void)setParts:(NSDictionary *)parts
+{
+	[self setExtraValue:parts forKey:@"parts" overriding:0];
+}
+
+- (NSSize)imageSize
+{
+	// the size sent by the client, or read from the image header once
+	if (self.contentsType != kMessageImage)
+		return NSZeroSize;
+	NSValue *size = [self extraValue:@"imageSize"];
+	if (size != nil)
+		return [size sizeValue];
+	NSSize imageSize = [self imageSizeFromHeader];
+	[self setImageSize:imageSize];
+	return imageSize;
+}
+
+- (void)setImageSize:(NSSize)imageSize
+{
+	[self setExtraValue:[NSValue valueWithSize:imageSize] forKey:@"imageSize" overriding:0];
+}
+
 @end
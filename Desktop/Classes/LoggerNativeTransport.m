@@ -98,30 +98,55 @@
 {
 	NSMutableArray *msgs = [NSMutableArray array];
 	//[self dumpBytes:cnx.tmpBuf length:numBytes];
+	// walk the messages with a cursor, and only remove the consumed bytes from the buffer
+	// once we're done: a single read can bring thousands of small messages
+	const uint8_t *bytes = (const uint8_t *)[cnx.buffer bytes];
 	NSUInteger bufferLength = [cnx.buffer length];
-	while (bufferLength > 4)
+	NSUInteger offset = 0;
+	BOOL invalidFrame = NO;
+	while (bufferLength - offset > 4)
 	{
 		// check whether we have a full message
 		uint32_t length;
-		[cnx.buffer getBytes:&length length:4];
+		memcpy(&length, bytes + offset, 4);
 		length = ntohl(length);
-		if (bufferLength < (length + 4))
+		BOOL v2Frame = (length & LOGGER_FRAME_V2_FLAG) != 0;
+		if (v2Frame)
+			length &= LOGGER_FRAME_SIZE_MASK;
+		if (bufferLength - offset < ((NSUInteger)length + 4))
 			break;
 
-		// get one message
-		CFDataRef subset = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,
-													   (unsigned char *) [cnx.buffer bytes] + 4,
-													   length,
-													   kCFAllocatorNull);
+		// get one message. Messages in the compact v2 format are transcoded to the v1 format first
+		CFDataRef subset;
+		if (v2Frame)
+		{
+			// a v2 frame we can't decode leaves us without the string table and delta bases of the
+			// client: we can't make sense of the rest of the stream
+			subset = (CFDataRef)CFBridgingRetain([cnx messageDataFromV2Frame:bytes + offset + 4 length:length]);
+			if (subset == NULL)
+			{
+				invalidFrame = YES;
+				break;
+			}
+		}
+		else
+			subset = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,
+												 bytes + offset + 4,
+												 length,
+												 kCFAllocatorNull);
 		if (subset != NULL)
 		{
 			// we receive a ClientInfo message only when the client connects. Once we get this message,
 			// the connection is considered being "live" (we need to wait a bit to let SSL negotiation to
 			// take place, and not open a window if it fails).
 			LoggerMessage *message = [[LoggerNativeMessage alloc] initWithData:(__bridge NSData *) subset connection:cnx];
+			if (message != nil)
+				[cnx journalMessage:message data:(__bridge NSData *)subset hasStringRefs:v2Frame];
 			CFRelease(subset);
 			if (message.type == LOGMSG_TYPE_CLIENTINFO)
 			{
+				// the client starts over with v2 string IDs and delta-encoded values after each client info
+				[cnx resetWireProtocolState];
 				message.message = [self clientInfoStringForMessage:message];
 				message.threadID = @"";
 				[cnx clientInfoReceived:message];
@@ -132,12 +157,30 @@
 				[msgs addObject:message];
 			}
 		}
-		[cnx.buffer replaceBytesInRange:NSMakeRange(0, length + 4) withBytes:NULL length:0];
-		bufferLength = [cnx.buffer length];
+		offset += (NSUInteger)length + 4;
+	}
+	if (offset)
+	{
+		[cnx.buffer replaceBytesInRange:NSMakeRange(0, offset) withBytes:NULL length:0];
+		[cnx flushJournal];
+	}
+
+	if (invalidFrame)
+	{
+		struct timeval t;
+		gettimeofday(&t, NULL);
+		LoggerMessage *msg = [[LoggerMessage alloc] init];
+		msg.timestamp = t;
+		msg.type = LOGMSG_TYPE_DISCONNECT;
+		msg.message = NSLocalizedString(@"Client disconnected (invalid data received)", @"");
+		[msgs addObject:msg];
 	}
 
 	if ([msgs count])
 		[cnx messagesReceived:msgs];
+
+	if (invalidFrame)
+		[cnx shutdown];
 }
 
 - (NSString *)clientInfoStringForMessage:(LoggerMessage *)message
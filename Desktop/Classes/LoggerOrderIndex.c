@@ -0,0 +1,158 @@
+/*
+ * LoggerOrderIndex.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "LoggerOrderIndex.h"
+
+struct LoggerOrderIndex
+{
+	int64_t *maxKeys;				// largest key up to each position
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t maxDelay;				// most positions a late key arrived after the first one with a larger or equal key
+};
+
+LoggerOrderIndex *LoggerOrderIndexCreate(void)
+{
+	return (LoggerOrderIndex *)calloc(1, sizeof(LoggerOrderIndex));
+}
+
+void LoggerOrderIndexDispose(LoggerOrderIndex *index)
+{
+	if (index == NULL)
+		return;
+	free(index->maxKeys);
+	free(index);
+}
+
+uint32_t LoggerOrderIndexCount(const LoggerOrderIndex *index)
+{
+	return index->count;
+}
+
+static bool AppendMaxKey(LoggerOrderIndex *index, int64_t maxKey)
+{
+	if (index->count == index->capacity)
+	{
+		uint32_t newCapacity = index->capacity ? index->capacity * 2 : 4096;
+		int64_t *newKeys = (int64_t *)realloc(index->maxKeys, newCapacity * sizeof(int64_t));
+		if (newKeys == NULL)
+			return false;
+		index->maxKeys = newKeys;
+		index->capacity = newCapacity;
+	}
+	index->maxKeys[index->count++] = maxKey;
+	return true;
+}
+
+bool LoggerOrderIndexAppend(LoggerOrderIndex *index, int64_t key)
+{
+	if (index->count == 0 || key >= index->maxKeys[index->count - 1])
+		return AppendMaxKey(index, key);
+
+	// a late key: a range holding it starts at or before its lower bound, and must reach this position
+	uint32_t delay = index->count - LoggerOrderIndexLowerBound(index, key);
+	if (delay > index->maxDelay)
+		index->maxDelay = delay;
+	return AppendMaxKey(index, index->maxKeys[index->count - 1]);
+}
+
+bool LoggerOrderIndexAppendWithoutKey(LoggerOrderIndex *index)
+{
+	return AppendMaxKey(index, index->count ? index->maxKeys[index->count - 1] : INT64_MIN);
+}
+
+bool LoggerOrderIndexInsertWithoutKey(LoggerOrderIndex *index, uint32_t position)
+{
+	// The new position takes the maximum before it, the maximums stay sorted. Late keys after it
+	// whose lower bound is before it are now one more position away
+	if (position >= index->count)
+		return LoggerOrderIndexAppendWithoutKey(index);
+	int64_t maxKey = position ? index->maxKeys[position - 1] : INT64_MIN;
+	if (!AppendMaxKey(index, maxKey))
+		return false;
+	memmove(index->maxKeys + position + 1, index->maxKeys + position, (index->count - 1 - position) * sizeof(int64_t));
+	index->maxKeys[position] = maxKey;
+	if (index->maxDelay && maxKey != INT64_MIN)
+		index->maxDelay++;
+	return true;
+}
+
+void LoggerOrderIndexRemove(LoggerOrderIndex *index, uint32_t position, uint32_t count)
+{
+	// The maximums that stay are still larger than or equal to the keys up to them, and positions
+	// only move back: late keys get closer to their lower bound, never further
+	if (position >= index->count)
+		return;
+	if (count > index->count - position)
+		count = index->count - position;
+	memmove(index->maxKeys + position, index->maxKeys + position + count, (index->count - position - count) * sizeof(int64_t));
+	index->count -= count;
+	if (index->count == 0)
+		index->maxDelay = 0;
+}
+
+void LoggerOrderIndexRemoveAll(LoggerOrderIndex *index)
+{
+	index->count = 0;
+	index->maxDelay = 0;
+}
+
+uint32_t LoggerOrderIndexLowerBound(const LoggerOrderIndex *index, int64_t key)
+{
+	uint32_t low = 0, high = index->count;
+	while (low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if (index->maxKeys[mid] < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+void LoggerOrderIndexRange(const LoggerOrderIndex *index, int64_t minKey, int64_t maxKey, uint32_t *outStart, uint32_t *outEnd)
+{
+	// Keys in order that are <= maxKey come before the first maximum > maxKey. A late key <= maxKey
+	// has its lower bound before that position, it can't be further than maxDelay positions after it
+	uint32_t start = LoggerOrderIndexLowerBound(index, minKey);
+	uint32_t end = (maxKey == INT64_MAX) ? index->count : LoggerOrderIndexLowerBound(index, maxKey + 1);
+	if (index->maxDelay && end < index->count)
+		end = (index->count - end > index->maxDelay) ? end + index->maxDelay + 1 : index->count;
+	*outStart = start;
+	*outEnd = (end > start) ? end : start;
+}
+
+size_t LoggerOrderIndexMemoryUsage(const LoggerOrderIndex *index)
+{
+	return sizeof(LoggerOrderIndex) + index->capacity * sizeof(int64_t);
+}
@@ -0,0 +1,82 @@
+/*
+ * LoggerOrderIndex.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_ORDER_INDEX_H
+#define LOGGER_ORDER_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Index of keys that arrive nearly sorted, like the timestamps and sequence numbers of the messages
+ * of a connection, by position in the connection's messages list (see LoggerConnection).
+ *
+ * For each position, the index keeps the largest key seen up to that position: these running maximums
+ * are sorted, so finding the first position with a key >= K is a binary search. Keys that arrive late
+ * (lower than a key before them) are not lost: the index remembers how many positions after their
+ * place in the sorted order they arrived, and extends the ranges it returns by that many positions.
+ * A few messages logged from different threads and received slightly out of order cost a few more
+ * positions to look at, not a scan.
+ *
+ * Positions without a key of their own (marks, client info) take the running maximum.
+ *
+ * Not thread safe: the connection only uses it with its messages list locked.
+ */
+
+typedef struct LoggerOrderIndex LoggerOrderIndex;
+
+LoggerOrderIndex *LoggerOrderIndexCreate(void);
+void LoggerOrderIndexDispose(LoggerOrderIndex *index);
+
+uint32_t LoggerOrderIndexCount(const LoggerOrderIndex *index);
+
+// Add a position after the last one, with or without a key. Return false if out of memory
+bool LoggerOrderIndexAppend(LoggerOrderIndex *index, int64_t key);
+bool LoggerOrderIndexAppendWithoutKey(LoggerOrderIndex *index);
+
+// Insert a position without a key before `position' (i.e. a mark inserted in the list)
+bool LoggerOrderIndexInsertWithoutKey(LoggerOrderIndex *index, uint32_t position);
+
+// Remove positions. What the index returns stays correct (ranges may get a little wider)
+void LoggerOrderIndexRemove(LoggerOrderIndex *index, uint32_t position, uint32_t count);
+void LoggerOrderIndexRemoveAll(LoggerOrderIndex *index);
+
+// First position whose key is >= `key': keys at the positions before it are all lower.
+// Returns the number of positions if there is none
+uint32_t LoggerOrderIndexLowerBound(const LoggerOrderIndex *index, int64_t key);
+
+// Positions [*outStart, *outEnd) hold all the keys in [minKey, maxKey]: positions outside hold none.
+// Keys that arrived out of order may put positions with keys outside the range in it
+void LoggerOrderIndexRange(const LoggerOrderIndex *index, int64_t minKey, int64_t maxKey, uint32_t *outStart, uint32_t *outEnd);
+
+// Number of bytes allocated by the index
+size_t LoggerOrderIndexMemoryUsage(const LoggerOrderIndex *index);
+
+#endif
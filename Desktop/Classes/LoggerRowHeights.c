@@ -0,0 +1,149 @@
+/*
+ * LoggerRowHeights.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <stdlib.h>
+#include "LoggerRowHeights.h"
+
+struct LoggerRowHeights
+{
+	float *heights;					// height of each row
+	double *sums;					// Fenwick tree: sums[i] is the height of rows (i - lowbit(i), i], 1-based
+	uint32_t count;
+	uint32_t capacity;
+};
+
+static inline uint32_t LowBit(uint32_t i)
+{
+	return i & (~i + 1);
+}
+
+static double PrefixSum(const LoggerRowHeights *rows, uint32_t count)
+{
+	// height of the first `count' rows
+	double sum = 0;
+	for (uint32_t i = count; i > 0; i -= LowBit(i))
+		sum += rows->sums[i];
+	return sum;
+}
+
+LoggerRowHeights *LoggerRowHeightsCreate(void)
+{
+	return (LoggerRowHeights *)calloc(1, sizeof(LoggerRowHeights));
+}
+
+void LoggerRowHeightsDispose(LoggerRowHeights *rows)
+{
+	if (rows == NULL)
+		return;
+	free(rows->heights);
+	free(rows->sums);
+	free(rows);
+}
+
+uint32_t LoggerRowHeightsCount(const LoggerRowHeights *rows)
+{
+	return rows->count;
+}
+
+bool LoggerRowHeightsAppend(LoggerRowHeights *rows, float height)
+{
+	if (rows->count == rows->capacity)
+	{
+		uint32_t newCapacity = rows->capacity ? rows->capacity * 2 : 4096;
+		float *newHeights = (float *)realloc(rows->heights, newCapacity * sizeof(float));
+		if (newHeights == NULL)
+			return false;
+		rows->heights = newHeights;
+		double *newSums = (double *)realloc(rows->sums, (newCapacity + 1) * sizeof(double));
+		if (newSums == NULL)
+			return false;
+		rows->sums = newSums;
+		rows->capacity = newCapacity;
+	}
+	// the new node covers the new row and the lowbit(i) - 1 rows before it
+	uint32_t i = ++rows->count;
+	rows->heights[i - 1] = height;
+	rows->sums[i] = (double)height + PrefixSum(rows, i - 1) - PrefixSum(rows, i - LowBit(i));
+	return true;
+}
+
+void LoggerRowHeightsTruncate(LoggerRowHeights *rows, uint32_t count)
+{
+	// nodes of the remaining rows only cover rows before them
+	if (count < rows->count)
+		rows->count = count;
+}
+
+float LoggerRowHeightsGet(const LoggerRowHeights *rows, uint32_t row)
+{
+	return (row < rows->count) ? rows->heights[row] : 0;
+}
+
+void LoggerRowHeightsSet(LoggerRowHeights *rows, uint32_t row, float height)
+{
+	if (row >= rows->count)
+		return;
+	double delta = (double)height - rows->heights[row];
+	rows->heights[row] = height;
+	for (uint32_t i = row + 1; i <= rows->count; i += LowBit(i))
+		rows->sums[i] += delta;
+}
+
+double LoggerRowHeightsOffset(const LoggerRowHeights *rows, uint32_t row, float spacing)
+{
+	if (row > rows->count)
+		row = rows->count;
+	return PrefixSum(rows, row) + (double)row * spacing;
+}
+
+uint32_t LoggerRowHeightsRowAtOffset(const LoggerRowHeights *rows, double offset, float spacing)
+{
+	// Descend the tree from its largest power of two: `pos' rows end at `sum', before the offset.
+	// The node at pos + step covers exactly `step' rows
+	if (offset < 0)
+		return 0;
+	uint32_t pos = 0, step = 1;
+	while (step <= rows->count / 2)
+		step <<= 1;
+	double sum = 0;
+	for (; step > 0; step >>= 1)
+	{
+		if (pos + step <= rows->count)
+		{
+			double next = sum + rows->sums[pos + step] + (double)step * spacing;
+			if (next <= offset)
+			{
+				pos += step;
+				sum = next;
+			}
+		}
+	}
+	return pos;
+}
@@ -0,0 +1,69 @@
+/*
+ * LoggerRowHeights.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_ROW_HEIGHTS_H
+#define LOGGER_ROW_HEIGHTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Heights of the rows of the log table, kept in a Fenwick tree (binary indexed tree) of their sums
+ * so that changing the height of a row, finding where a row starts and finding the row at a given
+ * offset all take O(log n) (see LoggerWindowController).
+ *
+ * Offsets are from the top of the first row. Rows are separated by `spacing', the table's
+ * intercell spacing, which is not part of their height.
+ *
+ * Not thread safe: the window controller only uses it on the main thread.
+ */
+
+typedef struct LoggerRowHeights LoggerRowHeights;
+
+LoggerRowHeights *LoggerRowHeightsCreate(void);
+void LoggerRowHeightsDispose(LoggerRowHeights *rows);
+
+uint32_t LoggerRowHeightsCount(const LoggerRowHeights *rows);
+
+// Add a row after the last one. Returns false if out of memory
+bool LoggerRowHeightsAppend(LoggerRowHeights *rows, float height);
+
+// Remove the rows from `count' on
+void LoggerRowHeightsTruncate(LoggerRowHeights *rows, uint32_t count);
+
+float LoggerRowHeightsGet(const LoggerRowHeights *rows, uint32_t row);
+void LoggerRowHeightsSet(LoggerRowHeights *rows, uint32_t row, float height);
+
+// Offset of the top of `row' (row <= count: the offset of row `count' is the height of all rows)
+double LoggerRowHeightsOffset(const LoggerRowHeights *rows, uint32_t row, float spacing);
+
+// Row at `offset', or the number of rows if the offset is past the last row
+uint32_t LoggerRowHeightsRowAtOffset(const LoggerRowHeights *rows, double offset, float spacing);
+
+#endif
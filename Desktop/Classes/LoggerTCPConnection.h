@@ -29,6 +29,7 @@
  * 
  */
 #import "LoggerIPConnection.h"
+#import "LoggerCommon.h"
 
 @interface LoggerTCPConnection : LoggerIPConnection
 {
@@ -39,6 +40,14 @@
 	
 	uint8_t *tmpBuf;
 	NSUInteger tmpBufSize;
+
+	// v2 wire protocol decoding state, reset by each client info message
+	NSMutableArray *wireStrings;				// strings defined by the client, file and function names come from the connection pools
+	int64_t wireDeltaBase[LOGGER_WIRE_DELTA_KEYS];
+
+	// compressed framing state, determined from the first bytes received
+	int framing;
+	NSMutableData *compressedBuffer;			// received blocks not completely decoded yet
 }
 
 @property (nonatomic, retain) NSInputStream *readStream;
@@ -49,4 +58,18 @@
 
 - (id)initWithInputStream:(NSInputStream *)anInputStream outputStream:(NSOutputStream *)outputStream clientAddress:(NSData *)anAddress;
 
+// Append bytes received from the client to the buffer, decompressing them if the client sends compressed
+// blocks. Returns NO if the data is invalid
+- (BOOL)appendReceivedBytes:(const uint8_t *)bytes length:(NSUInteger)length;
+
+// Transcode a v2 frame (without its size word) to the v1 format LoggerNativeMessage decodes. Returns nil if the frame is invalid
+- (NSData *)messageDataFromV2Frame:(const uint8_t *)frame length:(NSUInteger)length;
+- (void)resetWireProtocolState;
+
 @end
+
+enum {
+	kFramingUnknown = 0,
+	kFramingPlain,
+	kFramingCompressed
+};
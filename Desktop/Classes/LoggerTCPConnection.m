@@ -30,6 +30,7 @@
  */
 
 #import "LoggerTCPConnection.h"
+#import "LoggerCompression.h"
 
 #define TMP_BUF_SIZE	((size_t)32767)
 
@@ -50,6 +51,8 @@
 			return nil;
 		
 		buffer = [[NSMutableData alloc] initWithCapacity:2048];
+		wireStrings = [[NSMutableArray alloc] init];
+		compressedBuffer = [[NSMutableData alloc] init];
 	}
 	return self;
 }
@@ -78,7 +81,252 @@
 		readStream = nil;
 	}
 	[buffer setLength:0];
+	[compressedBuffer setLength:0];
 	[super shutdown];
 }
 
+#pragma mark -
+#pragma mark Compressed framing
+
+static uint32_t ReadUInt32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return ntohl(value);
+}
+
+- (BOOL)appendReceivedBytes:(const uint8_t *)bytes length:(NSUInteger)length
+{
+	if (framing == kFramingPlain)
+	{
+		[buffer appendBytes:bytes length:length];
+		return YES;
+	}
+
+	[compressedBuffer appendBytes:bytes length:length];
+	if (framing == kFramingUnknown)
+	{
+		// clients that compress their data do so from the very first byte they send
+		if ([compressedBuffer length] < 4)
+			return YES;
+		if (!(ReadUInt32([compressedBuffer bytes]) & LOGGER_FRAME_COMPRESSED_FLAG))
+		{
+			framing = kFramingPlain;
+			[buffer appendData:compressedBuffer];
+			[compressedBuffer setLength:0];
+			return YES;
+		}
+		framing = kFramingCompressed;
+	}
+
+	// decode all the complete blocks
+	const uint8_t *p = [compressedBuffer bytes];
+	NSUInteger available = [compressedBuffer length], consumed = 0;
+	while (available - consumed >= 8)
+	{
+		uint32_t header = ReadUInt32(p + consumed);
+		uint32_t payloadSize = header & LOGGER_FRAME_SIZE_MASK;
+		uint32_t originalSize = ReadUInt32(p + consumed + 4);
+		if (!(header & LOGGER_FRAME_COMPRESSED_FLAG) || payloadSize < 4 ||
+			originalSize > LOGGER_COMPRESSED_BLOCK_MAX_SIZE || payloadSize - 4 > originalSize)
+			return NO;
+		if (available - consumed - 4 < payloadSize)
+			break;
+
+		const uint8_t *payload = p + consumed + 8;
+		if (payloadSize - 4 == originalSize)
+		{
+			[buffer appendBytes:payload length:originalSize];
+		}
+		else
+		{
+			NSUInteger bufferLength = [buffer length];
+			[buffer increaseLengthBy:originalSize];
+			int32_t decompressed = LoggerLZ4Decompress(payload, payloadSize - 4, (uint8_t *)[buffer mutableBytes] + bufferLength, originalSize);
+			if (decompressed != (int32_t)originalSize)
+				return NO;
+		}
+		consumed += 4 + payloadSize;
+	}
+	if (consumed)
+		[compressedBuffer replaceBytesInRange:NSMakeRange(0, consumed) withBytes:NULL length:0];
+	return YES;
+}
+
+#pragma mark -
+#pragma mark v2 wire protocol
+
+static BOOL ReadVarint(const uint8_t **p, const uint8_t *end, uint64_t *outValue)
+{
+	uint64_t value = 0;
+	for (unsigned shift = 0; *p < end && shift < 64; shift += 7)
+	{
+		uint8_t b = *(*p)++;
+		value |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+		{
+			*outValue = value;
+			return YES;
+		}
+	}
+	return NO;
+}
+
+static void AppendStringRefPart(NSMutableData *data, uint8_t key, uint32_t stringID)
+{
+	// string references are passed to LoggerNativeMessage as a part with a 4 bytes payload,
+	// which it resolves with -wireStringWithID:
+	uint8_t part[10] = { key, PART_TYPE_STRING_REF };
+	uint32_t size = htonl(4), ref = htonl(stringID);
+	memcpy(&part[2], &size, 4);
+	memcpy(&part[6], &ref, 4);
+	[data appendBytes:part length:10];
+}
+
+- (NSString *)wireStringWithID:(uint32_t)stringID
+{
+	return (stringID < [wireStrings count]) ? wireStrings[stringID] : nil;
+}
+
+- (void)resetWireProtocolState
+{
+	[wireStrings removeAllObjects];
+	bzero(wireDeltaBase, sizeof(wireDeltaBase));
+}
+
+- (NSData *)messageDataFromV2Frame:(const uint8_t *)p length:(NSUInteger)length
+{
+	// The delta bases and strings the frame updates are only committed once the whole frame
+	// decoded: after an invalid frame, the state we have is still the one the client had before it
+	const uint8_t *end = p + length;
+	uint64_t partCount;
+	if (!ReadVarint(&p, end, &partCount) || partCount > 0xFFFF)
+		return nil;
+
+	int64_t deltaBase[LOGGER_WIRE_DELTA_KEYS];
+	memcpy(deltaBase, wireDeltaBase, sizeof(deltaBase));
+	NSUInteger stringsCount = [wireStrings count];
+	NSMutableDictionary *definedStrings = nil;		// string ID -> @[key, string]
+
+	NSMutableData *data = [NSMutableData dataWithCapacity:2 * length + 16];
+	uint16_t count16 = htons((uint16_t)partCount);
+	[data appendBytes:&count16 length:2];
+
+	for (uint64_t i = 0; i < partCount; i++)
+	{
+		if (end - p < 2)
+			return nil;
+		uint8_t key = *p++;
+		uint8_t type = *p++;
+		uint64_t value, size;
+		switch (type)
+		{
+			case PART_TYPE_INT16:
+			case PART_TYPE_INT32:
+			case PART_TYPE_INT64: {
+				if (!ReadVarint(&p, end, &value))
+					return nil;
+				int64_t n = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+				if (LOGGER_WIRE_IS_DELTA_KEY(key))
+				{
+					n = (int64_t)((uint64_t)deltaBase[key] + (uint64_t)n);
+					deltaBase[key] = n;
+				}
+				uint8_t part[10] = { key, type };
+				NSUInteger partSize = 2;
+				if (type == PART_TYPE_INT16)
+				{
+					uint16_t v = htons((uint16_t)n);
+					memcpy(&part[2], &v, 2);
+					partSize += 2;
+				}
+				else if (type == PART_TYPE_INT32)
+				{
+					uint32_t v = htonl((uint32_t)n);
+					memcpy(&part[2], &v, 4);
+					partSize += 4;
+				}
+				else
+				{
+					uint64_t v = CFSwapInt64HostToBig((uint64_t)n);
+					memcpy(&part[2], &v, 8);
+					partSize += 8;
+				}
+				[data appendBytes:part length:partSize];
+				break;
+			}
+
+			case PART_TYPE_STRING:
+			case PART_TYPE_BINARY:
+			case PART_TYPE_IMAGE: {
+				if (!ReadVarint(&p, end, &size) || size > (uint64_t)(end - p))
+					return nil;
+				uint8_t header[6] = { key, type };
+				uint32_t size32 = htonl((uint32_t)size);
+				memcpy(&header[2], &size32, 4);
+				[data appendBytes:header length:6];
+				[data appendBytes:p length:(NSUInteger)size];
+				p += size;
+				break;
+			}
+
+			case PART_TYPE_STRING_DEF: {
+				if (!ReadVarint(&p, end, &value) || !ReadVarint(&p, end, &size) || size > (uint64_t)(end - p))
+					return nil;
+				if (value >= LOGGER_WIRE_MAX_STRINGS || value > stringsCount)
+					return nil;
+
+				// decode the string once, it goes to the strings table with the rest of the frame
+				NSString *string = [[NSString alloc] initWithBytes:p length:(NSUInteger)size encoding:NSUTF8StringEncoding];
+				if (string == nil)
+					string = @"";
+				if (definedStrings == nil)
+					definedStrings = [[NSMutableDictionary alloc] init];
+				definedStrings[@(value)] = @[@(key), string];
+				if (value == stringsCount)
+					stringsCount++;
+				AppendStringRefPart(data, key, (uint32_t)value);
+				p += size;
+				break;
+			}
+
+			case PART_TYPE_STRING_REF: {
+				if (!ReadVarint(&p, end, &value) || value >= stringsCount)
+					return nil;
+				AppendStringRefPart(data, key, (uint32_t)value);
+				break;
+			}
+
+			default:
+				return nil;
+		}
+	}
+	if (p != end)
+		return nil;
+
+	// the frame is valid: commit the state it changed. File and function names go to the connection pools
+	memcpy(wireDeltaBase, deltaBase, sizeof(deltaBase));
+	for (NSNumber *stringID in [[definedStrings allKeys] sortedArrayUsingSelector:@selector(compare:)])
+	{
+		NSArray *definition = definedStrings[stringID];
+		uint8_t key = [definition[0] unsignedCharValue];
+		NSString *string = definition[1];
+		NSMutableSet *pool = (key == PART_KEY_FILENAME) ? self.filenames : (key == PART_KEY_FUNCTIONNAME) ? self.functionNames : nil;
+		if (pool != nil)
+		{
+			NSString *pooled = [pool member:string];
+			if (pooled != nil)
+				string = pooled;
+			else
+				[pool addObject:string];
+		}
+		NSUInteger index = [stringID unsignedIntegerValue];
+		if (index == [wireStrings count])
+			[wireStrings addObject:string];
+		else
+			wireStrings[index] = string;
+	}
+	return data;
+}
+
 @end
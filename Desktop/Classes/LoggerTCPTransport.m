@@ -74,16 +74,24 @@ static void AcceptSocketCallback(CFSocketRef sock, CFSocketCallBackType type, CF
 	if (self.active && self.ready)
 	{
 		__block NSInteger numConnected = 0;
+		__block size_t indexMemoryUsage = 0;
 		[self.connections enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
 			if (((LoggerConnection *)obj).connected)
 				numConnected++;
+			indexMemoryUsage += [(LoggerConnection *)obj textIndexMemoryUsage];
 		}];
 
+		NSString *status;
 		if (numConnected == 0)
-			return NSLocalizedString(@"Ready to accept connections", @"Transport ready status");
-		if (numConnected == 1)
-			return NSLocalizedString(@"1 active connection", @"1 active connection for transport");
-		return [NSString stringWithFormat:NSLocalizedString(@"%d active connections", @"Number of active connections for transport"), numConnected];
+			status = NSLocalizedString(@"Ready to accept connections", @"Transport ready status");
+		else if (numConnected == 1)
+			status = NSLocalizedString(@"1 active connection", @"1 active connection for transport");
+		else
+			status = [NSString stringWithFormat:NSLocalizedString(@"%d active connections", @"Number of active connections for transport"), numConnected];
+		if (indexMemoryUsage >= 1024 * 1024)
+			status = [NSString stringWithFormat:NSLocalizedString(@"%@ (search index: %.1f MB)", @"Transport status followed by the memory used by the search index of its connections"),
+					  status, indexMemoryUsage / (1024.0 * 1024.0)];
+		return status;
 	}
 	if (self.active)
 		return NSLocalizedString(@"Opening service", @"Transport status: opening");
@@ -315,13 +323,16 @@ static void AcceptSocketCallback(CFSocketRef sock, CFSocketCallBackType type, CF
 															 name:(NSString *)serviceName
 															 port:(int)listenerPort];
 
+			// let clients know which version of the wire protocol we understand, so they can use the compact encoding
+			NSMutableDictionary *txtRecord = [NSMutableDictionary dictionary];
+			txtRecord[(__bridge NSString *)LOGGER_TXT_KEY_PROTOCOL] = [[NSString stringWithFormat:@"%d", LOGGER_PROTOCOL_VERSION] dataUsingEncoding:NSASCIIStringEncoding];
+			txtRecord[(__bridge NSString *)LOGGER_TXT_KEY_COMPRESSION] = [@LOGGER_COMPRESSION_LZ4 dataUsingEncoding:NSASCIIStringEncoding];
+
 			// added in 1.5: let clients know that we have customized our service name and that they should connect to us
 			// only if their own settings match our name
 			if (!useDefaultServiceName)
-			{
-				NSData *filterData = [@"1" dataUsingEncoding:NSASCIIStringEncoding];
-				[self.bonjourService setTXTRecordData:[NSNetService dataFromTXTRecordDictionary:@{@"filterClients": filterData}]];
-			}
+				txtRecord[@"filterClients"] = [@"1" dataUsingEncoding:NSASCIIStringEncoding];
+			[self.bonjourService setTXTRecordData:[NSNetService dataFromTXTRecordDictionary:txtRecord]];
 
 			[self.bonjourService setIncludesPeerToPeer:YES];
 			[self.bonjourService setDelegate:self];
@@ -523,7 +534,19 @@ static void AcceptSocketCallback(CFSocketRef sock, CFSocketCallBackType type, CF
 						numBytes = [cnx.readStream read:cnx.tmpBuf maxLength:cnx.tmpBufSize];
 						if (numBytes <= 0)
 							break;
-						[cnx.buffer appendBytes:cnx.tmpBuf length:(NSUInteger) numBytes];
+						if (![cnx appendReceivedBytes:cnx.tmpBuf length:(NSUInteger) numBytes])
+						{
+							// invalid compressed data, we can't make sense of the rest of the stream
+							struct timeval t;
+							gettimeofday(&t, NULL);
+							LoggerMessage *msg = [[LoggerMessage alloc] init];
+							msg.timestamp = t;
+							msg.type = LOGMSG_TYPE_DISCONNECT;
+							msg.message = NSLocalizedString(@"Client disconnected (invalid data received)", @"");
+							[cnx messagesReceived:@[msg]];
+							[cnx shutdown];
+							break;
+						}
 
 						// method implemented by subclasses, depending on the input format
 						[self processIncomingData:cnx];
@@ -0,0 +1,384 @@
+/*
+ * LoggerTextIndex.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "LoggerTextIndex.h"
+#include "LoggerCommon.h"
+
+#define LOGGER_INDEX_USED_KEY		0x80000000U		// set in the keys of used slots
+#define LOGGER_INDEX_BATCH_ROWS		4096			// rows indexed each time the lock is taken
+#define LOGGER_INDEX_MAX_DENSITY	8				// the index is not used for trigrams in more than 1/8 of the rows
+
+typedef struct
+{
+	uint32_t key;					// trigram | LOGGER_INDEX_USED_KEY, 0 for empty slots
+	uint32_t lastRow;				// last row in the postings + 1, 0 if none
+	uint32_t count;					// number of rows in the postings
+	uint32_t length;
+	uint32_t capacity;
+	uint8_t *postings;				// row deltas, as varints
+} LoggerTextIndexList;
+
+struct LoggerTextIndex
+{
+	pthread_rwlock_t lock;			// writers hold it while indexing a batch of rows
+	uint32_t rowsCount;				// number of indexed rows
+
+	LoggerTextIndexList *lists;		// open addressing table of trigrams
+	uint32_t listsCount;
+	uint32_t tableSize;
+	size_t postingsSize;
+
+	uint32_t *unindexedRows;		// rows whose text has non-ASCII characters
+	uint32_t unindexedCount;
+	uint32_t unindexedCapacity;
+};
+
+static inline uint8_t LoggerIndexFold(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (uint8_t)(c | 0x20) : c;
+}
+
+static inline uint32_t LoggerIndexHash(uint32_t key)
+{
+	return key * 2654435761U;
+}
+
+LoggerTextIndex *LoggerTextIndexCreate(void)
+{
+	LoggerTextIndex *index = (LoggerTextIndex *)calloc(1, sizeof(LoggerTextIndex));
+	if (index == NULL)
+		return NULL;
+	pthread_rwlock_init(&index->lock, NULL);
+	return index;
+}
+
+void LoggerTextIndexDispose(LoggerTextIndex *index)
+{
+	if (index == NULL)
+		return;
+	for (uint32_t i = 0; i < index->tableSize; i++)
+		free(index->lists[i].postings);
+	free(index->lists);
+	free(index->unindexedRows);
+	pthread_rwlock_destroy(&index->lock);
+	free(index);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Indexing
+// -----------------------------------------------------------------------------
+static bool LoggerIndexGrowTable(LoggerTextIndex *index)
+{
+	uint32_t newSize = index->tableSize ? index->tableSize * 2 : 4096;
+	LoggerTextIndexList *newLists = (LoggerTextIndexList *)calloc(newSize, sizeof(LoggerTextIndexList));
+	if (newLists == NULL)
+		return false;
+	for (uint32_t i = 0; i < index->tableSize; i++)
+	{
+		if (index->lists[i].key == 0)
+			continue;
+		uint32_t slot = LoggerIndexHash(index->lists[i].key) & (newSize - 1);
+		while (newLists[slot].key != 0)
+			slot = (slot + 1) & (newSize - 1);
+		newLists[slot] = index->lists[i];
+	}
+	free(index->lists);
+	index->lists = newLists;
+	index->tableSize = newSize;
+	return true;
+}
+
+static LoggerTextIndexList *LoggerIndexFindList(const LoggerTextIndex *index, uint32_t key)
+{
+	if (index->tableSize == 0)
+		return NULL;
+	for (uint32_t slot = LoggerIndexHash(key) & (index->tableSize - 1); index->lists[slot].key != 0; slot = (slot + 1) & (index->tableSize - 1))
+	{
+		if (index->lists[slot].key == key)
+			return &index->lists[slot];
+	}
+	return NULL;
+}
+
+static LoggerTextIndexList *LoggerIndexAddList(LoggerTextIndex *index, uint32_t key)
+{
+	if (index->listsCount * 2 >= index->tableSize && !LoggerIndexGrowTable(index))
+		return NULL;
+	uint32_t slot = LoggerIndexHash(key) & (index->tableSize - 1);
+	while (index->lists[slot].key != 0)
+		slot = (slot + 1) & (index->tableSize - 1);
+	index->lists[slot].key = key;
+	index->listsCount++;
+	return &index->lists[slot];
+}
+
+static void LoggerIndexAddPosting(LoggerTextIndex *index, uint32_t trigram, uint32_t row)
+{
+	uint32_t key = trigram | LOGGER_INDEX_USED_KEY;
+	LoggerTextIndexList *list = LoggerIndexFindList(index, key);
+	if (list == NULL && (list = LoggerIndexAddList(index, key)) == NULL)
+		return;
+	if (list->lastRow == row + 1)
+		return;							// trigram seen earlier in this row
+	if (list->capacity - list->length < 5)
+	{
+		uint32_t newCapacity = list->capacity ? list->capacity * 2 : 8;
+		uint8_t *newPostings = (uint8_t *)realloc(list->postings, newCapacity);
+		if (newPostings == NULL)
+			return;
+		index->postingsSize += newCapacity - list->capacity;
+		list->postings = newPostings;
+		list->capacity = newCapacity;
+	}
+	uint32_t delta = row + 1 - list->lastRow;
+	uint8_t *p = list->postings + list->length;
+	while (delta >= 0x80)
+	{
+		*p++ = (uint8_t)(delta | 0x80);
+		delta >>= 7;
+	}
+	*p++ = (uint8_t)delta;
+	list->length = (uint32_t)(p - list->postings);
+	list->lastRow = row + 1;
+	list->count++;
+}
+
+static void LoggerIndexAddUnindexedRow(LoggerTextIndex *index, uint32_t row)
+{
+	if (index->unindexedCount == index->unindexedCapacity)
+	{
+		uint32_t newCapacity = index->unindexedCapacity ? index->unindexedCapacity * 2 : 256;
+		uint32_t *newRows = (uint32_t *)realloc(index->unindexedRows, newCapacity * sizeof(uint32_t));
+		if (newRows == NULL)
+			return;
+		index->unindexedRows = newRows;
+		index->unindexedCapacity = newCapacity;
+	}
+	index->unindexedRows[index->unindexedCount++] = row;
+}
+
+static void LoggerIndexAddRow(LoggerTextIndex *index, const LoggerMessageStore *store, uint32_t row)
+{
+	// messages without text never match a non-empty string (see LoggerMessageFilter's StringValue())
+	const LoggerMessageStorePage *page = LoggerMessageStoreGetPage(store, row);
+	if (page->contentsTypes[row & (LOGGER_STORE_PAGE_ROWS - 1)] != PART_TYPE_STRING)
+		return;
+	uint32_t length;
+	const uint8_t *text = LoggerMessageStoreGetContents(store, row, &length);
+	if (text == NULL || length < LOGGER_TEXT_INDEX_MIN_NEEDLE)
+		return;
+
+	uint8_t bits = 0;
+	for (uint32_t i = 0; i < length; i++)
+		bits |= text[i];
+	if (bits & 0x80)
+	{
+		LoggerIndexAddUnindexedRow(index, row);
+		return;
+	}
+
+	uint32_t trigram = ((uint32_t)LoggerIndexFold(text[0]) << 8) | LoggerIndexFold(text[1]);
+	for (uint32_t i = 2; i < length; i++)
+	{
+		trigram = ((trigram << 8) | LoggerIndexFold(text[i])) & 0xFFFFFF;
+		LoggerIndexAddPosting(index, trigram, row);
+	}
+}
+
+uint32_t LoggerTextIndexUpdate(LoggerTextIndex *index, const LoggerMessageStore *store)
+{
+	// Only the thread that updates the index writes rowsCount, we don't need the lock to read it here
+	uint32_t count = LoggerMessageStoreCount(store);
+	while (index->rowsCount < count)
+	{
+		uint32_t end = (count - index->rowsCount > LOGGER_INDEX_BATCH_ROWS) ? index->rowsCount + LOGGER_INDEX_BATCH_ROWS : count;
+		pthread_rwlock_wrlock(&index->lock);
+		for (uint32_t row = index->rowsCount; row < end; row++)
+			LoggerIndexAddRow(index, store, row);
+		index->rowsCount = end;
+		pthread_rwlock_unlock(&index->lock);
+	}
+	return count;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Queries
+// -----------------------------------------------------------------------------
+static const uint8_t *LoggerIndexNextRow(const uint8_t *p, uint32_t *ioRow)
+{
+	// Decode the next posting. *ioRow is the previous row + 1 on input, the decoded row + 1 on output
+	uint32_t delta = 0;
+	for (int shift = 0; ; shift += 7)
+	{
+		uint8_t b = *p++;
+		delta |= (uint32_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			break;
+	}
+	*ioRow += delta;
+	return p;
+}
+
+static uint32_t LoggerIndexIntersect(uint32_t *rows, uint32_t count, const LoggerTextIndexList *list)
+{
+	// Keep the rows (sorted) that are also in the list, returns their number. The last posting may
+	// have been decoded for an earlier row: keep comparing it once all postings are decoded
+	const uint8_t *p = list->postings, *end = list->postings + list->length;
+	uint32_t kept = 0, current = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		while (current < rows[i] + 1 && p < end)
+			p = LoggerIndexNextRow(p, &current);
+		if (current < rows[i] + 1)
+			break;		// the rows left are after the last posting
+		if (current == rows[i] + 1)
+			rows[kept++] = rows[i];
+	}
+	return kept;
+}
+
+uint64_t *LoggerTextIndexCopyCandidates(LoggerTextIndex *index, const uint8_t *needle, uint32_t length, uint32_t *outRowsCount)
+{
+	if (length < LOGGER_TEXT_INDEX_MIN_NEEDLE)
+		return NULL;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		if (needle[i] & 0x80)
+			return NULL;
+	}
+
+	pthread_rwlock_rdlock(&index->lock);
+	uint32_t rowsCount = index->rowsCount;
+	uint64_t *bitmap = (uint64_t *)calloc(rowsCount / 64 + 1, sizeof(uint64_t));
+	uint32_t numTrigrams = length - 2;
+	const LoggerTextIndexList **lists = (const LoggerTextIndexList **)malloc(numTrigrams * sizeof(LoggerTextIndexList *));
+	if (bitmap == NULL || lists == NULL)
+	{
+		pthread_rwlock_unlock(&index->lock);
+		free(bitmap);
+		free(lists);
+		return NULL;
+	}
+
+	// The posting lists of the needle's trigrams, shortest first. If a trigram
+	// is not in the index, only the unindexed rows can match
+	uint32_t numLists = 0;
+	bool missing = false;
+	uint32_t trigram = ((uint32_t)LoggerIndexFold(needle[0]) << 8) | LoggerIndexFold(needle[1]);
+	for (uint32_t i = 2; i < length; i++)
+	{
+		trigram = ((trigram << 8) | LoggerIndexFold(needle[i])) & 0xFFFFFF;
+		const LoggerTextIndexList *list = LoggerIndexFindList(index, trigram | LOGGER_INDEX_USED_KEY);
+		if (list == NULL)
+		{
+			missing = true;
+			break;
+		}
+		bool seen = false;
+		for (uint32_t j = 0; j < numLists && !seen; j++)
+			seen = (lists[j] == list);
+		if (seen)
+			continue;
+		uint32_t pos = numLists++;
+		while (pos > 0 && lists[pos - 1]->count > list->count)
+		{
+			lists[pos] = lists[pos - 1];
+			pos--;
+		}
+		lists[pos] = list;
+	}
+
+	// When the rarest trigram is in a large part of the rows, decoding its postings costs more than
+	// the scan it would save: the search goes through all the rows instead
+	if (!missing && numLists != 0 && (uint64_t)lists[0]->count * LOGGER_INDEX_MAX_DENSITY > rowsCount)
+	{
+		pthread_rwlock_unlock(&index->lock);
+		free(bitmap);
+		free(lists);
+		return NULL;
+	}
+
+	if (!missing && numLists != 0)
+	{
+		uint32_t *rows = (uint32_t *)malloc(lists[0]->count * sizeof(uint32_t));
+		if (rows == NULL)
+		{
+			// can't narrow down the search
+			pthread_rwlock_unlock(&index->lock);
+			free(bitmap);
+			free(lists);
+			return NULL;
+		}
+		uint32_t count = 0, current = 0;
+		for (const uint8_t *p = lists[0]->postings, *end = p + lists[0]->length; p < end; )
+		{
+			p = LoggerIndexNextRow(p, &current);
+			rows[count++] = current - 1;
+		}
+
+		// Intersect with the other lists. Once there are few candidates left compared to the
+		// size of the next list, checking the messages is cheaper than decoding it
+		for (uint32_t i = 1; i < numLists && count != 0; i++)
+		{
+			if ((uint64_t)count * 64 < lists[i]->count)
+				break;
+			count = LoggerIndexIntersect(rows, count, lists[i]);
+		}
+		for (uint32_t i = 0; i < count; i++)
+			bitmap[rows[i] >> 6] |= 1ULL << (rows[i] & 63);
+		free(rows);
+	}
+	for (uint32_t i = 0; i < index->unindexedCount; i++)
+	{
+		uint32_t row = index->unindexedRows[i];
+		bitmap[row >> 6] |= 1ULL << (row & 63);
+	}
+	pthread_rwlock_unlock(&index->lock);
+
+	free(lists);
+	*outRowsCount = rowsCount;
+	return bitmap;
+}
+
+size_t LoggerTextIndexMemoryUsage(LoggerTextIndex *index)
+{
+	pthread_rwlock_rdlock(&index->lock);
+	size_t size = sizeof(LoggerTextIndex) +
+				  index->tableSize * sizeof(LoggerTextIndexList) +
+				  index->postingsSize +
+				  index->unindexedCapacity * sizeof(uint32_t);
+	pthread_rwlock_unlock(&index->lock);
+	return size;
+}
@@ -0,0 +1,68 @@
+/*
+ * LoggerTextIndex.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_TEXT_INDEX_H
+#define LOGGER_TEXT_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "LoggerMessageStore.h"
+
+/* Trigram index of the text of the messages in a message store, used to find the messages that
+ * may contain a string without looking at all of them (see LoggerMessageFilter).
+ *
+ * For each sequence of three characters (trigram) found in message texts, the index keeps the list
+ * of rows it appears in, as varint-encoded row deltas. Text is indexed with ASCII letters lowercased.
+ * Rows whose text has non-ASCII characters are not indexed: Unicode case folding and composed
+ * characters may make them match an ASCII string in ways trigrams don't see, so they are always
+ * returned as candidates.
+ *
+ * One thread updates the index (the connection's message processing queue), any thread can query it.
+ */
+
+#define LOGGER_TEXT_INDEX_MIN_NEEDLE	3
+
+LoggerTextIndex *LoggerTextIndexCreate(void);
+void LoggerTextIndexDispose(LoggerTextIndex *index);
+
+// Index the rows appended to the store since the last call. Returns the number of indexed rows
+uint32_t LoggerTextIndexUpdate(LoggerTextIndex *index, const LoggerMessageStore *store);
+
+// Rows whose text may contain `needle' (ASCII, compared case-insensitively) as a bitmap of *outRowsCount
+// bits, to be freed by the caller. Rows past *outRowsCount were not indexed yet and may match too.
+// Returns NULL if the index can't narrow down the search (short or non-ASCII needle, or needle whose
+// trigrams are all in a large part of the rows).
+uint64_t *LoggerTextIndexCopyCandidates(LoggerTextIndex *index, const uint8_t *needle, uint32_t length, uint32_t *outRowsCount);
+
+// Number of bytes allocated by the index
+size_t LoggerTextIndexMemoryUsage(LoggerTextIndex *index);
+
+#endif
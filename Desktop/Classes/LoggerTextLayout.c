@@ -0,0 +1,183 @@
+/*
+ * LoggerTextLayout.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <math.h>
+#include "LoggerTextLayout.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define LOGGER_LAYOUT_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LOGGER_LAYOUT_NEON
+#endif
+
+static uint32_t LoggerLayoutWrapLine(const uint16_t *chars, uint32_t length, uint32_t columns)
+{
+	uint32_t lines = 1, start = 0;
+	while (length - start > columns)
+	{
+		// the line can break after the last space that fits, a space right past the margin included
+		uint32_t end = start + columns;
+		while (end > start && chars[end] != ' ')
+			end--;
+		if (end == start)
+			end = start + columns;
+		else
+		{
+			while (end < length && chars[end] == ' ')
+				end++;
+			if (end == length)
+				break;
+		}
+		start = end;
+		lines++;
+	}
+	return lines;
+}
+
+static uint32_t LoggerLayoutCountScalar(const uint16_t *chars, uint32_t start, uint32_t lineStart, uint32_t length, uint32_t columns, uint32_t lines)
+{
+	for (uint32_t i = start; i < length; i++)
+	{
+		uint16_t c = chars[i];
+		if (c == '\n')
+		{
+			lines += LoggerLayoutWrapLine(chars + lineStart, i - lineStart, columns);
+			lineStart = i + 1;
+		}
+		else if (c < 0x20 || c > 0x7E)
+			return 0;
+	}
+	if (lineStart < length || lines == 0)
+		lines += LoggerLayoutWrapLine(chars + lineStart, length - lineStart, columns);
+	return lines;
+}
+
+// The vector scans look at 8 characters at a time and leave the last incomplete block to the
+// scalar loop. In the masks, bits 2i and 2i+1 stand for character i of the block
+#if defined(LOGGER_LAYOUT_SSE2)
+static uint32_t LoggerLayoutCountSSE2(const uint16_t *chars, uint32_t length, uint32_t columns)
+{
+	const __m128i newline = _mm_set1_epi16('\n'), lowest = _mm_set1_epi16(0x20), highest = _mm_set1_epi16(0x7E);
+	uint32_t lines = 0, lineStart = 0, i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(chars + i));
+		// unsigned saturated differences are zero for characters from 0x20 to 0x7E
+		__m128i outside = _mm_or_si128(_mm_subs_epu16(c, highest), _mm_subs_epu16(lowest, c));
+		__m128i printable = _mm_cmpeq_epi16(outside, _mm_setzero_si128());
+		__m128i newlines = _mm_cmpeq_epi16(c, newline);
+		if (_mm_movemask_epi8(_mm_or_si128(printable, newlines)) != 0xFFFF)
+			return 0;
+		for (uint32_t mask = (uint32_t)_mm_movemask_epi8(newlines) & 0x5555; mask != 0; mask &= mask - 1)
+		{
+			uint32_t end = i + ((uint32_t)__builtin_ctz(mask) >> 1);
+			lines += LoggerLayoutWrapLine(chars + lineStart, end - lineStart, columns);
+			lineStart = end + 1;
+		}
+	}
+	return LoggerLayoutCountScalar(chars, i, lineStart, length, columns, lines);
+}
+#endif
+
+#if defined(LOGGER_LAYOUT_NEON)
+static uint32_t LoggerLayoutCountNEON(const uint16_t *chars, uint32_t length, uint32_t columns)
+{
+	const uint16x8_t newline = vdupq_n_u16('\n'), lowest = vdupq_n_u16(0x20), highest = vdupq_n_u16(0x7E);
+	uint32_t lines = 0, lineStart = 0, i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		uint16x8_t c = vld1q_u16(chars + i);
+		uint16x8_t newlines = vceqq_u16(c, newline);
+		uint16x8_t valid = vorrq_u16(vandq_u16(vcgeq_u16(c, lowest), vcleq_u16(c, highest)), newlines);
+		if (vminvq_u16(valid) == 0)
+			return 0;
+		// narrowing the lanes to bytes gives 8 bits per character
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(newlines)), 0) & 0x0101010101010101ULL;
+		for (; mask != 0; mask &= mask - 1)
+		{
+			uint32_t end = i + ((uint32_t)__builtin_ctzll(mask) >> 3);
+			lines += LoggerLayoutWrapLine(chars + lineStart, end - lineStart, columns);
+			lineStart = end + 1;
+		}
+	}
+	return LoggerLayoutCountScalar(chars, i, lineStart, length, columns, lines);
+}
+#endif
+
+uint32_t LoggerTextLayoutCountMonospacedLines(const uint16_t *chars, uint32_t length, uint32_t columns)
+{
+	if (columns == 0)
+		return 0;
+#if defined(LOGGER_LAYOUT_SSE2)
+	return LoggerLayoutCountSSE2(chars, length, columns);
+#elif defined(LOGGER_LAYOUT_NEON)
+	return LoggerLayoutCountNEON(chars, length, columns);
+#else
+	return LoggerLayoutCountScalar(chars, 0, 0, length, columns, 0);
+#endif
+}
+
+uint32_t LoggerTextLayoutWrapSegments(const LoggerTextSegment *segments, uint32_t count, float width)
+{
+	uint32_t lines = 1;
+	float lineStart = 0, wordStart = 0;
+	bool lineEmpty = true;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const LoggerTextSegment *segment = &segments[i];
+		if (width > 0 && segment->wordEnd - lineStart > width)
+		{
+			if (!lineEmpty)
+			{
+				lines++;
+				lineStart = wordStart;
+			}
+			if (segment->wordEnd - lineStart > width)
+			{
+				// a word longer than a line is broken, it ends on the last of the lines it takes
+				uint32_t extra = (uint32_t)ceilf((segment->wordEnd - lineStart) / width) - 1;
+				lines += extra;
+				lineStart += (float)extra * width;
+			}
+		}
+		lineEmpty = false;
+		wordStart = segment->next;
+		if (segment->endsLine)
+		{
+			if (i + 1 < count)
+				lines++;
+			lineStart = wordStart = 0;
+			lineEmpty = true;
+		}
+	}
+	return lines;
+}
@@ -0,0 +1,64 @@
+/*
+ * LoggerTextLayout.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_TEXT_LAYOUT_H
+#define LOGGER_TEXT_LAYOUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Line counting for the height of message cells (see +[LoggerMessageCell heightForCellWithMessage:...]).
+ *
+ * Texts are wrapped like NSLineBreakByWordWrapping does: lines break after the spaces that follow a
+ * word, spaces at the end of a line don't count in its width, and words longer than a line are
+ * broken anywhere. A newline at the very end of a text doesn't add an empty line.
+ *
+ * With a monospaced font, the UTF-16 characters of a text are scanned 8 at a time (SSE2 on Intel,
+ * NEON on ARM) for newlines and for characters that aren't one column wide.
+ *
+ * With other fonts, the text is measured once and its words are kept as segments: wrapping the text
+ * at another width only adds up the widths of the segments.
+ */
+
+typedef struct
+{
+	float wordEnd;			// x where the word ends, from the start of its line of text
+	float next;				// x where the next word starts, after the spaces that follow the word
+	uint32_t endsLine;		// the word is the last of its line of text
+} LoggerTextSegment;
+
+// Number of lines of a text wrapped at `columns' characters (columns > 0), 0 if the text has
+// characters other than printable ASCII and newlines: it then has to be measured
+uint32_t LoggerTextLayoutCountMonospacedLines(const uint16_t *chars, uint32_t length, uint32_t columns);
+
+// Number of lines of a measured text wrapped at `width'. The last segment must end its line
+uint32_t LoggerTextLayoutWrapSegments(const LoggerTextSegment *segments, uint32_t count, float width);
+
+#endif
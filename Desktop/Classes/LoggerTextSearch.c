@@ -0,0 +1,188 @@
+/*
+ * LoggerTextSearch.c
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#include <string.h>
+#include "LoggerTextSearch.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define LOGGER_SEARCH_SSE2
+#define LOGGER_SEARCH_AVX2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LOGGER_SEARCH_NEON
+#endif
+
+static inline uint8_t LoggerSearchFold(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (uint8_t)(c | 0x20) : c;
+}
+
+static inline uint8_t LoggerSearchFoldMask(uint8_t c, bool caseInsensitive)
+{
+	// Bits to set in text bytes before comparing them to a needle byte: for a lowercase letter,
+	// x | 0x20 equals it only when x is the letter in either case
+	return (caseInsensitive && c >= 'a' && c <= 'z') ? 0x20 : 0;
+}
+
+static inline bool LoggerSearchEqual(const uint8_t *s, const uint8_t *needle, uint32_t length, bool caseInsensitive)
+{
+	if (!caseInsensitive)
+		return memcmp(s, needle, length) == 0;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		if (LoggerSearchFold(s[i]) != needle[i])
+			return false;
+	}
+	return true;
+}
+
+static const uint8_t *LoggerSearchScalar(const uint8_t *text, uint32_t start, uint32_t length,
+										 const uint8_t *needle, uint32_t needleLength, bool caseInsensitive)
+{
+	uint8_t first = needle[0];
+	for (uint32_t i = start; i + needleLength <= length; i++)
+	{
+		uint8_t c = caseInsensitive ? LoggerSearchFold(text[i]) : text[i];
+		if (c == first && LoggerSearchEqual(text + i + 1, needle + 1, needleLength - 1, caseInsensitive))
+			return text + i;
+	}
+	return NULL;
+}
+
+// The vector searches test blocks of positions whose first and last needle bytes are both within
+// the text. The last block is moved back to end with the text (positions tested twice are just
+// verified again), texts shorter than a block are searched with the scalar loop. In the match masks,
+// bit i means that the first and last bytes of the needle match at position i of the block.
+#if defined(LOGGER_SEARCH_SSE2)
+static const uint8_t *LoggerSearchSSE2(const uint8_t *text, uint32_t length, const uint8_t *needle, uint32_t needleLength, bool caseInsensitive)
+{
+	uint32_t lastOffset = needleLength - 1, i = 0;
+	const __m128i first = _mm_set1_epi8((char)needle[0]), last = _mm_set1_epi8((char)needle[lastOffset]);
+	const __m128i firstFold = _mm_set1_epi8((char)LoggerSearchFoldMask(needle[0], caseInsensitive));
+	const __m128i lastFold = _mm_set1_epi8((char)LoggerSearchFoldMask(needle[lastOffset], caseInsensitive));
+	if (lastOffset + 16 > length)
+		return LoggerSearchScalar(text, 0, length, needle, needleLength, caseInsensitive);
+	for (;; i += 16)
+	{
+		if (i + lastOffset + 16 > length)
+		{
+			if (i + lastOffset == length)
+				return NULL;
+			i = length - lastOffset - 16;			// last block overlaps the previous one
+		}
+		__m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i)), firstFold);
+		__m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i + lastOffset)), lastFold);
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask != 0; mask &= mask - 1)
+		{
+			const uint8_t *s = text + i + __builtin_ctz(mask);
+			if (LoggerSearchEqual(s + 1, needle + 1, needleLength - 1, caseInsensitive))
+				return s;
+		}
+	}
+}
+#endif
+
+#if defined(LOGGER_SEARCH_AVX2)
+__attribute__((target("avx2")))
+static const uint8_t *LoggerSearchAVX2(const uint8_t *text, uint32_t length, const uint8_t *needle, uint32_t needleLength, bool caseInsensitive)
+{
+	uint32_t lastOffset = needleLength - 1, i = 0;
+	const __m256i first = _mm256_set1_epi8((char)needle[0]), last = _mm256_set1_epi8((char)needle[lastOffset]);
+	const __m256i firstFold = _mm256_set1_epi8((char)LoggerSearchFoldMask(needle[0], caseInsensitive));
+	const __m256i lastFold = _mm256_set1_epi8((char)LoggerSearchFoldMask(needle[lastOffset], caseInsensitive));
+	for (; i + lastOffset + 32 <= length; i += 32)
+	{
+		__m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i)), firstFold);
+		__m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i + lastOffset)), lastFold);
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask != 0; mask &= mask - 1)
+		{
+			const uint8_t *s = text + i + __builtin_ctz(mask);
+			if (LoggerSearchEqual(s + 1, needle + 1, needleLength - 1, caseInsensitive))
+				return s;
+		}
+	}
+	return LoggerSearchSSE2(text + i, length - i, needle, needleLength, caseInsensitive);
+}
+#endif
+
+#if defined(LOGGER_SEARCH_NEON)
+static const uint8_t *LoggerSearchNEON(const uint8_t *text, uint32_t length, const uint8_t *needle, uint32_t needleLength, bool caseInsensitive)
+{
+	uint32_t lastOffset = needleLength - 1, i = 0;
+	const uint8x16_t first = vdupq_n_u8(needle[0]), last = vdupq_n_u8(needle[lastOffset]);
+	const uint8x16_t firstFold = vdupq_n_u8(LoggerSearchFoldMask(needle[0], caseInsensitive));
+	const uint8x16_t lastFold = vdupq_n_u8(LoggerSearchFoldMask(needle[lastOffset], caseInsensitive));
+	if (lastOffset + 16 > length)
+		return LoggerSearchScalar(text, 0, length, needle, needleLength, caseInsensitive);
+	for (;; i += 16)
+	{
+		if (i + lastOffset + 16 > length)
+		{
+			if (i + lastOffset == length)
+				return NULL;
+			i = length - lastOffset - 16;
+		}
+		uint8x16_t a = vorrq_u8(vld1q_u8(text + i), firstFold);
+		uint8x16_t b = vorrq_u8(vld1q_u8(text + i + lastOffset), lastFold);
+		uint8x16_t eq = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+		// NEON has no movemask: narrowing each 16-bit lane by 4 bits gives 4 bits per position
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0) & 0x8888888888888888ULL;
+		for (; mask != 0; mask &= mask - 1)
+		{
+			const uint8_t *s = text + i + (__builtin_ctzll(mask) >> 2);
+			if (LoggerSearchEqual(s + 1, needle + 1, needleLength - 1, caseInsensitive))
+				return s;
+		}
+	}
+}
+#endif
+
+const uint8_t *LoggerTextSearchFind(const uint8_t *text, uint32_t length, const uint8_t *needle, uint32_t needleLength, bool caseInsensitive)
+{
+	if (needleLength == 0 || needleLength > length)
+		return NULL;
+#if defined(LOGGER_SEARCH_AVX2)
+	static int hasAVX2 = -1;
+	if (hasAVX2 < 0)
+		hasAVX2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	if (hasAVX2)
+		return LoggerSearchAVX2(text, length, needle, needleLength, caseInsensitive);
+#endif
+#if defined(LOGGER_SEARCH_SSE2)
+	return LoggerSearchSSE2(text, length, needle, needleLength, caseInsensitive);
+#elif defined(LOGGER_SEARCH_NEON)
+	return LoggerSearchNEON(text, length, needle, needleLength, caseInsensitive);
+#else
+	return LoggerSearchScalar(text, 0, length, needle, needleLength, caseInsensitive);
+#endif
+}
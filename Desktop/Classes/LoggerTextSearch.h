@@ -0,0 +1,52 @@
+/*
+ * LoggerTextSearch.h
+ *
+ * BSD license follows (http://www.opensource.org/licenses/bsd-license.php)
+ * 
+ * Copyright (c) 2010-2018 Florent Pillet <fpillet@gmail.com> All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of  source code  must retain  the above  copyright notice,
+ * this list of  conditions and the following  disclaimer. Redistributions in
+ * binary  form must  reproduce  the  above copyright  notice,  this list  of
+ * conditions and the following disclaimer  in the documentation and/or other
+ * materials  provided with  the distribution.  Neither the  name of  Florent
+ * Pillet nor the names of its contributors may be used to endorse or promote
+ * products  derived  from  this  software  without  specific  prior  written
+ * permission.  THIS  SOFTWARE  IS  PROVIDED BY  THE  COPYRIGHT  HOLDERS  AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE  COPYRIGHT
+ * HOLDER OR  CONTRIBUTORS BE  LIABLE FOR  ANY DIRECT,  INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY,  OR CONSEQUENTIAL DAMAGES (INCLUDING,  BUT NOT LIMITED
+ * TO, PROCUREMENT  OF SUBSTITUTE GOODS  OR SERVICES;  LOSS OF USE,  DATA, OR
+ * PROFITS; OR  BUSINESS INTERRUPTION)  HOWEVER CAUSED AND  ON ANY  THEORY OF
+ * LIABILITY,  WHETHER  IN CONTRACT,  STRICT  LIABILITY,  OR TORT  (INCLUDING
+ * NEGLIGENCE  OR OTHERWISE)  ARISING  IN ANY  WAY  OUT OF  THE  USE OF  THIS
+ * SOFTWARE,   EVEN  IF   ADVISED  OF   THE  POSSIBILITY   OF  SUCH   DAMAGE.
+ * 
+ */
+#ifndef LOGGER_TEXT_SEARCH_H
+#define LOGGER_TEXT_SEARCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Substring search in the UTF-8 bytes of message texts, used by the filter when it has to look at
+ * the messages themselves (see LoggerMessageFilter).
+ *
+ * The search compares the first and last bytes of the needle to 16 or 32 positions of the text at a
+ * time (SSE2 or AVX2 on Intel, NEON on ARM), and only compares the rest of the needle at the positions
+ * where both match.
+ *
+ * Case insensitive searches only fold ASCII letters, and expect the needle's letters to be lowercase.
+ * Other bytes, including the bytes of UTF-8 sequences, must be equal: comparisons where Unicode case
+ * folding or normalization matters have to be done with NSString.
+ */
+
+// First occurrence of `needle' (needleLength > 0) in `text', NULL if there is none
+const uint8_t *LoggerTextSearchFind(const uint8_t *text, uint32_t length, const uint8_t *needle, uint32_t needleLength, bool caseInsensitive);
+
+#endif
@@ -32,7 +32,7 @@
 #import "BWToolkitFramework.h"
 
 @class LoggerMessageCell, LoggerClientInfoCell, LoggerMarkerCell, LoggerTableView, LoggerSplitView;
-@class LoggerDetailsWindowController;
+@class LoggerDetailsWindowController, LoggerMessageFilter;
 
 @interface LoggerWindowController : NSWindowController <NSWindowDelegate, LoggerConnectionDelegate, NSTableViewDataSource, NSTableViewDelegate, NSSplitViewDelegate>
 {
@@ -73,9 +73,9 @@
 
 @property (nonatomic, retain) NSString *info;
 @property (nonatomic, retain) NSMutableArray *displayedMessages;
-@property (nonatomic, retain) NSMutableSet *tags;
 
 @property (nonatomic, retain) NSPredicate *filterPredicate;				// created from current selected filters, + quick filter string / tag / log level
+@property (nonatomic, retain) LoggerMessageFilter *messageFilter;		// filterPredicate compiled for fast evaluation
 @property (nonatomic, retain) LoggerMessageCell *messageCell;
 @property (nonatomic, retain) LoggerClientInfoCell *clientInfoCell;
 @property (nonatomic, retain) LoggerMarkerCell *markerCell;
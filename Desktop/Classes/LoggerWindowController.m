@@ -35,22 +35,50 @@
 #import "LoggerClientInfoCell.h"
 #import "LoggerMarkerCell.h"
 #import "LoggerMessage.h"
+#import "LoggerMessageFilter.h"
 #import "LoggerAppDelegate.h"
 #import "LoggerCommon.h"
 #import "LoggerDocument.h"
 #import "LoggerSplitView.h"
 #import "LoggerUtils.h"
+#import "LoggerRowHeights.h"
+#import "LoggerImageCache.h"
 
 #define kMaxTableRowHeight @"maxTableRowHeight"
 
+typedef NS_ENUM(int, LoggerFilterChange)
+{
+	LoggerFilterChangeUnrelated = 0,
+	LoggerFilterChangeNarrower,				// new filter lets through a subset of the messages the old one did
+	LoggerFilterChangeWider					// new filter lets through a superset of the messages the old one did
+};
+
 @interface LoggerWindowController ()
+{
+	NSUInteger _refreshGeneration;			// bumped when a refresh starts, older refreshes then give up
+	NSUInteger _displayedMessagesVersion;	// bumped when rows are removed from _displayedMessages
+	NSDictionary *_messageFilterState;		// quick filter and selected filters _messageFilter was built from
+	NSDictionary *_displayedFilterState;	// same for the displayed messages, nil while refreshing
+	NSUInteger _displayedTagsVersion;		// tagsVersion of the connection when the quick filter popup was built
+	LoggerRowHeights *_rowHeights;			// height of each row of _displayedMessages
+	CFMutableDictionaryRef _displayedRows;	// row of each message of _displayedMessages
+	BOOL _restoringEvictedMessages;			// older messages are being read back from the connection's journal
+	BOOL _decodingSavedChunks;				// the next messages of a saved document are being decoded
+	NSMutableIndexSet *_markRows;			// rows of the marks in _displayedMessages
+	NSDate *_timeRangeStart;				// time range of the displayed messages (nil for no bound)
+	NSDate *_timeRangeEnd;
+	NSMapTable *_runsDisplayCache;			// displayed messages of the disconnected runs we switched away from
+}
 - (void)rebuildQuickFilterPopup;
 - (void)updateClientInfo;
 - (void)updateFilterPredicate;
 - (void)refreshAllMessages:(NSArray *)selectMessages;
-- (void)filterIncomingMessages:(NSArray *)messages withFilter:(NSPredicate *)aFilter tableFrameSize:(NSSize)tableFrameSize;
+- (void)filterIncomingMessages:(NSArray *)messages withFilter:(LoggerMessageFilter *)aFilter tableFrameSize:(NSSize)tableFrameSize;
 - (NSPredicate *)filterPredicateFromCurrentSelection;
 - (void)tileLogTable:(BOOL)forceUpdate;
+- (void)indexDisplayedMessagesFromRow:(NSUInteger)firstRow;
+- (NSUInteger)rowOfDisplayedMessage:(id)msg;
+- (NSRange)visibleRows;
 - (void)rebuildMarksSubmenu;
 - (void)clearMarksSubmenu;
 - (void)rebuildRunsSubmenu;
@@ -72,7 +100,10 @@ static NSArray *sXcodeFileExtensions = nil;
 	{
 		_messageFilteringQueue = dispatch_queue_create("com.florentpillet.nslogger.messageFiltering", NULL);
 		_displayedMessages = [[NSMutableArray alloc] initWithCapacity:4096];
-		_tags = [[NSMutableSet alloc] init];
+		_rowHeights = LoggerRowHeightsCreate();
+		_displayedRows = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+		_markRows = [[NSMutableIndexSet alloc] init];
+		_runsDisplayCache = [NSMapTable weakToStrongObjectsMapTable];
 		_filterTags = [[NSMutableSet alloc] init];
 		_threadColumnWidth = DEFAULT_THREAD_COLUMN_WIDTH;
 
@@ -97,6 +128,9 @@ static NSArray *sXcodeFileExtensions = nil;
     _filterSetsTable.dataSource = nil;
 	_filterTable.delegate = nil;
     _filterTable.dataSource = nil;
+
+	LoggerRowHeightsDispose(_rowHeights);
+	CFRelease(_displayedRows);
 }
 
 - (NSUndoManager *)undoManager
@@ -153,8 +187,20 @@ static NSArray *sXcodeFileExtensions = nil;
 											 selector:@selector(tileLogTableNotification:)
 												 name:@"TileLogTableNotification"
 											   object:nil];
+	[[NSNotificationCenter defaultCenter] addObserver:self
+											 selector:@selector(imageThumbnailReady:)
+												 name:kImageThumbnailReadyNotification
+											   object:nil];
     
     [[NSUserDefaults standardUserDefaults] addObserver:self forKeyPath:kMaxTableRowHeight options:0 context:NULL];
+
+	// follow scrolling to pause evictions of old messages and read them back (see LoggerConnection.h)
+	NSClipView *clipView = [[_logTable enclosingScrollView] contentView];
+	[clipView setPostsBoundsChangedNotifications:YES];
+	[[NSNotificationCenter defaultCenter] addObserver:self
+											 selector:@selector(logTableScrolled:)
+												 name:NSViewBoundsDidChangeNotification
+											   object:clipView];
 }
 
 - (NSString *)windowTitleForDocumentDisplayName:(NSString *)displayName
@@ -246,12 +292,16 @@ static NSArray *sXcodeFileExtensions = nil;
 			if (group == NULL || dispatch_get_context(group) != NULL)
 			{
 				NSMutableIndexSet *set = [[NSMutableIndexSet alloc] init];
+				CGFloat defaultHeight = [self.logTable rowHeight];
 				for (LoggerMessage *msg in updatedMessages)
 				{
-					NSUInteger pos = [self.displayedMessages indexOfObjectIdenticalTo:msg];
-					if (pos == NSNotFound || pos > self.lastMessageRow)
-						break;
-					[set addIndex:pos];
+					NSUInteger pos = [self rowOfDisplayedMessage:msg];
+					if (pos == NSNotFound)
+						continue;
+					CGFloat height = msg.cachedCellSize.height;
+					LoggerRowHeightsSet(self->_rowHeights, (uint32_t)pos, (float)(height ? height : defaultHeight));
+					if (pos <= self.lastMessageRow)
+						[set addIndex:pos];
 				}
 				if ([set count])
 					[self.logTable noteHeightOfRowsWithIndexesChanged:set];
@@ -280,8 +330,7 @@ static NSArray *sXcodeFileExtensions = nil;
 	// tile the visible rows (and a bit more) first, then tile all the rest
 	// this gives us a better perceived speed
 	NSSize tableSize = _logTable.frame.size;
-	NSRect r = [_logTable.superview convertRect:[_logTable.superview bounds] toView:_logTable];
-	NSRange visibleRows = [_logTable rowsInRect:r];
+	NSRange visibleRows = [self visibleRows];
 	visibleRows.location = (NSUInteger) MAX((int)0, (int)visibleRows.location - 10);
 	visibleRows.length = MIN(visibleRows.location + visibleRows.length + 10, [_displayedMessages count] - visibleRows.location);
 	if (visibleRows.length)
@@ -325,6 +374,14 @@ static NSArray *sXcodeFileExtensions = nil;
 	[self tileLogTable:NO];
 }
 
+- (void)imageThumbnailReady:(NSNotification *)note
+{
+	// redraw the row of the image if we display it
+	NSUInteger row = [self rowOfDisplayedMessage:note.object];
+	if (row != NSNotFound && row < (NSUInteger)[_logTable numberOfRows])
+		[_logTable setNeedsDisplayInRect:[_logTable rectOfRow:(NSInteger)row]];
+}
+
 - (void)applyFontChanges
 {
 	[self tileLogTable:YES];
@@ -432,7 +489,8 @@ static NSArray *sXcodeFileExtensions = nil;
 - (void)updateFilterPredicate
 {
 	assert([NSThread isMainThread]);
-	NSPredicate *p = [self filterPredicateFromCurrentSelection];
+	NSPredicate *selectionPredicate = [self filterPredicateFromCurrentSelection];
+	NSPredicate *p = selectionPredicate;
 	NSMutableArray *andPredicates = [[NSMutableArray alloc] initWithCapacity:3];
 	if (_logLevel != 0)
 	{
@@ -483,11 +541,49 @@ static NSArray *sXcodeFileExtensions = nil;
 			[andPredicates addObject:p];
 		p = [NSCompoundPredicate andPredicateWithSubpredicates:andPredicates];
 	}
+	_messageFilterState = @{
+		@"selection": (selectionPredicate ?: [NSNull null]),
+		@"level": @(_logLevel),
+		@"tags": [_filterTags copy],
+		@"string": (_filterString ?: @""),
+		@"from": (_timeRangeStart ?: [NSNull null]),
+		@"to": (_timeRangeEnd ?: [NSNull null])
+	};
 	if (p == nil)
 		p = [NSPredicate predicateWithValue:YES];
 	else
 		p = [NSCompoundPredicate orPredicateWithSubpredicates:@[[self alwaysVisibleEntriesPredicate], p]];
+
+	// the time range applies to all messages (marks included). Refreshes only filter the messages
+	// of the connection's time index range, see -refreshAllMessages:
+	NSMutableArray *timePredicates = [[NSMutableArray alloc] initWithCapacity:3];
+	if (_timeRangeStart != nil)
+	{
+		NSExpression *lhs = [NSExpression expressionForKeyPath:@"timestamp"];
+		NSExpression *rhs = [NSExpression expressionForConstantValue:_timeRangeStart];
+		[timePredicates addObject:[NSComparisonPredicate predicateWithLeftExpression:lhs
+																	 rightExpression:rhs
+																			modifier:NSDirectPredicateModifier
+																				type:NSGreaterThanOrEqualToPredicateOperatorType
+																			 options:0]];
+	}
+	if (_timeRangeEnd != nil)
+	{
+		NSExpression *lhs = [NSExpression expressionForKeyPath:@"timestamp"];
+		NSExpression *rhs = [NSExpression expressionForConstantValue:_timeRangeEnd];
+		[timePredicates addObject:[NSComparisonPredicate predicateWithLeftExpression:lhs
+																	 rightExpression:rhs
+																			modifier:NSDirectPredicateModifier
+																				type:NSLessThanOrEqualToPredicateOperatorType
+																			 options:0]];
+	}
+	if ([timePredicates count])
+	{
+		[timePredicates addObject:p];
+		p = [NSCompoundPredicate andPredicateWithSubpredicates:timePredicates];
+	}
 	self.filterPredicate = p;
+	self.messageFilter = [[LoggerMessageFilter alloc] initWithPredicate:p];
 }
 
 - (void)refreshMessagesIfPredicateChanged
@@ -497,9 +593,9 @@ static NSArray *sXcodeFileExtensions = nil;
 	[self updateFilterPredicate];
 	if (![_filterPredicate isEqual:currentPredicate])
 	{
-		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(refreshAllMessages:) object:nil];
+		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(refilterMessages) object:nil];
 		[self rebuildQuickFilterPopup];
-		[self performSelector:@selector(refreshAllMessages:) withObject:nil afterDelay:0];
+		[self performSelector:@selector(refilterMessages) withObject:nil afterDelay:0];
 	}
 }
 
@@ -684,7 +780,11 @@ static NSArray *sXcodeFileExtensions = nil;
 		tagTitle = [NSString stringWithFormat:NSLocalizedString(@"Tag%@: %@", @""), _filterTags.count > 1 ? @"s" : @"", [_filterTags.allObjects componentsJoinedByString:@","]];
 	}
 
-	for (NSString *tag in [[_tags allObjects] sortedArrayUsingSelector:@selector(localizedCompare:)])
+	// tags of the connection's messages, and the ones selected in a previous run so they can be deselected
+	__atomic_store_n(&_displayedTagsVersion, [_attachedConnection tagsVersion], __ATOMIC_RELAXED);
+	NSMutableSet *tags = [[NSMutableSet alloc] initWithArray:[_attachedConnection tags]];
+	[tags unionSet:_filterTags];
+	for (NSString *tag in [[tags allObjects] sortedArrayUsingSelector:@selector(localizedCompare:)])
 	{
 		item = [[NSMenuItem alloc] initWithTitle:tag action:@selector(selectQuickFilterTag:) keyEquivalent:@""];
 		[item setRepresentedObject:tag];
@@ -699,13 +799,10 @@ static NSArray *sXcodeFileExtensions = nil;
 	self.hasQuickFilter = (_filterString != nil || _filterTags.count != 0 || _logLevel != 0);
 }
 
-- (void)addTags:(NSArray *)newTags
+- (void)updateTags
 {
-	// complete the set of "seen" _tags in messages
-	// if changed, update the quick filter popup
-	NSUInteger numTags = [_tags count];
-	[_tags addObjectsFromArray:newTags];
-	if ([_tags count] != numTags)
+	// update the quick filter popup if tags appeared in or disappeared from the connection
+	if ([_attachedConnection tagsVersion] != _displayedTagsVersion)
 		[self rebuildQuickFilterPopup];
 }
 
@@ -764,13 +861,123 @@ static NSArray *sXcodeFileExtensions = nil;
 #pragma mark -
 #pragma mark Table management
 // -----------------------------------------------------------------------------
+- (void)indexDisplayedMessagesFromRow:(NSUInteger)firstRow
+{
+	// Record the row and height of the displayed messages from firstRow on, after messages were
+	// appended to or removed from _displayedMessages
+	assert([NSThread isMainThread]);
+	if (firstRow == 0)
+	{
+		CFDictionaryRemoveAllValues(_displayedRows);
+		[_markRows removeAllIndexes];
+	}
+	else if ([_markRows count] && [_markRows lastIndex] >= firstRow)
+		[_markRows removeIndexesInRange:NSMakeRange(firstRow, [_markRows lastIndex] + 1 - firstRow)];
+	LoggerRowHeightsTruncate(_rowHeights, (uint32_t)firstRow);
+	CGFloat defaultHeight = [_logTable rowHeight];
+	NSUInteger count = [_displayedMessages count];
+	for (NSUInteger row = firstRow; row < count; row++)
+	{
+		LoggerMessage *msg = _displayedMessages[row];
+		CGFloat height = msg.cachedCellSize.height;
+		LoggerRowHeightsAppend(_rowHeights, (float)(height ? height : defaultHeight));
+		CFDictionarySetValue(_displayedRows, (__bridge const void *)msg, (const void *)row);
+		if (msg.type == LOGMSG_TYPE_MARK)
+			[_markRows addIndex:row];
+	}
+}
+
+- (NSUInteger)rowOfDisplayedMessage:(id)msg
+{
+	assert([NSThread isMainThread]);
+	const void *row;
+	if (msg != nil && CFDictionaryGetValueIfPresent(_displayedRows, (__bridge const void *)msg, &row))
+		return (NSUInteger)row;
+	return NSNotFound;
+}
+
+- (NSRange)visibleRows
+{
+	// Rows of the log table in its visible rect, found from the row heights
+	NSRect r = [_logTable.superview convertRect:_logTable.superview.bounds toView:_logTable];
+	float spacing = (float)_logTable.intercellSpacing.height;
+	uint32_t numRows = (uint32_t)MIN((NSUInteger)[_logTable numberOfRows], (NSUInteger)LoggerRowHeightsCount(_rowHeights));
+	uint32_t first = LoggerRowHeightsRowAtOffset(_rowHeights, NSMinY(r), spacing);
+	uint32_t last = LoggerRowHeightsRowAtOffset(_rowHeights, fmax(NSMinY(r), NSMaxY(r) - 1), spacing);
+	if (first >= numRows)
+		return NSMakeRange(0, 0);
+	return NSMakeRange(first, MIN(last, numRows - 1) - first + 1);
+}
+
+- (void)logTableScrolled:(NSNotification *)note
+{
+	// The connection keeps the segments of the messages on screen while the user looks at them. Once
+	// scrolled to the top, the messages it evicted are read back from its journal
+	assert([NSThread isMainThread]);
+	LoggerConnection *theConnection = _attachedConnection;
+	if (theConnection == nil || !_initialRefreshDone)
+		return;
+	NSRect bounds = [[note object] bounds];
+	NSRange visibleRows = [self visibleRows];
+	LoggerMessage *oldestVisible = nil;
+	for (NSUInteger row = visibleRows.location; oldestVisible == nil && row < MIN(NSMaxRange(visibleRows), [_displayedMessages count]); row++)
+	{
+		LoggerMessage *msg = _displayedMessages[row];
+		if (msg.type != LOGMSG_TYPE_CLIENTINFO)
+			oldestVisible = msg;
+	}
+	if (theConnection.oldestVisibleMessage != oldestVisible)
+		theConnection.oldestVisibleMessage = oldestVisible;
+
+	if (NSMinY(bounds) <= 0 && !_restoringEvictedMessages && [theConnection evictedSegmentsCount])
+	{
+		_restoringEvictedMessages = YES;
+		[theConnection restoreEvictedMessages:^(NSUInteger count) {
+			self->_restoringEvictedMessages = NO;
+			if (count && self.attachedConnection == theConnection)
+				[self refreshAllMessages:nil];
+		}];
+	}
+
+	// Saved documents decode their next chunk of messages when the user gets within a screen of the
+	// bottom. The messages are appended to the table like incoming messages
+	LoggerDocument *doc = (LoggerDocument *)self.document;
+	if (NSMaxY(bounds) >= NSHeight([_logTable frame]) - NSHeight(bounds) && !_decodingSavedChunks &&
+		[doc hasSavedChunksToDecodeForConnection:theConnection filter:_messageFilter following:1])
+	{
+		_decodingSavedChunks = YES;
+		[doc decodeSavedChunksOfConnection:theConnection filter:_messageFilter following:1 completion:^(NSUInteger count) {
+			self->_decodingSavedChunks = NO;
+		}];
+	}
+}
+
+- (BOOL)decodeSavedChunksThenRefresh:(NSArray *)selectedMessages
+{
+	// Before the messages of a saved document are filtered, the chunks that may hold messages passing
+	// the filter are decoded (their summary tells which ones can't). Without a filter, only the ones the
+	// previous filters skipped are: the chunks that follow wait for the user to scroll down
+	assert([NSThread isMainThread]);
+	LoggerDocument *doc = (LoggerDocument *)self.document;
+	LoggerConnection *theConnection = _attachedConnection;
+	LoggerMessageFilter *aFilter = _messageFilter;
+	NSUInteger following = [_filterPredicate isEqual:[NSPredicate predicateWithValue:YES]] ? 0 : NSUIntegerMax;
+	if (theConnection == nil || ![doc hasSavedChunksToDecodeForConnection:theConnection filter:aFilter following:following])
+		return NO;
+	self.info = NSLocalizedString(@"Loading messages...", @"");
+	[doc decodeSavedChunksOfConnection:theConnection filter:aFilter following:following completion:^(NSUInteger count) {
+		if (self.attachedConnection == theConnection)
+			[self refreshAllMessages:selectedMessages];
+	}];
+	return YES;
+}
+
 - (void)messagesAppendedToTable
 {
 	assert([NSThread isMainThread]);
 	if (_attachedConnection.connected)
 	{
-		NSRect r = [_logTable.superview convertRect:_logTable.superview.bounds toView:_logTable];
-		NSRange visibleRows = [_logTable rowsInRect:r];
+		NSRange visibleRows = [self visibleRows];
 		BOOL lastVisible = (visibleRows.location == NSNotFound ||
 							visibleRows.length == 0 ||
 							(visibleRows.location + visibleRows.length) >= _lastMessageRow);
@@ -789,7 +996,9 @@ static NSArray *sXcodeFileExtensions = nil;
 - (void)appendMessagesToTable:(NSArray *)messages
 {
 	assert([NSThread isMainThread]);
+	NSUInteger firstRow = [_displayedMessages count];
 	[_displayedMessages addObjectsFromArray:messages];
+	[self indexDisplayedMessagesFromRow:firstRow];
 
 	// schedule a table reload. Do this asynchronously (and cancellable-y) so we can limit the
 	// number of reload requests in case of high load
@@ -893,62 +1102,163 @@ void runSystemCommand(NSString *cmd)
 #pragma mark -
 #pragma mark Filtering
 // -----------------------------------------------------------------------------
+- (id)messageToMakeVisibleRememberingSelection:(NSArray **)selectedMessages
+{
+	// Remember the currently selected messages, and which message we should scroll
+	// back to once the table has been refiltered
+	NSIndexSet *selectedRows = [_logTable selectedRowIndexes];
+	if ([selectedRows count])
+		*selectedMessages = [_displayedMessages objectsAtIndexes:selectedRows];
+
+	NSRange visibleRows = [self visibleRows];
+	if (visibleRows.length != 0)
+	{
+		NSIndexSet *selectedVisible = [selectedRows indexesInRange:visibleRows options:0 passingTest:^(NSUInteger idx, BOOL *stop){return YES;}];
+		if ([selectedVisible count])
+			return _displayedMessages[selectedVisible.firstIndex];
+		return _displayedMessages[visibleRows.location];
+	}
+	return nil;
+}
+
+- (void)restoreSelection:(NSArray *)selectedMessages
+			visibleMessage:(id)messageToMakeVisible
+  makeTableFirstResponder:(BOOL)makeTableFirstResponder
+{
+	assert([NSThread isMainThread]);
+	if ([selectedMessages count])
+	{
+		// If there were selected rows, try to reselect them
+		NSMutableIndexSet *newSelectionIndexes = [[NSMutableIndexSet alloc] init];
+		for (id msg in selectedMessages)
+		{
+			NSUInteger msgIndex = [self rowOfDisplayedMessage:msg];
+			if (msgIndex != NSNotFound)
+				[newSelectionIndexes addIndex:(NSUInteger)msgIndex];
+		}
+		if ([newSelectionIndexes count])
+		{
+			[_logTable selectRowIndexes:newSelectionIndexes byExtendingSelection:NO];
+			if (makeTableFirstResponder)
+				[[self window] makeFirstResponder:_logTable];
+		}
+	}
+
+	if (messageToMakeVisible != nil)
+	{
+		// Restore the logical location in the message flow, to keep the user
+		// in-context
+		NSUInteger msgIndex = [self rowOfDisplayedMessage:messageToMakeVisible];
+		if (msgIndex == NSNotFound)
+		{
+			// go back to the closest message before it that is displayed
+			@synchronized(_attachedConnection.messages)
+			{
+				NSArray *messages = _attachedConnection.messages;
+				NSUInteger where = [_attachedConnection indexOfMessage:messageToMakeVisible];
+				if (where == 0)
+					msgIndex = 0;
+				while (where != NSNotFound && where > 0)
+				{
+					msgIndex = [self rowOfDisplayedMessage:messages[--where]];
+					if (msgIndex != NSNotFound)
+						break;
+					if (where == 0)
+						msgIndex = 0;
+				}
+			}
+		}
+		if (msgIndex != NSNotFound)
+			[_logTable scrollRowToVisible:msgIndex];
+	}
+}
+
 - (void)refreshAllMessages:(NSArray *)selectedMessages
 {
 	assert([NSThread isMainThread]);
+	if ([self decodeSavedChunksThenRefresh:selectedMessages])
+		return;
 	@synchronized (_attachedConnection.messages)
 	{
 		BOOL quickFilterWasFirstResponder = ([[self window] firstResponder] == [_quickFilterTextField currentEditor]);
 		id messageToMakeVisible = selectedMessages[0];
 		if (messageToMakeVisible == nil)
-		{
-			// Remember the currently selected messages
-			NSIndexSet *selectedRows = [_logTable selectedRowIndexes];
-			if ([selectedRows count])
-				selectedMessages = [_displayedMessages objectsAtIndexes:selectedRows];
-
-			NSRect r = [[_logTable superview] convertRect:[[_logTable superview] bounds] toView:_logTable];
-			NSRange visibleRows = [_logTable rowsInRect:r];
-			if (visibleRows.length != 0)
-			{
-				NSIndexSet *selectedVisible = [selectedRows indexesInRange:visibleRows options:0 passingTest:^(NSUInteger idx, BOOL *stop){return YES;}];
-				if ([selectedVisible count])
-					messageToMakeVisible = _displayedMessages[selectedVisible.firstIndex];
-				else
-					messageToMakeVisible = _displayedMessages[visibleRows.location];
-			}
-		}
+			messageToMakeVisible = [self messageToMakeVisibleRememberingSelection:&selectedMessages];
 
 		LoggerConnection *theConnection = _attachedConnection;
-
+		LoggerMessageFilter *aFilter = _messageFilter;
+		NSDictionary *filterState = _messageFilterState;
 		NSSize tableFrameSize = [_logTable frame].size;
-		NSUInteger numMessages = [_attachedConnection.messages count];
-		for (int i = 0; i < numMessages;)
+		NSArray *messages = nil;
+		NSUInteger firstIndex = NSNotFound;
+		if (theConnection != nil)
 		{
-			if (i == 0)
-			{
-				dispatch_async(_messageFilteringQueue, ^{
-					dispatch_async(dispatch_get_main_queue(), ^{
-						self.lastMessageRow = 0;
-						[self.displayedMessages removeAllObjects];
-						[self.logTable reloadData];
-						self.info = NSLocalizedString(@"No message", @"");
-					});
+			// with a time range, only the messages the time index finds in it are filtered
+			NSRange range = NSMakeRange(0, [theConnection.messages count]);
+			if (_timeRangeStart != nil || _timeRangeEnd != nil)
+				range = [theConnection rangeOfMessagesFromDate:_timeRangeStart toDate:_timeRangeEnd];
+			messages = [theConnection.messages subarrayWithRange:range];
+			NSUInteger visibleIndex = [theConnection indexOfMessage:messageToMakeVisible];
+			if (visibleIndex != NSNotFound && NSLocationInRange(visibleIndex, range))
+				firstIndex = visibleIndex - range.location;
+		}
+
+		// a refresh supersedes the ones still running: they stop filtering and drop their results
+		NSUInteger generation = __atomic_add_fetch(&_refreshGeneration, 1, __ATOMIC_RELAXED);
+		_displayedFilterState = nil;
+
+		dispatch_async(_messageFilteringQueue, ^{
+			dispatch_async(dispatch_get_main_queue(), ^{
+				self.lastMessageRow = 0;
+				[self.displayedMessages removeAllObjects];
+				[self indexDisplayedMessagesFromRow:0];
+				self->_displayedMessagesVersion++;
+				[self.logTable reloadData];
+				self.info = NSLocalizedString(@"No message", @"");
+			});
+			// Check that the connection didn't change
+			if (self.attachedConnection != theConnection || ![messages count])
+				return;
+
+			// the rows from the visible message on are appended as their chunks are filtered,
+			// the ones before are inserted on top once all chunks are done
+			__block NSUInteger publishedCount = 0;
+			NSArray *filteredMessages = [self filterMessages:messages
+												  withFilter:aFilter
+											  tableFrameSize:tableFrameSize
+												  connection:theConnection
+												  generation:generation
+											 startingAtIndex:firstIndex
+												   published:^(NSArray *publishedMessages) {
+				dispatch_async(dispatch_get_main_queue(), ^{
+					if (self.attachedConnection == theConnection)
+					{
+						[self appendMessagesToTable:publishedMessages];
+						publishedCount += [publishedMessages count];
+					}
 				});
-			}
-			NSUInteger length = MIN(4096, numMessages - i);
-			if (length)
+			}];
+			if (filteredMessages != nil)
 			{
-				NSPredicate *aFilter = _filterPredicate;
-				NSArray *subArray = [_attachedConnection.messages subarrayWithRange:NSMakeRange(i, length)];
-				dispatch_async(_messageFilteringQueue, ^{
-					// Check that the connection didn't change
+				dispatch_async(dispatch_get_main_queue(), ^{
 					if (self.attachedConnection == theConnection)
-						[self filterIncomingMessages:subArray withFilter:aFilter tableFrameSize:tableFrameSize];
+					{
+						NSUInteger before = [filteredMessages count] - publishedCount;
+						if (before)
+						{
+							[self.displayedMessages replaceObjectsInRange:NSMakeRange(0, 0)
+													 withObjectsFromArray:filteredMessages
+																	range:NSMakeRange(0, before)];
+							[self indexDisplayedMessagesFromRow:0];
+							self->_displayedMessagesVersion++;
+							self.lastMessageRow = 0;
+							[self.logTable reloadData];
+						}
+						[self updateTags];
+					}
 				});
 			}
-			i += length;
-		}
+		});
 
 		// Stuff we want to do only when filtering is complete. To do this, we enqueue
 		// one more operation to the message filtering queue, with the only goal of
@@ -966,52 +1276,14 @@ void runSystemCommand(NSString *cmd)
 																   object:nil];
 						[self messagesAppendedToTable];
 					}
-					
-					if ([selectedMessages count])
-					{
-						// If there were selected rows, try to reselect them
-						NSMutableIndexSet *newSelectionIndexes = [[NSMutableIndexSet alloc] init];
-						for (id msg in selectedMessages)
-						{
-							NSInteger msgIndex = [self.displayedMessages indexOfObjectIdenticalTo:msg];
-							if (msgIndex != NSNotFound)
-								[newSelectionIndexes addIndex:(NSUInteger)msgIndex];
-						}
-						if ([newSelectionIndexes count])
-						{
-							[self.logTable selectRowIndexes:newSelectionIndexes byExtendingSelection:NO];
-							if (!quickFilterWasFirstResponder)
-								[[self window] makeFirstResponder:self.logTable];
-						}
-					}
-					
-					if (messageToMakeVisible != nil)
-					{
-						// Restore the logical location in the message flow, to keep the user
-						// in-context
-						NSUInteger msgIndex;
-						id msg = messageToMakeVisible;
-						@synchronized(self.attachedConnection.messages)
-						{
-							while ((msgIndex = [self.displayedMessages indexOfObjectIdenticalTo:msg]) == NSNotFound)
-							{
-								NSUInteger where = [self.attachedConnection.messages indexOfObjectIdenticalTo:msg];
-								if (where == NSNotFound)
-									break;
-								if (where == 0)
-								{
-									msgIndex = 0;
-									break;
-								}
-								else
-									msg = self.attachedConnection.messages[where - 1];
-							}
-							if (msgIndex != NSNotFound)
-								[self.logTable scrollRowToVisible:msgIndex];
-						}
-					}
-					
+					[self restoreSelection:selectedMessages
+							visibleMessage:messageToMakeVisible
+				   makeTableFirstResponder:!quickFilterWasFirstResponder];
 					[self rebuildMarksSubmenu];
+
+					// from now on, filter changes that narrow or widen this filter can reuse the displayed messages
+					if (__atomic_load_n(&self->_refreshGeneration, __ATOMIC_RELAXED) == generation)
+						self->_displayedFilterState = filterState;
 				}
 				self.initialRefreshDone = YES;
 			});
@@ -1019,10 +1291,306 @@ void runSystemCommand(NSString *cmd)
 	}
 }
 
+static LoggerFilterChange CompareFilterStates(NSDictionary *oldState, NSDictionary *newState)
+{
+	// Tell whether the messages passing the new quick filter are a subset (narrower) or a superset
+	// (wider) of those passing the old one. See -updateFilterPredicate for the predicates we build.
+	if (oldState == nil || newState == nil || ![oldState[@"selection"] isEqual:newState[@"selection"]])
+		return LoggerFilterChangeUnrelated;
+
+	BOOL narrower = YES, wider = YES;
+
+	// log level: "level < logLevel", 0 means all levels
+	int oldLevel = [oldState[@"level"] intValue], newLevel = [newState[@"level"] intValue];
+	if (oldLevel != newLevel)
+	{
+		if (newLevel == 0 || (oldLevel != 0 && newLevel > oldLevel))
+			narrower = NO;
+		else
+			wider = NO;
+	}
+
+	// tags: "tag IN filterTags", no tag means all tags
+	NSSet *oldTags = oldState[@"tags"], *newTags = newState[@"tags"];
+	if (![oldTags isEqualToSet:newTags])
+	{
+		if ([oldTags count] && (![newTags count] || ![newTags isSubsetOfSet:oldTags]))
+			narrower = NO;
+		if ([newTags count] && (![oldTags count] || ![oldTags isSubsetOfSet:newTags]))
+			wider = NO;
+	}
+
+	// filter string: "messageText CONTAINS[c] string OR functionName CONTAINS[c] string"
+	NSString *oldString = oldState[@"string"], *newString = newState[@"string"];
+	if (![oldString isEqualToString:newString])
+	{
+		if ([oldString length] && [newString rangeOfString:oldString options:NSCaseInsensitiveSearch].location == NSNotFound)
+			narrower = NO;
+		if ([newString length] && [oldString rangeOfString:newString options:NSCaseInsensitiveSearch].location == NSNotFound)
+			wider = NO;
+	}
+
+	// time range: "timestamp >= from AND timestamp <= to", no date means no bound
+	id oldFrom = oldState[@"from"], newFrom = newState[@"from"];
+	if (![oldFrom isEqual:newFrom])
+	{
+		if (newFrom == [NSNull null] || (oldFrom != [NSNull null] && [newFrom compare:oldFrom] == NSOrderedAscending))
+			narrower = NO;
+		else
+			wider = NO;
+	}
+	id oldTo = oldState[@"to"], newTo = newState[@"to"];
+	if (![oldTo isEqual:newTo])
+	{
+		if (newTo == [NSNull null] || (oldTo != [NSNull null] && [newTo compare:oldTo] == NSOrderedDescending))
+			narrower = NO;
+		else
+			wider = NO;
+	}
+
+	if (narrower)
+		return LoggerFilterChangeNarrower;
+	if (wider)
+		return LoggerFilterChangeWider;
+	return LoggerFilterChangeUnrelated;
+}
+
+static NSArray *MessagesNotDisplayed(NSArray *allMessages, NSArray *displayedMessages, id visibleMessage, NSUInteger *visibleIndex)
+{
+	// The messages of the connection that didn't pass the previous filter. displayedMessages must be
+	// an ordered subset of allMessages, returns nil if it isn't (the connection was cleared, for example).
+	NSMutableArray *excluded = [[NSMutableArray alloc] initWithCapacity:[allMessages count] - MIN([allMessages count], [displayedMessages count])];
+	NSUInteger numDisplayed = [displayedMessages count], next = 0;
+	id nextDisplayed = numDisplayed ? displayedMessages[0] : nil;
+	*visibleIndex = NSNotFound;
+	for (id msg in allMessages)
+	{
+		if (msg == visibleMessage)
+			*visibleIndex = [excluded count];
+		if (msg == nextDisplayed)
+			nextDisplayed = (++next < numDisplayed) ? displayedMessages[next] : nil;
+		else
+			[excluded addObject:msg];
+	}
+	return (next == numDisplayed) ? excluded : nil;
+}
+
+static NSArray *MergeMessages(NSArray *allMessages, NSArray *displayedMessages, NSArray *addedMessages)
+{
+	// Merge two ordered subsets of allMessages, keeping the order of allMessages
+	NSMutableArray *merged = [[NSMutableArray alloc] initWithCapacity:[displayedMessages count] + [addedMessages count]];
+	NSUInteger numDisplayed = [displayedMessages count], numAdded = [addedMessages count];
+	NSUInteger nextDisplayed = 0, nextAdded = 0;
+	for (id msg in allMessages)
+	{
+		if (nextDisplayed < numDisplayed && displayedMessages[nextDisplayed] == msg)
+		{
+			[merged addObject:msg];
+			nextDisplayed++;
+		}
+		else if (nextAdded < numAdded && addedMessages[nextAdded] == msg)
+		{
+			[merged addObject:msg];
+			nextAdded++;
+		}
+	}
+	return merged;
+}
+
+- (void)refineDisplayedMessages:(LoggerFilterChange)change
+{
+	// Refilter when the new filter is narrower or wider than the one the displayed messages passed:
+	// when narrower, only the displayed messages are filtered again. When wider, the displayed messages
+	// all pass and we only filter the ones that were excluded.
+	assert([NSThread isMainThread]);
+	assert(change != LoggerFilterChangeUnrelated);
+	BOOL quickFilterWasFirstResponder = ([[self window] firstResponder] == [_quickFilterTextField currentEditor]);
+	NSArray *selectedMessages = nil;
+	id messageToMakeVisible = [self messageToMakeVisibleRememberingSelection:&selectedMessages];
+
+	LoggerConnection *theConnection = _attachedConnection;
+	LoggerMessageFilter *aFilter = _messageFilter;
+	NSDictionary *filterState = _messageFilterState;
+	NSSize tableFrameSize = [_logTable frame].size;
+	NSArray *displayedMessages = [_displayedMessages copy];
+	NSUInteger displayedVersion = _displayedMessagesVersion;
+	NSUInteger visibleRow = [self rowOfDisplayedMessage:messageToMakeVisible];
+
+	NSUInteger generation = __atomic_add_fetch(&_refreshGeneration, 1, __ATOMIC_RELAXED);
+	_displayedFilterState = nil;
+
+	dispatch_async(_messageFilteringQueue, ^{
+		if (self.attachedConnection != theConnection)
+			return;
+		NSArray *candidates = displayedMessages;
+		NSUInteger firstIndex = visibleRow;
+		NSArray *allMessages = nil;
+		if (change == LoggerFilterChangeWider)
+		{
+			// The connection's messages are copied once the incoming messages filtering jobs queued
+			// before this one ran. Messages received after the copy whose jobs are still pending are
+			// part of the result, these jobs skip the ones already displayed
+			@synchronized (theConnection.messages)
+			{
+				allMessages = [theConnection.messages copy];
+			}
+			candidates = MessagesNotDisplayed(allMessages, displayedMessages, messageToMakeVisible, &firstIndex);
+			if (candidates == nil)
+			{
+				dispatch_async(dispatch_get_main_queue(), ^{
+					if (self.attachedConnection == theConnection && __atomic_load_n(&self->_refreshGeneration, __ATOMIC_RELAXED) == generation)
+						[self refreshAllMessages:nil];
+				});
+				return;
+			}
+		}
+		NSArray *filteredMessages = [self filterMessages:candidates
+											  withFilter:aFilter
+										  tableFrameSize:tableFrameSize
+											  connection:theConnection
+											  generation:generation
+										 startingAtIndex:firstIndex
+											   published:nil];
+		if (filteredMessages == nil)
+			return;
+		if (change == LoggerFilterChangeWider)
+			filteredMessages = MergeMessages(allMessages, displayedMessages, filteredMessages);
+
+		dispatch_async(dispatch_get_main_queue(), ^{
+			if (self.attachedConnection != theConnection || __atomic_load_n(&self->_refreshGeneration, __ATOMIC_RELAXED) != generation)
+				return;
+			if (self->_displayedMessagesVersion != displayedVersion || [self.displayedMessages count] < [displayedMessages count])
+			{
+				// rows were removed from the table in the meantime
+				[self refreshAllMessages:selectedMessages];
+				return;
+			}
+
+			// Messages appended to the table since we started were filtered with the previous filter.
+			// When narrowing, filter them again. When widening, they were part of the messages we just
+			// filtered.
+			NSMutableArray *newMessages = [filteredMessages mutableCopy];
+			if (change == LoggerFilterChangeNarrower)
+			{
+				NSRange appended = NSMakeRange([displayedMessages count], [self.displayedMessages count] - [displayedMessages count]);
+				if (appended.length)
+					[newMessages addObjectsFromArray:[aFilter filteredMessages:[self.displayedMessages subarrayWithRange:appended]]];
+			}
+
+			[self.logTable deselectAll:self];
+			[self.displayedMessages setArray:newMessages];
+			[self indexDisplayedMessagesFromRow:0];
+			self->_displayedMessagesVersion++;
+			self.lastMessageRow = 0;
+			[self.logTable reloadData];
+			[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(messagesAppendedToTable) object:nil];
+			[self messagesAppendedToTable];
+			[self restoreSelection:selectedMessages
+					visibleMessage:messageToMakeVisible
+		   makeTableFirstResponder:!quickFilterWasFirstResponder];
+			self->_displayedFilterState = filterState;
+		});
+	});
+}
+
+- (void)refilterMessages
+{
+	// Refilter after the filter predicate changed, reusing the currently displayed
+	// messages when we can
+	assert([NSThread isMainThread]);
+	if ([self decodeSavedChunksThenRefresh:nil])
+		return;
+	LoggerFilterChange change = CompareFilterStates(_displayedFilterState, _messageFilterState);
+	if (change == LoggerFilterChangeUnrelated)
+		[self refreshAllMessages:nil];
+	else
+		[self refineDisplayedMessages:change];
+}
+
+static NSUInteger RefreshChunkForIteration(NSUInteger iteration, NSUInteger firstChunk, NSUInteger numChunks)
+{
+	// Iteration 0 filters firstChunk, then we alternate between the chunks after and
+	// before it, and finish with the side that has more chunks
+	NSUInteger before = firstChunk, after = numChunks - firstChunk - 1;
+	NSUInteger paired = MIN(before, after);
+	if (iteration == 0)
+		return firstChunk;
+	NSUInteger k = iteration - 1;
+	if (k < 2 * paired)
+		return (k & 1) ? firstChunk - (k / 2 + 1) : firstChunk + (k / 2 + 1);
+	k -= 2 * paired;
+	return (after > before) ? firstChunk + paired + 1 + k : firstChunk - paired - 1 - k;
+}
+
+- (NSArray *)filterMessages:(NSArray *)messages
+				 withFilter:(LoggerMessageFilter *)aFilter
+			 tableFrameSize:(NSSize)tableFrameSize
+				 connection:(LoggerConnection *)theConnection
+				 generation:(NSUInteger)generation
+			startingAtIndex:(NSUInteger)firstIndex
+				  published:(void (^)(NSArray *filteredMessages))published
+{
+	// Filter all the messages of a refresh, using all cores. Executed on the message filtering queue.
+	// Chunks are processed starting with the one holding the message we'll scroll to, so that the
+	// rows the user sees are filtered and tiled first, then results are merged in the original order.
+	// If given, the published block is called as soon as that chunk is done, then with the results of
+	// the chunks after it as they complete, in order. The chunks before it are only in the result.
+	// Returns nil if the connection changed or a newer refresh started in the meantime.
+	const NSUInteger chunkSize = 4096;
+	NSUInteger numMessages = [messages count];
+	NSUInteger numChunks = (numMessages + chunkSize - 1) / chunkSize;
+	NSUInteger firstChunk = (firstIndex < numMessages) ? firstIndex / chunkSize : 0;
+
+	NSMutableArray *chunkMessages = [[NSMutableArray alloc] initWithCapacity:numChunks];
+	for (NSUInteger i = 0; i < numChunks; i++)
+		[chunkMessages addObject:[NSNull null]];
+
+	__block BOOL cancelled = NO;
+	__block NSUInteger nextPublishedChunk = firstChunk;
+	dispatch_apply(numChunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iteration) {
+		if (__atomic_load_n(&cancelled, __ATOMIC_RELAXED))
+			return;
+		if (__atomic_load_n(&self->_refreshGeneration, __ATOMIC_RELAXED) != generation || self.attachedConnection != theConnection)
+		{
+			__atomic_store_n(&cancelled, YES, __ATOMIC_RELAXED);
+			return;
+		}
+		@autoreleasepool
+		{
+			NSUInteger chunk = RefreshChunkForIteration(iteration, firstChunk, numChunks);
+			NSRange range = NSMakeRange(chunk * chunkSize, MIN(chunkSize, numMessages - chunk * chunkSize));
+			NSArray *subArray = [messages subarrayWithRange:range];
+			NSArray *filteredMessages = [aFilter filteredMessages:subArray];
+			if ([filteredMessages count])
+				[self tileLogTableMessages:filteredMessages withSize:tableFrameSize forceUpdate:NO group:NULL];
+			@synchronized (chunkMessages)
+			{
+				chunkMessages[chunk] = filteredMessages;
+				if (published != nil && chunk == nextPublishedChunk)
+				{
+					// called with the lock held, so that the results are published in order
+					NSMutableArray *publishedMessages = [[NSMutableArray alloc] init];
+					while (nextPublishedChunk < numChunks && chunkMessages[nextPublishedChunk] != [NSNull null])
+						[publishedMessages addObjectsFromArray:chunkMessages[nextPublishedChunk++]];
+					if ([publishedMessages count])
+						published(publishedMessages);
+				}
+			}
+		}
+	});
+	if (cancelled)
+		return nil;
+
+	NSMutableArray *filteredMessages = [[NSMutableArray alloc] init];
+	for (NSUInteger i = 0; i < numChunks; i++)
+		[filteredMessages addObjectsFromArray:chunkMessages[i]];
+	return filteredMessages;
+}
+
 - (void)filterIncomingMessages:(NSArray *)messages
 {
 	assert([NSThread isMainThread]);
-	NSPredicate *aFilter = _filterPredicate;		// catch value now rather than dereference it from self later
+	LoggerMessageFilter *aFilter = _messageFilter;		// catch value now rather than dereference it from self later
 	NSSize tableFrameSize = [_logTable frame].size;
 	dispatch_async(_messageFilteringQueue, ^{
 		[self filterIncomingMessages:(NSArray *)messages withFilter:aFilter tableFrameSize:tableFrameSize];
@@ -1030,26 +1598,48 @@ void runSystemCommand(NSString *cmd)
 }
 
 - (void)filterIncomingMessages:(NSArray *)messages
-					withFilter:(NSPredicate *)aFilter
+					withFilter:(LoggerMessageFilter *)aFilter
 				tableFrameSize:(NSSize)tableFrameSize
 {
-	// collect all _tags
-	NSArray *msgTags = [messages valueForKeyPath:@"@distinctUnionOfObjects.tag"];
-
-	// find out which messages we want to keep. Executed on the message filtering queue
-	NSArray *filteredMessages = [messages filteredArrayUsingPredicate:aFilter];
+	// find out which messages we want to keep. Executed on the message filtering queue.
+	// The connection counted the tags of the messages before passing them on
+	NSArray *filteredMessages = [aFilter filteredMessages:messages];
+	LoggerConnection *theConnection = _attachedConnection;
 	if ([filteredMessages count])
 	{
-		LoggerConnection *theConnection = _attachedConnection;
 		dispatch_async(dispatch_get_main_queue(), ^{
 			[self tileLogTableMessages:filteredMessages withSize:tableFrameSize forceUpdate:NO group:NULL];
 			if (self.attachedConnection == theConnection)
 			{
-				[self appendMessagesToTable:filteredMessages];
-				[self addTags:msgTags];
+				// a refresh or refine that copied the connection's messages after these were received
+				// may have displayed them already
+				NSArray *newMessages = filteredMessages;
+				NSUInteger i, count = [filteredMessages count];
+				for (i = 0; i < count && [self rowOfDisplayedMessage:filteredMessages[i]] == NSNotFound; i++)
+					;
+				if (i < count)
+				{
+					NSMutableArray *notDisplayed = [[filteredMessages subarrayWithRange:NSMakeRange(0, i)] mutableCopy];
+					for (; i < count; i++)
+					{
+						if ([self rowOfDisplayedMessage:filteredMessages[i]] == NSNotFound)
+							[notDisplayed addObject:filteredMessages[i]];
+					}
+					newMessages = notDisplayed;
+				}
+				if ([newMessages count])
+					[self appendMessagesToTable:newMessages];
+				[self updateTags];
 			}
 		});
 	}
+	else if ([theConnection tagsVersion] != __atomic_load_n(&_displayedTagsVersion, __ATOMIC_RELAXED))
+	{
+		dispatch_async(dispatch_get_main_queue(), ^{
+			if (self.attachedConnection == theConnection)
+				[self updateTags];
+		});
+	}
 }
 
 // -----------------------------------------------------------------------------
@@ -1062,10 +1652,16 @@ void runSystemCommand(NSString *cmd)
 
 	if (_attachedConnection != nil)
 	{
+		// Keep the messages of a disconnected run around, so that switching back to it doesn't filter them again
+		[self cacheDisplayedMessagesOfRun];
+
 		// Completely clear log table
 		[_logTable deselectAll:self];
 		_lastMessageRow = 0;
 		[_displayedMessages removeAllObjects];
+		[self indexDisplayedMessagesFromRow:0];
+		_displayedMessagesVersion++;
+		_displayedFilterState = nil;
 		self.info = NSLocalizedString(@"No message", @"");
 		[_logTable reloadData];
 		[self rebuildMarksSubmenu];
@@ -1076,6 +1672,7 @@ void runSystemCommand(NSString *cmd)
 
 		// Cancel pending tasks
 		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(refreshAllMessages:) object:nil];
+		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(refilterMessages) object:nil];
 		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(refreshMessagesIfPredicateChanged) object:nil];
 		[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(messagesAppendedToTable) object:nil];
 		if (_lastTilingGroup != NULL)
@@ -1086,6 +1683,7 @@ void runSystemCommand(NSString *cmd)
 		
 		// Detach previous connection
 		_attachedConnection.attachedToWindow = NO;
+		_attachedConnection.oldestVisibleMessage = nil;
 		_attachedConnection = nil;
 	}
 	if (aConnection != nil)
@@ -1093,16 +1691,72 @@ void runSystemCommand(NSString *cmd)
 		_attachedConnection = aConnection;
 		_attachedConnection.attachedToWindow = YES;
 		_initialRefreshDone = NO;
+		NSDictionary *cachedRun = [_runsDisplayCache objectForKey:aConnection];
+		[_runsDisplayCache removeObjectForKey:aConnection];
 		dispatch_async(dispatch_get_main_queue(), ^{
 			[self updateClientInfo];
 			if (!_clientAppSettingsRestored)
 				[self restoreClientApplicationSettings];
 			[self rebuildRunsSubmenu];
-			[self refreshAllMessages:nil];
+			[self rebuildQuickFilterPopup];
+			if (![self displayCachedMessagesOfRun:cachedRun connection:aConnection])
+				[self refreshAllMessages:nil];
 		});
 	}
 }
 
+- (void)cacheDisplayedMessagesOfRun
+{
+	// Only runs that don't receive messages anymore and were completely filtered are kept, along with the
+	// filter they passed and the number of messages of the run at that time
+	assert([NSThread isMainThread]);
+	NSArray *runs = ((LoggerDocument *)self.document).attachedLogs;
+	for (LoggerConnection *run in [[_runsDisplayCache keyEnumerator] allObjects])
+	{
+		if ([runs indexOfObjectIdenticalTo:run] == NSNotFound)
+			[_runsDisplayCache removeObjectForKey:run];
+	}
+	if (_attachedConnection.connected || _displayedFilterState == nil || _restoringEvictedMessages)
+		return;
+	NSUInteger count;
+	@synchronized (_attachedConnection.messages)
+	{
+		count = [_attachedConnection.messages count];
+	}
+	[_runsDisplayCache setObject:@{
+		@"state": _displayedFilterState,
+		@"count": @(count),
+		@"messages": [_displayedMessages copy]
+	} forKey:_attachedConnection];
+}
+
+- (BOOL)displayCachedMessagesOfRun:(NSDictionary *)cachedRun connection:(LoggerConnection *)theConnection
+{
+	// Display the messages we had for this run when we switched away from it, if the filter and
+	// the run's messages didn't change since
+	assert([NSThread isMainThread]);
+	if (cachedRun == nil || _attachedConnection != theConnection || ![cachedRun[@"state"] isEqual:_messageFilterState])
+		return NO;
+	@synchronized (theConnection.messages)
+	{
+		if ([theConnection.messages count] != [cachedRun[@"count"] unsignedIntegerValue])
+			return NO;
+	}
+	__atomic_add_fetch(&_refreshGeneration, 1, __ATOMIC_RELAXED);
+	[_displayedMessages setArray:cachedRun[@"messages"]];
+	[self indexDisplayedMessagesFromRow:0];
+	_displayedMessagesVersion++;
+	_lastMessageRow = 0;
+	[_logTable reloadData];
+	[self messagesAppendedToTable];
+	[self tileLogTable:NO];
+	[self rebuildMarksSubmenu];
+	[self updateTags];
+	_displayedFilterState = _messageFilterState;
+	self.initialRefreshDone = YES;
+	return YES;
+}
+
 - (NSNumber *)shouldEnableRunsPopup
 {
 	NSUInteger numRuns = [((LoggerDocument *)[self document]).attachedLogs count];
@@ -1164,6 +1818,73 @@ didReceiveMessages:(NSArray *)theMessages
 	});
 }
 
+- (void)connection:(LoggerConnection *)theConnection didEvictMessages:(NSArray *)theMessages mark:(LoggerMessage *)mark
+{
+	// Go through the filtering queue so that the evicted messages a refresh or filtering of incoming
+	// messages is about to display are removed too
+	dispatch_async(dispatch_get_main_queue(), ^{
+		dispatch_async(self.messageFilteringQueue, ^{
+			dispatch_async(dispatch_get_main_queue(), ^{
+				if (self.initialRefreshDone && self.attachedConnection == theConnection)
+					[self removeEvictedMessagesFromTable:theMessages mark:mark];
+			});
+		});
+	});
+}
+
+- (void)removeEvictedMessagesFromTable:(NSArray *)evictedMessages mark:(LoggerMessage *)mark
+{
+	// The evicted messages are the oldest ones (the client info message excepted): their rows are
+	// at the top of the table, where the mark of dropped messages goes. Remove them without moving
+	// the rows the user is looking at
+	assert([NSThread isMainThread]);
+	NSMutableIndexSet *rows = [[NSMutableIndexSet alloc] init];
+	for (LoggerMessage *msg in evictedMessages)
+	{
+		NSUInteger row = [self rowOfDisplayedMessage:msg];
+		if (row != NSNotFound)
+			[rows addIndex:row];
+	}
+	if (![rows count] && mark == nil)
+		return;
+
+	NSUInteger firstRow = ([_displayedMessages count] && ((LoggerMessage *)_displayedMessages[0]).type == LOGMSG_TYPE_CLIENTINFO) ? 1 : 0;
+	NSUInteger anchorRow = [rows count] ? [rows lastIndex] + 1 : firstRow;
+	id anchorMessage = (anchorRow < [_displayedMessages count]) ? _displayedMessages[anchorRow] : nil;
+	float spacing = (float)_logTable.intercellSpacing.height;
+	double anchorOffset = LoggerRowHeightsOffset(_rowHeights, (uint32_t)anchorRow, spacing);
+	NSIndexSet *selectedRows = [_logTable selectedRowIndexes];
+	NSArray *selectedMessages = [selectedRows count] ? [_displayedMessages objectsAtIndexes:selectedRows] : nil;
+
+	for (LoggerMessage *msg in [_displayedMessages objectsAtIndexes:rows])
+		CFDictionaryRemoveValue(_displayedRows, (__bridge const void *)msg);
+	[_displayedMessages removeObjectsAtIndexes:rows];
+	int numRemoved = (int)[rows count];
+	if (mark != nil)
+	{
+		[self tileLogTableMessages:@[mark] withSize:[_logTable frame].size forceUpdate:NO group:NULL];
+		[_displayedMessages insertObject:mark atIndex:firstRow];
+		numRemoved--;
+	}
+	[self indexDisplayedMessagesFromRow:MIN(firstRow, [rows count] ? [rows firstIndex] : firstRow)];
+	_displayedMessagesVersion++;
+	_lastMessageRow = (_lastMessageRow > numRemoved) ? _lastMessageRow - numRemoved : 0;
+
+	// keep the first row that stays at the same place on screen
+	NSClipView *clipView = [[_logTable enclosingScrollView] contentView];
+	NSPoint origin = [clipView bounds].origin;
+	NSUInteger newAnchorRow = [self rowOfDisplayedMessage:anchorMessage];
+	if (newAnchorRow != NSNotFound)
+		origin.y = fmax(0, origin.y - (anchorOffset - LoggerRowHeightsOffset(_rowHeights, (uint32_t)newAnchorRow, spacing)));
+	[_logTable deselectAll:self];
+	[_logTable reloadData];
+	[clipView scrollToPoint:origin];
+	[[_logTable enclosingScrollView] reflectScrolledClipView:clipView];
+	[self restoreSelection:selectedMessages visibleMessage:nil makeTableFirstResponder:NO];
+	[self rebuildMarksSubmenu];
+	self.info = [NSString stringWithFormat:NSLocalizedString(@"%u messages", @""), [_displayedMessages count]];
+}
+
 - (void)remoteDisconnected:(LoggerConnection *)theConnection
 {
 	// we always get called on the main thread
@@ -1303,11 +2024,10 @@ didReceiveMessages:(NSArray *)theMessages
 	assert([NSThread isMainThread]);
 	if (tableView == _logTable && row >= 0 && row < [_displayedMessages count])
 	{
-		// use only cached sizes
-		LoggerMessage *message = _displayedMessages[(NSUInteger) row];
-		NSSize cachedSize = message.cachedCellSize;
-		if (cachedSize.height)
-			return cachedSize.height;
+		// use only the heights computed by tiling
+		float height = LoggerRowHeightsGet(_rowHeights, (uint32_t)row);
+		if (height)
+			return height;
 	}
 	return [tableView rowHeight];
 }
@@ -1638,6 +2358,181 @@ didReceiveMessages:(NSArray *)theMessages
 	[self openFilterEditSheet:dict];
 }
 
+// -----------------------------------------------------------------------------
+#pragma mark -
+#pragma mark Time navigation
+// -----------------------------------------------------------------------------
+static NSDate *DateOfMessage(LoggerMessage *message)
+{
+	struct timeval tv = message.timestamp;
+	return [NSDate dateWithTimeIntervalSince1970:(double)tv.tv_sec + (double)tv.tv_usec / 1000000.0];
+}
+
+static NSString *StringFromTime(NSDate *date)
+{
+	NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+	[formatter setLocale:[NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"]];
+	[formatter setDateFormat:@"yyyy-MM-dd HH:mm:ss.SSS"];
+	return [formatter stringFromDate:date];
+}
+
+static NSDate *TimeFromString(NSString *string, NSDate *referenceDate)
+{
+	// Full dates, or times of the day of the reference date
+	string = [string stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+	NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+	[formatter setLocale:[NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"]];
+	for (NSString *format in @[@"yyyy-MM-dd HH:mm:ss.SSS", @"yyyy-MM-dd HH:mm:ss", @"yyyy-MM-dd HH:mm"])
+	{
+		[formatter setDateFormat:format];
+		NSDate *date = [formatter dateFromString:string];
+		if (date != nil)
+			return date;
+	}
+	for (NSString *format in @[@"HH:mm:ss.SSS", @"HH:mm:ss", @"HH:mm"])
+	{
+		[formatter setDateFormat:format];
+		NSDate *time = [formatter dateFromString:string];
+		if (time == nil)
+			continue;
+		NSCalendar *calendar = [NSCalendar currentCalendar];
+		NSDateComponents *day = [calendar components:(NSCalendarUnitEra | NSCalendarUnitYear | NSCalendarUnitMonth | NSCalendarUnitDay)
+											fromDate:(referenceDate ?: [NSDate date])];
+		NSDateComponents *timeOfDay = [calendar components:(NSCalendarUnitHour | NSCalendarUnitMinute | NSCalendarUnitSecond | NSCalendarUnitNanosecond)
+												  fromDate:time];
+		day.hour = timeOfDay.hour;
+		day.minute = timeOfDay.minute;
+		day.second = timeOfDay.second;
+		day.nanosecond = timeOfDay.nanosecond;
+		return [calendar dateFromComponents:day];
+	}
+	return nil;
+}
+
+- (LoggerMessage *)referenceMessageForTime
+{
+	// The selected message, or the first one visible
+	NSInteger row = [_logTable selectedRow];
+	if (row < 0 || row >= (NSInteger)[_displayedMessages count])
+	{
+		NSRange visibleRows = [self visibleRows];
+		if (visibleRows.length == 0)
+			return [_displayedMessages firstObject];
+		row = (NSInteger)visibleRows.location;
+	}
+	return _displayedMessages[(NSUInteger)row];
+}
+
+- (void)goToDate:(NSDate *)date
+{
+	// Find the first message at this time with the connection's time index, then the first
+	// message from there on that passed the filter
+	assert([NSThread isMainThread]);
+	NSUInteger row = NSNotFound;
+	@synchronized (_attachedConnection.messages)
+	{
+		NSArray *messages = _attachedConnection.messages;
+		NSUInteger count = [messages count];
+		for (NSUInteger i = [_attachedConnection indexOfFirstMessageAtOrAfterDate:date]; i < count && row == NSNotFound; i++)
+			row = [self rowOfDisplayedMessage:messages[i]];
+	}
+	if (row == NSNotFound)
+	{
+		NSBeep();
+		return;
+	}
+	[_logTable scrollRowToVisible:(NSInteger)row];
+	[_logTable selectRowIndexes:[NSIndexSet indexSetWithIndex:row] byExtendingSelection:NO];
+	[[self window] makeFirstResponder:_logTable];
+}
+
+- (NSTextField *)timeFieldWithFrame:(NSRect)frame placeholder:(NSString *)placeholder value:(NSDate *)value
+{
+	NSTextField *field = [[NSTextField alloc] initWithFrame:frame];
+	[[field cell] setPlaceholderString:placeholder];
+	if (value != nil)
+		[field setStringValue:StringFromTime(value)];
+	return field;
+}
+
+- (IBAction)goToTime:(id)sender
+{
+	LoggerMessage *reference = [self referenceMessageForTime];
+	NSDate *referenceDate = (reference != nil) ? DateOfMessage(reference) : nil;
+	NSTextField *field = [self timeFieldWithFrame:NSMakeRect(0, 0, 260, 22)
+									  placeholder:NSLocalizedString(@"yyyy-mm-dd hh:mm:ss.sss", @"")
+											value:referenceDate];
+
+	NSAlert *alert = [[NSAlert alloc] init];
+	[alert setMessageText:NSLocalizedString(@"Go to Time", @"")];
+	[alert setInformativeText:NSLocalizedString(@"Enter a date and time, or a time of the day of the selected message.", @"")];
+	[alert addButtonWithTitle:NSLocalizedString(@"Go", @"")];
+	[alert addButtonWithTitle:NSLocalizedString(@"Cancel", @"")];
+	[alert setAccessoryView:field];
+	[[alert window] setInitialFirstResponder:field];
+	[alert beginSheetModalForWindow:[self window] completionHandler:^(NSModalResponse returnCode) {
+		if (returnCode != NSAlertFirstButtonReturn)
+			return;
+		NSDate *date = TimeFromString([field stringValue], referenceDate);
+		if (date == nil)
+			NSBeep();
+		else
+			[self goToDate:date];
+	}];
+}
+
+- (IBAction)showTimeRange:(id)sender
+{
+	LoggerMessage *reference = [self referenceMessageForTime];
+	NSDate *referenceDate = (reference != nil) ? DateOfMessage(reference) : nil;
+	NSView *accessory = [[NSView alloc] initWithFrame:NSMakeRect(0, 0, 260, 52)];
+	NSTextField *fromField = [self timeFieldWithFrame:NSMakeRect(0, 30, 260, 22)
+										  placeholder:NSLocalizedString(@"From (no limit)", @"")
+												value:_timeRangeStart];
+	NSTextField *toField = [self timeFieldWithFrame:NSMakeRect(0, 0, 260, 22)
+										placeholder:NSLocalizedString(@"To (no limit)", @"")
+											  value:_timeRangeEnd];
+	[accessory addSubview:fromField];
+	[accessory addSubview:toField];
+	[fromField setNextKeyView:toField];
+
+	NSAlert *alert = [[NSAlert alloc] init];
+	[alert setMessageText:NSLocalizedString(@"Show Time Range", @"")];
+	[alert setInformativeText:NSLocalizedString(@"Only show the messages logged between these times. Times without a date are on the day of the selected message.", @"")];
+	[alert addButtonWithTitle:NSLocalizedString(@"Show", @"")];
+	[alert addButtonWithTitle:NSLocalizedString(@"Cancel", @"")];
+	[alert setAccessoryView:accessory];
+	[[alert window] setInitialFirstResponder:fromField];
+	[alert beginSheetModalForWindow:[self window] completionHandler:^(NSModalResponse returnCode) {
+		if (returnCode != NSAlertFirstButtonReturn)
+			return;
+		NSString *from = [fromField stringValue], *to = [toField stringValue];
+		NSDate *start = [from length] ? TimeFromString(from, referenceDate) : nil;
+		NSDate *end = [to length] ? TimeFromString(to, referenceDate) : nil;
+		if (([from length] && start == nil) || ([to length] && end == nil) ||
+			(start != nil && end != nil && [start compare:end] == NSOrderedDescending))
+		{
+			NSBeep();
+			return;
+		}
+		[self setTimeRangeStart:start end:end];
+	}];
+}
+
+- (IBAction)showAllTimes:(id)sender
+{
+	[self setTimeRangeStart:nil end:nil];
+}
+
+- (void)setTimeRangeStart:(NSDate *)start end:(NSDate *)end
+{
+	assert([NSThread isMainThread]);
+	_timeRangeStart = start;
+	_timeRangeEnd = end;
+	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(refreshMessagesIfPredicateChanged) object:nil];
+	[self performSelector:@selector(refreshMessagesIfPredicateChanged) withObject:nil afterDelay:0];
+}
+
 // -----------------------------------------------------------------------------
 #pragma mark -
 #pragma mark Markers
@@ -1645,14 +2540,7 @@ didReceiveMessages:(NSArray *)theMessages
 - (void)rebuildMarksSubmenu
 {
 	NSMenuItem *marksSubmenu = [[[[NSApp mainMenu] itemWithTag:TOOLS_MENU_ITEM_TAG] submenu] itemWithTag:TOOLS_MENU_JUMP_TO_MARK_TAG];
-	NSExpression *lhs = [NSExpression expressionForKeyPath:@"type"];
-	NSExpression *rhs = [NSExpression expressionForConstantValue:@LOGMSG_TYPE_MARK];
-	NSPredicate *predicate = [NSComparisonPredicate predicateWithLeftExpression:lhs
-																rightExpression:rhs
-																	   modifier:NSDirectPredicateModifier
-																		   type:NSEqualToPredicateOperatorType
-																		options:0];
-	NSArray *marks = [_displayedMessages filteredArrayUsingPredicate:predicate];
+	NSArray *marks = [_displayedMessages objectsAtIndexes:_markRows];
 	NSMenu *menu = [marksSubmenu submenu];
 	[menu removeAllItems];
 	if (![marks count])
@@ -1687,7 +2575,7 @@ didReceiveMessages:(NSArray *)theMessages
 - (void)jumpToMark:(NSMenuItem *)markMenuItem
 {
 	LoggerMessage *mark = [markMenuItem representedObject];
-	NSUInteger idx = [_displayedMessages indexOfObjectIdenticalTo:mark];
+	NSUInteger idx = [self rowOfDisplayedMessage:mark];
 	if (idx == NSNotFound)
 	{
 		// actually, shouldn't happen
@@ -1731,11 +2619,12 @@ didReceiveMessages:(NSArray *)theMessages
 				NSUInteger location = [self.attachedConnection.messages count];
 				if (beforeMessage != nil)
 				{
-					NSUInteger pos = [self.attachedConnection.messages indexOfObjectIdenticalTo:beforeMessage];
+					NSUInteger pos = [self.attachedConnection indexOfMessage:beforeMessage];
 					if (pos != NSNotFound)
 						location = pos;
 				}
 				[self.attachedConnection.messages insertObject:mark atIndex:location];
+				[self.attachedConnection invalidateMessageIndexes];
 			}
 			dispatch_async(dispatch_get_main_queue(), ^{
 				[[self document] updateChangeCount:NSChangeDone];
@@ -1787,6 +2676,9 @@ didReceiveMessages:(NSArray *)theMessages
 		LoggerMessage *markMessage = _displayedMessages[(NSUInteger) rowIndex];
 		assert(markMessage.type == LOGMSG_TYPE_MARK);
 		[_displayedMessages removeObjectAtIndex:(NSUInteger)rowIndex];
+		CFDictionaryRemoveValue(_displayedRows, (__bridge const void *)markMessage);
+		[self indexDisplayedMessagesFromRow:(NSUInteger)rowIndex];
+		_displayedMessagesVersion++;
 		[_logTable reloadData];
 		[self rebuildMarksSubmenu];
 		dispatch_async(_messageFilteringQueue, ^{
@@ -1795,6 +2687,7 @@ didReceiveMessages:(NSArray *)theMessages
 			dispatch_async(self.attachedConnection.messageProcessingQueue, ^{
 				@synchronized(self.attachedConnection.messages) {
 					[self.attachedConnection.messages removeObjectIdenticalTo:markMessage];
+					[self.attachedConnection invalidateMessageIndexes];
 				}
 				dispatch_async(dispatch_get_main_queue(), ^{
 					[[self document] updateChangeCount:NSChangeDone];
@@ -1848,6 +2741,14 @@ didReceiveMessages:(NSArray *)theMessages
 	{
 		return _logTable.selectedRowIndexes.count > 0;
 	}
+	else if (action == @selector(goToTime:) || action == @selector(showTimeRange:))
+	{
+		return (_attachedConnection != nil);
+	}
+	else if (action == @selector(showAllTimes:))
+	{
+		return (_timeRangeStart != nil || _timeRangeEnd != nil);
+	}
 	return YES;
 }
 
@@ -0,0 +1,398 @@
+/*
+ * compression_benchmark.c
+ *
+ * Throughput and CPU cost of the compressed framing used between NSLogger clients and the viewer
+ * (see LoggerCommon.h and LoggerCompression.h), measured over a loopback TCP socket.
+ *
+ * For each payload type, a stream of NSLogger messages is sent as-is, then cut in compressed
+ * blocks the same way LoggerClient.m does it. The receiving thread decodes the blocks like
+ * the viewer and checks that it gets the original stream back.
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -pthread -I../../Client/iOS compression_benchmark.c -o compression_benchmark
+ *	./compression_benchmark [megabytes per payload type]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "LoggerCompression.h"
+
+// LoggerCommon.h relies on CoreFoundation, only the constants we need are repeated here
+#define PART_KEY_MESSAGE_TYPE			0
+#define PART_KEY_TIMESTAMP_S			1
+#define PART_KEY_TIMESTAMP_US			3
+#define PART_KEY_THREAD_ID				4
+#define PART_KEY_TAG					5
+#define PART_KEY_LEVEL					6
+#define PART_KEY_MESSAGE				7
+#define PART_KEY_MESSAGE_SEQ			10
+#define PART_KEY_FILENAME				11
+#define PART_KEY_LINENUMBER				12
+#define PART_KEY_FUNCTIONNAME			13
+#define PART_TYPE_STRING				0
+#define PART_TYPE_BINARY				1
+#define PART_TYPE_INT32					3
+#define PART_TYPE_IMAGE					5
+#define LOGGER_FRAME_SIZE_MASK			0x3FFFFFFFU
+#define LOGGER_FRAME_COMPRESSED_FLAG	0x40000000U
+#define LOGGER_COMPRESSED_BLOCK_MAX_SIZE	65536
+
+#define SEND_BUFFER_SIZE				32768		// LOGGER_COMPRESSED_SEND_BUFFER_SIZE in LoggerClient.m
+
+typedef struct
+{
+	uint8_t *bytes;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static void BufferAppend(Buffer *b, const void *bytes, size_t length)
+{
+	if (b->length + length > b->capacity)
+	{
+		while (b->length + length > b->capacity)
+			b->capacity = b->capacity ? b->capacity * 2 : 65536;
+		b->bytes = realloc(b->bytes, b->capacity);
+		if (b->bytes == NULL)
+			abort();
+	}
+	memcpy(b->bytes + b->length, bytes, length);
+	b->length += length;
+}
+
+static void BufferAppendInt32(Buffer *b, uint32_t value)
+{
+	value = htonl(value);
+	BufferAppend(b, &value, 4);
+}
+
+// -----------------------------------------------------------------------------
+// Message generation
+// -----------------------------------------------------------------------------
+static void AddIntPart(Buffer *b, uint8_t key, uint32_t value)
+{
+	uint8_t header[2] = { key, PART_TYPE_INT32 };
+	BufferAppend(b, header, 2);
+	BufferAppendInt32(b, value);
+}
+
+static void AddDataPart(Buffer *b, uint8_t key, uint8_t type, const void *bytes, uint32_t length)
+{
+	uint8_t header[2] = { key, type };
+	BufferAppend(b, header, 2);
+	BufferAppendInt32(b, length);
+	BufferAppend(b, bytes, length);
+}
+
+static void AddStringPart(Buffer *b, uint8_t key, const char *s)
+{
+	AddDataPart(b, key, PART_TYPE_STRING, s, (uint32_t)strlen(s));
+}
+
+static void AppendMessage(Buffer *stream, uint32_t seq, int payloadType)
+{
+	static const char *files[] = { "/Users/dev/Projects/App/Sources/Network/APIClient.m", "/Users/dev/Projects/App/Sources/UI/FeedViewController.m",
+		"/Users/dev/Projects/App/Sources/Model/SyncEngine.m", "/Users/dev/Projects/App/Sources/Model/Database.m" };
+	static const char *functions[] = { "-[APIClient performRequest:completion:]", "-[FeedViewController tableView:cellForRowAtIndexPath:]",
+		"-[SyncEngine mergeChanges:fromContext:]", "-[Database executeQuery:arguments:]" };
+	static const char *tags[] = { "network", "ui", "sync", "db" };
+	static const char *formats[] = {
+		"GET https://api.example.com/v2/items?page=%u&limit=50 -> 200 (%u ms, %u bytes)",
+		"configured cell at row %u section 0 for item id=%08x, height %u.0",
+		"merged %u inserted, %u updated objects in context <NSManagedObjectContext: 0x7fa%05x>",
+		"SELECT * FROM items WHERE updated_at > %u ORDER BY id LIMIT %u (%u rows)"
+	};
+
+	Buffer msg = { 0 };
+	uint32_t r = (uint32_t)rand();
+	unsigned site = r % 4;
+	uint16_t partCount = 0;
+	AddIntPart(&msg, PART_KEY_MESSAGE_SEQ, seq); partCount++;
+	AddIntPart(&msg, PART_KEY_TIMESTAMP_S, 1700000000 + seq / 1000); partCount++;
+	AddIntPart(&msg, PART_KEY_TIMESTAMP_US, (seq * 997) % 1000000); partCount++;
+	AddStringPart(&msg, PART_KEY_THREAD_ID, (r & 16) ? "Main thread" : "com.apple.root.default-qos"); partCount++;
+	AddIntPart(&msg, PART_KEY_MESSAGE_TYPE, 0); partCount++;
+	AddStringPart(&msg, PART_KEY_TAG, tags[site]); partCount++;
+	AddIntPart(&msg, PART_KEY_LEVEL, r % 5); partCount++;
+	AddStringPart(&msg, PART_KEY_FILENAME, files[site]); partCount++;
+	AddIntPart(&msg, PART_KEY_LINENUMBER, 100 + site * 37); partCount++;
+	AddStringPart(&msg, PART_KEY_FUNCTIONNAME, functions[site]); partCount++;
+
+	if (payloadType == 0)
+	{
+		char text[256];
+		snprintf(text, sizeof(text), formats[site], seq, r % 4096, (r >> 8) % 100000);
+		AddStringPart(&msg, PART_KEY_MESSAGE, text);
+	}
+	else if (payloadType == 1)
+	{
+		// binary data, shown as a hex dump by the viewer: packet-like buffers with headers,
+		// small counters and padding, plus a random section
+		uint8_t data[512];
+		uint32_t length = 64 + r % 448;
+		for (uint32_t i = 0; i < length; i++)
+		{
+			if (i < 16)
+				data[i] = (uint8_t)("\x45\x00\x05\xdc\x1c\x46\x40\x00\x40\x06\x00\x00\xc0\xa8\x01\x02"[i]);
+			else if (i < 48)
+				data[i] = (uint8_t)rand();
+			else
+				data[i] = (uint8_t)((i & 3) ? 0 : (i >> 2));
+		}
+		AddDataPart(&msg, PART_KEY_MESSAGE, PART_TYPE_BINARY, data, length);
+	}
+	else
+	{
+		// PNG images are already deflate-compressed: model them as random bytes after a PNG header
+		uint32_t length = 8192 + r % 65536;
+		uint8_t *data = malloc(length);
+		memcpy(data, "\x89PNG\r\n\x1a\n\0\0\0\rIHDR", 16);
+		for (uint32_t i = 16; i < length; i++)
+			data[i] = (uint8_t)rand();
+		AddDataPart(&msg, PART_KEY_MESSAGE, PART_TYPE_IMAGE, data, length);
+		free(data);
+	}
+	partCount++;
+
+	BufferAppendInt32(stream, (uint32_t)msg.length + 2);
+	uint16_t count = htons(partCount);
+	BufferAppend(stream, &count, 2);
+	BufferAppend(stream, msg.bytes, msg.length);
+	free(msg.bytes);
+}
+
+static void BuildStream(Buffer *stream, int payloadType, size_t targetSize)
+{
+	srand(42 + payloadType);
+	for (uint32_t seq = 1; stream->length < targetSize; seq++)
+		AppendMessage(stream, seq, payloadType);
+}
+
+// -----------------------------------------------------------------------------
+// Sender (client side)
+// -----------------------------------------------------------------------------
+static double ThreadCPUTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double WallTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void WriteAll(int fd, const uint8_t *p, size_t length)
+{
+	while (length)
+	{
+		ssize_t n = write(fd, p, length);
+		if (n <= 0)
+		{
+			perror("write");
+			exit(1);
+		}
+		p += n;
+		length -= (size_t)n;
+	}
+}
+
+static size_t SendStream(int fd, const Buffer *stream, int compress, double *cpuTime)
+{
+	// Like LoggerWriteMoreData(): messages are packed in a send buffer, large messages are sent
+	// on their own. With compression, each send buffer (or 64 KB slice of a large message) is one block.
+	static uint8_t block[8 + LOGGER_COMPRESSED_BLOCK_MAX_SIZE];
+	static uint32_t hashTable[LOGGER_LZ4_HASH_SIZE];
+	double start = ThreadCPUTime();
+	size_t sent = 0, pos = 0;
+	while (pos < stream->length)
+	{
+		// gather whole messages up to the send buffer size
+		size_t end = pos;
+		while (end < stream->length)
+		{
+			uint32_t size;
+			memcpy(&size, stream->bytes + end, 4);
+			size_t messageLength = 4 + ntohl(size);
+			if (end > pos && end + messageLength - pos > SEND_BUFFER_SIZE)
+				break;
+			end += messageLength;
+			if (end - pos > SEND_BUFFER_SIZE)
+				break;
+		}
+
+		if (!compress)
+		{
+			WriteAll(fd, stream->bytes + pos, end - pos);
+			sent += end - pos;
+			pos = end;
+			continue;
+		}
+		while (pos < end)
+		{
+			uint32_t length = (uint32_t)((end - pos) < LOGGER_COMPRESSED_BLOCK_MAX_SIZE ? (end - pos) : LOGGER_COMPRESSED_BLOCK_MAX_SIZE);
+			uint32_t payloadLength = LoggerLZ4Compress(stream->bytes + pos, length, block + 8, length - 1, hashTable);
+			if (payloadLength == 0)
+			{
+				memcpy(block + 8, stream->bytes + pos, length);
+				payloadLength = length;
+			}
+			uint32_t header[2] = { htonl((payloadLength + 4) | LOGGER_FRAME_COMPRESSED_FLAG), htonl(length) };
+			memcpy(block, header, 8);
+			WriteAll(fd, block, 8 + payloadLength);
+			sent += 8 + payloadLength;
+			pos += length;
+		}
+	}
+	*cpuTime = ThreadCPUTime() - start;
+	return sent;
+}
+
+// -----------------------------------------------------------------------------
+// Receiver (viewer side)
+// -----------------------------------------------------------------------------
+typedef struct
+{
+	int fd;
+	int compressed;
+	const Buffer *expected;
+	double cpuTime;
+	int ok;
+} Receiver;
+
+static void *ReceiverThread(void *context)
+{
+	Receiver *rcv = (Receiver *)context;
+	double start = ThreadCPUTime();
+	Buffer pending = { 0 };
+	Buffer output = { 0 };
+	static uint8_t tmp[32767];			// TMP_BUF_SIZE in LoggerTCPConnection.m
+	size_t expectedLength = rcv->expected->length;
+	rcv->ok = 1;
+	output.capacity = expectedLength;
+	output.bytes = malloc(output.capacity);
+
+	for (;;)
+	{
+		ssize_t n = read(rcv->fd, tmp, sizeof(tmp));
+		if (n <= 0)
+			break;
+		if (!rcv->compressed)
+		{
+			BufferAppend(&output, tmp, (size_t)n);
+			continue;
+		}
+		BufferAppend(&pending, tmp, (size_t)n);
+		size_t consumed = 0;
+		while (pending.length - consumed >= 8)
+		{
+			uint32_t header, originalSize;
+			memcpy(&header, pending.bytes + consumed, 4);
+			memcpy(&originalSize, pending.bytes + consumed + 4, 4);
+			header = ntohl(header);
+			originalSize = ntohl(originalSize);
+			uint32_t payloadSize = header & LOGGER_FRAME_SIZE_MASK;
+			if (pending.length - consumed - 4 < payloadSize)
+				break;
+			const uint8_t *payload = pending.bytes + consumed + 8;
+			if (payloadSize - 4 == originalSize)
+			{
+				BufferAppend(&output, payload, originalSize);
+			}
+			else
+			{
+				if (output.length + originalSize > output.capacity ||
+					LoggerLZ4Decompress(payload, payloadSize - 4, output.bytes + output.length, originalSize) != (int32_t)originalSize)
+				{
+					rcv->ok = 0;
+					break;
+				}
+				output.length += originalSize;
+			}
+			consumed += 4 + payloadSize;
+		}
+		memmove(pending.bytes, pending.bytes + consumed, pending.length - consumed);
+		pending.length -= consumed;
+	}
+	rcv->cpuTime = ThreadCPUTime() - start;
+	if (output.length != expectedLength || memcmp(output.bytes, rcv->expected->bytes, expectedLength) != 0)
+		rcv->ok = 0;
+	free(pending.bytes);
+	free(output.bytes);
+	return NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+static void Run(const char *name, const Buffer *stream, int compress)
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrLength = sizeof(addr);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+		getsockname(listener, (struct sockaddr *)&addr, &addrLength) < 0)
+	{
+		perror("listen");
+		exit(1);
+	}
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(client, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		perror("connect");
+		exit(1);
+	}
+	int one = 1;
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	Receiver rcv = { accept(listener, NULL, NULL), compress, stream, 0, 0 };
+	close(listener);
+
+	pthread_t thread;
+	double start = WallTime();
+	pthread_create(&thread, NULL, ReceiverThread, &rcv);
+	double sendCPU;
+	size_t sent = SendStream(client, stream, compress, &sendCPU);
+	shutdown(client, SHUT_WR);
+	pthread_join(thread, NULL);
+	double elapsed = WallTime() - start;
+	close(client);
+	close(rcv.fd);
+
+	double mb = (double)stream->length / (1024.0 * 1024.0);
+	printf("%-6s %-10s %8.1f MB -> %8.1f MB (%5.2fx)  %8.1f MB/s  sender CPU %6.1f ns/byte  receiver CPU %6.1f ns/byte  %s\n",
+		   name, compress ? "compressed" : "raw", mb, (double)sent / (1024.0 * 1024.0), (double)stream->length / (double)sent,
+		   mb / elapsed, sendCPU * 1e9 / (double)stream->length, rcv.cpuTime * 1e9 / (double)stream->length,
+		   rcv.ok ? "ok" : "MISMATCH");
+}
+
+int main(int argc, char *argv[])
+{
+	size_t megabytes = (argc > 1) ? (size_t)atoi(argv[1]) : 64;
+	static const char *names[] = { "text", "hex", "png" };
+	for (int type = 0; type < 3; type++)
+	{
+		Buffer stream = { 0 };
+		BuildStream(&stream, type, megabytes * 1024 * 1024);
+		Run(names[type], &stream, 0);
+		Run(names[type], &stream, 1);
+		free(stream.bytes);
+	}
+	return 0;
+}
@@ -0,0 +1,416 @@
+/*
+ * document_benchmark.c
+ *
+ * Size of saved documents and time it takes to save and open them (Desktop/Classes/LoggerDocumentFile.c).
+ * 1,000,000 messages with the parts the client library sends are saved:
+ *	- "raw": as a .rawnsloggerdata file, each message in the v1 wire format with its file, function,
+ *	  tag and thread names
+ *	- "document": in the chunked format, names in the string table and chunks compressed with LZ4
+ * then loaded into a message store (Desktop/Classes/LoggerMessageStore.c). Opening a document reads
+ * its index, the chunks are then decompressed on all CPUs and their messages appended in order.
+ * The contents of the two stores are compared.
+ *
+ * The viewer only decodes the chunks it needs: the summaries of the index (time and sequence ranges,
+ * level, type and tag bitmaps) are checked against the messages of each chunk, then the messages of a
+ * 10 seconds time range are loaded from the chunks whose time range overlaps it.
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -I../../Desktop/Classes -I../../Client/iOS document_benchmark.c ../../Desktop/Classes/LoggerDocumentFile.c \
+ *		../../Desktop/Classes/LoggerMessageStore.c ../../Desktop/Classes/LoggerTextIndex.c -o document_benchmark -lpthread
+ *	./document_benchmark [number of messages]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "LoggerDocumentFile.h"
+#include "LoggerMessageStore.h"
+#include "LoggerCommon.h"
+
+typedef struct
+{
+	uint8_t *bytes;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint8_t *Reserve(Buffer *b, size_t size)
+{
+	if (b->length + size > b->capacity)
+	{
+		b->capacity = (b->capacity ? b->capacity * 2 : 65536) + size;
+		b->bytes = (uint8_t *)realloc(b->bytes, b->capacity);
+		if (b->bytes == NULL)
+			exit(1);
+	}
+	uint8_t *p = b->bytes + b->length;
+	b->length += size;
+	return p;
+}
+
+static void AddInt(Buffer *b, uint8_t key, uint32_t value)
+{
+	uint8_t *p = Reserve(b, 6);
+	p[0] = key;
+	p[1] = PART_TYPE_INT32;
+	value = htonl(value);
+	memcpy(p + 2, &value, 4);
+}
+
+static void AddString(Buffer *b, uint8_t key, const char *s, uint32_t length, LoggerDocumentWriter *writer)
+{
+	// messages saved in documents refer to names in the string table
+	uint8_t *p = Reserve(b, writer ? 10 : 6 + length);
+	p[0] = key;
+	p[1] = writer ? PART_TYPE_STRING_REF : PART_TYPE_STRING;
+	uint32_t n = htonl(writer ? 4 : length);
+	memcpy(p + 2, &n, 4);
+	if (writer)
+	{
+		n = htonl(LoggerDocumentWriterInternString(writer, (const uint8_t *)s, length));
+		memcpy(p + 6, &n, 4);
+	}
+	else
+		memcpy(p + 6, s, length);
+}
+
+static void Generate(uint32_t count, FILE *raw, LoggerDocumentWriter *writer)
+{
+	static const char *tags[] = { "network", "ui", "database", "sync", "auth", "cache", "", "" };
+	static const char *files[] = { "/Users/dev/App/Sources/NetworkManager.m", "/Users/dev/App/Sources/ViewController.m",
+								   "/Users/dev/App/Sources/Database.m", "/Users/dev/App/Sources/SyncEngine.m" };
+	static const char *functions[] = { "-[NetworkManager fetch:completion:]", "-[ViewController viewDidLoad]",
+									   "-[Database executeQuery:]", "-[SyncEngine mergeChanges:]", "-[SyncEngine start]" };
+	static const char words[] = "request completed with status code 200 after retrying the operation while the cache was cold ";
+	Buffer b = { NULL, 0, 0 };
+	uint32_t seed = 12345;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		seed = seed * 1103515245U + 12345U;
+		uint32_t r = seed >> 8;
+		b.length = 0;
+		Reserve(&b, 6);
+		AddInt(&b, PART_KEY_MESSAGE_SEQ, i + 1);
+		AddInt(&b, PART_KEY_TIMESTAMP_S, 1500000000U + i / 1000);
+		AddInt(&b, PART_KEY_TIMESTAMP_US, (i % 1000) * 1000);
+		char thread[32];
+		AddString(&b, PART_KEY_THREAD_ID, thread, (uint32_t)snprintf(thread, sizeof(thread), (r & 3) ? "Thread 0x%x" : "Main thread", 0x1000 + (r % 6)), writer);
+		AddInt(&b, PART_KEY_MESSAGE_TYPE, LOGMSG_TYPE_LOG);
+		const char *tag = tags[r % 8];
+		uint32_t tagStringID = LOGGER_DOCUMENT_NO_STRING;
+		if (*tag)
+		{
+			AddString(&b, PART_KEY_TAG, tag, (uint32_t)strlen(tag), writer);
+			if (writer)
+				tagStringID = LoggerDocumentWriterInternString(writer, (const uint8_t *)tag, (uint32_t)strlen(tag));
+		}
+		AddInt(&b, PART_KEY_LEVEL, (r >> 4) % 4);
+		AddString(&b, PART_KEY_FILENAME, files[(r >> 6) % 4], (uint32_t)strlen(files[(r >> 6) % 4]), writer);
+		AddString(&b, PART_KEY_FUNCTIONNAME, functions[(r >> 8) % 5], (uint32_t)strlen(functions[(r >> 8) % 5]), writer);
+		AddInt(&b, PART_KEY_LINENUMBER, 10 + (r >> 10) % 500);
+		uint32_t textLength = 40 + (r >> 12) % 121;
+		uint8_t *p = Reserve(&b, 6 + textLength);
+		p[0] = PART_KEY_MESSAGE;
+		p[1] = PART_TYPE_STRING;
+		uint32_t n = htonl(textLength);
+		memcpy(p + 2, &n, 4);
+		for (uint32_t j = 0; j < textLength; j++)
+			p[6 + j] = (uint8_t)words[(i + j) % (sizeof(words) - 1)];
+
+		uint32_t size = htonl((uint32_t)(b.length - 4));
+		memcpy(b.bytes, &size, 4);
+		b.bytes[4] = 0;
+		b.bytes[5] = 11;
+		if (writer)
+		{
+			LoggerDocumentMessageInfo info = {
+				.timestamp = (1500000000LL + i / 1000) * 1000000LL + (i % 1000) * 1000,
+				.sequence = i + 1,
+				.level = (int32_t)((r >> 4) % 4),
+				.type = LOGMSG_TYPE_LOG,
+				.tagStringID = tagStringID
+			};
+			LoggerDocumentWriterAddMessage(writer, b.bytes + 4, (uint32_t)b.length - 4, &info);
+		}
+		else
+			fwrite(b.bytes, 1, b.length, raw);
+	}
+	free(b.bytes);
+}
+
+static const uint8_t *Map(const char *path, size_t *outLength)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+		return NULL;
+	void *bytes = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	*outLength = (size_t)st.st_size;
+	return (bytes == MAP_FAILED) ? NULL : (const uint8_t *)bytes;
+}
+
+static void AppendMessages(LoggerMessageStore *store, const uint8_t *p, size_t length, LoggerMessageStoreDecodeContext *context)
+{
+	for (size_t offset = 0; length - offset > 4; )
+	{
+		uint32_t size;
+		memcpy(&size, p + offset, 4);
+		size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+		if (length - offset < (size_t)size + 4 || LoggerMessageStoreAppendMessage(store, p + offset + 4, size, context) < 0)
+			break;
+		offset += (size_t)size + 4;
+	}
+}
+
+static uint32_t InternDocumentString(void *info, LoggerMessageStore *store, uint32_t stringID)
+{
+	uint32_t length;
+	const uint8_t *bytes = LoggerDocumentReaderGetString((const LoggerDocumentReader *)info, stringID, &length);
+	return (bytes != NULL) ? LoggerMessageStoreInternString(store, bytes, length) : LOGGER_STORE_NO_STRING;
+}
+
+typedef struct
+{
+	const LoggerDocumentReader *reader;
+	uint8_t **chunks;
+	uint32_t *sizes;
+	uint32_t next;
+	uint32_t count;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+} Decompression;
+
+static void *DecompressChunks(void *arg)
+{
+	Decompression *d = (Decompression *)arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&d->lock);
+		uint32_t chunk = d->next++;
+		pthread_mutex_unlock(&d->lock);
+		if (chunk >= d->count)
+			return NULL;
+		uint32_t size;
+		uint8_t *bytes = LoggerDocumentReaderCopyChunk(d->reader, chunk, &size);
+		pthread_mutex_lock(&d->lock);
+		d->sizes[chunk] = size;
+		d->chunks[chunk] = bytes ? bytes : (uint8_t *)calloc(1, 1);
+		pthread_cond_broadcast(&d->ready);
+		pthread_mutex_unlock(&d->lock);
+	}
+}
+
+static double Load(const LoggerDocumentReader *reader, LoggerMessageStore *store, int threadsCount)
+{
+	LoggerMessageStoreDecodeContext context;
+	memset(&context, 0, sizeof(context));
+	context.internStringRef = &InternDocumentString;
+	context.info = (void *)reader;
+	Decompression d = { reader, NULL, NULL, 0, LoggerDocumentReaderChunksCount(reader), PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+	d.chunks = (uint8_t **)calloc(d.count + 1, sizeof(uint8_t *));
+	d.sizes = (uint32_t *)calloc(d.count + 1, sizeof(uint32_t));
+	pthread_t threads[64];
+	double t0 = Now();
+	for (int i = 0; i < threadsCount; i++)
+		pthread_create(&threads[i], NULL, DecompressChunks, &d);
+
+	// messages are appended in order as their chunk becomes available
+	for (uint32_t chunk = 0; chunk < d.count; chunk++)
+	{
+		pthread_mutex_lock(&d.lock);
+		while (d.chunks[chunk] == NULL)
+			pthread_cond_wait(&d.ready, &d.lock);
+		pthread_mutex_unlock(&d.lock);
+		AppendMessages(store, d.chunks[chunk], d.sizes[chunk], &context);
+		free(d.chunks[chunk]);
+	}
+	double elapsed = Now() - t0;
+	for (int i = 0; i < threadsCount; i++)
+		pthread_join(threads[i], NULL);
+	free(d.chunks);
+	free(d.sizes);
+	return elapsed;
+}
+
+static int CheckSummaries(const LoggerDocumentReader *reader)
+{
+	// every message of a chunk must be within its summary
+	for (uint32_t i = 0, chunksCount = LoggerDocumentReaderChunksCount(reader); i < chunksCount; i++)
+	{
+		const LoggerDocumentChunk *chunk = LoggerDocumentReaderGetChunk(reader, i);
+		uint32_t length, messagesCount = 0;
+		uint8_t *bytes = LoggerDocumentReaderCopyChunk(reader, i, &length);
+		if (bytes == NULL)
+			return 0;
+		for (uint32_t offset = 0; length - offset > 4; )
+		{
+			uint32_t size, tagStringID = 0;
+			memcpy(&size, bytes + offset, 4);
+			size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+			LoggerMessageStoreParsedMessage parsed;
+			if (length - offset < size + 4 || !LoggerMessageStoreParseMessage(bytes + offset + 4, size, &parsed))
+				break;
+			if (parsed.tag.present && parsed.tag.type == PART_TYPE_STRING_REF && parsed.tag.length == 4)
+			{
+				memcpy(&tagStringID, parsed.tag.bytes, 4);
+				tagStringID = ntohl(tagStringID);
+			}
+			int64_t timestamp = parsed.seconds * 1000000LL + parsed.microseconds;
+			if (timestamp < chunk->minTimestamp || timestamp > chunk->maxTimestamp ||
+				parsed.sequence < chunk->minSequence || parsed.sequence > chunk->maxSequence ||
+				!((chunk->levels >> (parsed.level & 31)) & 1) || !((chunk->types >> (parsed.type & 31)) & 1) ||
+				(parsed.tag.present && !((chunk->tags >> (tagStringID & 63)) & 1)))
+				break;
+			messagesCount++;
+			offset += size + 4;
+		}
+		free(bytes);
+		if (messagesCount != chunk->messagesCount)
+			return 0;
+	}
+	return 1;
+}
+
+static double LoadTimeRange(const LoggerDocumentReader *reader, LoggerMessageStore *store, int64_t start, int64_t end, uint32_t *outChunks)
+{
+	// only the chunks whose time range overlaps the requested one are decoded
+	LoggerMessageStoreDecodeContext context;
+	memset(&context, 0, sizeof(context));
+	context.internStringRef = &InternDocumentString;
+	context.info = (void *)reader;
+	*outChunks = 0;
+	double t0 = Now();
+	for (uint32_t i = 0, chunksCount = LoggerDocumentReaderChunksCount(reader); i < chunksCount; i++)
+	{
+		const LoggerDocumentChunk *chunk = LoggerDocumentReaderGetChunk(reader, i);
+		if (chunk->maxTimestamp < start || chunk->minTimestamp > end)
+			continue;
+		uint32_t size;
+		uint8_t *bytes = LoggerDocumentReaderCopyChunk(reader, i, &size);
+		if (bytes != NULL)
+			AppendMessages(store, bytes, size, &context);
+		free(bytes);
+		(*outChunks)++;
+	}
+	return Now() - t0;
+}
+
+static int Compare(const LoggerMessageStore *a, const LoggerMessageStore *b)
+{
+	uint32_t count = LoggerMessageStoreCount(a);
+	if (count != LoggerMessageStoreCount(b))
+		return 0;
+	for (uint32_t row = 0; row < count; row++)
+	{
+		const LoggerMessageStorePage *pa = LoggerMessageStoreGetPage(a, row), *pb = LoggerMessageStoreGetPage(b, row);
+		uint32_t i = row & (LOGGER_STORE_PAGE_ROWS - 1), la, lb;
+		const uint8_t *ca = LoggerMessageStoreGetContents(a, row, &la), *cb = LoggerMessageStoreGetContents(b, row, &lb);
+		if (pa->timestamps[i] != pb->timestamps[i] || pa->sequences[i] != pb->sequences[i] || pa->levels[i] != pb->levels[i] ||
+			pa->lineNumbers[i] != pb->lineNumbers[i] || la != lb || memcmp(ca, cb, la) != 0)
+			return 0;
+		uint32_t ids[4][2] = { { pa->tagIDs[i], pb->tagIDs[i] }, { pa->threadIDs[i], pb->threadIDs[i] },
+							   { pa->filenameIDs[i], pb->filenameIDs[i] }, { pa->functionNameIDs[i], pb->functionNameIDs[i] } };
+		for (int j = 0; j < 4; j++)
+		{
+			if ((ids[j][0] == LOGGER_STORE_NO_STRING) != (ids[j][1] == LOGGER_STORE_NO_STRING))
+				return 0;
+			if (ids[j][0] == LOGGER_STORE_NO_STRING)
+				continue;
+			const uint8_t *sa = LoggerMessageStoreGetString(a, ids[j][0], &la), *sb = LoggerMessageStoreGetString(b, ids[j][1], &lb);
+			if (la != lb || memcmp(sa, sb, la) != 0)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t count = (argc > 1) ? (uint32_t)atol(argv[1]) : 1000000;
+	char rawPath[] = "/tmp/document_benchmark_raw_XXXXXX", documentPath[] = "/tmp/document_benchmark_doc_XXXXXX";
+	FILE *raw = fdopen(mkstemp(rawPath), "wb"), *document = fdopen(mkstemp(documentPath), "wb");
+	if (raw == NULL || document == NULL)
+		return 1;
+
+	double t0 = Now();
+	Generate(count, raw, NULL);
+	fclose(raw);
+	double rawWriteTime = Now() - t0;
+	t0 = Now();
+	LoggerDocumentWriter *writer = LoggerDocumentWriterCreate(document);
+	LoggerDocumentWriterBeginRun(writer, "run", 3);
+	Generate(count, NULL, writer);
+	int written = LoggerDocumentWriterFinish(writer);
+	LoggerDocumentWriterDispose(writer);
+	fclose(document);
+	double documentWriteTime = Now() - t0;
+	if (!written)
+	{
+		fprintf(stderr, "can't write the document\n");
+		return 1;
+	}
+
+	size_t rawLength, documentLength;
+	const uint8_t *rawBytes = Map(rawPath, &rawLength), *documentBytes = Map(documentPath, &documentLength);
+	if (rawBytes == NULL || documentBytes == NULL)
+		return 1;
+	LoggerMessageStore *rawStore = LoggerMessageStoreCreate(NULL);
+	LoggerMessageStoreDecodeContext context;
+	memset(&context, 0, sizeof(context));
+	t0 = Now();
+	AppendMessages(rawStore, rawBytes, rawLength, &context);
+	double rawLoadTime = Now() - t0;
+
+	t0 = Now();
+	LoggerDocumentReader *reader = LoggerDocumentReaderOpen(documentBytes, documentLength);
+	double openTime = Now() - t0;
+	if (reader == NULL)
+	{
+		fprintf(stderr, "can't open the document\n");
+		return 1;
+	}
+	int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	cpus = (cpus < 1) ? 1 : (cpus > 64) ? 64 : cpus;
+	LoggerMessageStore *store1 = LoggerMessageStoreCreate(NULL), *storeN = LoggerMessageStoreCreate(NULL);
+	double load1 = Load(reader, store1, 1), loadN = Load(reader, storeN, cpus);
+
+	printf("messages:        %u (%u chunks, %u strings)\n", count, LoggerDocumentReaderChunksCount(reader), LoggerDocumentReaderStringsCount(reader));
+	printf("raw:             %.1f MB, write %.0f ms, load %.0f ms\n", rawLength / 1048576.0, rawWriteTime * 1000.0, rawLoadTime * 1000.0);
+	printf("document:        %.1f MB, write %.0f ms, open %.2f ms, load %.0f ms (1 thread) %.0f ms (%d threads)\n",
+		   documentLength / 1048576.0, documentWriteTime * 1000.0, openTime * 1000.0, load1 * 1000.0, loadN * 1000.0, cpus);
+	printf("contents:        %s\n", (Compare(rawStore, store1) && Compare(rawStore, storeN)) ? "identical" : "MISMATCH");
+
+	// 10 seconds in the middle of the messages (they are 1 ms apart)
+	int64_t rangeStart = (1500000000LL + count / 2000) * 1000000LL, rangeEnd = rangeStart + 10000000LL;
+	uint32_t rangeChunks;
+	LoggerMessageStore *rangeStore = LoggerMessageStoreCreate(NULL);
+	double rangeTime = LoadTimeRange(reader, rangeStore, rangeStart, rangeEnd, &rangeChunks);
+	printf("summaries:       %s\n", CheckSummaries(reader) ? "match the messages" : "MISMATCH");
+	printf("time range:      10 s, %u of %u chunks decoded (%u messages) in %.1f ms\n", rangeChunks,
+		   LoggerDocumentReaderChunksCount(reader), LoggerMessageStoreCount(rangeStore), rangeTime * 1000.0);
+	LoggerMessageStoreRelease(rangeStore);
+
+	LoggerDocumentReaderDispose(reader);
+	LoggerMessageStoreRelease(rawStore);
+	LoggerMessageStoreRelease(store1);
+	LoggerMessageStoreRelease(storeN);
+	unlink(rawPath);
+	if (getenv("KEEP") == NULL) unlink(documentPath); else printf("%s\n", documentPath);
+	return 0;
+}
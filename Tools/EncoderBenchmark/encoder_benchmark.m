@@ -0,0 +1,94 @@
+/*
+ * encoder_benchmark.m
+ *
+ * Cost of encoding messages in LoggerClient.m's per-thread arena. LoggerClient.m is compiled in
+ * with LOGGER_ENCODER_STATISTICS, which counts encoded messages and encoder allocations:
+ *	- "warm": once the calling thread's arena is warmed up, encoding a message must cost a single
+ *	  allocation (the CFData the message is copied to by LoggerMessageFinalize)
+ *	- "after exception": a message whose formatting throws must give the arena back, so that the
+ *	  next messages still cost a single allocation instead of going through temporary arenas
+ *
+ * The logger doesn't connect to any viewer: messages stay in its queue. The benchmark exits with
+ * status 1 if messages cost more than one allocation, or if the arena is left in use.
+ *
+ * Build and run (macOS):
+ *	clang -O2 -fno-objc-arc -framework Foundation -framework CFNetwork -framework Security \
+ *		-framework SystemConfiguration -I../../Client/iOS encoder_benchmark.m -o encoder_benchmark
+ *	./encoder_benchmark [number of messages]
+ */
+
+#define LOGGER_ENCODER_STATISTICS 1
+#import "LoggerClient.m"
+
+@interface ThrowingDescription : NSObject
+@end
+
+@implementation ThrowingDescription
+- (NSString *)description
+{
+	[NSException raise:NSInternalInconsistencyException format:@"description failed"];
+	return nil;
+}
+@end
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static BOOL Run(const char *name, Logger *logger, uint32_t count)
+{
+	uint32_t messagesBefore = atomic_load(&sEncodedMessagesCount);
+	uint32_t allocationsBefore = atomic_load(&sEncoderAllocationsCount);
+	double start = Now();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		@autoreleasepool
+		{
+			LogMessageToF(logger, __FILE__, __LINE__, __FUNCTION__, @"benchmark", 1, @"message %u of %u", i, count);
+		}
+	}
+	double elapsed = Now() - start;
+	uint32_t messages = atomic_load(&sEncodedMessagesCount) - messagesBefore;
+	uint32_t allocations = atomic_load(&sEncoderAllocationsCount) - allocationsBefore;
+	printf("%-16s %8u messages: %6.0f ns/message, %.3f encoder allocations/message\n",
+		   name, messages, elapsed * 1e9 / (double)count, messages ? (double)allocations / (double)messages : 0.0);
+	return messages == count && allocations == messages;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t count = (argc > 1) ? (uint32_t)atoi(argv[1]) : 100000;
+	BOOL ok = YES;
+	@autoreleasepool
+	{
+		Logger *logger = LoggerInit();
+		LoggerSetOptions(logger, kLoggerOption_BufferLogsUntilConnection);
+
+		// warm up this thread's arena
+		LogMessageTo(logger, @"benchmark", 1, @"warm up");
+		ok &= Run("warm", logger, count);
+
+		@try
+		{
+			LogMessageTo(logger, @"benchmark", 1, @"%@", [[[ThrowingDescription alloc] init] autorelease]);
+		}
+		@catch (NSException *exception)
+		{
+		}
+		LoggerMessageEncoder *arena = (LoggerMessageEncoder *)pthread_getspecific(sEncoderKey);
+		if (arena == NULL || arena->inUse)
+		{
+			printf("arena left in use after an exception\n");
+			ok = NO;
+		}
+		ok &= Run("after exception", logger, count);
+
+		LoggerStop(logger);
+	}
+	if (!ok)
+		printf("FAILED: encoding a message cost more than one allocation\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+/*
+ * filter_benchmark.m
+ *
+ * Time it takes to refilter the messages of a connection when the filter changes (LoggerWindowController
+ * -refreshAllMessages:). 2,000,000 messages are decoded into a message store by LoggerNativeMessage, then
+ * filtered with predicates built like -updateFilterPredicate does, using:
+ *	- "NSPredicate": -filteredArrayUsingPredicate:, the previous implementation (KVC for every key of every message)
+ *	- "compiled": LoggerMessageFilter
+ * The compiled filter must return the same messages, and filter them in less than a second (the time
+ * a refilter may take before the window shows its progress). The benchmark exits with status 1 if it
+ * doesn't.
+ *
+ * Build and run (macOS):
+ *	clang -O2 -fobjc-arc -framework Cocoa -I../../Desktop/Classes -I../../Client/iOS filter_benchmark.m \
+ *		../../Desktop/Classes/LoggerMessage.m ../../Desktop/Classes/LoggerNativeMessage.m \
+ *		../../Desktop/Classes/LoggerMessageFilter.m ../../Desktop/Classes/LoggerMessageStore.c \
+ *		../../Desktop/Classes/LoggerTextIndex.c ../../Desktop/Classes/LoggerTextSearch.c -o filter_benchmark
+ *	./filter_benchmark [number of messages]
+ */
+
+#include <arpa/inet.h>
+#import <Cocoa/Cocoa.h>
+#import "LoggerConnection.h"
+#import "LoggerNativeMessage.h"
+#import "LoggerMessageFilter.h"
+#import "LoggerTextIndex.h"
+#import "LoggerCommon.h"
+
+// LoggerMessage.m and LoggerNativeMessage.m only need this much of a connection
+char sConnectionAssociatedObjectKey = 1;
+
+@implementation LoggerConnection
+{
+	LoggerMessageStore *_store;
+}
+
+- (id)init
+{
+	if ((self = [super init]) != nil)
+	{
+		_filenames = [[NSMutableSet alloc] init];
+		_functionNames = [[NSMutableSet alloc] init];
+		_store = LoggerMessageStoreCreate(&CFRelease);
+		LoggerMessageStoreSetTextIndex(_store, LoggerTextIndexCreate());
+	}
+	return self;
+}
+
+- (LoggerMessageStore *)retainedMessageStore
+{
+	return LoggerMessageStoreRetain(_store);
+}
+
+- (NSString *)wireStringWithID:(uint32_t)stringID
+{
+	return nil;
+}
+
+@end
+
+static void AddInt(NSMutableData *data, uint8_t key, uint32_t value)
+{
+	uint8_t part[6] = { key, PART_TYPE_INT32 };
+	value = htonl(value);
+	memcpy(part + 2, &value, 4);
+	[data appendBytes:part length:6];
+}
+
+static void AddString(NSMutableData *data, uint8_t key, NSString *s)
+{
+	const char *utf8 = [s UTF8String];
+	uint32_t length = (uint32_t)strlen(utf8);
+	uint8_t part[6] = { key, PART_TYPE_STRING };
+	uint32_t n = htonl(length);
+	memcpy(part + 2, &n, 4);
+	[data appendBytes:part length:6];
+	[data appendBytes:utf8 length:length];
+}
+
+static NSArray *GenerateMessages(LoggerConnection *cnx, NSUInteger count)
+{
+	NSArray *tags = @[@"network", @"ui", @"database", @"sync", @"auth", @"cache", @"", @""];
+	NSArray *functions = @[@"-[NetworkManager fetch:completion:]", @"-[ViewController viewDidLoad]",
+						   @"-[Database executeQuery:]", @"-[SyncEngine mergeChanges:]", @"-[SyncEngine start]"];
+	NSArray *texts = @[@"request completed with status code 200", @"Connection timeout, retrying in 5 seconds",
+					   @"loaded 42 rows from the cache", @"user tapped the refresh button",
+					   @"merge conflict resolved in favor of the server version"];
+	NSMutableArray *messages = [[NSMutableArray alloc] initWithCapacity:count];
+	uint32_t seed = 12345;
+	for (NSUInteger i = 0; i < count; i++)
+	{
+		@autoreleasepool
+		{
+			seed = seed * 1103515245U + 12345U;
+			uint32_t r = seed >> 8;
+			NSMutableData *data = [[NSMutableData alloc] initWithLength:2];
+			uint16_t partCount = 0;
+			AddInt(data, PART_KEY_MESSAGE_SEQ, (uint32_t)i + 1); partCount++;
+			AddInt(data, PART_KEY_TIMESTAMP_S, 1500000000U + (uint32_t)i / 1000); partCount++;
+			AddInt(data, PART_KEY_TIMESTAMP_US, (uint32_t)(i % 1000) * 1000); partCount++;
+			AddString(data, PART_KEY_THREAD_ID, (r & 3) ? [NSString stringWithFormat:@"Thread 0x%x", 0x1000 + (r % 6)] : @"Main thread"); partCount++;
+			AddInt(data, PART_KEY_MESSAGE_TYPE, LOGMSG_TYPE_LOG); partCount++;
+			if ([tags[r % 8] length])
+			{
+				AddString(data, PART_KEY_TAG, tags[r % 8]);
+				partCount++;
+			}
+			AddInt(data, PART_KEY_LEVEL, (r >> 4) % 4); partCount++;
+			AddString(data, PART_KEY_FUNCTIONNAME, functions[(r >> 8) % 5]); partCount++;
+			AddString(data, PART_KEY_MESSAGE, [NSString stringWithFormat:@"%@ (%lu)", texts[(r >> 12) % 5], (unsigned long)i]); partCount++;
+			uint8_t *p = [data mutableBytes];
+			p[0] = (uint8_t)(partCount >> 8);
+			p[1] = (uint8_t)partCount;
+			[messages addObject:[[LoggerNativeMessage alloc] initWithData:data connection:cnx]];
+		}
+	}
+	return messages;
+}
+
+static NSPredicate *FilterPredicate(NSPredicate *p)
+{
+	// see -[LoggerWindowController updateFilterPredicate]
+	NSPredicate *alwaysVisible = [NSPredicate predicateWithFormat:@"type IN %@",
+								  [NSSet setWithObjects:@LOGMSG_TYPE_MARK, @LOGMSG_TYPE_CLIENTINFO, @LOGMSG_TYPE_DISCONNECT, nil]];
+	return [NSCompoundPredicate orPredicateWithSubpredicates:@[alwaysVisible, p]];
+}
+
+int main(int argc, const char *argv[])
+{
+	@autoreleasepool
+	{
+		NSUInteger count = (argc > 1) ? (NSUInteger)atol(argv[1]) : 2000000;
+		LoggerConnection *cnx = [[LoggerConnection alloc] init];
+		NSArray *messages = GenerateMessages(cnx, count);
+		LoggerMessageStore *store = [cnx retainedMessageStore];
+		LoggerTextIndexUpdate(LoggerMessageStoreGetTextIndex(store), store);
+		LoggerMessageStoreRelease(store);
+
+		NSDictionary *filters = @{
+			@"level < 2": FilterPredicate([NSPredicate predicateWithFormat:@"level < 2"]),
+			@"tag == network, level < 3": FilterPredicate([NSPredicate predicateWithFormat:@"tag == 'network' AND level < 3"]),
+			@"quick filter 'timeout'": FilterPredicate([NSPredicate predicateWithFormat:@"messageText CONTAINS[c] 'timeout' OR functionName CONTAINS[c] 'timeout'"]),
+			@"text, thread 0x1002": FilterPredicate([NSPredicate predicateWithFormat:@"messageType == 'text' AND threadID == 'Thread 0x1002'"]),
+			@"function begins with -[Sync": FilterPredicate([NSPredicate predicateWithFormat:@"functionName BEGINSWITH '-[Sync'"]),
+		};
+		printf("%lu messages\n", (unsigned long)count);
+		BOOL ok = YES;
+		for (NSString *name in [[filters allKeys] sortedArrayUsingSelector:@selector(compare:)])
+		{
+			NSPredicate *predicate = filters[name];
+			NSDate *start = [NSDate date];
+			NSArray *expected = [messages filteredArrayUsingPredicate:predicate];
+			NSTimeInterval predicateTime = -[start timeIntervalSinceNow];
+
+			start = [NSDate date];
+			LoggerMessageFilter *filter = [[LoggerMessageFilter alloc] initWithPredicate:predicate];
+			NSArray *filtered = [filter filteredMessages:messages];
+			NSTimeInterval compiledTime = -[start timeIntervalSinceNow];
+
+			BOOL same = [filtered isEqualToArray:expected];
+			printf("%-30s NSPredicate %7.0f ms   compiled %6.0f ms   %lu matches%s%s\n", [name UTF8String],
+				   predicateTime * 1000.0, compiledTime * 1000.0, (unsigned long)[filtered count],
+				   same ? "" : "   MISMATCH", (compiledTime < 1.0) ? "" : "   TOO SLOW");
+			ok &= (same && compiledTime < 1.0);
+		}
+		if (!ok)
+		{
+			printf("FAILED\n");
+			return 1;
+		}
+	}
+	return 0;
+}
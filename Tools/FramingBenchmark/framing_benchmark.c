@@ -0,0 +1,119 @@
+/*
+ * framing_benchmark.c
+ *
+ * Cost of splitting the viewer's receive buffer into messages (LoggerNativeTransport -processIncomingData:).
+ * 64 KB reads of 100-byte messages are appended to a buffer, then parsed:
+ *	- "memmove": the previous implementation, which removed each message from the front of the
+ *	  buffer as soon as it was parsed (-replaceBytesInRange:withBytes:length: is a memmove)
+ *	- "cursor": the current implementation, which walks the buffer and compacts it once per read
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 framing_benchmark.c -o framing_benchmark
+ *	./framing_benchmark [number of reads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define READ_SIZE		65536
+#define MESSAGE_SIZE	100
+
+typedef struct
+{
+	uint8_t *bytes;
+	size_t length;
+} Buffer;
+
+static uint64_t sChecksum;
+
+static void MessageReceived(const uint8_t *message, uint32_t length)
+{
+	// stands for the LoggerNativeMessage creation, keeps the compiler from optimizing the parsing away
+	sChecksum += message[0] + length;
+}
+
+static size_t ProcessWithMemmove(Buffer *b)
+{
+	size_t count = 0;
+	while (b->length > 4)
+	{
+		uint32_t length;
+		memcpy(&length, b->bytes, 4);
+		length = ntohl(length);
+		if (b->length < (size_t)length + 4)
+			break;
+		MessageReceived(b->bytes + 4, length);
+		memmove(b->bytes, b->bytes + length + 4, b->length - length - 4);
+		b->length -= length + 4;
+		count++;
+	}
+	return count;
+}
+
+static size_t ProcessWithCursor(Buffer *b)
+{
+	size_t count = 0, offset = 0;
+	while (b->length - offset > 4)
+	{
+		uint32_t length;
+		memcpy(&length, b->bytes + offset, 4);
+		length = ntohl(length);
+		if (b->length - offset < (size_t)length + 4)
+			break;
+		MessageReceived(b->bytes + offset + 4, length);
+		offset += (size_t)length + 4;
+		count++;
+	}
+	if (offset)
+	{
+		memmove(b->bytes, b->bytes + offset, b->length - offset);
+		b->length -= offset;
+	}
+	return count;
+}
+
+static double Run(const uint8_t *stream, size_t streamLength, size_t (*process)(Buffer *), size_t *outCount)
+{
+	Buffer b = { malloc(2 * READ_SIZE), 0 };
+	struct timespec start, end;
+	size_t count = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t pos = 0; pos < streamLength; pos += READ_SIZE)
+	{
+		size_t n = (streamLength - pos < READ_SIZE) ? streamLength - pos : READ_SIZE;
+		memcpy(b.bytes + b.length, stream + pos, n);
+		b.length += n;
+		count += process(&b);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(b.bytes);
+	*outCount = count;
+	return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t reads = (argc > 1) ? (size_t)atoi(argv[1]) : 2000;
+	size_t streamLength = reads * READ_SIZE;
+	uint8_t *stream = malloc(streamLength);
+	for (size_t pos = 0; pos < streamLength; pos += MESSAGE_SIZE)
+	{
+		uint32_t size = htonl(MESSAGE_SIZE - 4);
+		if (pos + 4 <= streamLength)
+			memcpy(stream + pos, &size, 4);
+		for (size_t i = pos + 4; i < pos + MESSAGE_SIZE && i < streamLength; i++)
+			stream[i] = (uint8_t)i;
+	}
+
+	size_t count;
+	double t = Run(stream, streamLength, ProcessWithMemmove, &count);
+	printf("memmove: %zu messages in %.3f s, %10.0f messages/s\n", count, t, (double)count / t);
+	t = Run(stream, streamLength, ProcessWithCursor, &count);
+	printf("cursor:  %zu messages in %.3f s, %10.0f messages/s\n", count, t, (double)count / t);
+	free(stream);
+	return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ * journal_soak_benchmark.c
+ *
+ * Soak test of the journal live connections write their messages to (Desktop/Classes/LoggerJournal.c).
+ * A child process appends messages at a steady rate (10,000 per second by default) like the viewer's
+ * transport does: the messages it decoded from each read, then a flush. A quarter of them have a
+ * PART_TYPE_STRING_REF thread name, which the journal resolves. Every second the child reports the
+ * number of messages flushed so far and its resident memory.
+ *
+ * At the end of each run the child is killed with SIGKILL, then the journal is checked like the
+ * viewer does when it recovers journals at launch:
+ *	- it must not be reported as in use anymore (its lock goes away with the process)
+ *	- every message flushed before the last report must be in the file, in order, with its string
+ *	  references replaced by the strings. Only the last message may be cut short by the kill
+ *	- the memory of the child must stay flat: once the first tenth of the run is over, it must not
+ *	  grow by more than 1 MB
+ * The program exits with status 1 if a run fails one of these checks.
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -I../../Desktop/Classes -I../../Client/iOS journal_soak_benchmark.c ../../Desktop/Classes/LoggerJournal.c \
+ *		-o journal_soak_benchmark -lpthread
+ *	./journal_soak_benchmark [seconds per run] [runs] [messages per second]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#include "LoggerJournal.h"
+#include "LoggerCommon.h"
+
+#define FLUSHES_PER_SECOND	100					// the transport flushes after each read, reads come in every few ms
+#define THREAD_NAMES		8
+#define RSS_SLACK			(1024 * 1024)
+
+typedef struct
+{
+	uint64_t flushed;							// messages flushed to the journal
+	uint64_t rss;								// resident memory of the child, bytes
+} Report;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t ResidentMemory(void)
+{
+#ifdef __APPLE__
+	mach_task_basic_info_data_t info;
+	mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+	if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+		return 0;
+	return info.resident_size;
+#else
+	unsigned long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static void ThreadName(uint32_t stringID, char *name, size_t size)
+{
+	snprintf(name, size, "Worker thread %u", stringID);
+}
+
+static const uint8_t *ResolveString(void *info, uint32_t stringID, uint32_t *outLength)
+{
+	// the client defined one string per thread name
+	char *names = (char *)info;
+	if (stringID >= THREAD_NAMES)
+		return NULL;
+	*outLength = (uint32_t)strlen(names + stringID * 32);
+	return (const uint8_t *)(names + stringID * 32);
+}
+
+static uint8_t *AddPart(uint8_t *p, uint8_t key, uint8_t type, const void *data, uint32_t length)
+{
+	p[0] = key;
+	p[1] = type;
+	if (type == PART_TYPE_INT32)
+	{
+		uint32_t value = htonl(*(const uint32_t *)data);
+		memcpy(p + 2, &value, 4);
+		return p + 6;
+	}
+	uint32_t n = htonl(length);
+	memcpy(p + 2, &n, 4);
+	memcpy(p + 6, data, length);
+	return p + 6 + length;
+}
+
+static size_t MakeMessage(uint8_t *buffer, uint32_t seq)
+{
+	// the parts the client sends for a log message, with a text of 40 to 160 bytes
+	static const char words[] = "request completed with status code 200 after retrying the operation while the cache was cold ";
+	char text[160], thread[32];
+	uint32_t r = seq * 2654435761U, textLength = 40 + (r >> 8) % 121, stringID = (r >> 20) % THREAD_NAMES;
+	for (uint32_t j = 0; j < textLength; j++)
+		text[j] = words[(seq + j) % (sizeof(words) - 1)];
+	uint32_t type = LOGMSG_TYPE_LOG, ts = 1500000000U + seq / 10000, level = r % 4;
+	uint8_t *p = buffer + 2;
+	p = AddPart(p, PART_KEY_MESSAGE_SEQ, PART_TYPE_INT32, &seq, 0);
+	p = AddPart(p, PART_KEY_TIMESTAMP_S, PART_TYPE_INT32, &ts, 0);
+	p = AddPart(p, PART_KEY_MESSAGE_TYPE, PART_TYPE_INT32, &type, 0);
+	p = AddPart(p, PART_KEY_LEVEL, PART_TYPE_INT32, &level, 0);
+	if (seq % 4 == 0)
+	{
+		uint32_t ref = htonl(stringID);
+		p = AddPart(p, PART_KEY_THREAD_ID, PART_TYPE_STRING_REF, &ref, 4);
+	}
+	else
+	{
+		ThreadName(stringID, thread, sizeof(thread));
+		p = AddPart(p, PART_KEY_THREAD_ID, PART_TYPE_STRING, thread, (uint32_t)strlen(thread));
+	}
+	p = AddPart(p, PART_KEY_MESSAGE, PART_TYPE_STRING, text, textLength);
+	buffer[0] = 0;
+	buffer[1] = 6;
+	return (size_t)(p - buffer);
+}
+
+static void RunWriter(const char *path, uint32_t rate, int reportFd)
+{
+	// child process: append and flush until killed
+	LoggerJournal *journal = LoggerJournalCreate(path);
+	if (journal == NULL)
+		_exit(2);
+	char names[THREAD_NAMES * 32];
+	for (uint32_t i = 0; i < THREAD_NAMES; i++)
+		ThreadName(i, names + i * 32, 32);
+
+	uint8_t message[512];
+	uint32_t seq = 1;
+	double start = Now(), nextReport = start + 1.0;
+	for (uint64_t flush = 1; ; flush++)
+	{
+		// messages due by this flush
+		uint64_t due = flush * rate / FLUSHES_PER_SECOND;
+		while (seq <= due)
+		{
+			size_t length = MakeMessage(message, seq);
+			if (!LoggerJournalAppendMessage(journal, message, (uint32_t)length, (seq % 4 == 0) ? &ResolveString : NULL, names))
+				_exit(3);
+			seq++;
+		}
+		if (!LoggerJournalFlush(journal))
+			_exit(3);
+		double now = Now();
+		if (now >= nextReport)
+		{
+			Report report = { seq - 1, ResidentMemory() };
+			if (write(reportFd, &report, sizeof(report)) != sizeof(report))
+				_exit(4);
+			nextReport += 1.0;
+		}
+		double wake = start + (double)flush / FLUSHES_PER_SECOND;
+		if (wake > now)
+			usleep((useconds_t)((wake - now) * 1e6));
+	}
+}
+
+static uint32_t Get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static int CheckMessage(const uint8_t *m, uint32_t size, uint32_t expectedSeq)
+{
+	// the message must be the one written, with its thread name resolved
+	uint8_t expected[512];
+	size_t expectedLength = MakeMessage(expected, expectedSeq);
+	if (expectedSeq % 4 != 0)
+		return (size == expectedLength && memcmp(m, expected, size) == 0);
+	uint32_t stringID = ((expectedSeq * 2654435761U) >> 20) % THREAD_NAMES;
+	char thread[32];
+	ThreadName(stringID, thread, sizeof(thread));
+	uint32_t threadLength = (uint32_t)strlen(thread);
+	size_t refOffset = 2 + 4 * 6;				// the thread part follows four int32 parts
+	if (size != expectedLength - 4 + threadLength)
+		return 0;
+	return (memcmp(m, expected, refOffset) == 0 &&
+			m[refOffset] == PART_KEY_THREAD_ID && m[refOffset + 1] == PART_TYPE_STRING &&
+			Get32(m + refOffset + 2) == threadLength &&
+			memcmp(m + refOffset + 6, thread, threadLength) == 0 &&
+			memcmp(m + refOffset + 6 + threadLength, expected + refOffset + 10, expectedLength - refOffset - 10) == 0);
+}
+
+static int CheckJournal(const char *path, uint64_t flushed, uint64_t *outMessages, size_t *outTornBytes, uint64_t *outSize)
+{
+	// read the messages one by one, long runs write journals of several GB
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+	uint8_t header[4], message[512];
+	uint64_t messages = 0, size = 0;
+	size_t torn = 0;
+	int ok = 1;
+	for (;;)
+	{
+		size_t n = fread(header, 1, 4, f);
+		if (n < 4)
+		{
+			torn = n;
+			break;
+		}
+		uint32_t length = Get32(header) & LOGGER_FRAME_SIZE_MASK;
+		n = (length <= sizeof(message)) ? fread(message, 1, length, f) : 0;
+		if (n < length && length <= sizeof(message))
+		{
+			torn = 4 + n;
+			break;
+		}
+		if (length > sizeof(message) || !CheckMessage(message, length, (uint32_t)messages + 1))
+		{
+			printf("  message %llu is corrupt\n", (unsigned long long)messages + 1);
+			ok = 0;
+			break;
+		}
+		messages++;
+		size += 4 + length;
+	}
+	fclose(f);
+	*outMessages = messages;
+	*outTornBytes = torn;
+	*outSize = size + torn;
+	if (messages < flushed)
+	{
+		printf("  %llu messages flushed, %llu in the journal\n", (unsigned long long)flushed, (unsigned long long)messages);
+		ok = 0;
+	}
+	return ok;
+}
+
+static int Run(const char *path, unsigned run, unsigned seconds, uint32_t rate)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		return 0;
+	unlink(path);
+	pid_t pid = fork();
+	if (pid < 0)
+		return 0;
+	if (pid == 0)
+	{
+		close(fds[0]);
+		RunWriter(path, rate, fds[1]);
+	}
+	close(fds[1]);
+
+	// read the reports until the end of the run, then kill the writer where it stands
+	Report report, first = { 0, 0 }, last = { 0, 0 };
+	uint64_t settledRss = 0, maxRss = 0;
+	unsigned reports = 0, settleAfter = (seconds + 9) / 10;
+	while (reports < seconds && read(fds[0], &report, sizeof(report)) == sizeof(report))
+	{
+		reports++;
+		if (reports == 1)
+			first = report;
+		if (reports == settleAfter)
+			settledRss = report.rss;
+		if (report.rss > maxRss)
+			maxRss = report.rss;
+		last = report;
+	}
+	int inUse = LoggerJournalIsInUse(path);
+	kill(pid, SIGKILL);
+	int status;
+	waitpid(pid, &status, 0);
+	close(fds[0]);
+
+	int ok = (reports == seconds);
+	if (!ok)
+		printf("  the writer stopped after %u s (status %d)\n", reports, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	if (!inUse)
+	{
+		printf("  the journal wasn't reported in use while being written\n");
+		ok = 0;
+	}
+	if (LoggerJournalIsInUse(path))
+	{
+		printf("  the journal is still reported in use after the writer was killed\n");
+		ok = 0;
+	}
+	uint64_t messages = 0;
+	size_t tornBytes = 0;
+	uint64_t journalSize = 0;
+	ok &= CheckJournal(path, last.flushed, &messages, &tornBytes, &journalSize);
+	uint64_t growth = (maxRss > settledRss) ? maxRss - settledRss : 0;
+	if (growth > RSS_SLACK)
+	{
+		printf("  memory grew by %.1f MB after the first %u s\n", (double)growth / 1048576.0, settleAfter);
+		ok = 0;
+	}
+	printf("run %u: %u s, %llu messages (%.0f/s), journal %.1f MB, killed with %zu bytes of a message written, "
+		   "RSS %.1f MB after 1 s, %.1f MB after %u s, max %.1f MB%s\n",
+		   run, reports, (unsigned long long)messages, (double)last.flushed / (reports ? reports : 1),
+		   (double)journalSize / 1048576.0, tornBytes,
+		   (double)first.rss / 1048576.0, (double)settledRss / 1048576.0, settleAfter, (double)maxRss / 1048576.0,
+		   ok ? "" : "   FAILED");
+	unlink(path);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned seconds = (argc > 1) ? (unsigned)atoi(argv[1]) : 60;
+	unsigned runs = (argc > 2) ? (unsigned)atoi(argv[2]) : 5;
+	uint32_t rate = (argc > 3) ? (uint32_t)atoi(argv[3]) : 10000;
+	if (seconds < 2 || runs < 1 || rate < FLUSHES_PER_SECOND)
+	{
+		fprintf(stderr, "usage: %s [seconds per run (>= 2)] [runs] [messages per second (>= %d)]\n", argv[0], FLUSHES_PER_SECOND);
+		return 1;
+	}
+	char path[] = "/tmp/journal_soakXXXXXX";
+	if (mkdtemp(path) == NULL)
+		return 1;
+	char file[sizeof(path) + 32];
+	snprintf(file, sizeof(file), "%s/Session.rawnsloggerdata", path);
+
+	int ok = 1;
+	for (unsigned run = 1; run <= runs; run++)
+		ok &= Run(file, run, seconds, rate);
+	rmdir(path);
+	if (!ok)
+		printf("FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,328 @@
+/*
+ * queue_benchmark.c
+ *
+ * Contention between logging threads pushing messages to the client's log queue (LoggerClient.m
+ * LoggerPushMessageToQueue), with 1, 4, 16 and 64 producer threads and one worker thread that encodes
+ * the messages to its send buffer (LoggerWriteMoreData):
+ *	- "mutex": each push takes the log queue mutex and inserts the message in the seq-ordered queue
+ *	  (a CFArray, here a plain array with the same memmove). The worker encodes with the mutex held
+ *	- "ring": producers publish to a lock-free ring that the worker drains to the ordered queue under
+ *	  the mutex, producers drain it themselves when it is full. The worker encodes with the mutex held
+ *	- "batch": the current implementation. Like "ring", but the worker takes the messages that fit in
+ *	  its send buffer off the queue and encodes them with the mutex released
+ *
+ * "push" is the average time a logging thread spends in LoggerPushMessageToQueue, the cost logging
+ * adds to the app's threads. "locked" is the time per message the worker holds the log queue mutex,
+ * which producers that find the ring full (or all of them with "mutex") wait for on other cores.
+ * "ns/message" is the time to get all the messages through the worker. With fewer cores than threads,
+ * push times mostly measure the scheduler: look at "locked" there.
+ *
+ * The worker checks that each message was received exactly once and counts lost and duplicated
+ * messages, and messages received out of seq order within one drain. It exits with status 1 if any
+ * message was lost or duplicated.
+ *
+ * The ring is the client's own (LoggerMessageRing.h). The ordered log queue is a plain array standing
+ * in for the client's CFArray, with the same insertion from the end.
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -pthread -I../../Client/iOS queue_benchmark.c -o queue_benchmark
+ *	./queue_benchmark [messages per producer]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "LoggerMessageRing.h"
+
+#define MAX_PRODUCERS		64
+
+typedef struct
+{
+	uint32_t seq;
+	uint32_t producer;
+	uint32_t index;
+	uint8_t payload[52];							// encoded messages are small heap blocks (CFData)
+} Message;
+
+enum { MODE_MUTEX, MODE_RING, MODE_BATCH };
+static const char *sModeNames[] = { "mutex", "ring", "batch" };
+
+#define SEND_BUFFER_SIZE	32768					// the client's send buffer
+
+typedef struct
+{
+	// seq-ordered queue, only touched with the mutex held
+	pthread_mutex_t mutex;
+	Message **queue;
+	size_t count;
+	size_t capacity;
+
+	// ring
+	int mode;
+	LoggerMessageRing ring;
+
+	_Atomic(uint32_t) nextSeq;
+	_Atomic(uint64_t) pushTime;						// ns spent pushing, all producers
+	_Atomic(int) producersRunning;
+	uint32_t messagesPerProducer;
+
+	// worker results
+	uint8_t *received;								// receive count of each message, by producer and index
+	uint64_t duplicates;
+	uint64_t outOfOrder;
+	uint8_t sendBuffer[SEND_BUFFER_SIZE];
+	size_t sendBufferUsed;
+	uint32_t checksum;
+	double lockedTime;								// time the worker held the mutex
+} Queue;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void InsertInQueue(Queue *q, Message *message)
+{
+	// LoggerInsertMessageInQueue: ordered insertion from the end, must be called with the mutex held
+	if (q->count == q->capacity)
+	{
+		q->capacity = q->capacity ? q->capacity * 2 : 1024;
+		q->queue = realloc(q->queue, q->capacity * sizeof(Message *));
+	}
+	size_t idx = q->count;
+	while (idx > 0 && q->queue[idx - 1]->seq > message->seq)
+		idx--;
+	memmove(&q->queue[idx + 1], &q->queue[idx], (q->count - idx) * sizeof(Message *));
+	q->queue[idx] = message;
+	q->count++;
+}
+
+static void DrainRing(Queue *q)
+{
+	// LoggerDrainMessageRing, must be called with the mutex held
+	Message *message;
+	while ((message = (Message *)LoggerMessageRingPop(&q->ring)) != NULL)
+		InsertInQueue(q, message);
+}
+
+static void Push(Queue *q, Message *message)
+{
+	if (q->mode != MODE_MUTEX)
+	{
+		if (LoggerMessageRingPush(&q->ring, message))
+			return;
+		pthread_mutex_lock(&q->mutex);
+		DrainRing(q);
+		InsertInQueue(q, message);
+		pthread_mutex_unlock(&q->mutex);
+	}
+	else
+	{
+		pthread_mutex_lock(&q->mutex);
+		InsertInQueue(q, message);
+		pthread_mutex_unlock(&q->mutex);
+	}
+}
+
+static void *Producer(void *arg)
+{
+	Queue *q = ((void **)arg)[0];
+	uint32_t producer = (uint32_t)(uintptr_t)((void **)arg)[1];
+	double pushTime = 0;
+	for (uint32_t i = 0; i < q->messagesPerProducer; i++)
+	{
+		// like the client, the sequence number is taken first, then the message is encoded and pushed
+		Message *message = malloc(sizeof(Message));
+		message->seq = atomic_fetch_add_explicit(&q->nextSeq, 1, memory_order_relaxed);
+		message->producer = producer;
+		message->index = i;
+		memset(message->payload, (int)i, sizeof(message->payload));
+		double start = Now();
+		Push(q, message);
+		pushTime += Now() - start;
+	}
+	atomic_fetch_add_explicit(&q->pushTime, (uint64_t)(pushTime * 1e9), memory_order_relaxed);
+	atomic_fetch_sub_explicit(&q->producersRunning, 1, memory_order_release);
+	return NULL;
+}
+
+static int EncodeMessage(Queue *q, Message *message)
+{
+	// stands in for LoggerWireEncodeMessage: returns 0 if the message doesn't fit in the send buffer
+	size_t size = 8 + sizeof(message->payload);
+	if (q->sendBufferUsed + size > SEND_BUFFER_SIZE)
+		return 0;
+	uint8_t *p = q->sendBuffer + q->sendBufferUsed;
+	memcpy(p, &message->seq, 4);
+	memcpy(p + 4, &message->index, 4);
+	uint32_t h = q->checksum;
+	for (size_t i = 0; i < sizeof(message->payload); i++)
+	{
+		p[8 + i] = message->payload[i];
+		h = (h ^ message->payload[i]) * 16777619u;
+	}
+	q->checksum = h;
+	q->sendBufferUsed += size;
+	return 1;
+}
+
+static void ReceiveMessage(Queue *q, Message *message, uint32_t *previousSeq, size_t i)
+{
+	uint8_t *received = &q->received[(size_t)message->producer * q->messagesPerProducer + message->index];
+	if (*received)
+		q->duplicates++;
+	*received = 1;
+	if (i && *previousSeq > message->seq)
+		q->outOfOrder++;
+	*previousSeq = message->seq;
+	free(message);
+}
+
+static int ReceiveMessages(Queue *q)
+{
+	// the worker thread fills its send buffer with the messages in the queue, then "sends" it
+	size_t count = 0;
+	uint32_t previousSeq = 0;
+	pthread_mutex_lock(&q->mutex);
+	double locked = Now();
+	if (q->mode != MODE_MUTEX)
+		DrainRing(q);
+	if (q->mode == MODE_BATCH)
+	{
+		// LoggerWriteMoreData: take the messages that fit off the queue, encode them unlocked
+		size_t space = SEND_BUFFER_SIZE - q->sendBufferUsed, size = 0;
+		while (count < q->count && (count == 0 || size + 8 + sizeof(q->queue[count]->payload) <= space))
+		{
+			size += 8 + sizeof(q->queue[count]->payload);
+			count++;
+		}
+		Message **messages = malloc((count ? count : 1) * sizeof(Message *));
+		memcpy(messages, q->queue, count * sizeof(Message *));
+		memmove(q->queue, q->queue + count, (q->count - count) * sizeof(Message *));
+		q->count -= count;
+		q->lockedTime += Now() - locked;
+		pthread_mutex_unlock(&q->mutex);
+
+		size_t encoded = 0;
+		while (encoded < count && EncodeMessage(q, messages[encoded]))
+		{
+			ReceiveMessage(q, messages[encoded], &previousSeq, encoded);
+			encoded++;
+		}
+		if (encoded < count)
+		{
+			// put back what didn't fit
+			pthread_mutex_lock(&q->mutex);
+			locked = Now();
+			if (q->count + count - encoded > q->capacity)
+			{
+				q->capacity = q->count + count - encoded + 1024;
+				q->queue = realloc(q->queue, q->capacity * sizeof(Message *));
+			}
+			memmove(q->queue + (count - encoded), q->queue, q->count * sizeof(Message *));
+			memcpy(q->queue, messages + encoded, (count - encoded) * sizeof(Message *));
+			q->count += count - encoded;
+			q->lockedTime += Now() - locked;
+			pthread_mutex_unlock(&q->mutex);
+		}
+		free(messages);
+		count = encoded;
+	}
+	else
+	{
+		while (count < q->count && EncodeMessage(q, q->queue[count]))
+		{
+			ReceiveMessage(q, q->queue[count], &previousSeq, count);
+			count++;
+		}
+		memmove(q->queue, q->queue + count, (q->count - count) * sizeof(Message *));
+		q->count -= count;
+		q->lockedTime += Now() - locked;
+		pthread_mutex_unlock(&q->mutex);
+	}
+
+	// send the buffer once it is full or the queue is empty
+	if (count == 0 || q->sendBufferUsed + 64 > SEND_BUFFER_SIZE)
+	{
+		int sent = (q->sendBufferUsed != 0);
+		q->sendBufferUsed = 0;
+		return count != 0 || sent;
+	}
+	return 1;
+}
+
+static int Run(int mode, uint32_t producers, uint32_t messagesPerProducer)
+{
+	Queue *q = calloc(1, sizeof(Queue));
+	pthread_mutex_init(&q->mutex, NULL);
+	q->mode = mode;
+	LoggerMessageRingInit(&q->ring);
+	q->messagesPerProducer = messagesPerProducer;
+	q->received = calloc((size_t)producers * messagesPerProducer, 1);
+	atomic_init(&q->producersRunning, (int)producers);
+	atomic_init(&q->pushTime, 0);
+
+	pthread_t threads[MAX_PRODUCERS];
+	void *args[MAX_PRODUCERS][2];
+	double start = Now();
+	for (uint32_t i = 0; i < producers; i++)
+	{
+		args[i][0] = q;
+		args[i][1] = (void *)(uintptr_t)i;
+		pthread_create(&threads[i], NULL, Producer, args[i]);
+	}
+
+	// worker thread (this one): receive until all producers are done and the queue is empty
+	for (;;)
+	{
+		int running = atomic_load_explicit(&q->producersRunning, memory_order_acquire);
+		if (!ReceiveMessages(q))
+		{
+			if (running == 0)
+				break;
+			sched_yield();
+		}
+	}
+	double elapsed = Now() - start;
+	for (uint32_t i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+
+	uint64_t total = (uint64_t)producers * messagesPerProducer, lost = 0;
+	for (uint64_t i = 0; i < total; i++)
+		lost += (q->received[i] == 0);
+	printf("%-5s %2u producers: push %6.0f ns, locked %4.0f ns, %5.0f ns/message, %8.0f messages/s, lost %llu, duplicated %llu, out of order %llu\n",
+		   sModeNames[mode], producers, (double)atomic_load(&q->pushTime) / (double)total, q->lockedTime * 1e9 / (double)total,
+		   elapsed * 1e9 / (double)total, (double)total / elapsed,
+		   (unsigned long long)lost, (unsigned long long)q->duplicates, (unsigned long long)q->outOfOrder);
+
+	uint64_t duplicates = q->duplicates;
+	free(q->received);
+	free(q->queue);
+	LoggerMessageRingFree(&q->ring);
+	pthread_mutex_destroy(&q->mutex);
+	free(q);
+	return lost == 0 && duplicates == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t messagesPerProducer = (argc > 1) ? (uint32_t)atoi(argv[1]) : 100000;
+	static const uint32_t producerCounts[] = { 1, 4, 16, 64 };
+	int ok = 1;
+	for (size_t i = 0; i < sizeof(producerCounts) / sizeof(producerCounts[0]); i++)
+	{
+		for (int mode = MODE_MUTEX; mode <= MODE_BATCH; mode++)
+			ok &= Run(mode, producerCounts[i], messagesPerProducer);
+	}
+	if (!ok)
+		printf("FAILED: messages were lost or duplicated\n");
+	return ok ? 0 : 1;
+}
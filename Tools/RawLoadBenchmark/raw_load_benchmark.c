@@ -0,0 +1,389 @@
+/*
+ * raw_load_benchmark.c
+ *
+ * Time it takes to load a .rawnsloggerdata file (a sequence of messages in the v1 wire format, each
+ * preceded by its size, as written by the client library's buffer file) into message stores
+ * (Desktop/Classes/LoggerMessageStore.c) with their text index, like LoggerDocument does:
+ *	- "sequential": LoggerMessageStoreAppendMessage on each message into a single store, then the text
+ *	  index is updated (what the loader did before it decoded in parallel)
+ *	- "ranges": ranges of 8192 messages located from their size words, each decoded into a store of
+ *	  its own and indexed on the threads (2 ranges per thread at most are under way). Ranges are handed
+ *	  over in order as soon as the ranges before them are, like the loader delivers them to the connection
+ * The calling thread locates the ranges while the threads decode the ones located before. In the app the
+ * message objects are also created by the threads that decode the ranges. Only locating the ranges and
+ * handing them over stay serial, they overlap the decoding: on N CPUs the ranges loader takes at least the
+ * longest of these serial steps and of the decode time divided by N, which bounds its speedup.
+ * The file is mapped in memory. Without a file, 2,000,000 messages are generated.
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -I../../Desktop/Classes -I../../Client/iOS raw_load_benchmark.c ../../Desktop/Classes/LoggerMessageStore.c \
+ *		../../Desktop/Classes/LoggerTextIndex.c -o raw_load_benchmark -lpthread
+ *	./raw_load_benchmark [file.rawnsloggerdata]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "LoggerMessageStore.h"
+#include "LoggerTextIndex.h"
+#include "LoggerCommon.h"
+
+#define SYNTHETIC_MESSAGES	2000000
+#define RANGE_SIZE			8192
+#define MAX_THREADS			64
+
+typedef struct
+{
+	uint8_t *bytes;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint8_t *Reserve(Buffer *b, size_t size)
+{
+	if (b->length + size > b->capacity)
+	{
+		b->capacity = (b->capacity ? b->capacity * 2 : 65536) + size;
+		b->bytes = (uint8_t *)realloc(b->bytes, b->capacity);
+		if (b->bytes == NULL)
+			exit(1);
+	}
+	uint8_t *p = b->bytes + b->length;
+	b->length += size;
+	return p;
+}
+
+static void AddInt(Buffer *b, uint8_t key, uint32_t value)
+{
+	uint8_t *p = Reserve(b, 6);
+	p[0] = key;
+	p[1] = PART_TYPE_INT32;
+	value = htonl(value);
+	memcpy(p + 2, &value, 4);
+}
+
+static void AddString(Buffer *b, uint8_t key, const char *s, uint32_t length)
+{
+	uint8_t *p = Reserve(b, 6 + length);
+	p[0] = key;
+	p[1] = PART_TYPE_STRING;
+	uint32_t n = htonl(length);
+	memcpy(p + 2, &n, 4);
+	memcpy(p + 6, s, length);
+}
+
+static void Generate(Buffer *b)
+{
+	static const char *tags[] = { "network", "ui", "database", "sync", "auth", "cache", "", "" };
+	static const char *files[] = { "/Users/dev/App/Sources/NetworkManager.m", "/Users/dev/App/Sources/ViewController.m",
+								   "/Users/dev/App/Sources/Database.m", "/Users/dev/App/Sources/SyncEngine.m" };
+	static const char *functions[] = { "-[NetworkManager fetch:completion:]", "-[ViewController viewDidLoad]",
+									   "-[Database executeQuery:]", "-[SyncEngine mergeChanges:]", "-[SyncEngine start]" };
+	static const char words[] = "request completed with status code 200 after retrying the operation while the cache was cold ";
+	uint32_t seed = 12345;
+	for (uint32_t i = 0; i < SYNTHETIC_MESSAGES; i++)
+	{
+		seed = seed * 1103515245U + 12345U;
+		uint32_t r = seed >> 8;
+		size_t start = b->length;
+		Reserve(b, 6);
+		AddInt(b, PART_KEY_MESSAGE_SEQ, i + 1);
+		AddInt(b, PART_KEY_TIMESTAMP_S, 1500000000U + i / 1000);
+		AddInt(b, PART_KEY_TIMESTAMP_US, (i % 1000) * 1000);
+		char thread[32];
+		AddString(b, PART_KEY_THREAD_ID, thread, (uint32_t)snprintf(thread, sizeof(thread), (r & 3) ? "Thread 0x%x" : "Main thread", 0x1000 + (r % 6)));
+		AddInt(b, PART_KEY_MESSAGE_TYPE, LOGMSG_TYPE_LOG);
+		const char *tag = tags[r % 8];
+		if (*tag)
+			AddString(b, PART_KEY_TAG, tag, (uint32_t)strlen(tag));
+		AddInt(b, PART_KEY_LEVEL, (r >> 4) % 4);
+		AddString(b, PART_KEY_FILENAME, files[(r >> 6) % 4], (uint32_t)strlen(files[(r >> 6) % 4]));
+		AddString(b, PART_KEY_FUNCTIONNAME, functions[(r >> 8) % 5], (uint32_t)strlen(functions[(r >> 8) % 5]));
+		AddInt(b, PART_KEY_LINENUMBER, 10 + (r >> 10) % 500);
+		uint32_t textLength = 40 + (r >> 12) % 121;
+		uint8_t *p = Reserve(b, 6 + textLength);
+		p[0] = PART_KEY_MESSAGE;
+		p[1] = PART_TYPE_STRING;
+		uint32_t n = htonl(textLength);
+		memcpy(p + 2, &n, 4);
+		for (uint32_t j = 0; j < textLength; j++)
+			p[6 + j] = (uint8_t)words[(i + j) % (sizeof(words) - 1)];
+
+		uint32_t size = htonl((uint32_t)(b->length - start - 4));
+		memcpy(b->bytes + start, &size, 4);
+		b->bytes[start + 4] = 0;
+		b->bytes[start + 5] = 11;
+	}
+}
+
+static void LoadSequential(LoggerMessageStore *store, const uint8_t *p, size_t length, double *times)
+{
+	double t0 = Now();
+	LoggerMessageStoreDecodeContext context;
+	memset(&context, 0, sizeof(context));
+	while (length > 4)
+	{
+		uint32_t size;
+		memcpy(&size, p, 4);
+		size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+		if (length - 4 < size || LoggerMessageStoreAppendMessage(store, p + 4, size, &context) < 0)
+			break;
+		length -= (size_t)size + 4;
+		p += (size_t)size + 4;
+	}
+	double t1 = Now();
+	LoggerTextIndexUpdate(LoggerMessageStoreGetTextIndex(store), store);
+	times[0] = t1 - t0;
+	times[1] = Now() - t1;
+}
+
+static size_t LocateFrames(const uint8_t *p, size_t length, uint32_t maxCount)
+{
+	const uint8_t *start = p;
+	for (uint32_t count = 0; count < maxCount && length > 4; count++)
+	{
+		uint32_t size;
+		memcpy(&size, p, 4);
+		size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+		if (length - 4 < size)
+			break;
+		length -= (size_t)size + 4;
+		p += (size_t)size + 4;
+	}
+	return (size_t)(p - start);
+}
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	uint32_t slots;						// ranges located and not handed over yet, at most
+	const uint8_t *starts[2 * MAX_THREADS];
+	size_t lengths[2 * MAX_THREADS];
+	LoggerMessageStore *decoded[2 * MAX_THREADS];
+	uint64_t located;
+	uint64_t taken;
+	uint64_t delivered;
+	int done;
+	LoggerMessageStore **stores;		// ranges handed over, in order
+	uint32_t storesCount;
+	double decodeTime;					// sum of the threads' decode and index times
+	double mergeTime;
+} Pipeline;
+
+static void *DecodeRanges(void *arg)
+{
+	Pipeline *pipeline = (Pipeline *)arg;
+	pthread_mutex_lock(&pipeline->mutex);
+	for (;;)
+	{
+		if (pipeline->taken == pipeline->located)
+		{
+			if (pipeline->done)
+				break;
+			pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+			continue;
+		}
+		uint32_t slot = (uint32_t)(pipeline->taken++ % pipeline->slots);
+		const uint8_t *p = pipeline->starts[slot];
+		size_t length = pipeline->lengths[slot];
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		double t0 = Now();
+		LoggerMessageStore *store = LoggerMessageStoreCreate(NULL);
+		LoggerMessageStoreSetTextIndex(store, LoggerTextIndexCreate());
+		LoggerMessageStoreDecodeContext context;
+		memset(&context, 0, sizeof(context));
+		while (length > 4)
+		{
+			uint32_t size;
+			memcpy(&size, p, 4);
+			size = ntohl(size) & LOGGER_FRAME_SIZE_MASK;
+			LoggerMessageStoreAppendMessage(store, p + 4, size, &context);
+			length -= (size_t)size + 4;
+			p += (size_t)size + 4;
+		}
+		LoggerTextIndexUpdate(LoggerMessageStoreGetTextIndex(store), store);
+		double t1 = Now();
+
+		// hand over the ranges that are ready, in order
+		pthread_mutex_lock(&pipeline->mutex);
+		pipeline->decodeTime += t1 - t0;
+		pipeline->decoded[slot] = store;
+		for (; pipeline->delivered < pipeline->located && pipeline->decoded[pipeline->delivered % pipeline->slots] != NULL; pipeline->delivered++)
+		{
+			slot = (uint32_t)(pipeline->delivered % pipeline->slots);
+			pipeline->stores[pipeline->storesCount++] = pipeline->decoded[slot];
+			pipeline->decoded[slot] = NULL;
+		}
+		pipeline->mergeTime += Now() - t1;
+		pthread_cond_broadcast(&pipeline->changed);
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+	return NULL;
+}
+
+static uint32_t LoadRanges(LoggerMessageStore **stores, const uint8_t *p, size_t length, int threadsCount, double *times)
+{
+	// The calling thread locates the ranges while the threads decode the ranges located before
+	Pipeline pipeline;
+	memset(&pipeline, 0, sizeof(pipeline));
+	pthread_mutex_init(&pipeline.mutex, NULL);
+	pthread_cond_init(&pipeline.changed, NULL);
+	pipeline.slots = 2 * (uint32_t)threadsCount;
+	pipeline.stores = stores;
+	pthread_t threads[MAX_THREADS];
+	for (int i = 0; i < threadsCount; i++)
+		pthread_create(&threads[i], NULL, DecodeRanges, &pipeline);
+	double locateTime = 0;
+	for (;;)
+	{
+		double t0 = Now();
+		size_t rangeLength = LocateFrames(p, length, RANGE_SIZE);
+		locateTime += Now() - t0;
+		pthread_mutex_lock(&pipeline.mutex);
+		if (rangeLength == 0)
+		{
+			pipeline.done = 1;
+			pthread_cond_broadcast(&pipeline.changed);
+			pthread_mutex_unlock(&pipeline.mutex);
+			break;
+		}
+		while (pipeline.located - pipeline.delivered >= pipeline.slots)
+			pthread_cond_wait(&pipeline.changed, &pipeline.mutex);
+		uint32_t slot = (uint32_t)(pipeline.located++ % pipeline.slots);
+		pipeline.starts[slot] = p;
+		pipeline.lengths[slot] = rangeLength;
+		pipeline.decoded[slot] = NULL;
+		pthread_cond_broadcast(&pipeline.changed);
+		pthread_mutex_unlock(&pipeline.mutex);
+		length -= rangeLength;
+		p += rangeLength;
+	}
+	for (int i = 0; i < threadsCount; i++)
+		pthread_join(threads[i], NULL);
+	times[0] = locateTime;
+	times[1] = pipeline.mergeTime;
+	times[2] = pipeline.decodeTime;
+	pthread_cond_destroy(&pipeline.changed);
+	pthread_mutex_destroy(&pipeline.mutex);
+	return pipeline.storesCount;
+}
+
+static int SameString(const LoggerMessageStore *a, uint32_t ida, const LoggerMessageStore *b, uint32_t idb)
+{
+	// string IDs are interned by each store
+	uint32_t la, lb;
+	const uint8_t *sa = LoggerMessageStoreGetString(a, ida, &la), *sb = LoggerMessageStoreGetString(b, idb, &lb);
+	return (ida == LOGGER_STORE_NO_STRING || idb == LOGGER_STORE_NO_STRING) ? (ida == idb) : (la == lb && memcmp(sa, sb, la) == 0);
+}
+
+static int Compare(const LoggerMessageStore *a, LoggerMessageStore **stores, uint32_t storesCount)
+{
+	uint32_t row = 0;
+	for (uint32_t s = 0; s < storesCount; s++)
+	{
+		const LoggerMessageStore *b = stores[s];
+		for (uint32_t rowb = 0; rowb < LoggerMessageStoreCount(b); rowb++, row++)
+		{
+			if (row >= LoggerMessageStoreCount(a))
+				return 0;
+			const LoggerMessageStorePage *pa = LoggerMessageStoreGetPage(a, row), *pb = LoggerMessageStoreGetPage(b, rowb);
+			uint32_t i = row & (LOGGER_STORE_PAGE_ROWS - 1), j = rowb & (LOGGER_STORE_PAGE_ROWS - 1), la, lb;
+			const uint8_t *ca = LoggerMessageStoreGetContents(a, row, &la), *cb = LoggerMessageStoreGetContents(b, rowb, &lb);
+			if (pa->timestamps[i] != pb->timestamps[j] || pa->sequences[i] != pb->sequences[j] || pa->levels[i] != pb->levels[j] ||
+				pa->lineNumbers[i] != pb->lineNumbers[j] || !SameString(a, pa->tagIDs[i], b, pb->tagIDs[j]) ||
+				!SameString(a, pa->threadIDs[i], b, pb->threadIDs[j]) || !SameString(a, pa->filenameIDs[i], b, pb->filenameIDs[j]) ||
+				!SameString(a, pa->functionNameIDs[i], b, pb->functionNameIDs[j]) || la != lb || (la && memcmp(ca, cb, la) != 0))
+				return 0;
+		}
+	}
+	return (row == LoggerMessageStoreCount(a));
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t *bytes;
+	size_t length;
+	Buffer generated = { NULL, 0, 0 };
+	if (argc > 1)
+	{
+		int fd = open(argv[1], O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			fprintf(stderr, "can't read %s\n", argv[1]);
+			return 1;
+		}
+		void *mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapped == MAP_FAILED)
+			return 1;
+		bytes = (const uint8_t *)mapped;
+		length = (size_t)st.st_size;
+	}
+	else
+	{
+		Generate(&generated);
+		bytes = generated.bytes;
+		length = generated.length;
+	}
+
+	LoggerMessageStore *sequential = LoggerMessageStoreCreate(NULL);
+	LoggerMessageStoreSetTextIndex(sequential, LoggerTextIndexCreate());
+	double times[2];
+	double t0 = Now();
+	LoadSequential(sequential, bytes, length, times);
+	double sequentialTime = Now() - t0;
+	printf("%u messages, %.1f MB\n", LoggerMessageStoreCount(sequential), length / 1048576.0);
+	printf("sequential:           %.0f ms (decode %.0f ms, index %.0f ms)\n", sequentialTime * 1000.0, times[0] * 1000.0, times[1] * 1000.0);
+
+	int ok = 1;
+	int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	cpus = (cpus < 1) ? 1 : (cpus > MAX_THREADS) ? MAX_THREADS : cpus;
+	LoggerMessageStore **stores = (LoggerMessageStore **)malloc((length / (RANGE_SIZE * 6) + 2) * sizeof(LoggerMessageStore *));
+	for (int threadsCount = 1; threadsCount <= cpus; threadsCount = (threadsCount * 2 > cpus && threadsCount < cpus) ? cpus : threadsCount * 2)
+	{
+		double rangeTimes[3];
+		t0 = Now();
+		uint32_t storesCount = LoadRanges(stores, bytes, length, threadsCount, rangeTimes);
+		double rangesTime = Now() - t0;
+		int same = Compare(sequential, stores, storesCount);
+		ok &= same;
+		printf("ranges, %2d thread%s:   %.0f ms, %u stores (locate %.0f ms, decode %.0f ms, hand over %.1f ms)%s\n", threadsCount, (threadsCount > 1) ? "s" : " ",
+			   rangesTime * 1000.0, storesCount, rangeTimes[0] * 1000.0, rangeTimes[2] * 1000.0, rangeTimes[1] * 1000.0, same ? "" : "   MISMATCH");
+		if (threadsCount == 1)
+		{
+			// locating overlaps the decoding, the loader takes at least the longest of the two
+			double serialTime = rangeTimes[0] + rangeTimes[1];
+			for (int n = 4; n <= 16; n *= 2)
+			{
+				double bound = (serialTime > rangeTimes[2] / n) ? serialTime : rangeTimes[2] / n;
+				printf("           on %2d CPUs: at least %.0f ms, speedup over sequential at most %.1fx\n", n, bound * 1000.0, sequentialTime / bound);
+			}
+		}
+		for (uint32_t i = 0; i < storesCount; i++)
+			LoggerMessageStoreRelease(stores[i]);
+	}
+	free(stores);
+	LoggerMessageStoreRelease(sequential);
+	free(generated.bytes);
+	if (!ok)
+		printf("FAILED\n");
+	return ok ? 0 : 1;
+}
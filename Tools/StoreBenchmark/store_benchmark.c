@@ -0,0 +1,455 @@
+/*
+ * store_benchmark.c
+ *
+ * Memory used by the viewer's columnar message store (Desktop/Classes/LoggerMessageStore.c) and
+ * cost of loading and scanning it, and of indexing and searching the message texts with its trigram
+ * index (Desktop/Classes/LoggerTextIndex.c). Messages are read from a .rawnsloggerdata file (a sequence of
+ * messages in the v1 wire format, as saved by the viewer) or generated: 1,000,000 messages with
+ * the parts the client library sends (sequence, timestamp, thread, tag, level, file, function,
+ * line and a text message of 40 to 160 bytes). The memory per message includes the object the
+ * viewer keeps for each row besides the store. It is compared with the memory the viewer used before
+ * the store, when each message was a LoggerMessage holding its own message and thread ID strings.
+ *
+ * Before that, the trigram index is checked against a scan: for random needles looked up in random
+ * texts of a few letters, the rows the index returns must include all the rows that match. The
+ * program exits with status 1 if they don't.
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -I../../Desktop/Classes -I../../Client/iOS store_benchmark.c ../../Desktop/Classes/LoggerMessageStore.c \
+ *		../../Desktop/Classes/LoggerTextIndex.c -o store_benchmark -lpthread
+ *	./store_benchmark [file.rawnsloggerdata]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "LoggerMessageStore.h"
+#include "LoggerTextIndex.h"
+#include "LoggerCommon.h"
+
+#define SYNTHETIC_MESSAGES	1000000
+
+// The viewer also keeps one LoggerNativeMessage object per row in the connection's messages list. It reads
+// the message values from the store: it only holds what LoggerMessage caches to display the message and
+// its tag ID, then its own store reference, row and the values set on it (rarely). This is the layout of
+// its instance variables on 64-bit, to count them in the memory used per message. Objects are allocated
+// in 16 bytes quanta, the list holds a pointer to each
+typedef struct
+{
+	void *isa;
+	uint32_t tagID;
+	uint16_t colorRulesVersion;
+	int16_t colorRule;
+	uint16_t textLayoutVersion;
+	uint16_t textLines;
+	float textWidth;
+	double cachedCellSize[2];
+	void *store;
+	uint32_t row;
+	uint8_t overrides;
+	void *values;
+} NativeMessageInstance;
+
+#define ROW_OBJECT_BYTES	((sizeof(NativeMessageInstance) + 15) / 16 * 16 + sizeof(void *))
+
+// Before the store, each row was a LoggerMessage with these instance variables, which retained the
+// message contents and the thread ID string. Tags, file and function names were shared
+typedef struct
+{
+	void *isa;
+	unsigned long sequence;
+	short contentsType;
+	void *parts;
+	struct { long tv_sec; int tv_usec; } timestamp;
+	void *tag;
+	void *message;
+	short type;
+	short level;
+	void *threadID;
+	double imageSize[2];
+	double cachedCellSize[2];
+	void *image;
+	void *filename;
+	void *functionName;
+	int lineNumber;
+} BaselineMessageInstance;
+
+static size_t StringObjectBytes(const uint8_t *bytes, uint32_t length)
+{
+	// An immutable CFString with inline contents: object header, length, then the characters
+	// (8-bit when the text is ASCII, UTF-16 otherwise) and a terminating zero, in 16 bytes quanta
+	size_t characters = length;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		if (bytes[i] >= 0x80)
+		{
+			characters = (size_t)length * 2;
+			break;
+		}
+	}
+	return (16 + 8 + characters + 1 + 15) / 16 * 16;
+}
+
+static size_t BaselineMessageBytes(const uint8_t *message, uint32_t length)
+{
+	LoggerMessageStoreParsedMessage parsed;
+	LoggerMessageStoreParseMessage(message, length, &parsed);
+	size_t size = (sizeof(BaselineMessageInstance) + 15) / 16 * 16 + sizeof(void *);
+	const LoggerMessageStoreParsedPart *contents = &parsed.contents;
+	if (contents->present && contents->length)
+	{
+		if (contents->type == PART_TYPE_STRING)
+			size += StringObjectBytes(contents->bytes, contents->length);
+		else
+			size += 48 + (contents->length + 15) / 16 * 16;		// NSData object and its bytes
+	}
+	const LoggerMessageStoreParsedPart *thread = &parsed.threadID;
+	if (thread->present && thread->type == PART_TYPE_STRING)
+		size += StringObjectBytes(thread->bytes, thread->length);
+	else if (thread->present)
+		size += StringObjectBytes((const uint8_t *)"Thread 0x00000000", 17);
+	return size;
+}
+
+typedef struct
+{
+	uint8_t *bytes;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint8_t *Reserve(Buffer *b, size_t size)
+{
+	if (b->length + size > b->capacity)
+	{
+		b->capacity = (b->capacity ? b->capacity * 2 : 65536) + size;
+		b->bytes = (uint8_t *)realloc(b->bytes, b->capacity);
+		if (b->bytes == NULL)
+			exit(1);
+	}
+	uint8_t *p = b->bytes + b->length;
+	b->length += size;
+	return p;
+}
+
+static void AddInt(Buffer *b, uint8_t key, uint32_t value)
+{
+	uint8_t *p = Reserve(b, 6);
+	p[0] = key;
+	p[1] = PART_TYPE_INT32;
+	value = htonl(value);
+	memcpy(p + 2, &value, 4);
+}
+
+static void AddString(Buffer *b, uint8_t key, const char *s, uint32_t length)
+{
+	uint8_t *p = Reserve(b, 6 + length);
+	p[0] = key;
+	p[1] = PART_TYPE_STRING;
+	uint32_t n = htonl(length);
+	memcpy(p + 2, &n, 4);
+	memcpy(p + 6, s, length);
+}
+
+static void Generate(Buffer *b)
+{
+	static const char *tags[] = { "network", "ui", "database", "sync", "auth", "cache", "", "" };
+	static const char *files[] = { "/Users/dev/App/Sources/NetworkManager.m", "/Users/dev/App/Sources/ViewController.m",
+								   "/Users/dev/App/Sources/Database.m", "/Users/dev/App/Sources/SyncEngine.m" };
+	static const char *functions[] = { "-[NetworkManager fetch:completion:]", "-[ViewController viewDidLoad]",
+									   "-[Database executeQuery:]", "-[SyncEngine mergeChanges:]", "-[SyncEngine start]" };
+	static const char words[] = "request completed with status code 200 after retrying the operation while the cache was cold ";
+	uint32_t seed = 12345;
+	for (uint32_t i = 0; i < SYNTHETIC_MESSAGES; i++)
+	{
+		seed = seed * 1103515245U + 12345U;
+		uint32_t r = seed >> 8;
+		size_t start = b->length;
+		Reserve(b, 6);
+		AddInt(b, PART_KEY_MESSAGE_SEQ, i + 1);
+		AddInt(b, PART_KEY_TIMESTAMP_S, 1500000000U + i / 1000);
+		AddInt(b, PART_KEY_TIMESTAMP_US, (i % 1000) * 1000);
+		char thread[32];
+		AddString(b, PART_KEY_THREAD_ID, thread, (uint32_t)snprintf(thread, sizeof(thread), (r & 3) ? "Thread 0x%x" : "Main thread", 0x1000 + (r % 6)));
+		AddInt(b, PART_KEY_MESSAGE_TYPE, LOGMSG_TYPE_LOG);
+		const char *tag = tags[r % 8];
+		if (*tag)
+			AddString(b, PART_KEY_TAG, tag, (uint32_t)strlen(tag));
+		AddInt(b, PART_KEY_LEVEL, (r >> 4) % 4);
+		AddString(b, PART_KEY_FILENAME, files[(r >> 6) % 4], (uint32_t)strlen(files[(r >> 6) % 4]));
+		AddString(b, PART_KEY_FUNCTIONNAME, functions[(r >> 8) % 5], (uint32_t)strlen(functions[(r >> 8) % 5]));
+		AddInt(b, PART_KEY_LINENUMBER, 10 + (r >> 10) % 500);
+		uint32_t textLength = 40 + (r >> 12) % 121;
+		uint8_t *p = Reserve(b, 6 + textLength);
+		p[0] = PART_KEY_MESSAGE;
+		p[1] = PART_TYPE_STRING;
+		uint32_t n = htonl(textLength);
+		memcpy(p + 2, &n, 4);
+		for (uint32_t j = 0; j < textLength; j++)
+			p[6 + j] = (uint8_t)words[(i + j) % (sizeof(words) - 1)];
+
+		uint32_t size = htonl((uint32_t)(b->length - start - 4));
+		memcpy(b->bytes + start, &size, 4);
+		b->bytes[start + 4] = 0;
+		b->bytes[start + 5] = 11;
+	}
+}
+
+static uint32_t Search(const LoggerMessageStore *store, const char *needle)
+{
+	// Case-insensitive search of every message text, like the quick filter did without the index
+	uint32_t count = LoggerMessageStoreCount(store), matches = 0;
+	size_t needleLength = strlen(needle);
+	for (uint32_t row = 0; row < count; row++)
+	{
+		uint32_t length;
+		const uint8_t *text = LoggerMessageStoreGetContents(store, row, &length);
+		for (uint32_t i = 0; text != NULL && i + needleLength <= length; i++)
+		{
+			if (strncasecmp((const char *)text + i, needle, needleLength) == 0)
+			{
+				matches++;
+				break;
+			}
+		}
+	}
+	return matches;
+}
+
+static uint32_t IndexedSearch(const LoggerMessageStore *store, LoggerTextIndex *index, const char *needle, uint32_t *outCandidates)
+{
+	uint32_t rowsCount, matches = 0, candidates = 0;
+	size_t needleLength = strlen(needle);
+	uint64_t *bitmap = LoggerTextIndexCopyCandidates(index, (const uint8_t *)needle, (uint32_t)needleLength, &rowsCount);
+	if (bitmap == NULL)
+	{
+		// the index can't narrow down the search: all the rows are candidates
+		*outCandidates = LoggerMessageStoreCount(store);
+		return Search(store, needle);
+	}
+	for (uint32_t w = 0; bitmap != NULL && w <= rowsCount / 64; w++)
+	{
+		for (uint64_t bits = bitmap[w]; bits != 0; bits &= bits - 1)
+		{
+			uint32_t row = w * 64 + (uint32_t)__builtin_ctzll(bits), length;
+			const uint8_t *text = LoggerMessageStoreGetContents(store, row, &length);
+			candidates++;
+			for (uint32_t i = 0; text != NULL && i + needleLength <= length; i++)
+			{
+				if (strncasecmp((const char *)text + i, needle, needleLength) == 0)
+				{
+					matches++;
+					break;
+				}
+			}
+		}
+	}
+	free(bitmap);
+	*outCandidates = candidates;
+	return matches;
+}
+
+static int CheckTextIndex(void)
+{
+	// Texts and needles made of a few letters in both cases and spaces, so that trigrams are in many
+	// rows (but few enough for the index to be used) and needles of any length have matches
+	static const char letters[] = "abcdABCD ";
+	LoggerMessageStore *store = LoggerMessageStoreCreate(NULL);
+	LoggerMessageStoreDecodeContext context;
+	memset(&context, 0, sizeof(context));
+	Buffer b = { NULL, 0, 0 };
+	uint32_t seed = 42;
+	for (uint32_t i = 0; i < 20000; i++)
+	{
+		char text[16];
+		seed = seed * 1103515245U + 12345U;
+		uint32_t length = 3 + (seed >> 8) % 12;
+		for (uint32_t j = 0; j < length; j++)
+		{
+			seed = seed * 1103515245U + 12345U;
+			text[j] = letters[(seed >> 8) % (sizeof(letters) - 1)];
+		}
+		b.length = 0;
+		Reserve(&b, 2);
+		AddInt(&b, PART_KEY_MESSAGE_SEQ, i + 1);
+		AddInt(&b, PART_KEY_MESSAGE_TYPE, LOGMSG_TYPE_LOG);
+		AddString(&b, PART_KEY_MESSAGE, text, length);
+		b.bytes[0] = 0;
+		b.bytes[1] = 3;
+		LoggerMessageStoreAppendMessage(store, b.bytes, (uint32_t)b.length, &context);
+	}
+	free(b.bytes);
+	LoggerTextIndex *index = LoggerTextIndexCreate();
+	LoggerTextIndexUpdate(index, store);
+
+	uint32_t count = LoggerMessageStoreCount(store), checked = 0, missed = 0;
+	for (uint32_t n = 0; n < 2000; n++)
+	{
+		char needle[12];
+		seed = seed * 1103515245U + 12345U;
+		uint32_t needleLength = LOGGER_TEXT_INDEX_MIN_NEEDLE + (seed >> 8) % 6;
+		for (uint32_t j = 0; j < needleLength; j++)
+		{
+			seed = seed * 1103515245U + 12345U;
+			needle[j] = letters[(seed >> 8) % (sizeof(letters) - 1)];
+		}
+		needle[needleLength] = 0;
+		uint32_t rowsCount;
+		uint64_t *bitmap = LoggerTextIndexCopyCandidates(index, (const uint8_t *)needle, needleLength, &rowsCount);
+		if (bitmap == NULL)
+			continue;
+		for (uint32_t row = 0; row < count; row++)
+		{
+			uint32_t length;
+			const uint8_t *text = LoggerMessageStoreGetContents(store, row, &length);
+			int match = 0;
+			for (uint32_t i = 0; !match && text != NULL && i + needleLength <= length; i++)
+				match = (strncasecmp((const char *)text + i, needle, needleLength) == 0);
+			if (match && row < rowsCount && !(bitmap[row / 64] & (1ULL << (row % 64))))
+			{
+				if (missed++ < 5)
+					printf("text index check: row %u \"%.*s\" matches \"%s\" but is not a candidate\n", row, (int)length, text, needle);
+			}
+		}
+		free(bitmap);
+		checked++;
+	}
+	printf("text index check:     %u needles, %s\n", checked, missed ? "FAILED" : "OK");
+	LoggerTextIndexDispose(index);
+	LoggerMessageStoreRelease(store);
+	return missed == 0;
+}
+
+static int Load(Buffer *b, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+	uint8_t chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		memcpy(Reserve(b, n), chunk, n);
+	fclose(f);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	if (!CheckTextIndex())
+		return 1;
+
+	Buffer stream = { NULL, 0, 0 };
+	if (argc > 1)
+	{
+		if (!Load(&stream, argv[1]))
+		{
+			fprintf(stderr, "can't read %s\n", argv[1]);
+			return 1;
+		}
+	}
+	else
+		Generate(&stream);
+
+	LoggerMessageStore *store = LoggerMessageStoreCreate(NULL);
+	LoggerMessageStoreDecodeContext context;
+	memset(&context, 0, sizeof(context));
+	double t0 = Now();
+	size_t offset = 0, contentsBytes = 0;
+	while (stream.length - offset > 4)
+	{
+		uint32_t length;
+		memcpy(&length, stream.bytes + offset, 4);
+		length = ntohl(length) & LOGGER_FRAME_SIZE_MASK;
+		if (stream.length - offset < (size_t)length + 4)
+			break;
+		if (LoggerMessageStoreAppendMessage(store, stream.bytes + offset + 4, length, &context) < 0)
+			break;
+		offset += (size_t)length + 4;
+	}
+	double loadTime = Now() - t0;
+
+	uint32_t count = LoggerMessageStoreCount(store);
+	if (count == 0)
+	{
+		fprintf(stderr, "no messages\n");
+		return 1;
+	}
+	for (uint32_t row = 0; row < count; row++)
+	{
+		uint32_t length;
+		LoggerMessageStoreGetContents(store, row, &length);
+		contentsBytes += length;
+	}
+	size_t baselineBytes = 0;
+	for (size_t baselineOffset = 0; baselineOffset < offset;)
+	{
+		uint32_t length;
+		memcpy(&length, stream.bytes + baselineOffset, 4);
+		length = ntohl(length) & LOGGER_FRAME_SIZE_MASK;
+		baselineBytes += BaselineMessageBytes(stream.bytes + baselineOffset + 4, length);
+		baselineOffset += (size_t)length + 4;
+	}
+
+	// the kind of scan a filter does: messages with a given tag and a level of at most 1
+	uint32_t tagID = LoggerMessageStoreInternString(store, (const uint8_t *)"network", 7);
+	t0 = Now();
+	uint32_t matches = 0;
+	for (uint32_t row = 0; row < count; row += LOGGER_STORE_PAGE_ROWS)
+	{
+		const LoggerMessageStorePage *page = LoggerMessageStoreGetPage(store, row);
+		uint32_t rows = (count - row < LOGGER_STORE_PAGE_ROWS) ? count - row : LOGGER_STORE_PAGE_ROWS;
+		for (uint32_t i = 0; i < rows; i++)
+			matches += (page->tagIDs[i] == tagID && page->levels[i] <= 1);
+	}
+	double scanTime = Now() - t0;
+
+	LoggerTextIndex *index = LoggerTextIndexCreate();
+	t0 = Now();
+	LoggerTextIndexUpdate(index, store);
+	double indexTime = Now() - t0;
+
+	size_t memory = LoggerMessageStoreMemoryUsage(store);
+	printf("messages:             %u\n", count);
+	printf("wire bytes/message:   %.1f\n", (double)offset / count);
+	printf("text bytes/message:   %.1f\n", (double)contentsBytes / count);
+	printf("store bytes/message:  %.1f (%.1f MB, %u interned strings)\n", (double)memory / count, memory / 1048576.0, LoggerMessageStoreStringsCount(store) - 1);
+	printf("row objects:          %zu bytes/message (message object and messages list slot)\n", (size_t)ROW_OBJECT_BYTES);
+	printf("total bytes/message:  %.1f (%.1f MB)\n", (double)memory / count + ROW_OBJECT_BYTES,
+		   (memory + (double)ROW_OBJECT_BYTES * count) / 1048576.0);
+	printf("before the store:     %.1f bytes/message (%.1f MB, message objects with their strings)\n",
+		   (double)baselineBytes / count, baselineBytes / 1048576.0);
+	printf("load:                 %.0f ms (%.1f M messages/s)\n", loadTime * 1000.0, count / loadTime / 1e6);
+	printf("tag and level scan:   %.2f ms (%u matches)\n", scanTime * 1000.0, matches);
+	size_t indexMemory = LoggerTextIndexMemoryUsage(index);
+	printf("text index:           %.0f ms, %.1f bytes/message\n", indexTime * 1000.0, (double)indexMemory / count);
+	printf("with the text index:  %.1f bytes/message (%.1f MB, what retention limits count)\n", (double)(memory + indexMemory) / count + ROW_OBJECT_BYTES,
+		   (memory + indexMemory + (double)ROW_OBJECT_BYTES * count) / 1048576.0);
+	const char *needles[] = { "Cache Was Cold", "status code 404", "4f2a91c0" };
+	for (size_t i = 0; i < sizeof(needles) / sizeof(needles[0]); i++)
+	{
+		t0 = Now();
+		uint32_t scanMatches = Search(store, needles[i]);
+		double searchTime = Now() - t0;
+		uint32_t candidates;
+		t0 = Now();
+		uint32_t indexMatches = IndexedSearch(store, index, needles[i], &candidates);
+		double indexedTime = Now() - t0;
+		printf("search \"%s\": scan %.1f ms, index %.2f ms (%u candidates, %u matches%s)\n", needles[i], searchTime * 1000.0,
+			   indexedTime * 1000.0, candidates, indexMatches, (indexMatches == scanMatches) ? "" : ", MISMATCH");
+	}
+	LoggerTextIndexDispose(index);
+
+	LoggerMessageStoreRelease(store);
+	free(stream.bytes);
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * text_layout_benchmark.c
+ *
+ * Cost of recomputing the number of lines of every message text when the width of the messages
+ * column changes, as the viewer does to tile the table while a window is resized
+ * (Desktop/Classes/LoggerTextLayout.c). Each line of a log file, or each group of 1 to 4 lines, stands
+ * for a message; all messages are wrapped at widths of 40 to 200 columns:
+ *	- "scalar": a character loop that finds the newlines, then wraps the lines longer than a row
+ *	- "vector": LoggerTextLayoutCountMonospacedLines (SSE2 on Intel, NEON on ARM)
+ *	- "segments": LoggerTextLayoutWrapSegments, what proportional fonts use once the words of the
+ *	  messages were measured (here with a 7 pixels advance); the line counts must be the same
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -I../../Desktop/Classes text_layout_benchmark.c ../../Desktop/Classes/LoggerTextLayout.c -o text_layout_benchmark
+ *	./text_layout_benchmark /var/log/system.log
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "LoggerTextLayout.h"
+
+#define ADVANCE		7.0f
+
+typedef struct
+{
+	const uint16_t *chars;
+	uint32_t length;
+	LoggerTextSegment *segments;
+	uint32_t segmentsCount;
+} Message;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint32_t WrapLine(const uint16_t *chars, uint32_t length, uint32_t columns)
+{
+	uint32_t lines = 1, start = 0;
+	while (length - start > columns)
+	{
+		uint32_t end = start + columns;
+		while (end > start && chars[end] != ' ')
+			end--;
+		if (end == start)
+			end = start + columns;
+		else
+		{
+			while (end < length && chars[end] == ' ')
+				end++;
+			if (end == length)
+				break;
+		}
+		start = end;
+		lines++;
+	}
+	return lines;
+}
+
+static uint32_t ScalarCount(const uint16_t *chars, uint32_t length, uint32_t columns)
+{
+	uint32_t lines = 0, lineStart = 0;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		if (chars[i] == '\n')
+		{
+			lines += WrapLine(chars + lineStart, i - lineStart, columns);
+			lineStart = i + 1;
+		}
+		else if (chars[i] < 0x20 || chars[i] > 0x7E)
+			return 0;
+	}
+	if (lineStart < length || lines == 0)
+		lines += WrapLine(chars + lineStart, length - lineStart, columns);
+	return lines;
+}
+
+static void Segment(Message *m)
+{
+	// what LoggerMessageCell gets by measuring the text with a monospaced font
+	m->segments = (LoggerTextSegment *)malloc((m->length + 1) * sizeof(LoggerTextSegment));
+	m->segmentsCount = 0;
+	uint32_t lineStart = 0;
+	for (;;)
+	{
+		uint32_t lineEnd = lineStart, i = lineStart;
+		while (lineEnd < m->length && m->chars[lineEnd] != '\n')
+			lineEnd++;
+		uint32_t first = m->segmentsCount;
+		while (i < lineEnd || m->segmentsCount == first)
+		{
+			while (i < lineEnd && m->chars[i] != ' ')
+				i++;
+			uint32_t wordEnd = i;
+			while (i < lineEnd && m->chars[i] == ' ')
+				i++;
+			m->segments[m->segmentsCount++] = (LoggerTextSegment){ (float)(wordEnd - lineStart) * ADVANCE, (float)(i - lineStart) * ADVANCE, 0 };
+		}
+		m->segments[m->segmentsCount - 1].endsLine = 1;
+		if (lineEnd + 1 >= m->length)
+			break;
+		lineStart = lineEnd + 1;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s file.log\n", argv[0]);
+		return 1;
+	}
+	FILE *f = fopen(argv[1], "rb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "can't read %s\n", argv[1]);
+		return 1;
+	}
+	size_t size = 0, capacity = 1 << 20, n;
+	uint8_t *text = (uint8_t *)malloc(capacity);
+	while (text != NULL && (n = fread(text + size, 1, capacity - size, f)) > 0)
+	{
+		size += n;
+		if (size == capacity)
+			text = (uint8_t *)realloc(text, capacity *= 2);
+	}
+	fclose(f);
+	if (text == NULL || size == 0)
+	{
+		fprintf(stderr, "no messages\n");
+		return 1;
+	}
+
+	// the viewer gets UTF-16 characters from the message strings, bytes are simply widened here
+	uint16_t *chars = (uint16_t *)malloc(size * sizeof(uint16_t));
+	for (size_t i = 0; i < size; i++)
+		chars[i] = text[i];
+	uint32_t count = 0, messagesCapacity = 65536, seed = 12345;
+	Message *messages = (Message *)malloc(messagesCapacity * sizeof(Message));
+	for (size_t start = 0; start < size && messages != NULL; )
+	{
+		seed = seed * 1103515245U + 12345U;
+		size_t end = start;
+		for (uint32_t lines = 1 + (seed >> 8) % 4; lines > 0 && end < size; lines--)
+		{
+			uint8_t *eol = (uint8_t *)memchr(text + end, '\n', size - end);
+			end = eol ? (size_t)(eol - text) + 1 : size;
+		}
+		if (count == messagesCapacity)
+			messages = (Message *)realloc(messages, (messagesCapacity *= 2) * sizeof(Message));
+		if (messages != NULL)
+		{
+			uint32_t length = (uint32_t)(end - start - (text[end - 1] == '\n'));
+			messages[count] = (Message){ chars + start, length > 2048 ? 2048 : length, NULL, 0 };
+			Segment(&messages[count++]);
+		}
+		start = end;
+	}
+
+	uint32_t widths = 0, measured = 0;
+	uint64_t scalarLines = 0, vectorLines = 0, segmentLines = 0;
+	double scalarTime = 0, vectorTime = 0, segmentTime = 0;
+	for (uint32_t columns = 40; columns <= 200; columns += 4, widths++)
+	{
+		double t0 = Now();
+		for (uint32_t i = 0; i < count; i++)
+			scalarLines += ScalarCount(messages[i].chars, messages[i].length, columns);
+		double t1 = Now();
+		for (uint32_t i = 0; i < count; i++)
+			vectorLines += LoggerTextLayoutCountMonospacedLines(messages[i].chars, messages[i].length, columns);
+		double t2 = Now();
+		for (uint32_t i = 0; i < count; i++)
+			segmentLines += LoggerTextLayoutWrapSegments(messages[i].segments, messages[i].segmentsCount, (float)columns * ADVANCE);
+		double t3 = Now();
+		scalarTime += t1 - t0;
+		vectorTime += t2 - t1;
+		segmentTime += t3 - t2;
+	}
+
+	// segments also wrap the texts the monospaced count leaves to measuring: only compare the others
+	uint64_t comparedLines = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (LoggerTextLayoutCountMonospacedLines(messages[i].chars, messages[i].length, 80) != 0)
+		{
+			measured++;
+			comparedLines += LoggerTextLayoutWrapSegments(messages[i].segments, messages[i].segmentsCount, 80 * ADVANCE)
+				- LoggerTextLayoutCountMonospacedLines(messages[i].chars, messages[i].length, 80);
+		}
+	}
+	printf("%u messages, %.1f characters/message, %u counted with the monospaced scan\n", count, (double)size / count, measured);
+	printf("%u widths: scalar %.1f ms/width, vector %.1f ms/width (%s), segments %.1f ms/width (%s)\n", widths,
+		   scalarTime * 1000.0 / widths, vectorTime * 1000.0 / widths, (scalarLines == vectorLines) ? "same lines" : "MISMATCH",
+		   segmentTime * 1000.0 / widths, (comparedLines == 0) ? "same lines" : "MISMATCH");
+	for (uint32_t i = 0; i < count; i++)
+		free(messages[i].segments);
+	free(messages);
+	free(chars);
+	free(text);
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * text_search_benchmark.c
+ *
+ * Speed of the substring search the filter runs on message texts it can't rule out with the text index
+ * (Desktop/Classes/LoggerTextSearch.c). Each line of a log file stands for a message; every line is
+ * searched for each needle, as the quick filter does:
+ *	- "scalar": the previous implementation, a byte loop that compares the rest of the needle
+ *	  wherever the first byte matches
+ *	- "vector": LoggerTextSearchFind (AVX2 or SSE2 on Intel, NEON on ARM)
+ *	- "memmem": the C library's case sensitive search, for reference
+ *
+ * Build and run (Linux or macOS):
+ *	cc -O2 -I../../Desktop/Classes text_search_benchmark.c ../../Desktop/Classes/LoggerTextSearch.c -o text_search_benchmark
+ *	./text_search_benchmark /var/log/system.log [needle ...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "LoggerTextSearch.h"
+
+#define MIN_BYTES_SEARCHED	(256 * 1024 * 1024)
+
+typedef struct
+{
+	const uint8_t *bytes;
+	uint32_t length;
+} Line;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static inline uint8_t Fold(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (uint8_t)(c | 0x20) : c;
+}
+
+static const uint8_t *ScalarFind(const uint8_t *s, uint32_t length, const uint8_t *needle, uint32_t needleLength, bool caseInsensitive)
+{
+	uint8_t first = needle[0];
+	for (uint32_t i = 0; i + needleLength <= length; i++)
+	{
+		uint8_t c = caseInsensitive ? Fold(s[i]) : s[i];
+		if (c != first)
+			continue;
+		uint32_t j = 1;
+		while (j < needleLength && (caseInsensitive ? Fold(s[i + j]) : s[i + j]) == needle[j])
+			j++;
+		if (j == needleLength)
+			return s + i;
+	}
+	return NULL;
+}
+
+static const uint8_t *MemmemFind(const uint8_t *s, uint32_t length, const uint8_t *needle, uint32_t needleLength, bool caseInsensitive)
+{
+	(void)caseInsensitive;
+	return (const uint8_t *)memmem(s, length, needle, needleLength);
+}
+
+typedef const uint8_t *(*FindFunction)(const uint8_t *, uint32_t, const uint8_t *, uint32_t, bool);
+
+static double Run(FindFunction find, const Line *lines, uint32_t count, size_t bytes, const uint8_t *needle, uint32_t needleLength,
+				  bool caseInsensitive, uint32_t *outMatches)
+{
+	uint32_t passes = (uint32_t)(MIN_BYTES_SEARCHED / bytes) + 1, matches = 0;
+	double t0 = Now();
+	for (uint32_t pass = 0; pass < passes; pass++)
+	{
+		matches = 0;
+		for (uint32_t i = 0; i < count; i++)
+			matches += (find(lines[i].bytes, lines[i].length, needle, needleLength, caseInsensitive) != NULL);
+	}
+	*outMatches = matches;
+	return (double)bytes * passes / (Now() - t0) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s file.log [needle ...]\n", argv[0]);
+		return 1;
+	}
+	FILE *f = fopen(argv[1], "rb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "can't read %s\n", argv[1]);
+		return 1;
+	}
+	size_t size = 0, capacity = 1 << 20, n;
+	uint8_t *text = (uint8_t *)malloc(capacity);
+	while (text != NULL && (n = fread(text + size, 1, capacity - size, f)) > 0)
+	{
+		size += n;
+		if (size == capacity)
+			text = (uint8_t *)realloc(text, capacity *= 2);
+	}
+	fclose(f);
+	if (text == NULL || size == 0)
+	{
+		fprintf(stderr, "no lines\n");
+		return 1;
+	}
+
+	uint32_t count = 0, linesCapacity = 65536;
+	Line *lines = (Line *)malloc(linesCapacity * sizeof(Line));
+	for (size_t start = 0; start < size && lines != NULL; )
+	{
+		uint8_t *eol = (uint8_t *)memchr(text + start, '\n', size - start);
+		size_t end = eol ? (size_t)(eol - text) : size;
+		if (count == linesCapacity)
+			lines = (Line *)realloc(lines, (linesCapacity *= 2) * sizeof(Line));
+		if (lines != NULL && end > start)
+			lines[count++] = (Line){ text + start, (uint32_t)(end - start) };
+		start = end + 1;
+	}
+
+	static const char *defaultNeedles[] = { "error", "status", "connection timeout", "4f2a91c0", "e" };
+	const char **needles = (argc > 2) ? (const char **)(argv + 2) : defaultNeedles;
+	int needlesCount = (argc > 2) ? argc - 2 : (int)(sizeof(defaultNeedles) / sizeof(defaultNeedles[0]));
+	printf("%u lines, %.1f bytes/line\n", count, (double)size / count);
+	for (int i = 0; i < needlesCount; i++)
+	{
+		// case insensitive searches expect a lowercase needle, like the filter passes them
+		uint32_t needleLength = (uint32_t)strlen(needles[i]), matches[4];
+		uint8_t *needle = (uint8_t *)malloc(needleLength + 1);
+		for (uint32_t j = 0; j <= needleLength; j++)
+			needle[j] = Fold((uint8_t)needles[i][j]);
+		double scalar = Run(ScalarFind, lines, count, size, needle, needleLength, true, &matches[0]);
+		double vector = Run(LoggerTextSearchFind, lines, count, size, needle, needleLength, true, &matches[1]);
+		double scalarCase = Run(ScalarFind, lines, count, size, needle, needleLength, false, &matches[2]);
+		double vectorCase = Run(LoggerTextSearchFind, lines, count, size, needle, needleLength, false, &matches[3]);
+		uint32_t memmemMatches;
+		double libc = Run(MemmemFind, lines, count, size, needle, needleLength, false, &memmemMatches);
+		printf("\"%s\": case insensitive scalar %.2f GB/s, vector %.2f GB/s (%u matches) | case sensitive scalar %.2f GB/s, vector %.2f GB/s, memmem %.2f GB/s (%u matches)%s\n",
+			   needles[i], scalar, vector, matches[1], scalarCase, vectorCase, libc, matches[3],
+			   (matches[0] == matches[1] && matches[2] == matches[3] && matches[3] == memmemMatches) ? "" : " MISMATCH");
+		free(needle);
+	}
+	free(lines);
+	free(text);
+	return 0;
+}
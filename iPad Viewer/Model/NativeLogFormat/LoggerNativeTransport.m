@@ -108,19 +108,23 @@
 {
 	NSMutableArray *msgs = [NSMutableArray array];
 	//[self dumpBytes:cnx.tmpBuf length:numBytes];
+	// walk the messages with a cursor, and only remove the consumed bytes from the buffer
+	// once we're done: a single read can bring thousands of small messages
+	const uint8_t *bytes = (const uint8_t *)[cnx.buffer bytes];
 	NSUInteger bufferLength = [cnx.buffer length];
-	while (bufferLength > 4)
+	NSUInteger offset = 0;
+	while (bufferLength - offset > 4)
 	{
 		// check whether we have a full message
 		uint32_t length;
-		[cnx.buffer getBytes:&length length:4];
+		memcpy(&length, bytes + offset, 4);
 		length = ntohl(length);
-		if (bufferLength < (length + 4))
+		if (bufferLength - offset < ((NSUInteger)length + 4))
 			break;
 
 		// get one message
 		CFDataRef subset = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,
-													   (unsigned char *) [cnx.buffer bytes] + 4,
+													   bytes + offset + 4,
 													   length,
 													   kCFAllocatorNull);
 		if (subset != NULL)
@@ -143,9 +147,10 @@
 			}
 			[message release];
 		}
-		[cnx.buffer replaceBytesInRange:NSMakeRange(0, length + 4) withBytes:NULL length:0];
-		bufferLength = [cnx.buffer length];
+		offset += (NSUInteger)length + 4;
 	}
+	if (offset)
+		[cnx.buffer replaceBytesInRange:NSMakeRange(0, offset) withBytes:NULL length:0];
 
 	if ([msgs count])
 		[cnx messagesReceived:msgs];